@@ -0,0 +1,484 @@
+#include <errno.h>
+#include <png.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "console.h"
+#include "memory_utils.h"
+#include "apng_writer.h"
+#include "workers/render_worker.h"
+
+#define LOG_HEADER "[apng writer] "
+
+// PLTE & tRNS are written with every entry reserved, then filled in once every frame's colours are known
+#define APNG_PALETTE_SIZE 256
+#define APNG_PLTE_CHUNK_SIZE (12 + APNG_PALETTE_SIZE * 3)
+#define APNG_TRNS_CHUNK_SIZE (12 + APNG_PALETTE_SIZE)
+
+typedef struct apng_frame {
+	int width;
+	int height;
+	uint8_t* board;
+	size_t board_size;
+	Colour* palette;
+	int palette_size;
+} ApngFrame;
+
+// APNG WRITER
+static pthread_t apng_writer_thread_id;
+static ReorderBuffer apng_writer_buffer;
+// Read by the workers pushing frames & the writer thread
+static atomic_bool apng_writer_running = false;
+static atomic_bool apng_writer_stopping = false;
+// Set once the file can't be written, later frames are only drained
+static bool apng_writer_failed = false;
+static char* apng_file_name = NULL;
+static FILE* apng_file = NULL;
+static png_structp apng_png = NULL;
+static int apng_frame_rate = 0;
+// Size of the first frame, later frames are clipped or padded to it
+static int apng_width = 0;
+static int apng_height = 0;
+static long apng_palette_offset = 0;
+static long apng_actl_offset = 0;
+static uint32_t apng_sequence = 0;
+static int frames_written = 0;
+static int frames_skipped = 0;
+// Palette of the whole animation, every frame's colours are mapped into it
+static Colour apng_palette[APNG_PALETTE_SIZE];
+static int apng_palette_size = 0;
+static bool apng_palette_overflowed = false;
+// Previous & current frames, as indices into apng_palette
+static uint8_t* previous_indices = NULL;
+static uint8_t* current_indices = NULL;
+static uint8_t* row_buffer = NULL;
+static uint8_t* deflate_buffer = NULL;
+static size_t deflate_buffer_size = 0;
+static z_stream deflate_stream;
+
+static void put_u32(uint8_t* buffer, uint32_t value)
+{
+	buffer[0] = (uint8_t) (value >> 24);
+	buffer[1] = (uint8_t) (value >> 16);
+	buffer[2] = (uint8_t) (value >> 8);
+	buffer[3] = (uint8_t) value;
+}
+
+static void put_u16(uint8_t* buffer, uint16_t value)
+{
+	buffer[0] = (uint8_t) (value >> 8);
+	buffer[1] = (uint8_t) value;
+}
+
+static void free_apng_frame(void* data)
+{
+	ApngFrame* frame = (ApngFrame*) data;
+	free(frame->board);
+	free(frame->palette);
+	free(frame);
+}
+
+static uint8_t get_palette_index(Colour colour)
+{
+	for (int i = 0; i < apng_palette_size; i++) {
+		if (apng_palette[i].value == colour.value) {
+			return (uint8_t) i;
+		}
+	}
+	if (apng_palette_size < APNG_PALETTE_SIZE) {
+		apng_palette[apng_palette_size] = colour;
+		return (uint8_t) apng_palette_size++;
+	}
+
+	if (!apng_palette_overflowed) {
+		log_message(LOG_ERROR, LOG_HEADER"More than %d colours used across all frames, extra colours are drawn as the first colour",
+			APNG_PALETTE_SIZE);
+		apng_palette_overflowed = true;
+	}
+	return 0;
+}
+
+// Writes the signature, IHDR & placeholder PLTE / tRNS / acTL
+static bool write_apng_header()
+{
+	apng_png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (apng_png == NULL) {
+		log_message(LOG_ERROR, LOG_HEADER"PNG create write struct failed. png_ptr was null");
+		return false;
+	}
+	png_infop info_ptr = png_create_info_struct(apng_png);
+	if (info_ptr == NULL) {
+		log_message(LOG_ERROR, LOG_HEADER"PNG create info struct failed. info_ptr was null");
+		png_destroy_write_struct(&apng_png, NULL);
+		return false;
+	}
+
+	png_color placeholder_palette[APNG_PALETTE_SIZE] = { 0 };
+	png_byte placeholder_alpha[APNG_PALETTE_SIZE];
+	memset(placeholder_alpha, 255, sizeof(placeholder_alpha));
+
+	png_init_io(apng_png, apng_file);
+	png_set_IHDR(apng_png, info_ptr, (png_uint_32) apng_width, (png_uint_32) apng_height, 8, PNG_COLOR_TYPE_PALETTE,
+		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_set_PLTE(apng_png, info_ptr, placeholder_palette, APNG_PALETTE_SIZE);
+	png_set_tRNS(apng_png, info_ptr, placeholder_alpha, APNG_PALETTE_SIZE, NULL);
+	png_write_info(apng_png, info_ptr);
+	png_write_flush(apng_png);
+	png_destroy_info_struct(apng_png, &info_ptr);
+
+	apng_actl_offset = ftell(apng_file);
+	apng_palette_offset = apng_actl_offset - APNG_TRNS_CHUNK_SIZE - APNG_PLTE_CHUNK_SIZE;
+
+	uint8_t actl[8] = { 0 }; // Frame count is filled in on close, zero plays loops forever
+	png_write_chunk(apng_png, (png_const_bytep) "acTL", actl, sizeof(actl));
+	return true;
+}
+
+// Deflates a region of current_indices as unfiltered paletted rows
+static size_t deflate_region(int x, int y, int width, int height)
+{
+	deflateReset(&deflate_stream);
+	size_t bound = deflateBound(&deflate_stream, (uLong) (width + 1) * (uLong) height);
+	if (deflate_buffer_size < bound) {
+		uint8_t* new_deflate_buffer = realloc(deflate_buffer, bound);
+		if (new_deflate_buffer == NULL) {
+			return 0;
+		}
+		deflate_buffer = new_deflate_buffer;
+		deflate_buffer_size = bound;
+	}
+
+	deflate_stream.next_out = deflate_buffer;
+	deflate_stream.avail_out = (uInt) deflate_buffer_size;
+	for (int row = 0; row < height; row++) {
+		row_buffer[0] = 0; // Filter type none, palette indices don't predict well
+		memcpy(row_buffer + 1, current_indices + (size_t) (y + row) * (size_t) apng_width + x, (size_t) width);
+		deflate_stream.next_in = row_buffer;
+		deflate_stream.avail_in = (uInt) width + 1;
+		if (deflate(&deflate_stream, row == height - 1 ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR) {
+			return 0;
+		}
+	}
+	return deflate_buffer_size - deflate_stream.avail_out;
+}
+
+// Bounding box of every index that differs from the previous frame, false if nothing changed
+static bool find_dirty_rect(int* out_x, int* out_y, int* out_width, int* out_height)
+{
+	size_t row_size = (size_t) apng_width;
+	int min_y = 0;
+	while (min_y < apng_height
+		&& memcmp(previous_indices + (size_t) min_y * row_size, current_indices + (size_t) min_y * row_size, row_size) == 0) {
+		min_y++;
+	}
+	if (min_y == apng_height) {
+		return false;
+	}
+	int max_y = apng_height - 1;
+	while (max_y > min_y
+		&& memcmp(previous_indices + (size_t) max_y * row_size, current_indices + (size_t) max_y * row_size, row_size) == 0) {
+		max_y--;
+	}
+
+	int min_x = apng_width;
+	int max_x = -1;
+	for (int y = min_y; y <= max_y; y++) {
+		const uint8_t* previous_row = previous_indices + (size_t) y * row_size;
+		const uint8_t* current_row = current_indices + (size_t) y * row_size;
+		for (int x = 0; x < min_x; x++) {
+			if (previous_row[x] != current_row[x]) {
+				min_x = x;
+				break;
+			}
+		}
+		for (int x = apng_width - 1; x > max_x; x--) {
+			if (previous_row[x] != current_row[x]) {
+				max_x = x;
+				break;
+			}
+		}
+	}
+
+	*out_x = min_x;
+	*out_y = min_y;
+	*out_width = max_x - min_x + 1;
+	*out_height = max_y - min_y + 1;
+	return true;
+}
+
+static void write_frame(ApngFrame* frame)
+{
+	if (apng_png == NULL) {
+		apng_width = frame->width;
+		apng_height = frame->height;
+		size_t pixel_count = (size_t) apng_width * (size_t) apng_height;
+		previous_indices = calloc(pixel_count, 1);
+		current_indices = calloc(pixel_count, 1);
+		row_buffer = malloc((size_t) apng_width + 1);
+		if (previous_indices == NULL || current_indices == NULL || row_buffer == NULL || !write_apng_header()) {
+			log_message(LOG_ERROR, LOG_HEADER"Failed to start animation of size %dx%d", apng_width, apng_height);
+			apng_writer_failed = true;
+			return;
+		}
+		if (deflateInit(&deflate_stream, Z_BEST_COMPRESSION) != Z_OK) {
+			log_message(LOG_ERROR, LOG_HEADER"Failed to initialise deflate stream");
+			apng_writer_failed = true;
+			return;
+		}
+	}
+	else if (frame->width != apng_width || frame->height != apng_height) {
+		log_message(LOG_ERROR, LOG_HEADER"Frame %d is %dx%d, it will be fitted to the animation's %dx%d",
+			frames_written, frame->width, frame->height, apng_width, apng_height);
+	}
+
+	// Same palette handling as generate_canvas_image, with indices then mapped into the animation's palette
+	Colour* palette = frame->palette;
+	int palette_size = frame->palette_size;
+	if (palette == NULL || palette_size == 0) {
+		palette = default_palette;
+		palette_size = 32;
+	}
+	uint8_t lookup[256];
+	lookup[0] = get_palette_index(palette[0]);
+	for (int i = 1; i < 256; i++) {
+		lookup[i] = i < palette_size ? get_palette_index(palette[i]) : lookup[0];
+	}
+
+	for (int y = 0; y < apng_height; y++) {
+		uint8_t* row = current_indices + (size_t) y * (size_t) apng_width;
+		size_t source_start = (size_t) y * (size_t) frame->width;
+		int row_width = y < frame->height ? (frame->width < apng_width ? frame->width : apng_width) : 0;
+		if (source_start + (size_t) row_width > frame->board_size) {
+			row_width = source_start < frame->board_size ? (int) (frame->board_size - source_start) : 0;
+		}
+		for (int x = 0; x < row_width; x++) {
+			row[x] = lookup[frame->board[source_start + (size_t) x]];
+		}
+		memset(row + row_width, lookup[0], (size_t) (apng_width - row_width));
+	}
+
+	int x = 0;
+	int y = 0;
+	int width = apng_width;
+	int height = apng_height;
+	if (frames_written > 0 && !find_dirty_rect(&x, &y, &width, &height)) {
+		// Frames can't be empty, so an unchanged commit still repeats a single pixel
+		width = 1;
+		height = 1;
+	}
+
+	size_t data_size = deflate_region(x, y, width, height);
+	if (data_size == 0) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to deflate frame %d", frames_written);
+		return;
+	}
+
+	uint8_t fctl[26];
+	put_u32(fctl, apng_sequence++);
+	put_u32(fctl + 4, (uint32_t) width);
+	put_u32(fctl + 8, (uint32_t) height);
+	put_u32(fctl + 12, (uint32_t) x);
+	put_u32(fctl + 16, (uint32_t) y);
+	put_u16(fctl + 20, 1); // Delay of 1 / frame rate seconds
+	put_u16(fctl + 22, (uint16_t) apng_frame_rate);
+	fctl[24] = 0; // APNG_DISPOSE_OP_NONE, the next frame's region is drawn over this one
+	fctl[25] = 0; // APNG_BLEND_OP_SOURCE
+	png_write_chunk(apng_png, (png_const_bytep) "fcTL", fctl, sizeof(fctl));
+
+	// The first frame doubles as the default image
+	if (frames_written == 0) {
+		png_write_chunk(apng_png, (png_const_bytep) "IDAT", deflate_buffer, data_size);
+	}
+	else {
+		uint8_t sequence[4];
+		put_u32(sequence, apng_sequence++);
+		png_write_chunk_start(apng_png, (png_const_bytep) "fdAT", (png_uint_32) (sizeof(sequence) + data_size));
+		png_write_chunk_data(apng_png, sequence, sizeof(sequence));
+		png_write_chunk_data(apng_png, deflate_buffer, data_size);
+		png_write_chunk_end(apng_png);
+	}
+	frames_written++;
+
+	uint8_t* swap = previous_indices;
+	previous_indices = current_indices;
+	current_indices = swap;
+}
+
+void* start_apng_writer_loop(void* data)
+{
+	while (true) {
+		void* frame = NULL;
+		if (!pop_reorder_buffer(&apng_writer_buffer, &frame)) {
+			// Frames behind a gap that never arrived can't be written once stopping
+			if (apng_writer_stopping) {
+				break;
+			}
+			usleep(10000); // Wait for 10ms
+			continue;
+		}
+
+		if (frame == NULL) {
+			frames_skipped++;
+			continue;
+		}
+		if (!apng_writer_failed) {
+			write_frame((ApngFrame*) frame);
+		}
+		free_apng_frame(frame);
+	}
+	return NULL;
+}
+
+bool start_apng_writer(const char* file_name, int frame_rate)
+{
+	if (apng_writer_running) {
+		log_message(LOG_ERROR, LOG_HEADER"APNG writer is already running");
+		return false;
+	}
+	if (frame_rate <= 0 || frame_rate > UINT16_MAX) {
+		log_message(LOG_ERROR, LOG_HEADER"Invalid APNG frame rate %d", frame_rate);
+		return false;
+	}
+
+	// Opened for update, so that the header can be rewritten once every frame is known
+	apng_file = fopen(file_name, "wb+");
+	if (apng_file == NULL) {
+		log_message(LOG_ERROR, LOG_HEADER"Couldn't open %s for writing: %s", file_name, strerror(errno));
+		return false;
+	}
+
+	apng_file_name = strdup(file_name);
+	apng_frame_rate = frame_rate;
+	apng_png = NULL;
+	apng_sequence = 0;
+	apng_palette_size = 0;
+	apng_palette_overflowed = false;
+	frames_written = 0;
+	frames_skipped = 0;
+	apng_writer_stopping = false;
+	apng_writer_failed = false;
+
+	init_reorder_buffer(&apng_writer_buffer, 0, DEFAULT_REORDER_WINDOW);
+	pthread_create(&apng_writer_thread_id, NULL, start_apng_writer_loop, NULL);
+	apng_writer_running = true;
+	log_message(LOG_INFO, LOG_HEADER"Writing canvases at %d fps to %s", frame_rate, file_name);
+	return true;
+}
+
+bool is_apng_writer_running()
+{
+	return apng_writer_running;
+}
+
+void push_apng_writer(int frame_index, int width, int height, const uint8_t* board, size_t board_size,
+	const Colour* palette, int palette_size)
+{
+	ApngFrame* frame = malloc(sizeof(ApngFrame));
+	uint8_t* board_copy = malloc(board_size > 0 ? board_size : 1);
+	Colour* palette_copy = palette_size > 0 ? malloc(sizeof(Colour) * (size_t) palette_size) : NULL;
+	if (frame == NULL || board_copy == NULL || (palette_size > 0 && palette_copy == NULL) || width <= 0 || height <= 0) {
+		free(frame);
+		free(board_copy);
+		free(palette_copy);
+		skip_apng_writer(frame_index);
+		return;
+	}
+
+	memcpy(board_copy, board, board_size);
+	if (palette_copy != NULL) {
+		memcpy(palette_copy, palette, sizeof(Colour) * (size_t) palette_size);
+	}
+	*frame = (ApngFrame) {
+		.width = width,
+		.height = height,
+		.board = board_copy,
+		.board_size = board_size,
+		.palette = palette_copy,
+		.palette_size = palette_copy != NULL ? palette_size : 0
+	};
+	push_reorder_buffer(&apng_writer_buffer, frame_index, frame);
+}
+
+void skip_apng_writer(int frame_index)
+{
+	push_reorder_buffer(&apng_writer_buffer, frame_index, NULL);
+}
+
+static void patch_chunk(long offset, const char* type, const uint8_t* data, uint32_t length)
+{
+	uint8_t header[8];
+	put_u32(header, length);
+	memcpy(header + 4, type, 4);
+	uLong crc = crc32(0L, header + 4, 4);
+	crc = crc32(crc, data, length);
+	uint8_t footer[4];
+	put_u32(footer, (uint32_t) crc);
+
+	fseek(apng_file, offset, SEEK_SET);
+	fwrite(header, 1, sizeof(header), apng_file);
+	fwrite(data, 1, length, apng_file);
+	fwrite(footer, 1, sizeof(footer), apng_file);
+}
+
+void stop_apng_writer()
+{
+	if (!apng_writer_running) {
+		return;
+	}
+
+	apng_writer_stopping = true;
+	pthread_join(apng_writer_thread_id, NULL);
+	size_t dropped = get_reorder_buffer_pending(&apng_writer_buffer);
+	free_reorder_buffer(&apng_writer_buffer, free_apng_frame);
+
+	if (apng_png != NULL && !apng_writer_failed) {
+		png_write_chunk(apng_png, (png_const_bytep) "IEND", NULL, 0);
+		png_write_flush(apng_png);
+		deflateEnd(&deflate_stream);
+
+		uint8_t actl[8];
+		put_u32(actl, (uint32_t) frames_written);
+		put_u32(actl + 4, 0);
+		patch_chunk(apng_actl_offset, "acTL", actl, sizeof(actl));
+
+		uint8_t plte[APNG_PALETTE_SIZE * 3] = { 0 };
+		uint8_t trns[APNG_PALETTE_SIZE];
+		memset(trns, 255, sizeof(trns));
+		for (int i = 0; i < apng_palette_size; i++) {
+			plte[i * 3] = apng_palette[i].r;
+			plte[i * 3 + 1] = apng_palette[i].g;
+			plte[i * 3 + 2] = apng_palette[i].b;
+			trns[i] = apng_palette[i].a;
+		}
+		patch_chunk(apng_palette_offset, "PLTE", plte, sizeof(plte));
+		patch_chunk(apng_palette_offset + APNG_PLTE_CHUNK_SIZE, "tRNS", trns, sizeof(trns));
+	}
+	if (apng_png != NULL) {
+		png_destroy_write_struct(&apng_png, NULL);
+	}
+	if (fclose(apng_file) != 0) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to finish writing %s: %s", apng_file_name, strerror(errno));
+	}
+	apng_file = NULL;
+
+	free(previous_indices);
+	free(current_indices);
+	free(row_buffer);
+	free(deflate_buffer);
+	previous_indices = NULL;
+	current_indices = NULL;
+	row_buffer = NULL;
+	deflate_buffer = NULL;
+	deflate_buffer_size = 0;
+	apng_writer_running = false;
+
+	log_message(LOG_INFO, LOG_HEADER"Wrote %d frames (%d skipped, %zu still out of order) to %s",
+		frames_written, frames_skipped, dropped, apng_file_name);
+	free(apng_file_name);
+	apng_file_name = NULL;
+}
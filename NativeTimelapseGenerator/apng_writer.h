@@ -0,0 +1,20 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "workers/worker_structs.h"
+
+// Appends every canvas, in commit order, to a single animated PNG. Each frame only carries the
+// paletted bounding box that changed since the previous commit
+
+// STRICT: Call on main thread only
+bool start_apng_writer(const char* file_name, int frame_rate);
+bool is_apng_writer_running();
+// Copies the board & palette, palette indices outside of the palette are drawn as the first colour
+void push_apng_writer(int frame_index, int width, int height, const uint8_t* board, size_t board_size,
+	const Colour* palette, int palette_size);
+// Frames that failed to download must still be skipped, otherwise every later frame is held back
+void skip_apng_writer(int frame_index);
+// STRICT: Call on main thread only, writes every frame that can be written and finalises the file
+void stop_apng_writer();
@@ -0,0 +1,283 @@
+// Compares the canvas control pixel loop of the placer colour lookup table against the stb hash map
+// it replaced, over a real placers download (packed or raw) when one is given, otherwise over synthetic placers.
+// PNG encoding, which both paths share, is left out.
+// Usage: placer_colour_lut_bench [width] [height] [users] [top placers] [iterations] [placers download]
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../save_pack.h"
+#include "../placers_codec.h"
+#include "../workers/placer_colour_lut.h"
+#define STB_DS_IMPLEMENTATION
+#include "../lib/stb/stb_ds.h"
+
+typedef struct {
+	UserIntId key;
+	Placer* value;
+} PlacerLookupEntry;
+
+typedef struct {
+	UserIntId key;
+	uint32_t value; // Pixels placed
+} PlacerCountEntry;
+
+// Stands in for save_pack.c's, a download given to the bench is always a file of its own
+uint8_t* read_save(const char* save_path, size_t* out_size)
+{
+	FILE* file = fopen(save_path, "rb");
+	if (file == NULL) {
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	rewind(file);
+	uint8_t* data = size >= 0 ? malloc((size_t) size + 1) : NULL;
+	if (data != NULL && fread(data, 1, (size_t) size, file) != (size_t) size) {
+		free(data);
+		data = NULL;
+	}
+	fclose(file);
+	*out_size = (size_t) size;
+	return data;
+}
+
+static volatile uint32_t bench_sink;
+
+static double now_ms()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (double) time.tv_sec * 1000.0 + (double) time.tv_nsec / 1000000.0;
+}
+
+// xorshift32, so every run is over the same placers
+static uint32_t next_random(uint32_t* state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+// A third of pixels were never placed, the rest skew heavily towards the most active users like a real canvas
+static uint32_t* generate_placers(int width, int height, uint32_t users)
+{
+	uint32_t* placers = malloc(sizeof(uint32_t) * (size_t) width * (size_t) height);
+	if (placers == NULL) {
+		return NULL;
+	}
+	uint32_t state = 0x9E3779B9;
+	for (size_t i = 0; i < (size_t) width * (size_t) height; i++) {
+		uint32_t roll = next_random(&state);
+		if (roll % 3 == 0) {
+			placers[i] = 0;
+			continue;
+		}
+		// Product of two uniform draws, so low ids are far more common
+		uint64_t a = next_random(&state) % users;
+		uint64_t b = next_random(&state) % users;
+		placers[i] = (uint32_t) (a * b / users) + 1;
+	}
+	return placers;
+}
+
+// The removed generate_canvas_control_image loop: a hash map lookup & 4 byte copy per pixel into rows
+// that are all held until the image is written
+static double run_hash_map(int width, int height, const uint32_t* placers, Placer* top_placers, int top_placers_size)
+{
+	double start = now_ms();
+	PlacerLookupEntry* placers_lookup_map = NULL;
+	for (int i = 0; i < top_placers_size; i++) {
+		hmput(placers_lookup_map, top_placers[i].int_id, &top_placers[i]);
+	}
+
+	uint8_t** row_pointers = malloc(sizeof(uint8_t*) * (size_t) height);
+	for (int y = 0; y < height; y++) {
+		row_pointers[y] = calloc(sizeof(Colour) * (size_t) width, sizeof(uint8_t));
+		for (int x = 0; x < width; x++) {
+			Placer* top_placer = hmget(placers_lookup_map, placers[(size_t) y * (size_t) width + (size_t) x]);
+			if (top_placer == NULL) {
+				memset(&row_pointers[y][sizeof(Colour) * (size_t) x], 0, sizeof(Colour));
+				continue;
+			}
+			for (size_t p = 0; p < sizeof(Colour); p++) {
+				row_pointers[y][sizeof(Colour) * (size_t) x + p] = top_placer->colour.channels[p];
+			}
+		}
+	}
+
+	uint32_t sink = 0;
+	for (int y = 0; y < height; y++) {
+		sink += row_pointers[y][(size_t) y % ((size_t) width * sizeof(Colour))];
+		free(row_pointers[y]);
+	}
+	free(row_pointers);
+	hmfree(placers_lookup_map);
+	bench_sink += sink;
+	return now_ms() - start;
+}
+
+// The generate_canvas_control_image loop at scale 1: a lookup table fill per job, then a palette index per pixel
+// into a single reused row
+static double run_lut(PlacerColourLut* lut, uint8_t* row, int width, int height, const uint32_t* placers,
+	const Placer* top_placers, int top_placers_size)
+{
+	double start = now_ms();
+	if (!fill_placer_colour_lut(lut, top_placers, top_placers_size)) {
+		return -1.0;
+	}
+
+	uint32_t sink = 0;
+	for (int y = 0; y < height; y++) {
+		const uint32_t* placers_row = placers + (size_t) y * (size_t) width;
+		for (int x = 0; x < width; x++) {
+			row[x] = lookup_placer_colour_lut(lut, placers_row[x]);
+		}
+		sink += row[y % width];
+	}
+	bench_sink += sink;
+	return now_ms() - start;
+}
+
+// The placers with the most pixels on the board, as get_top_placers would pick them from the download's counts.
+// Pixels nobody placed are id 0, which is never a top placer
+static int pick_top_placers(const uint32_t* placers, size_t length, Placer* top_placers, int top_placers_size)
+{
+	PlacerCountEntry* counts = NULL;
+	for (size_t i = 0; i < length; i++) {
+		if (placers[i] == 0) {
+			continue;
+		}
+		ptrdiff_t entry = hmgeti(counts, placers[i]);
+		if (entry >= 0) {
+			counts[entry].value++;
+		}
+		else {
+			hmput(counts, placers[i], 1);
+		}
+	}
+
+	int picked = 0;
+	for (ptrdiff_t i = 0; i < hmlen(counts); i++) {
+		int insert = picked < top_placers_size ? picked : top_placers_size;
+		while (insert > 0 && counts[i].value > top_placers[insert - 1].pixels_placed) {
+			insert--;
+		}
+		if (insert >= top_placers_size) {
+			continue;
+		}
+		if (picked < top_placers_size) {
+			picked++;
+		}
+		memmove(&top_placers[insert + 1], &top_placers[insert], sizeof(Placer) * (size_t) (picked - insert - 1));
+		top_placers[insert] = (Placer) { .int_id = counts[i].key, .pixels_placed = counts[i].value };
+	}
+	hmfree(counts);
+	return picked;
+}
+
+// Both paths must produce the same colour for every pixel
+static bool check_paths_match(PlacerColourLut* lut, int width, int height, const uint32_t* placers,
+	Placer* top_placers, int top_placers_size)
+{
+	PlacerLookupEntry* placers_lookup_map = NULL;
+	for (int i = 0; i < top_placers_size; i++) {
+		hmput(placers_lookup_map, top_placers[i].int_id, &top_placers[i]);
+	}
+	fill_placer_colour_lut(lut, top_placers, top_placers_size);
+
+	bool matched = true;
+	for (size_t i = 0; matched && i < (size_t) width * (size_t) height; i++) {
+		Placer* top_placer = hmget(placers_lookup_map, placers[i]);
+		uint8_t index = lookup_placer_colour_lut(lut, placers[i]);
+		uint32_t hash_map_colour = top_placer == NULL ? 0 : top_placer->colour.value;
+		uint32_t lut_colour = index == 0 ? 0 : top_placers[index - 1].colour.value;
+		matched = hash_map_colour == lut_colour;
+	}
+	hmfree(placers_lookup_map);
+	return matched;
+}
+
+int main(int argc, char* argv[])
+{
+	int width = argc > 1 ? atoi(argv[1]) : 2000;
+	int height = argc > 2 ? atoi(argv[2]) : 2000;
+	uint32_t users = argc > 3 ? (uint32_t) strtoul(argv[3], NULL, 10) : 50000;
+	int top_placers_size = argc > 4 ? atoi(argv[4]) : 10;
+	int iterations = argc > 5 ? atoi(argv[5]) : 20;
+	const char* placers_path = argc > 6 ? argv[6] : NULL;
+	if (width <= 0 || height <= 0 || users == 0 || top_placers_size <= 0 || top_placers_size > 255 || iterations <= 0) {
+		fprintf(stderr, "Usage: %s [width] [height] [users] [top placers (1-255)] [iterations] [placers download]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// A real board's placers are skewed towards a few very active users in a way the synthetic ones only approximate
+	uint32_t* placers = NULL;
+	if (placers_path != NULL) {
+		size_t length = 0;
+		placers = decode_placers_download(placers_path, &length);
+		if (placers == NULL || length != (size_t) width * (size_t) height) {
+			fprintf(stderr, "%s doesn't hold %dx%d placers\n", placers_path, width, height);
+			return EXIT_FAILURE;
+		}
+	}
+	else {
+		placers = generate_placers(width, height, users);
+	}
+	Placer* top_placers = calloc((size_t) top_placers_size, sizeof(Placer));
+	uint8_t* row = malloc((size_t) width);
+	PlacerColourLut lut = { 0 };
+	if (placers == NULL || top_placers == NULL || row == NULL || !init_placer_colour_lut(&lut)) {
+		fprintf(stderr, "Failed to allocate benchmark buffers\n");
+		return EXIT_FAILURE;
+	}
+	// The most active users, the synthetic placers are generated so that these are the lowest ids
+	if (placers_path != NULL) {
+		top_placers_size = pick_top_placers(placers, (size_t) width * (size_t) height, top_placers, top_placers_size);
+	}
+	else {
+		for (int i = 0; i < top_placers_size; i++) {
+			top_placers[i] = (Placer) { .int_id = (UserIntId) (i + 1) };
+		}
+	}
+	for (int i = 0; i < top_placers_size; i++) {
+		top_placers[i].colour = (Colour) { .r = (uint8_t) (i * 37), .g = (uint8_t) (i * 91), .b = (uint8_t) (i * 53), .a = 255 };
+	}
+
+	if (!check_paths_match(&lut, width, height, placers, top_placers, top_placers_size)) {
+		fprintf(stderr, "Lookup table & hash map paths disagree\n");
+		return EXIT_FAILURE;
+	}
+
+	double hash_map_total = 0.0, hash_map_best = 0.0;
+	double lut_total = 0.0, lut_best = 0.0;
+	for (int i = 0; i < iterations; i++) {
+		double hash_map_time = run_hash_map(width, height, placers, top_placers, top_placers_size);
+		double lut_time = run_lut(&lut, row, width, height, placers, top_placers, top_placers_size);
+		hash_map_total += hash_map_time;
+		lut_total += lut_time;
+		hash_map_best = i == 0 || hash_map_time < hash_map_best ? hash_map_time : hash_map_best;
+		lut_best = i == 0 || lut_time < lut_best ? lut_time : lut_best;
+	}
+
+	if (placers_path != NULL) {
+		printf("input: placers download %s\n", placers_path);
+	}
+	else {
+		printf("input: synthetic placers of %u users\n", users);
+	}
+	printf("%dx%d placers, %d top placers, %d iterations\n", width, height, top_placers_size, iterations);
+	printf("hash map:     %8.2f ms mean, %8.2f ms best\n", hash_map_total / iterations, hash_map_best);
+	printf("lookup table: %8.2f ms mean, %8.2f ms best\n", lut_total / iterations, lut_best);
+	printf("speedup:      %8.2fx mean\n", hash_map_total / lut_total);
+
+	free_placer_colour_lut(&lut);
+	free(row);
+	free(top_placers);
+	free(placers);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,232 @@
+// Compares compiling every statement on each call, as database.c used to, against reusing statements compiled
+// once, over an import of synthetic commits & the per commit lookups a resumed run makes of each of them.
+// Usage: statement_cache_bench [commits] [schema path] [scratch database path]
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Set by CMake to the source tree's schema
+#ifndef BENCH_SCHEMA_PATH
+#define BENCH_SCHEMA_PATH "schema.sql"
+#endif
+
+// Same as main_thread.c's, commits are imported this many at a time in a single transaction each
+#define COMMIT_IMPORT_BATCH_SIZE 1024
+
+// Same SQL as database.c's
+static const char add_commit_sql[] = "INSERT INTO Commits (instance_id, hash, date) VALUES (?, ?, ?) "
+	"ON CONFLICT (hash) DO UPDATE SET hash = excluded.hash RETURNING id;";
+static const char check_save_exists_sql[] = "SELECT EXISTS (SELECT 1 FROM Saves WHERE commit_id = ? AND type = ?)";
+static const char find_commit_changed_pixels_sql[] = "SELECT changed_pixels FROM CommitStats WHERE commit_id = ?";
+
+typedef struct bench_statements {
+	bool cached;
+	sqlite3_stmt* add_commit;
+	sqlite3_stmt* check_save_exists;
+	sqlite3_stmt* find_commit_changed_pixels;
+} BenchStatements;
+
+static double now_ms()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (double) time.tv_sec * 1000.0 + (double) time.tv_nsec / 1000000.0;
+}
+
+static void remove_scratch_database(const char* database_path)
+{
+	char path[4096];
+	unlink(database_path);
+	snprintf(path, sizeof(path), "%s-wal", database_path);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s-shm", database_path);
+	unlink(path);
+}
+
+// Configured as try_create_database does, with the indexes the hot queries rely on
+static sqlite3* open_scratch_database(const char* database_path, const char* schema_sql)
+{
+	remove_scratch_database(database_path);
+	sqlite3* database = NULL;
+	if (sqlite3_open(database_path, &database) != SQLITE_OK) {
+		fprintf(stderr, "Cannot open %s: %s\n", database_path, sqlite3_errmsg(database));
+		sqlite3_close(database);
+		return NULL;
+	}
+	char* err_msg = NULL;
+	if (sqlite3_exec(database, "PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL; "
+			"PRAGMA cache_size = -65536; PRAGMA temp_store = MEMORY;", NULL, NULL, &err_msg) != SQLITE_OK
+		|| sqlite3_exec(database, schema_sql, NULL, NULL, &err_msg) != SQLITE_OK
+		|| sqlite3_exec(database, "CREATE INDEX IF NOT EXISTS idx_saves_commit_type ON Saves (commit_id, type); "
+			"INSERT INTO Instances (repo_url, game_server_url) VALUES ('bench', 'bench');", NULL, NULL, &err_msg) != SQLITE_OK) {
+		fprintf(stderr, "Failed to create %s: %s\n", database_path, err_msg);
+		sqlite3_free(err_msg);
+		sqlite3_close(database);
+		return NULL;
+	}
+	return database;
+}
+
+// Cached statements are only reset, the rest are compiled again as every call used to
+static sqlite3_stmt* get_statement(sqlite3* database, sqlite3_stmt* cached, const char* sql)
+{
+	if (cached != NULL) {
+		sqlite3_reset(cached);
+		sqlite3_clear_bindings(cached);
+		return cached;
+	}
+	sqlite3_stmt* stmt = NULL;
+	sqlite3_prepare_v2(database, sql, -1, &stmt, NULL);
+	return stmt;
+}
+
+static void put_statement(BenchStatements* statements, sqlite3_stmt* stmt)
+{
+	if (!statements->cached) {
+		sqlite3_finalize(stmt);
+	}
+}
+
+// Returns each commit's ID, or null if the import failed
+static int* import_commits(sqlite3* database, BenchStatements* statements, int commit_count)
+{
+	int* commit_ids = malloc(sizeof(int) * (size_t) commit_count);
+	if (commit_ids == NULL) {
+		return NULL;
+	}
+	char hash[41];
+	for (int i = 0; i < commit_count; i++) {
+		if (i % COMMIT_IMPORT_BATCH_SIZE == 0) {
+			sqlite3_exec(database, i == 0 ? "BEGIN" : "COMMIT; BEGIN", NULL, NULL, NULL);
+		}
+		snprintf(hash, sizeof(hash), "%08x%032x", (unsigned int) i * 2654435761u, (unsigned int) i);
+		sqlite3_stmt* stmt = get_statement(database, statements->add_commit, add_commit_sql);
+		sqlite3_bind_int(stmt, 1, 1);
+		sqlite3_bind_text(stmt, 2, hash, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 3, 1648800000 + (int64_t) i * 60);
+		commit_ids[i] = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : -1;
+		sqlite3_reset(stmt);
+		put_statement(statements, stmt);
+		if (commit_ids[i] == -1) {
+			fprintf(stderr, "Failed to insert commit %d: %s\n", i, sqlite3_errmsg(database));
+			sqlite3_exec(database, "ROLLBACK", NULL, NULL, NULL);
+			free(commit_ids);
+			return NULL;
+		}
+	}
+	sqlite3_exec(database, "COMMIT", NULL, NULL, NULL);
+	return commit_ids;
+}
+
+// The lookups designate_jobs & spend_frame_budget make of every commit
+static int64_t look_up_commits(sqlite3* database, BenchStatements* statements, const int* commit_ids, int commit_count)
+{
+	int64_t found = 0;
+	for (int i = 0; i < commit_count; i++) {
+		sqlite3_stmt* stmt = get_statement(database, statements->check_save_exists, check_save_exists_sql);
+		sqlite3_bind_int(stmt, 1, commit_ids[i]);
+		sqlite3_bind_int(stmt, 2, 1);
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			found += sqlite3_column_int(stmt, 0);
+		}
+		sqlite3_reset(stmt);
+		put_statement(statements, stmt);
+
+		stmt = get_statement(database, statements->find_commit_changed_pixels, find_commit_changed_pixels_sql);
+		sqlite3_bind_int(stmt, 1, commit_ids[i]);
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			found += sqlite3_column_int64(stmt, 0);
+		}
+		sqlite3_reset(stmt);
+		put_statement(statements, stmt);
+	}
+	return found;
+}
+
+static bool run_bench(const char* database_path, const char* schema_sql, int commit_count, bool cached,
+	double* out_import_ms, double* out_lookup_ms)
+{
+	sqlite3* database = open_scratch_database(database_path, schema_sql);
+	if (database == NULL) {
+		return false;
+	}
+	BenchStatements statements = { .cached = cached };
+	if (cached) {
+		sqlite3_prepare_v3(database, add_commit_sql, -1, SQLITE_PREPARE_PERSISTENT, &statements.add_commit, NULL);
+		sqlite3_prepare_v3(database, check_save_exists_sql, -1, SQLITE_PREPARE_PERSISTENT, &statements.check_save_exists, NULL);
+		sqlite3_prepare_v3(database, find_commit_changed_pixels_sql, -1, SQLITE_PREPARE_PERSISTENT,
+			&statements.find_commit_changed_pixels, NULL);
+	}
+
+	double start = now_ms();
+	int* commit_ids = import_commits(database, &statements, commit_count);
+	*out_import_ms = now_ms() - start;
+	bool imported = commit_ids != NULL;
+	if (imported) {
+		start = now_ms();
+		look_up_commits(database, &statements, commit_ids, commit_count);
+		*out_lookup_ms = now_ms() - start;
+	}
+
+	free(commit_ids);
+	sqlite3_finalize(statements.add_commit);
+	sqlite3_finalize(statements.check_save_exists);
+	sqlite3_finalize(statements.find_commit_changed_pixels);
+	sqlite3_close(database);
+	remove_scratch_database(database_path);
+	return imported;
+}
+
+static char* read_schema(const char* schema_path)
+{
+	FILE* file = fopen(schema_path, "r");
+	if (file == NULL) {
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	long file_size = ftell(file);
+	rewind(file);
+	char* schema_sql = malloc((size_t) file_size + 1);
+	if (schema_sql != NULL) {
+		size_t read = fread(schema_sql, 1, (size_t) file_size, file);
+		schema_sql[read] = '\0';
+	}
+	fclose(file);
+	return schema_sql;
+}
+
+int main(int argc, char* argv[])
+{
+	int commit_count = argc > 1 ? atoi(argv[1]) : 50000;
+	const char* schema_path = argc > 2 ? argv[2] : BENCH_SCHEMA_PATH;
+	const char* database_path = argc > 3 ? argv[3] : "statement_cache_bench.db";
+	if (commit_count <= 0) {
+		fprintf(stderr, "Usage: %s [commits] [schema path] [scratch database path]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	char* schema_sql = read_schema(schema_path);
+	if (schema_sql == NULL) {
+		fprintf(stderr, "Cannot read schema file: %s\n", schema_path);
+		return EXIT_FAILURE;
+	}
+
+	double uncached_import_ms = 0.0, uncached_lookup_ms = 0.0;
+	double cached_import_ms = 0.0, cached_lookup_ms = 0.0;
+	bool ran = run_bench(database_path, schema_sql, commit_count, false, &uncached_import_ms, &uncached_lookup_ms)
+		&& run_bench(database_path, schema_sql, commit_count, true, &cached_import_ms, &cached_lookup_ms);
+	free(schema_sql);
+	if (!ran) {
+		return EXIT_FAILURE;
+	}
+
+	printf("%d commits, imported %d per transaction\n", commit_count, COMMIT_IMPORT_BATCH_SIZE);
+	printf("import,  prepared per call: %8.2f ms\n", uncached_import_ms);
+	printf("import,  cached:            %8.2f ms (%.2fx)\n", cached_import_ms, uncached_import_ms / cached_import_ms);
+	printf("lookups, prepared per call: %8.2f ms\n", uncached_lookup_ms);
+	printf("lookups, cached:            %8.2f ms (%.2fx)\n", cached_lookup_ms, uncached_lookup_ms / cached_lookup_ms);
+	return EXIT_SUCCESS;
+}
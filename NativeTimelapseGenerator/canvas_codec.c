@@ -0,0 +1,493 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "console.h"
+#include "memory_utils.h"
+#include "save_pack.h"
+#include "canvas_codec.h"
+#include "lib/stb/stb_ds.h"
+
+#define LOG_HEADER "[canvas codec] "
+
+// Raw boards are palette indices, which never begin with this, so raw & encoded downloads can live side by side
+#define CANVAS_CODEC_MAGIC "RPCD"
+#define CANVAS_CODEC_VERSION 1
+#define CANVAS_CODEC_HEADER_SIZE 12
+// Shorter runs are cheaper as part of a literal
+#define MIN_RUN_LENGTH 4
+// Guards against decoding a chain of deltas that loops back on itself
+#define MAX_DELTA_CHAIN 65536
+
+typedef enum canvas_frame_kind:uint8_t {
+	CANVAS_KEYFRAME = 0,
+	CANVAS_DELTA = 1
+} CanvasFrameKind;
+
+// Header: magic, version, kind, base path length (u16 LE), board size (u32 LE), base path, then the runs
+typedef struct canvas_header {
+	CanvasFrameKind kind;
+	uint32_t board_size;
+	const char* base_path; // Not null terminated, deltas only
+	uint16_t base_path_length;
+	const uint8_t* payload;
+	size_t payload_size;
+} CanvasHeader;
+
+typedef struct byte_buffer {
+	uint8_t* data;
+	size_t size;
+	size_t capacity;
+} ByteBuffer;
+
+typedef struct codec_board {
+	SaveJob job;
+	char* save_path;
+} CodecBoard;
+
+// CANVAS CODEC
+static ReorderBuffer codec_buffer;
+// Held while encoding, so each board is only ever diffed against the one before it
+static pthread_mutex_t codec_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool codec_running = false; // Read by workers
+static int codec_keyframe_interval = 0;
+static uint8_t* previous_board = NULL;
+static size_t previous_size = 0;
+static char* previous_save_path = NULL;
+static uint8_t* delta_board = NULL;
+static int boards_since_keyframe = 0;
+static int keyframes_encoded = 0;
+static int deltas_encoded = 0;
+static int boards_skipped = 0;
+static uint64_t raw_bytes = 0;
+static uint64_t encoded_bytes = 0;
+
+static bool reserve_byte_buffer(ByteBuffer* buffer, size_t additional)
+{
+	if (buffer->size + additional <= buffer->capacity) {
+		return true;
+	}
+	size_t capacity = buffer->capacity * 2;
+	if (capacity < buffer->size + additional) {
+		capacity = buffer->size + additional;
+	}
+	uint8_t* data = realloc(buffer->data, capacity);
+	if (data == NULL) {
+		return false;
+	}
+	buffer->data = data;
+	buffer->capacity = capacity;
+	return true;
+}
+
+static void put_varint(ByteBuffer* buffer, uint64_t value)
+{
+	while (value >= 0x80) {
+		buffer->data[buffer->size++] = (uint8_t) (value | 0x80);
+		value >>= 7;
+	}
+	buffer->data[buffer->size++] = (uint8_t) value;
+}
+
+static bool get_varint(const uint8_t* data, size_t size, size_t* position, uint64_t* out_value)
+{
+	uint64_t value = 0;
+	for (int shift = 0; shift < 64 && *position < size; shift += 7) {
+		uint8_t byte = data[(*position)++];
+		value |= (uint64_t) (byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) {
+			*out_value = value;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Compares a word at a time, as deltas are almost entirely long runs of zero
+static size_t find_run_end(const uint8_t* data, size_t start, size_t size)
+{
+	uint8_t value = data[start];
+	uint64_t pattern = value * 0x0101010101010101ull;
+	size_t end = start + 1;
+	while (end + 8 <= size) {
+		uint64_t word;
+		memcpy(&word, data + end, 8);
+		if (word != pattern) {
+			break;
+		}
+		end += 8;
+	}
+	while (end < size && data[end] == value) {
+		end++;
+	}
+	return end;
+}
+
+static bool put_literal(ByteBuffer* buffer, const uint8_t* data, size_t length)
+{
+	if (length == 0) {
+		return true;
+	}
+	if (!reserve_byte_buffer(buffer, length + 10)) {
+		return false;
+	}
+	put_varint(buffer, (uint64_t) (length - 1) << 1);
+	memcpy(buffer->data + buffer->size, data, length);
+	buffer->size += length;
+	return true;
+}
+
+// Each token is a varint, odd for a run of (token >> 1) + MIN_RUN_LENGTH copies of the byte after it,
+// even for (token >> 1) + 1 literal bytes after it
+static bool encode_runs(const uint8_t* data, size_t size, ByteBuffer* out)
+{
+	size_t literal_start = 0;
+	size_t position = 0;
+	while (position < size) {
+		size_t run_end = find_run_end(data, position, size);
+		if (run_end - position >= MIN_RUN_LENGTH) {
+			if (!put_literal(out, data + literal_start, position - literal_start) || !reserve_byte_buffer(out, 11)) {
+				return false;
+			}
+			put_varint(out, ((uint64_t) (run_end - position - MIN_RUN_LENGTH) << 1) | 1);
+			out->data[out->size++] = data[position];
+			literal_start = run_end;
+		}
+		position = run_end;
+	}
+	return put_literal(out, data + literal_start, size - literal_start);
+}
+
+// Keyframes are written over the board, deltas are XORed into it, so runs of zero cost nothing to apply
+static bool apply_runs(const uint8_t* runs, size_t runs_size, uint8_t* board, size_t size, bool xor)
+{
+	size_t position = 0;
+	size_t written = 0;
+	while (position < runs_size) {
+		uint64_t token;
+		if (!get_varint(runs, runs_size, &position, &token)) {
+			return false;
+		}
+		bool run = token & 1;
+		uint64_t length = (token >> 1) + (run ? MIN_RUN_LENGTH : 1);
+		if (length > size - written || position + (run ? 1 : length) > runs_size) {
+			return false;
+		}
+		if (run) {
+			uint8_t value = runs[position++];
+			if (!xor) {
+				memset(board + written, value, length);
+			}
+			else if (value != 0) {
+				for (uint64_t i = 0; i < length; i++) {
+					board[written + i] ^= value;
+				}
+			}
+		}
+		else {
+			if (!xor) {
+				memcpy(board + written, runs + position, length);
+			}
+			else {
+				for (uint64_t i = 0; i < length; i++) {
+					board[written + i] ^= runs[position + i];
+				}
+			}
+			position += length;
+		}
+		written += length;
+	}
+	return written == size;
+}
+
+// Branchless over plain arrays so that it is auto-vectorised
+static void xor_boards(const uint8_t* restrict previous, const uint8_t* restrict board, size_t size, uint8_t* restrict out)
+{
+	for (size_t i = 0; i < size; i++) {
+		out[i] = previous[i] ^ board[i];
+	}
+}
+
+static bool read_canvas_header(const uint8_t* data, size_t size, CanvasHeader* out_header)
+{
+	if (size < CANVAS_CODEC_HEADER_SIZE || memcmp(data, CANVAS_CODEC_MAGIC, 4) != 0 || data[4] != CANVAS_CODEC_VERSION) {
+		return false;
+	}
+	uint16_t base_path_length = (uint16_t) (data[6] | data[7] << 8);
+	if (data[5] > CANVAS_DELTA || size < CANVAS_CODEC_HEADER_SIZE + (size_t) base_path_length) {
+		return false;
+	}
+	*out_header = (CanvasHeader) {
+		.kind = data[5],
+		.board_size = (uint32_t) data[8] | (uint32_t) data[9] << 8 | (uint32_t) data[10] << 16 | (uint32_t) data[11] << 24,
+		.base_path = (const char*) data + CANVAS_CODEC_HEADER_SIZE,
+		.base_path_length = base_path_length,
+		.payload = data + CANVAS_CODEC_HEADER_SIZE + base_path_length,
+		.payload_size = size - CANVAS_CODEC_HEADER_SIZE - base_path_length
+	};
+	return true;
+}
+
+static bool write_canvas_header(ByteBuffer* buffer, CanvasFrameKind kind, uint32_t board_size, const char* base_path)
+{
+	size_t base_path_length = base_path == NULL ? 0 : strlen(base_path);
+	if (base_path_length > UINT16_MAX || !reserve_byte_buffer(buffer, CANVAS_CODEC_HEADER_SIZE + base_path_length)) {
+		return false;
+	}
+	uint8_t* header = buffer->data + buffer->size;
+	memcpy(header, CANVAS_CODEC_MAGIC, 4);
+	header[4] = CANVAS_CODEC_VERSION;
+	header[5] = kind;
+	header[6] = (uint8_t) base_path_length;
+	header[7] = (uint8_t) (base_path_length >> 8);
+	for (int i = 0; i < 4; i++) {
+		header[8 + i] = (uint8_t) (board_size >> (i * 8));
+	}
+	if (base_path_length > 0) {
+		memcpy(header + CANVAS_CODEC_HEADER_SIZE, base_path, base_path_length);
+	}
+	buffer->size += CANVAS_CODEC_HEADER_SIZE + base_path_length;
+	return true;
+}
+
+static void free_codec_board(void* data)
+{
+	CodecBoard* board = (CodecBoard*) data;
+	free(board->job.data);
+	free(board->save_path);
+	free(board);
+}
+
+static bool encode_codec_board(CodecBoard* board, EncodedCanvas* out_canvas)
+{
+	size_t size = board->job.size;
+	bool keyframe = previous_board == NULL || previous_size != size || size > UINT32_MAX
+		|| boards_since_keyframe + 1 >= codec_keyframe_interval;
+	if (!keyframe && delta_board == NULL) {
+		delta_board = malloc(size);
+		keyframe = delta_board == NULL;
+	}
+
+	ByteBuffer encoded = { .data = malloc(size / 16 + 64), .size = 0, .capacity = size / 16 + 64 };
+	bool encoded_runs = encoded.data != NULL;
+	if (keyframe) {
+		encoded_runs = encoded_runs && write_canvas_header(&encoded, CANVAS_KEYFRAME, (uint32_t) size, NULL)
+			&& encode_runs(board->job.data, size, &encoded);
+	}
+	else {
+		xor_boards(previous_board, board->job.data, size, delta_board);
+		encoded_runs = encoded_runs && write_canvas_header(&encoded, CANVAS_DELTA, (uint32_t) size, previous_save_path)
+			&& encode_runs(delta_board, size, &encoded);
+	}
+	if (!encoded_runs) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to encode canvas of commit %s", board->job.commit_hash);
+		free(encoded.data);
+		return false;
+	}
+
+	// Becomes the base of the next board, a board that is also the same size can be reused in place
+	if (previous_size != size) {
+		free(previous_board);
+		free(delta_board);
+		delta_board = NULL;
+		previous_board = malloc(size);
+		previous_size = previous_board == NULL ? 0 : size;
+	}
+	if (previous_board != NULL) {
+		memcpy(previous_board, board->job.data, size);
+	}
+	free(previous_save_path);
+	previous_save_path = strdup(board->save_path);
+	boards_since_keyframe = keyframe ? 0 : boards_since_keyframe + 1;
+	if (keyframe) {
+		keyframes_encoded++;
+	}
+	else {
+		deltas_encoded++;
+	}
+	raw_bytes += size;
+	encoded_bytes += encoded.size;
+
+	*out_canvas = (EncodedCanvas) { .job = board->job, .save_path = board->save_path };
+	out_canvas->job.data = encoded.data;
+	out_canvas->job.size = encoded.size;
+	free(board->job.data);
+	free(board);
+	return true;
+}
+
+void start_canvas_codec(int keyframe_interval)
+{
+	init_reorder_buffer(&codec_buffer, 0, DEFAULT_REORDER_WINDOW);
+	codec_keyframe_interval = keyframe_interval;
+	boards_since_keyframe = 0;
+	keyframes_encoded = 0;
+	deltas_encoded = 0;
+	boards_skipped = 0;
+	raw_bytes = 0;
+	encoded_bytes = 0;
+	codec_running = true;
+	log_message(LOG_INFO, LOG_HEADER"Storing canvas downloads as a keyframe every %d commits, with deltas between",
+		keyframe_interval);
+}
+
+bool is_canvas_codec_running()
+{
+	return codec_running;
+}
+
+EncodedCanvas* advance_canvas_codec(SaveJob job, const char* save_path)
+{
+	CodecBoard* item = NULL;
+	if (job.data != NULL) {
+		// The download itself may still be rendered by another worker
+		uint8_t* data = malloc(job.size);
+		if (data != NULL) {
+			memcpy(data, job.data, job.size);
+			item = malloc(sizeof(CodecBoard));
+			*item = (CodecBoard) { .job = job, .save_path = strdup(save_path) };
+			item->job.data = data;
+		}
+	}
+	push_reorder_buffer(&codec_buffer, job.frame_index, item);
+
+	// Whoever pushes last encodes every board that is now in order, including those pushed by others
+	EncodedCanvas* canvases = NULL;
+	pthread_mutex_lock(&codec_mutex);
+	void* data = NULL;
+	while (pop_reorder_buffer(&codec_buffer, &data)) {
+		if (data == NULL) {
+			boards_skipped++;
+			continue;
+		}
+		EncodedCanvas canvas;
+		if (encode_codec_board((CodecBoard*) data, &canvas)) {
+			arrput(canvases, canvas);
+		}
+		else {
+			free_codec_board(data);
+		}
+	}
+	pthread_mutex_unlock(&codec_mutex);
+	return canvases;
+}
+
+void stop_canvas_codec()
+{
+	if (!codec_running) {
+		return;
+	}
+
+	size_t dropped = get_reorder_buffer_pending(&codec_buffer);
+	free_reorder_buffer(&codec_buffer, free_codec_board);
+	free(previous_board);
+	free(delta_board);
+	free(previous_save_path);
+	previous_board = NULL;
+	delta_board = NULL;
+	previous_save_path = NULL;
+	previous_size = 0;
+	codec_running = false;
+
+	log_message(LOG_INFO, LOG_HEADER"Canvas codec stopped after %d keyframes & %d deltas (%d skipped, %zu still out of order), "
+		"%llu bytes stored as %llu", keyframes_encoded, deltas_encoded, boards_skipped, dropped,
+		(unsigned long long) raw_bytes, (unsigned long long) encoded_bytes);
+}
+
+char* get_canvas_download_base(const uint8_t* data, size_t size)
+{
+	CanvasHeader header;
+	if (!read_canvas_header(data, size, &header) || header.kind != CANVAS_DELTA) {
+		return NULL;
+	}
+	return strndup(header.base_path, header.base_path_length);
+}
+
+uint8_t* rebase_canvas_download(const uint8_t* data, size_t size, const char* base_path, size_t* out_size)
+{
+	CanvasHeader header;
+	if (!read_canvas_header(data, size, &header) || header.kind != CANVAS_DELTA) {
+		return NULL;
+	}
+	// Only the header changes, runs are copied as they are
+	ByteBuffer rebased = { 0 };
+	if (!write_canvas_header(&rebased, CANVAS_DELTA, header.board_size, base_path)
+		|| !reserve_byte_buffer(&rebased, header.payload_size)) {
+		free(rebased.data);
+		return NULL;
+	}
+	memcpy(rebased.data + rebased.size, header.payload, header.payload_size);
+	rebased.size += header.payload_size;
+	*out_size = rebased.size;
+	return rebased.data;
+}
+
+typedef struct canvas_file {
+	uint8_t* data;
+	size_t size;
+} CanvasFile;
+
+uint8_t* decode_canvas_download(const char* save_path, size_t* out_size)
+{
+	// Walks back to the keyframe, then replays every delta after it forwards
+	CanvasFile* chain = NULL;
+	char* path = strdup(save_path);
+	CanvasHeader header = { 0 };
+	bool encoded = false;
+	bool found_keyframe = false;
+	while (path != NULL && arrlen(chain) < MAX_DELTA_CHAIN) {
+		CanvasFile file = { 0 };
+		file.data = read_save(path, &file.size);
+		free(path);
+		path = NULL;
+		if (file.data == NULL) {
+			break;
+		}
+		arrput(chain, file);
+		encoded = read_canvas_header(file.data, file.size, &header);
+		if (!encoded || header.kind == CANVAS_KEYFRAME) {
+			found_keyframe = true;
+			break;
+		}
+		path = strndup(header.base_path, header.base_path_length);
+	}
+	free(path);
+
+	uint8_t* board = NULL;
+	size_t board_size = 0;
+	if (found_keyframe) {
+		CanvasFile keyframe = arrlast(chain);
+		if (!encoded) {
+			// Raw boards are the keyframe as they are
+			board = keyframe.data;
+			board_size = keyframe.size;
+			arrlast(chain).data = NULL;
+		}
+		else if ((board = malloc(header.board_size > 0 ? header.board_size : 1)) != NULL) {
+			board_size = header.board_size;
+			if (!apply_runs(header.payload, header.payload_size, board, board_size, false)) {
+				free(board);
+				board = NULL;
+			}
+		}
+	}
+	for (ptrdiff_t i = arrlen(chain) - 2; i >= 0 && board != NULL; i--) {
+		if (!read_canvas_header(chain[i].data, chain[i].size, &header) || header.board_size != board_size
+			|| !apply_runs(header.payload, header.payload_size, board, board_size, true)) {
+			free(board);
+			board = NULL;
+		}
+	}
+	for (int i = 0; i < arrlen(chain); i++) {
+		free(chain[i].data);
+	}
+	arrfree(chain);
+
+	if (board == NULL) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to decode canvas download %s", save_path);
+		return NULL;
+	}
+	*out_size = board_size;
+	return board;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "workers/worker_structs.h"
+
+// Stores canvas downloads as a keyframe every keyframe_interval boards, with the boards in between stored
+// as run length encoded XORs against the board before them. Boards are encoded strictly in commit order
+
+// A canvas download ready to be saved in place of the raw board, data & save path are malloc allocated
+typedef struct encoded_canvas {
+	SaveJob job; // Data is the encoded canvas
+	char* save_path;
+} EncodedCanvas;
+
+// STRICT: Call on main thread only
+void start_canvas_codec(int keyframe_interval);
+bool is_canvas_codec_running();
+// Copies job's board, a job without data skips its frame. Save path is where this board will be saved, later
+// boards refer to it. Returns stb array of every canvas that could be encoded in order, possibly none
+EncodedCanvas* advance_canvas_codec(SaveJob job, const char* save_path);
+// STRICT: Call on main thread only, once every worker has stopped
+void stop_canvas_codec();
+
+// Save path of the canvas a delta is based on, malloc allocated. Null for keyframes & raw boards
+char* get_canvas_download_base(const uint8_t* data, size_t size);
+// Copy of a delta that's based on base_path instead, malloc allocated. Null if data isn't a delta
+uint8_t* rebase_canvas_download(const uint8_t* data, size_t size, const char* base_path, size_t* out_size);
+
+// Decodes any single canvas download by replaying from its keyframe, raw boards are returned as they are.
+// Returns a malloc allocated board, or null
+uint8_t* decode_canvas_download(const char* save_path, size_t* out_size);
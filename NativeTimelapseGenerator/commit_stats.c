@@ -0,0 +1,158 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "console.h"
+#include "database.h"
+#include "memory_utils.h"
+#include "commit_stats.h"
+
+#define LOG_HEADER "[commit stats] "
+
+typedef struct commit_stats_board {
+	int stats_index;
+	int commit_id;
+	bool counted;
+	int width;
+	int height;
+	uint8_t* board;
+} CommitStatsBoard;
+
+// COMMIT STATS
+static ReorderBuffer commit_stats_buffer;
+// Held while counting, so boards are only ever compared one at a time and in order
+static pthread_mutex_t commit_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool commit_stats_running = false; // Read by workers
+static void (*commit_stats_complete)() = NULL;
+static int expected_count = 0;
+static int counted_count = 0;
+static int skipped_count = 0;
+// Kept in the previous board's own buffer, so no copy is needed
+static CommitStatsBoard* previous_board = NULL;
+
+static void free_commit_stats_board(void* data)
+{
+	CommitStatsBoard* board = (CommitStatsBoard*) data;
+	if (board != NULL) {
+		free(board->board);
+		free(board);
+	}
+}
+
+// Branchless over plain arrays so that it is auto-vectorised
+static size_t count_changed_pixels(const uint8_t* restrict previous, const uint8_t* restrict board, size_t size)
+{
+	size_t changed = 0;
+	for (size_t i = 0; i < size; i++) {
+		changed += previous[i] != board[i];
+	}
+	return changed;
+}
+
+static void count_commit_stats_board(CommitStatsBoard* board)
+{
+	size_t size = (size_t) board->width * (size_t) board->height;
+	size_t changed = 0;
+	// A canvas that was resized is counted as entirely changed
+	if (previous_board != NULL && previous_board->width == board->width && previous_board->height == board->height) {
+		changed = count_changed_pixels(previous_board->board, board->board, size);
+	}
+	else if (previous_board != NULL) {
+		changed = size;
+	}
+	// Otherwise the commit before it never arrived, so its changes are unknown
+	if (board->counted && (previous_board != NULL || board->stats_index == 0)) {
+		add_commit_stats_to_db(board->commit_id, (int64_t) changed, (int64_t) size);
+	}
+
+	free_commit_stats_board(previous_board);
+	previous_board = board;
+}
+
+static void drain_commit_stats()
+{
+	bool completed = false;
+	pthread_mutex_lock(&commit_stats_mutex);
+	void* data = NULL;
+	while (pop_reorder_buffer(&commit_stats_buffer, &data)) {
+		if (data == NULL) {
+			free_commit_stats_board(previous_board);
+			previous_board = NULL;
+			skipped_count++;
+		}
+		else {
+			count_commit_stats_board((CommitStatsBoard*) data);
+			counted_count++;
+		}
+		completed = expected_count > 0 && counted_count + skipped_count == expected_count;
+	}
+	pthread_mutex_unlock(&commit_stats_mutex);
+
+	if (completed) {
+		log_message(LOG_INFO, LOG_HEADER"Counted changes of %d commits (%d skipped)", counted_count, skipped_count);
+		commit_stats_complete();
+	}
+}
+
+void start_commit_stats(int expected_commits, void (*on_complete)())
+{
+	init_reorder_buffer(&commit_stats_buffer, 0, DEFAULT_REORDER_WINDOW);
+	commit_stats_complete = on_complete;
+	expected_count = expected_commits;
+	counted_count = 0;
+	skipped_count = 0;
+	previous_board = NULL;
+	commit_stats_running = true;
+	if (expected_commits > 0) {
+		log_message(LOG_INFO, LOG_HEADER"Counting changes of %d commits", expected_commits);
+	}
+	else {
+		log_message(LOG_INFO, LOG_HEADER"Counting changes of every downloaded canvas");
+	}
+}
+
+bool is_commit_stats_running()
+{
+	return commit_stats_running;
+}
+
+bool is_commit_stats_counting_downloads()
+{
+	return commit_stats_running && expected_count == 0;
+}
+
+void push_commit_stats(int stats_index, int commit_id, int width, int height, uint8_t* board, bool counted)
+{
+	CommitStatsBoard* item = malloc(sizeof(CommitStatsBoard));
+	*item = (CommitStatsBoard) {
+		.stats_index = stats_index,
+		.commit_id = commit_id,
+		.counted = counted,
+		.width = width,
+		.height = height,
+		.board = board
+	};
+	push_reorder_buffer(&commit_stats_buffer, stats_index, item);
+	drain_commit_stats();
+}
+
+void skip_commit_stats(int stats_index)
+{
+	push_reorder_buffer(&commit_stats_buffer, stats_index, NULL);
+	drain_commit_stats();
+}
+
+void stop_commit_stats()
+{
+	if (!commit_stats_running) {
+		return;
+	}
+
+	pthread_mutex_lock(&commit_stats_mutex);
+	free_reorder_buffer(&commit_stats_buffer, free_commit_stats_board);
+	free_commit_stats_board(previous_board);
+	previous_board = NULL;
+	commit_stats_running = false;
+	pthread_mutex_unlock(&commit_stats_mutex);
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Counts the pixels each commit's canvas changed against the commit before it, strictly in commit order,
+// and records them in CommitStats so that a frame budget can be spent where the canvas is most active.
+// Normally counted from canvases as they're downloaded, a frame budget only makes a pass of its own over
+// commits that were never counted
+
+// STRICT: Call on main thread only. on_complete is called, from whichever worker finishes the pass, once
+// expected_commits commits have been counted or skipped. With 0 expected commits, every canvas download is
+// counted until stopped instead, with its frame index as its stats index
+void start_commit_stats(int expected_commits, void (*on_complete)());
+bool is_commit_stats_running();
+bool is_commit_stats_counting_downloads();
+// Takes ownership of board. A board that isn't counted is only compared against. Boards are only counted against
+// the board at the stats index before them, the first board at index 0 is counted as unchanged
+void push_commit_stats(int stats_index, int commit_id, int width, int height, uint8_t* board, bool counted);
+// Commits that failed to download must still be skipped, otherwise every later commit is held back. The commit
+// after a skipped one isn't counted, as there's nothing to compare it against
+void skip_commit_stats(int stats_index);
+// STRICT: Call on main thread only
+void stop_commit_stats();
@@ -1,7 +1,13 @@
+#define _GNU_SOURCE
 #include <avcall.h>
+#include <errno.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <sqlite3.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <openssl/evp.h>
 #include <openssl/sha.h>
 #include <string.h>
@@ -16,27 +22,287 @@
 
 #define LOG_HEADER "[database] "
 
+#define DATABASE_FILE_NAME "instance_tracker.db"
+// Read only connections that lookups are spread across, so that they never wait on writes
+#define DATABASE_READER_COUNT 4
+// Applied to every connection. Negative cache sizes are in KiB
+#define DATABASE_TUNING_SQL "PRAGMA cache_size = -65536; PRAGMA temp_store = MEMORY; " \
+	"PRAGMA mmap_size = 268435456; PRAGMA busy_timeout = 5000;"
+
+// Saves are committed once this many are queued, or once the first of them has waited this long
+#define SAVE_BATCH_ROWS 256
+#define SAVE_BATCH_INTERVAL_MS 50
+// Periodic durability syncs the filesystem once per batch, so batches are far larger
+#define SAVE_SYNC_BATCH_ROWS 4096
+#define SAVE_SYNC_INTERVAL_MS 1000
+
+// HOT QUERIES
+// Run per commit or per save, so each must be served by an index. Checked by check_query_plans, & compiled as
+// the database opens so that a statement that no longer compiles fails the open rather than a later commit
+static const char move_save_sql[] = "UPDATE Saves SET save_path = ? WHERE save_path = ?";
+static const char find_packed_save_sql[] = "SELECT id, save_path, pack_path, pack_offset, pack_length FROM Saves "
+	"WHERE save_path = ? AND pack_path IS NOT NULL LIMIT 1";
+static const char get_commit_saves_sql[] = "SELECT DISTINCT Saves.commit_id, Saves.type FROM Saves "
+	"INNER JOIN Commits ON Commits.id = Saves.commit_id WHERE Commits.instance_id = ?";
+static const char check_save_exists_sql[] = "SELECT EXISTS (SELECT 1 FROM Saves WHERE commit_id = ? AND type = ?)";
+static const char find_content_hash_sql[] = "SELECT commit_id FROM ContentHashes WHERE hash = ? AND type = ?";
+static const char add_save_reference_sql[] = "INSERT INTO Saves (commit_id, start_date, finish_date, type, save_path, pack_path, pack_offset, pack_length) "
+	"SELECT DISTINCT ?, ?, ?, type, save_path, pack_path, pack_offset, pack_length FROM Saves WHERE commit_id = ? AND type = ?";
+static const char find_commit_changed_pixels_sql[] = "SELECT changed_pixels FROM CommitStats WHERE commit_id = ?";
+static const char find_existing_palette_sql[] = "SELECT id FROM Palettes WHERE hash = ?";
+// Run on the writer
+static const char* const hot_writer_queries[] = {
+	move_save_sql, add_save_reference_sql, find_existing_palette_sql
+};
+// Run on every reader
+static const char* const hot_reader_queries[] = {
+	find_packed_save_sql, get_commit_saves_sql, check_save_exists_sql, find_content_hash_sql, find_commit_changed_pixels_sql
+};
+#define HOT_WRITER_QUERY_COUNT ((int) (sizeof(hot_writer_queries) / sizeof(hot_writer_queries[0])))
+#define HOT_READER_QUERY_COUNT ((int) (sizeof(hot_reader_queries) / sizeof(hot_reader_queries[0])))
+
+typedef struct cached_statement {
+	char* key; // SQL of the statement
+	sqlite3_stmt* value;
+} CachedStatement;
+
+typedef struct database_reader {
+	sqlite3* connection;
+	pthread_mutex_t mutex; // Held for as long as a lookup uses the connection
+	CachedStatement* statements; // stb string hashmap
+} DatabaseReader;
+
 // DATABASE
+// The only connection that writes, owned by the database thread. Every write is run there one after another, so
+// neither the connection nor its statements need a lock
 static sqlite3* database = NULL;
 static pthread_t database_thread_id;
-// Needed until Work functions are made awaitable
-static pthread_mutex_t database_mutex;
+static bool database_thread_started = false;
+static CachedStatement* cached_statements = NULL; // stb string hashmap, only used on the database thread
+
+// DATABASE THREAD
+static WorkQueue database_thread_work_queue;
+static pthread_mutex_t database_work_mutex = PTHREAD_MUTEX_INITIALIZER; // Held to push or pop work
+static pthread_cond_t database_work_pushed = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t database_work_popped = PTHREAD_COND_INITIALIZER;
+
+// A write posted by another thread, which waits until it has run
+typedef struct database_call {
+	av_alist work;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool done;
+} DatabaseCall;
+
+// DATABASE READERS
+static DatabaseReader database_readers[DATABASE_READER_COUNT];
+static int database_readers_open = 0;
+static atomic_uint next_database_reader = 0;
+
+// SAVE BATCHES
+static pthread_t save_batch_thread_id;
+static pthread_mutex_t save_batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t save_batch_cond = PTHREAD_COND_INITIALIZER;
+static PendingSave* pending_saves = NULL; // stb array
+static bool save_batches_running = false;
+static bool save_batches_stopping = false;
+static SaveCommittedCallback save_committed_callback = NULL;
+static SaveDurability save_batch_durability = SAVE_DURABILITY_PERIODIC;
+static int save_batch_rows = SAVE_BATCH_ROWS;
+static int save_batch_interval_ms = SAVE_BATCH_INTERVAL_MS; // 0 commits whatever is queued straight away
+static int save_sync_fd = -1; // Any file on the filesystem holding the saves, for syncfs
+
+// Readies a cached statement for its next use
+static void release_cached(sqlite3_stmt* stmt)
+{
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
+// Each statement is only compiled on its first use on a connection & reused after, so statements must be
+// released rather than finalised
+static int prepare_cached_on(sqlite3* connection, CachedStatement** cache, const char* sql, sqlite3_stmt** out_stmt)
+{
+	ptrdiff_t index = shgeti(*cache, sql);
+	if (index >= 0) {
+		// In case it was left mid step by an early return
+		release_cached((*cache)[index].value);
+		*out_stmt = (*cache)[index].value;
+		return SQLITE_OK;
+	}
+	int result = sqlite3_prepare_v3(connection, sql, -1, SQLITE_PREPARE_PERSISTENT, out_stmt, NULL);
+	if (result == SQLITE_OK) {
+		if (*cache == NULL) {
+			sh_new_strdup(*cache);
+		}
+		shput(*cache, sql, *out_stmt);
+	}
+	return result;
+}
+
+// Compiles every statement into the connection's cache up front, false if any of them doesn't compile
+static bool prepare_hot_statements(sqlite3* connection, CachedStatement** cache, const char* const* queries, int count)
+{
+	for (int i = 0; i < count; i++) {
+		sqlite3_stmt* stmt;
+		if (prepare_cached_on(connection, cache, queries[i], &stmt) != SQLITE_OK) {
+			log_message(LOG_ERROR, LOG_HEADER"Failed to prepare '%s': %s\n", queries[i], sqlite3_errmsg(connection));
+			return false;
+		}
+	}
+	return true;
+}
+
+// STRICT: Call on database thread only
+static int prepare_cached(const char* sql, sqlite3_stmt** out_stmt)
+{
+	return prepare_cached_on(database, &cached_statements, sql, out_stmt);
+}
+
+static void finalize_cached_statements(CachedStatement** cache)
+{
+	for (int i = 0; i < shlen(*cache); i++) {
+		sqlite3_finalize((*cache)[i].value);
+	}
+	shfree(*cache);
+	*cache = NULL;
+}
+
+static void run_database_call(DatabaseCall* call)
+{
+	av_call(call->work);
+	pthread_mutex_lock(&call->mutex);
+	call->done = true;
+	pthread_cond_signal(&call->cond);
+	pthread_mutex_unlock(&call->mutex);
+}
+
+// Runs the work on the database thread & waits for it to finish, so that the writer connection is only ever used
+// there. Work from the database thread itself is run straight away
+static void database_thread_call(av_alist work)
+{
+	if (pthread_equal(pthread_self(), database_thread_id)) {
+		av_call(work);
+		return;
+	}
+
+	DatabaseCall call = { .work = work, .done = false };
+	pthread_mutex_init(&call.mutex, NULL);
+	pthread_cond_init(&call.cond, NULL);
+	av_alist call_alist;
+	av_start_void(call_alist, &run_database_call);
+	av_ptr(call_alist, DatabaseCall*, &call);
+	database_thread_post(call_alist);
+
+	pthread_mutex_lock(&call.mutex);
+	while (!call.done) {
+		pthread_cond_wait(&call.cond, &call.mutex);
+	}
+	pthread_mutex_unlock(&call.mutex);
+	pthread_cond_destroy(&call.cond);
+	pthread_mutex_destroy(&call.mutex);
+}
+
+// Lookups take whichever reader is free, only waiting when every reader is in use
+static DatabaseReader* lock_reader()
+{
+	unsigned int start = atomic_fetch_add(&next_database_reader, 1);
+	for (int i = 0; i < database_readers_open; i++) {
+		DatabaseReader* reader = &database_readers[(start + (unsigned int) i) % (unsigned int) database_readers_open];
+		if (pthread_mutex_trylock(&reader->mutex) == 0) {
+			return reader;
+		}
+	}
+	DatabaseReader* reader = &database_readers[start % (unsigned int) database_readers_open];
+	pthread_mutex_lock(&reader->mutex);
+	return reader;
+}
+
+static void unlock_reader(DatabaseReader* reader)
+{
+	pthread_mutex_unlock(&reader->mutex);
+}
+
+// Must be called with the reader locked
+static int prepare_reader_cached(DatabaseReader* reader, const char* sql, sqlite3_stmt** out_stmt)
+{
+	return prepare_cached_on(reader->connection, &reader->statements, sql, out_stmt);
+}
+
+// STRICT: Call on database thread only, once nothing is using the readers
+static void close_database_readers()
+{
+	for (int i = 0; i < database_readers_open; i++) {
+		finalize_cached_statements(&database_readers[i].statements);
+		sqlite3_close(database_readers[i].connection);
+		pthread_mutex_destroy(&database_readers[i].mutex);
+	}
+	database_readers_open = 0;
+}
+
+// STRICT: Call on database thread only, once the database is in WAL mode. Readers only see committed rows, so
+// never block the writer nor are blocked by it
+static bool open_database_readers()
+{
+	for (int i = 0; i < DATABASE_READER_COUNT; i++) {
+		DatabaseReader* reader = &database_readers[i];
+		*reader = (DatabaseReader) { .connection = NULL, .statements = NULL };
+		if (sqlite3_open_v2(DATABASE_FILE_NAME, &reader->connection, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK
+			|| sqlite3_exec(reader->connection, DATABASE_TUNING_SQL, NULL, NULL, NULL) != SQLITE_OK) {
+			log_message(LOG_ERROR, LOG_HEADER"Cannot open database reader: %s\n", sqlite3_errmsg(reader->connection));
+			sqlite3_close(reader->connection);
+			close_database_readers();
+			return false;
+		}
+		pthread_mutex_init(&reader->mutex, NULL);
+		database_readers_open++;
+		if (!prepare_hot_statements(reader->connection, &reader->statements, hot_reader_queries, HOT_READER_QUERY_COUNT)) {
+			close_database_readers();
+			return false;
+		}
+	}
+	return true;
+}
+
+// STRICT: Call on database thread only
+static void finalize_writer_statements()
+{
+	finalize_cached_statements(&cached_statements);
+}
+
+void free_statement_cache()
+{
+	av_alist finalize_alist;
+	av_start_void(finalize_alist, &finalize_writer_statements);
+	database_thread_call(finalize_alist);
+	for (int i = 0; i < database_readers_open; i++) {
+		pthread_mutex_lock(&database_readers[i].mutex);
+		finalize_cached_statements(&database_readers[i].statements);
+		pthread_mutex_unlock(&database_readers[i].mutex);
+	}
+}
 
 bool add_save_to_db(int commit_id, SaveJobType type, const char* save_path)
 {
-	pthread_mutex_lock(&database_mutex);
+	return add_packed_save_to_db(commit_id, type, save_path, NULL, 0, 0);
+}
 
+// STRICT: Call on database thread only
+static void insert_packed_save(int commit_id, SaveJobType type, const char* save_path, const char* pack_path,
+	int64_t pack_offset, int64_t pack_length, bool* out_added)
+{
+	*out_added = false;
 	sqlite3_stmt* stmt;
-	const char* sql = "INSERT INTO Saves (commit_id, start_date, finish_date, type, save_path) VALUES (?, ?, ?, ?, ?);";
+	const char* sql = "INSERT INTO Saves (commit_id, start_date, finish_date, type, save_path, pack_path, pack_offset, pack_length) "
+		"VALUES (?, ?, ?, ?, ?, ?, ?, ?);";
 	int rc;
 
 	time_t current_time = time(NULL);
 
-	rc = sqlite3_prepare_v2(database, sql, -1, &stmt, 0);
+	rc = prepare_cached(sql, &stmt);
 	if (rc != SQLITE_OK) {
 		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare save statement: %s\n", sqlite3_errmsg(database));
-		pthread_mutex_unlock(&database_mutex);
-		return false;
+		return;
 	}
 
 	sqlite3_bind_int(stmt, 1, commit_id);
@@ -44,30 +310,556 @@ bool add_save_to_db(int commit_id, SaveJobType type, const char* save_path)
 	sqlite3_bind_int64(stmt, 3, current_time);  // finish_date (TODO: Implement - same as start for now)
 	sqlite3_bind_int(stmt, 4, type);
 	sqlite3_bind_text(stmt, 5, save_path, -1, SQLITE_TRANSIENT);
+	if (pack_path != NULL) {
+		sqlite3_bind_text(stmt, 6, pack_path, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_int64(stmt, 7, pack_offset);
+		sqlite3_bind_int64(stmt, 8, pack_length);
+	}
+	else {
+		sqlite3_bind_null(stmt, 6);
+		sqlite3_bind_null(stmt, 7);
+		sqlite3_bind_null(stmt, 8);
+	}
 
 	rc = sqlite3_step(stmt);
 	if (rc != SQLITE_DONE) {
 		log_message(LOG_ERROR, LOG_HEADER"Failed to insert save: %s\n", sqlite3_errmsg(database));
-		sqlite3_finalize(stmt);
-		pthread_mutex_unlock(&database_mutex);
+		release_cached(stmt);
+		return;
+	}
+
+	release_cached(stmt);
+	*out_added = true;
+}
+
+// Saves outside of a pack leave its columns null, save_path is where they're unpacked to either way
+bool add_packed_save_to_db(int commit_id, SaveJobType type, const char* save_path, const char* pack_path,
+	int64_t pack_offset, int64_t pack_length)
+{
+	bool added = false;
+	av_alist save_alist;
+	av_start_void(save_alist, &insert_packed_save);
+	av_int(save_alist, commit_id);
+	av_int(save_alist, type);
+	av_ptr(save_alist, const char*, save_path);
+	av_ptr(save_alist, const char*, pack_path);
+	av_longlong(save_alist, pack_offset);
+	av_longlong(save_alist, pack_length);
+	av_ptr(save_alist, bool*, &added);
+	database_thread_call(save_alist);
+	return added;
+}
+
+// STRICT: Call on database thread only
+static bool insert_pending_save(const PendingSave* save, sqlite3_stmt* save_batch_stmt, sqlite3_stmt* content_hash_batch_stmt)
+{
+	release_cached(save_batch_stmt);
+	time_t current_time = time(NULL);
+	sqlite3_bind_int(save_batch_stmt, 1, save->commit_id);
+	sqlite3_bind_int64(save_batch_stmt, 2, current_time);
+	sqlite3_bind_int64(save_batch_stmt, 3, current_time);
+	sqlite3_bind_int(save_batch_stmt, 4, save->type);
+	sqlite3_bind_text(save_batch_stmt, 5, save->save_path, -1, SQLITE_STATIC);
+	if (save->pack_path != NULL) {
+		sqlite3_bind_text(save_batch_stmt, 6, save->pack_path, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(save_batch_stmt, 7, save->pack_offset);
+	}
+	// Loose saves record their length too, so that reconciling catches files cut short
+	sqlite3_bind_int64(save_batch_stmt, 8, save->pack_length);
+	if (sqlite3_step(save_batch_stmt) != SQLITE_DONE) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to insert save %s: %s\n", save->save_path, sqlite3_errmsg(database));
 		return false;
 	}
+	if (save->content_hash == 0) {
+		return true;
+	}
 
-	pthread_mutex_unlock(&database_mutex);
+	// Only now that it's saved can identical downloads reuse it
+	release_cached(content_hash_batch_stmt);
+	sqlite3_bind_int64(content_hash_batch_stmt, 1, (sqlite3_int64) save->content_hash);
+	sqlite3_bind_int(content_hash_batch_stmt, 2, save->type);
+	sqlite3_bind_int(content_hash_batch_stmt, 3, save->commit_id);
+	if (sqlite3_step(content_hash_batch_stmt) != SQLITE_DONE) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to insert content hash: %s\n", sqlite3_errmsg(database));
+	}
 	return true;
 }
 
+// STRICT: Call on database thread only. Every save of a batch shares a single transaction, & so a single journal sync
+static void insert_save_batch(const PendingSave* saves, bool* inserted, bool* out_committed)
+{
+	*out_committed = false;
+	sqlite3_stmt* save_batch_stmt = NULL;
+	sqlite3_stmt* content_hash_batch_stmt = NULL;
+	const char* save_sql = "INSERT INTO Saves (commit_id, start_date, finish_date, type, save_path, pack_path, pack_offset, pack_length) "
+		"VALUES (?, ?, ?, ?, ?, ?, ?, ?);";
+	const char* content_hash_sql = "INSERT OR IGNORE INTO ContentHashes (hash, type, commit_id) VALUES (?, ?, ?)";
+	bool prepared = prepare_cached(save_sql, &save_batch_stmt) == SQLITE_OK
+		&& prepare_cached(content_hash_sql, &content_hash_batch_stmt) == SQLITE_OK;
+	if (!prepared) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare save batch statements: %s\n", sqlite3_errmsg(database));
+		return;
+	}
+
+	char* err_msg = NULL;
+	bool committed = false;
+	if (sqlite3_exec(database, "BEGIN", NULL, NULL, &err_msg) == SQLITE_OK) {
+		// A save that fails on its own doesn't hold back the rest of its batch
+		for (int i = 0; i < arrlen(saves); i++) {
+			inserted[i] = insert_pending_save(&saves[i], save_batch_stmt, content_hash_batch_stmt);
+		}
+		committed = sqlite3_exec(database, "COMMIT", NULL, NULL, &err_msg) == SQLITE_OK;
+		if (!committed) {
+			sqlite3_exec(database, "ROLLBACK", NULL, NULL, NULL);
+		}
+	}
+	if (err_msg != NULL) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to commit batch of %d saves: %s\n", (int) arrlen(saves), err_msg);
+		sqlite3_free(err_msg);
+	}
+	*out_committed = committed;
+}
+
+static void commit_save_batch(PendingSave* saves, bool report)
+{
+	// Every file & pack written since the last batch reaches the disk before any of their rows
+	if (save_batch_durability == SAVE_DURABILITY_PERIODIC && save_sync_fd != -1 && syncfs(save_sync_fd) == -1) {
+		log_message(LOG_WARNING, LOG_HEADER"Failed to sync saves to disk: %s\n", strerror(errno));
+	}
+
+	bool* inserted = calloc((size_t) arrlen(saves) + 1, sizeof(bool));
+	bool committed = false;
+	if (inserted != NULL) {
+		av_alist batch_alist;
+		av_start_void(batch_alist, &insert_save_batch);
+		av_ptr(batch_alist, const PendingSave*, saves);
+		av_ptr(batch_alist, bool*, inserted);
+		av_ptr(batch_alist, bool*, &committed);
+		database_thread_call(batch_alist);
+	}
+
+	for (int i = 0; i < arrlen(saves); i++) {
+		free(saves[i].pack_path);
+		saves[i].pack_path = NULL;
+		if (inserted != NULL) {
+			inserted[i] = committed && inserted[i];
+		}
+	}
+	// A single callback per batch, batches can be thousands of rows, far more than the main work queue holds
+	save_committed_callback(saves, inserted, report);
+	free(inserted);
+}
+
+void* start_save_batch_loop(void* data)
+{
+	while (true) {
+		pthread_mutex_lock(&save_batch_mutex);
+		while (arrlen(pending_saves) == 0 && !save_batches_stopping) {
+			pthread_cond_wait(&save_batch_cond, &save_batch_mutex);
+		}
+		// The first save of a batch starts its timer
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += save_batch_interval_ms * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		while (save_batch_interval_ms > 0 && arrlen(pending_saves) < save_batch_rows && !save_batches_stopping
+			&& pthread_cond_timedwait(&save_batch_cond, &save_batch_mutex, &deadline) == 0) {
+		}
+		PendingSave* saves = pending_saves;
+		pending_saves = NULL;
+		bool stopping = save_batches_stopping;
+		pthread_mutex_unlock(&save_batch_mutex);
+
+		if (arrlen(saves) > 0) {
+			commit_save_batch(saves, !stopping);
+		}
+		arrfree(saves);
+		if (stopping) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+// STRICT: Call on database thread only
+static void set_writer_synchronous(const char* synchronous_sql)
+{
+	char* err_msg = NULL;
+	if (sqlite3_exec(database, synchronous_sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+		log_message(LOG_WARNING, LOG_HEADER"Failed to set database durability: %s\n", err_msg);
+		sqlite3_free(err_msg);
+	}
+}
+
+void start_save_batches(SaveCommittedCallback on_committed, SaveDurability durability)
+{
+	save_committed_callback = on_committed;
+	save_batch_durability = durability;
+	save_batches_stopping = false;
+	const char* synchronous_sql = "PRAGMA synchronous = NORMAL";
+	switch (durability) {
+		case SAVE_DURABILITY_SYNC: {
+			// Saves are already synced one by one, so their rows don't wait for a batch to fill
+			save_batch_rows = SAVE_BATCH_ROWS;
+			save_batch_interval_ms = 0;
+			synchronous_sql = "PRAGMA synchronous = FULL";
+			break;
+		}
+		case SAVE_DURABILITY_PERIODIC: {
+			save_batch_rows = SAVE_SYNC_BATCH_ROWS;
+			save_batch_interval_ms = SAVE_SYNC_INTERVAL_MS;
+			save_sync_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			break;
+		}
+		case SAVE_DURABILITY_RELAXED: {
+			save_batch_rows = SAVE_BATCH_ROWS;
+			save_batch_interval_ms = SAVE_BATCH_INTERVAL_MS;
+			synchronous_sql = "PRAGMA synchronous = OFF";
+			break;
+		}
+	}
+	av_alist durability_alist;
+	av_start_void(durability_alist, &set_writer_synchronous);
+	av_ptr(durability_alist, const char*, synchronous_sql);
+	database_thread_call(durability_alist);
+
+	pthread_create(&save_batch_thread_id, NULL, start_save_batch_loop, NULL);
+	save_batches_running = true;
+}
+
+void queue_save_to_db(PendingSave save)
+{
+	pthread_mutex_lock(&save_batch_mutex);
+	arrput(pending_saves, save);
+	pthread_cond_signal(&save_batch_cond);
+	pthread_mutex_unlock(&save_batch_mutex);
+}
+
+void stop_save_batches()
+{
+	if (!save_batches_running) {
+		return;
+	}
+
+	pthread_mutex_lock(&save_batch_mutex);
+	save_batches_stopping = true;
+	pthread_cond_signal(&save_batch_cond);
+	pthread_mutex_unlock(&save_batch_mutex);
+	pthread_join(save_batch_thread_id, NULL);
+	if (save_sync_fd != -1) {
+		close(save_sync_fd);
+		save_sync_fd = -1;
+	}
+	save_batches_running = false;
+}
+
+LooseSave* get_loose_saves()
+{
+	DatabaseReader* reader = lock_reader();
+	sqlite3_stmt* stmt;
+	LooseSave* saves = NULL;
+
+	const char* sql = "SELECT Saves.save_path, Saves.type, Commits.hash, Commits.date FROM Saves "
+		"INNER JOIN Commits ON Commits.id = Saves.commit_id "
+		"WHERE Saves.pack_path IS NULL AND Saves.save_path IS NOT NULL GROUP BY Saves.save_path";
+
+	if (prepare_reader_cached(reader, sql, &stmt) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare loose saves statement: %s\n", sqlite3_errmsg(reader->connection));
+		unlock_reader(reader);
+		return NULL;
+	}
+
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		LooseSave save = {
+			.save_path = strdup((const char*) sqlite3_column_text(stmt, 0)),
+			.type = sqlite3_column_int(stmt, 1),
+			.commit_hash = strdup((const char*) sqlite3_column_text(stmt, 2)),
+			.date = (time_t) sqlite3_column_int64(stmt, 3)
+		};
+		arrput(saves, save);
+	}
+
+	release_cached(stmt);
+	unlock_reader(reader);
+	return saves;
+}
+
+// STRICT: Call on database thread only
+static void update_save_path(const char* save_path, const char* new_save_path, bool* out_moved)
+{
+	*out_moved = false;
+	sqlite3_stmt* stmt;
+
+	const char* sql = move_save_sql;
+
+	if (prepare_cached(sql, &stmt) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare move save statement: %s\n", sqlite3_errmsg(database));
+		return;
+	}
+
+	sqlite3_bind_text(stmt, 1, new_save_path, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(stmt, 2, save_path, -1, SQLITE_TRANSIENT);
+
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to move save: %s\n", sqlite3_errmsg(database));
+		release_cached(stmt);
+		return;
+	}
+
+	release_cached(stmt);
+	*out_moved = true;
+}
+
+bool move_save_in_db(const char* save_path, const char* new_save_path)
+{
+	bool moved = false;
+	av_alist move_alist;
+	av_start_void(move_alist, &update_save_path);
+	av_ptr(move_alist, const char*, save_path);
+	av_ptr(move_alist, const char*, new_save_path);
+	av_ptr(move_alist, bool*, &moved);
+	database_thread_call(move_alist);
+	return moved;
+}
+
+// A negative length is one that was never recorded, loose saves from before lengths were kept. Only missing or
+// empty files are caught for those
+static bool is_save_on_disk(const char* save_path, const char* pack_path, int64_t pack_offset, int64_t pack_length)
+{
+	struct stat file_stat;
+	if (pack_path != NULL) {
+		return stat(pack_path, &file_stat) == 0 && (int64_t) file_stat.st_size >= pack_offset + pack_length;
+	}
+	if (stat(save_path, &file_stat) != 0) {
+		return false;
+	}
+	return pack_length < 0 ? file_stat.st_size > 0 : (int64_t) file_stat.st_size == pack_length;
+}
+
+// STRICT: Call on database thread only
+static void remove_missing_saves(int* out_missing)
+{
+	*out_missing = -1;
+	sqlite3_stmt* stmt;
+	int* missing_ids = NULL; // stb array
+
+	const char* sql = "SELECT id, save_path, pack_path, pack_offset, pack_length FROM Saves WHERE save_path IS NOT NULL";
+
+	if (prepare_cached(sql, &stmt) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare reconcile saves statement: %s\n", sqlite3_errmsg(database));
+		return;
+	}
+	int checked = 0;
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		int64_t length = sqlite3_column_type(stmt, 4) == SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 4);
+		if (!is_save_on_disk((const char*) sqlite3_column_text(stmt, 1), (const char*) sqlite3_column_text(stmt, 2),
+				sqlite3_column_int64(stmt, 3), length)) {
+			arrput(missing_ids, sqlite3_column_int(stmt, 0));
+		}
+		checked++;
+	}
+	release_cached(stmt);
+
+	if (arrlen(missing_ids) == 0) {
+		log_message(LOG_INFO, LOG_HEADER"Reconciled %d saves, all are on disk", checked);
+		*out_missing = 0;
+		return;
+	}
+
+	const char* delete_sql = "DELETE FROM Saves WHERE id = ?";
+	if (prepare_cached(delete_sql, &stmt) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare delete save statement: %s\n", sqlite3_errmsg(database));
+		arrfree(missing_ids);
+		return;
+	}
+	char* err_msg = NULL;
+	bool removed = sqlite3_exec(database, "BEGIN", NULL, NULL, &err_msg) == SQLITE_OK;
+	for (int i = 0; removed && i < arrlen(missing_ids); i++) {
+		sqlite3_reset(stmt);
+		sqlite3_bind_int(stmt, 1, missing_ids[i]);
+		removed = sqlite3_step(stmt) == SQLITE_DONE;
+	}
+	release_cached(stmt);
+	// Identical downloads must not be pointed at a commit whose save is gone
+	removed = removed && sqlite3_exec(database, "DELETE FROM ContentHashes WHERE NOT EXISTS (SELECT 1 FROM Saves "
+		"WHERE Saves.commit_id = ContentHashes.commit_id AND Saves.type = ContentHashes.type)", NULL, NULL, &err_msg) == SQLITE_OK;
+	removed = removed && sqlite3_exec(database, "COMMIT", NULL, NULL, &err_msg) == SQLITE_OK;
+	if (!removed) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to remove missing saves: %s\n", err_msg ? err_msg : sqlite3_errmsg(database));
+		sqlite3_free(err_msg);
+		sqlite3_exec(database, "ROLLBACK", NULL, NULL, NULL);
+		arrfree(missing_ids);
+		return;
+	}
+
+	int missing = (int) arrlen(missing_ids);
+	arrfree(missing_ids);
+	log_message(LOG_WARNING, LOG_HEADER"Reconciled %d saves, removed %d that were no longer on disk", checked, missing);
+	*out_missing = missing;
+}
+
+int reconcile_saves_in_db()
+{
+	int missing = -1;
+	av_alist reconcile_alist;
+	av_start_void(reconcile_alist, &remove_missing_saves);
+	av_ptr(reconcile_alist, int*, &missing);
+	database_thread_call(reconcile_alist);
+	return missing;
+}
+
+// Returns stb array of every save still inside a pack, references to the same packed data are only returned once
+PackedSave* get_packed_saves()
+{
+	DatabaseReader* reader = lock_reader();
+	sqlite3_stmt* stmt;
+	PackedSave* saves = NULL;
+
+	const char* sql = "SELECT id, save_path, pack_path, pack_offset, pack_length FROM Saves WHERE pack_path IS NOT NULL "
+		"GROUP BY pack_path, pack_offset ORDER BY pack_path, pack_offset";
+
+	if (prepare_reader_cached(reader, sql, &stmt) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare packed saves statement: %s\n", sqlite3_errmsg(reader->connection));
+		unlock_reader(reader);
+		return NULL;
+	}
+
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		PackedSave save = {
+			.save_id = sqlite3_column_int(stmt, 0),
+			.save_path = strdup((const char*) sqlite3_column_text(stmt, 1)),
+			.pack_path = strdup((const char*) sqlite3_column_text(stmt, 2)),
+			.pack_offset = sqlite3_column_int64(stmt, 3),
+			.pack_length = sqlite3_column_int64(stmt, 4)
+		};
+		arrput(saves, save);
+	}
+
+	release_cached(stmt);
+	unlock_reader(reader);
+	return saves;
+}
+
+// Finds the pack holding the save at save_path, false if it's a file of its own
+bool find_packed_save(const char* save_path, PackedSave* out_save)
+{
+	DatabaseReader* reader = lock_reader();
+	sqlite3_stmt* stmt;
+
+	const char* sql = find_packed_save_sql;
+
+	if (prepare_reader_cached(reader, sql, &stmt) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare find packed save statement: %s\n", sqlite3_errmsg(reader->connection));
+		unlock_reader(reader);
+		return false;
+	}
+
+	sqlite3_bind_text(stmt, 1, save_path, -1, SQLITE_TRANSIENT);
+	bool found = sqlite3_step(stmt) == SQLITE_ROW;
+	if (found) {
+		*out_save = (PackedSave) {
+			.save_id = sqlite3_column_int(stmt, 0),
+			.save_path = strdup((const char*) sqlite3_column_text(stmt, 1)),
+			.pack_path = strdup((const char*) sqlite3_column_text(stmt, 2)),
+			.pack_offset = sqlite3_column_int64(stmt, 3),
+			.pack_length = sqlite3_column_int64(stmt, 4)
+		};
+	}
+
+	release_cached(stmt);
+	unlock_reader(reader);
+	return found;
+}
+
+// STRICT: Call on database thread only
+static void clear_save_pack(const char* pack_path, int64_t pack_offset, bool* out_unpacked)
+{
+	*out_unpacked = false;
+	sqlite3_stmt* stmt;
+
+	const char* sql = "UPDATE Saves SET pack_path = NULL, pack_offset = NULL WHERE pack_path = ? AND pack_offset = ?";
+
+	if (prepare_cached(sql, &stmt) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare unpack save statement: %s\n", sqlite3_errmsg(database));
+		return;
+	}
+
+	sqlite3_bind_text(stmt, 1, pack_path, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_int64(stmt, 2, pack_offset);
+
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to unpack save: %s\n", sqlite3_errmsg(database));
+		release_cached(stmt);
+		return;
+	}
+
+	release_cached(stmt);
+	*out_unpacked = true;
+}
+
+// Points the save at its loose file, once it has been unpacked. Every reference to the same packed
+// data is moved along with it
+bool unpack_save_in_db(const char* pack_path, int64_t pack_offset)
+{
+	bool unpacked = false;
+	av_alist unpack_alist;
+	av_start_void(unpack_alist, &clear_save_pack);
+	av_ptr(unpack_alist, const char*, pack_path);
+	av_longlong(unpack_alist, pack_offset);
+	av_ptr(unpack_alist, bool*, &unpacked);
+	database_thread_call(unpack_alist);
+	return unpacked;
+}
+
+CommitSaves* get_commit_saves(int instance_id)
+{
+	DatabaseReader* reader = lock_reader();
+	sqlite3_stmt* stmt;
+	CommitSaves* commit_saves = NULL;
+
+	// Read straight out of idx_saves_commit_type, without touching the Saves table itself
+	const char* sql = get_commit_saves_sql;
+
+	if (prepare_reader_cached(reader, sql, &stmt) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare commit saves statement: %s\n", sqlite3_errmsg(reader->connection));
+		unlock_reader(reader);
+		return NULL;
+	}
+
+	sqlite3_bind_int(stmt, 1, instance_id);
+
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		int commit_id = sqlite3_column_int(stmt, 0);
+		int type = sqlite3_column_int(stmt, 1);
+		if (type < 0 || type >= 32) {
+			continue;
+		}
+		ptrdiff_t index = hmgeti(commit_saves, commit_id);
+		if (index >= 0) {
+			commit_saves[index].value |= 1u << type;
+		}
+		else {
+			hmput(commit_saves, commit_id, 1u << type);
+		}
+	}
+
+	release_cached(stmt);
+	unlock_reader(reader);
+	return commit_saves;
+}
+
 bool check_save_exists(int commit_id, SaveJobType type)
 {
-	pthread_mutex_lock(&database_mutex);
+	DatabaseReader* reader = lock_reader();
 	sqlite3_stmt* stmt;
 	int save_exists = 0;
 
-	const char* sql = "SELECT COUNT(*) FROM Saves WHERE commit_id = ? AND type = ?";
+	const char* sql = check_save_exists_sql;
 	
-	if (sqlite3_prepare_v2(database, sql, -1, &stmt, 0) != SQLITE_OK) {
-		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare save check statement: %s\n", sqlite3_errmsg(database));
-		pthread_mutex_unlock(&database_mutex);
+	if (prepare_reader_cached(reader, sql, &stmt) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare save check statement: %s\n", sqlite3_errmsg(reader->connection));
+		unlock_reader(reader);
 		return false;
 	}
 
@@ -78,12 +870,192 @@ bool check_save_exists(int commit_id, SaveJobType type)
 		save_exists = sqlite3_column_int(stmt, 0);
 	}
 
-	sqlite3_finalize(stmt);
-	pthread_mutex_unlock(&database_mutex);
+	release_cached(stmt);
+	unlock_reader(reader);
 
 	return save_exists > 0;
 }
 
+// Returns the commit an identical download was first seen in, or -1
+int find_content_hash(uint64_t hash, SaveJobType type)
+{
+	DatabaseReader* reader = lock_reader();
+	sqlite3_stmt* stmt;
+	int commit_id = -1;
+
+	const char* sql = find_content_hash_sql;
+
+	if (prepare_reader_cached(reader, sql, &stmt) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare content hash statement: %s\n", sqlite3_errmsg(reader->connection));
+		unlock_reader(reader);
+		return -1;
+	}
+
+	sqlite3_bind_int64(stmt, 1, (sqlite3_int64) hash);
+	sqlite3_bind_int(stmt, 2, type);
+
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		commit_id = sqlite3_column_int(stmt, 0);
+	}
+
+	release_cached(stmt);
+	unlock_reader(reader);
+	return commit_id;
+}
+
+// STRICT: Call on database thread only
+static void insert_content_hash(uint64_t hash, SaveJobType type, int commit_id, bool* out_added)
+{
+	*out_added = false;
+	sqlite3_stmt* stmt;
+
+	// The earliest save of some content is kept, it's the one other saves reference
+	const char* sql = "INSERT OR IGNORE INTO ContentHashes (hash, type, commit_id) VALUES (?, ?, ?)";
+
+	if (prepare_cached(sql, &stmt) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare content hash insert statement: %s\n", sqlite3_errmsg(database));
+		return;
+	}
+
+	sqlite3_bind_int64(stmt, 1, (sqlite3_int64) hash);
+	sqlite3_bind_int(stmt, 2, type);
+	sqlite3_bind_int(stmt, 3, commit_id);
+
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to insert content hash: %s\n", sqlite3_errmsg(database));
+		release_cached(stmt);
+		return;
+	}
+
+	release_cached(stmt);
+	*out_added = true;
+}
+
+bool add_content_hash_to_db(uint64_t hash, SaveJobType type, int commit_id)
+{
+	bool added = false;
+	av_alist hash_alist;
+	av_start_void(hash_alist, &insert_content_hash);
+	av_ulonglong(hash_alist, hash);
+	av_int(hash_alist, type);
+	av_int(hash_alist, commit_id);
+	av_ptr(hash_alist, bool*, &added);
+	database_thread_call(hash_alist);
+	return added;
+}
+
+// STRICT: Call on database thread only
+static void insert_save_reference(int commit_id, int source_commit_id, SaveJobType type, bool* out_referenced)
+{
+	*out_referenced = false;
+	sqlite3_stmt* stmt;
+	time_t current_time = time(NULL);
+
+	const char* sql = add_save_reference_sql;
+
+	if (prepare_cached(sql, &stmt) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare save reference statement: %s\n", sqlite3_errmsg(database));
+		return;
+	}
+
+	sqlite3_bind_int(stmt, 1, commit_id);
+	sqlite3_bind_int64(stmt, 2, current_time);
+	sqlite3_bind_int64(stmt, 3, current_time);
+	sqlite3_bind_int(stmt, 4, source_commit_id);
+	sqlite3_bind_int(stmt, 5, type);
+
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to insert save reference: %s\n", sqlite3_errmsg(database));
+		release_cached(stmt);
+		return;
+	}
+	*out_referenced = sqlite3_changes(database) > 0;
+
+	release_cached(stmt);
+}
+
+// Copies a save of the source commit to another commit, pointing at the same file. False if the
+// source commit has no such save (yet)
+bool add_save_reference_to_db(int commit_id, int source_commit_id, SaveJobType type)
+{
+	bool referenced = false;
+	av_alist reference_alist;
+	av_start_void(reference_alist, &insert_save_reference);
+	av_int(reference_alist, commit_id);
+	av_int(reference_alist, source_commit_id);
+	av_int(reference_alist, type);
+	av_ptr(reference_alist, bool*, &referenced);
+	database_thread_call(reference_alist);
+	return referenced;
+}
+
+// STRICT: Call on database thread only
+static void insert_commit_stats(int commit_id, int64_t changed_pixels, int64_t total_pixels, bool* out_added)
+{
+	*out_added = false;
+	sqlite3_stmt* stmt;
+
+	const char* sql = "INSERT OR REPLACE INTO CommitStats (commit_id, changed_pixels, total_pixels) VALUES (?, ?, ?)";
+
+	if (prepare_cached(sql, &stmt) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare commit stats insert statement: %s\n", sqlite3_errmsg(database));
+		return;
+	}
+
+	sqlite3_bind_int(stmt, 1, commit_id);
+	sqlite3_bind_int64(stmt, 2, changed_pixels);
+	sqlite3_bind_int64(stmt, 3, total_pixels);
+
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to insert commit stats: %s\n", sqlite3_errmsg(database));
+		release_cached(stmt);
+		return;
+	}
+
+	release_cached(stmt);
+	*out_added = true;
+}
+
+// Later passes replace the stats of an earlier one, as the commits before them may have changed
+bool add_commit_stats_to_db(int commit_id, int64_t changed_pixels, int64_t total_pixels)
+{
+	bool added = false;
+	av_alist stats_alist;
+	av_start_void(stats_alist, &insert_commit_stats);
+	av_int(stats_alist, commit_id);
+	av_longlong(stats_alist, changed_pixels);
+	av_longlong(stats_alist, total_pixels);
+	av_ptr(stats_alist, bool*, &added);
+	database_thread_call(stats_alist);
+	return added;
+}
+
+// Returns -1 if the commit has no stats yet
+int64_t find_commit_changed_pixels(int commit_id)
+{
+	DatabaseReader* reader = lock_reader();
+	sqlite3_stmt* stmt;
+	int64_t changed_pixels = -1;
+
+	const char* sql = find_commit_changed_pixels_sql;
+
+	if (prepare_reader_cached(reader, sql, &stmt) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare commit stats statement: %s\n", sqlite3_errmsg(reader->connection));
+		unlock_reader(reader);
+		return -1;
+	}
+
+	sqlite3_bind_int(stmt, 1, commit_id);
+
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		changed_pixels = sqlite3_column_int64(stmt, 0);
+	}
+
+	release_cached(stmt);
+	unlock_reader(reader);
+	return changed_pixels;
+}
+
 void compute_palette_hash(const Colour* palette, int palette_size, char* out_hash)
 {
 	EVP_MD_CTX* ctx = EVP_MD_CTX_new();
@@ -112,7 +1084,7 @@ int create_new_palette(const Colour* palette, int palette_size)
 	
 	// Insert new palette
 	const char* sql_insert_palette = "INSERT INTO Palettes (size, hash) VALUES (?, ?)";
-	if (sqlite3_prepare_v2(database, sql_insert_palette, -1, &stmt, NULL) != SQLITE_OK) {
+	if (prepare_cached(sql_insert_palette, &stmt) != SQLITE_OK) {
 		return -1;
 	}
 
@@ -123,10 +1095,10 @@ int create_new_palette(const Colour* palette, int palette_size)
 	sqlite3_bind_text(stmt, 2, palette_hash, -1, SQLITE_STATIC);
 
 	if (sqlite3_step(stmt) != SQLITE_DONE) {
-		sqlite3_finalize(stmt);
+		release_cached(stmt);
 		return -1;
 	}
-	sqlite3_finalize(stmt);
+	release_cached(stmt);
 	
 	palette_id = sqlite3_last_insert_rowid(database);
 	
@@ -135,7 +1107,7 @@ int create_new_palette(const Colour* palette, int palette_size)
 		"INSERT INTO Colours (palette_id, red, green, blue, alpha, position) "
 		"VALUES (?, ?, ?, ?, ?, ?)";
 	
-	if (sqlite3_prepare_v2(database, sql_insert_colors, -1, &stmt, NULL) != SQLITE_OK) {
+	if (prepare_cached(sql_insert_colors, &stmt) != SQLITE_OK) {
 		return -1;
 	}
 	
@@ -148,13 +1120,13 @@ int create_new_palette(const Colour* palette, int palette_size)
 		sqlite3_bind_int(stmt, 6, i);
 		
 		if (sqlite3_step(stmt) != SQLITE_DONE) {
-			sqlite3_finalize(stmt);
+			release_cached(stmt);
 			return -1;
 		}
 		sqlite3_reset(stmt);
 	}
 	
-	sqlite3_finalize(stmt);
+	release_cached(stmt);
 	return palette_id;
 }
 
@@ -164,10 +1136,10 @@ int find_existing_palette(const Colour* palette, int palette_size)
 	compute_palette_hash(palette, palette_size, palette_hash);
 
 	sqlite3_stmt* stmt;
-	const char* sql = "SELECT id FROM Palettes WHERE hash = ?";
+	const char* sql = find_existing_palette_sql;
 	int palette_id = -1;
 
-	if (sqlite3_prepare_v2(database, sql, -1, &stmt, NULL) != SQLITE_OK) {
+	if (prepare_cached(sql, &stmt) != SQLITE_OK) {
 		return -1;
 	}
 
@@ -177,7 +1149,7 @@ int find_existing_palette(const Colour* palette, int palette_size)
 		palette_id = sqlite3_column_int(stmt, 0);
 	}
 
-	sqlite3_finalize(stmt);
+	release_cached(stmt);
 	return palette_id;
 }
 
@@ -190,7 +1162,7 @@ int find_existing_canvas_metadata(CanvasMetadata metadata, int palette_id)
 		"SELECT id FROM CanvasMetadatas "
 		"WHERE width = ? AND height = ? AND palette_id = ?";
 	
-	if (sqlite3_prepare_v2(database, sql, -1, &stmt, NULL) != SQLITE_OK) {
+	if (prepare_cached(sql, &stmt) != SQLITE_OK) {
 		return -1;
 	}
 	
@@ -202,19 +1174,16 @@ int find_existing_canvas_metadata(CanvasMetadata metadata, int palette_id)
 		metadata_id = sqlite3_column_int(stmt, 0);
 	}
 	
-	sqlite3_finalize(stmt);
+	release_cached(stmt);
 	return metadata_id;
 }
 
-// Main function to add canvas metadata to database
+// Main function to add canvas metadata to database. STRICT: Call on database thread only
 bool add_canvas_metadata_to_db(CanvasMetadata metadata, int commit_id)
 {
-	pthread_mutex_lock(&database_mutex);
-
 	// Begin transaction
 	if (sqlite3_exec(database, "BEGIN TRANSACTION", NULL, NULL, NULL) != SQLITE_OK) {
 		log_message(LOG_ERROR, LOG_HEADER"Failed to begin transaction\n");
-		pthread_mutex_unlock(&database_mutex);
 		return false;
 	}
 
@@ -225,7 +1194,6 @@ bool add_canvas_metadata_to_db(CanvasMetadata metadata, int commit_id)
 		if (palette_id == -1) {
 			log_message(LOG_ERROR, LOG_HEADER"Failed to create new palette\n");
 			sqlite3_exec(database, "ROLLBACK", NULL, NULL, NULL);
-			pthread_mutex_unlock(&database_mutex);
 			return false;
 		}
 	}
@@ -240,9 +1208,8 @@ bool add_canvas_metadata_to_db(CanvasMetadata metadata, int commit_id)
 			"INSERT INTO CanvasMetadatas (palette_id, first_seen_commit_id, width, height) "
 			"VALUES (?, ?, ?, ?)";
 		
-		if (sqlite3_prepare_v2(database, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		if (prepare_cached(sql, &stmt) != SQLITE_OK) {
 			sqlite3_exec(database, "ROLLBACK", NULL, NULL, NULL);
-			pthread_mutex_unlock(&database_mutex);
 			return false;
 		}
 		
@@ -252,13 +1219,12 @@ bool add_canvas_metadata_to_db(CanvasMetadata metadata, int commit_id)
 		sqlite3_bind_int(stmt, 4, metadata.height);
 		
 		if (sqlite3_step(stmt) != SQLITE_DONE) {
-			sqlite3_finalize(stmt);
+			release_cached(stmt);
 			sqlite3_exec(database, "ROLLBACK", NULL, NULL, NULL);
-			pthread_mutex_unlock(&database_mutex);
 			return false;
 		}
 		
-		sqlite3_finalize(stmt);
+		release_cached(stmt);
 		metadata_id = sqlite3_last_insert_rowid(database);
 	}
 	
@@ -268,9 +1234,8 @@ bool add_canvas_metadata_to_db(CanvasMetadata metadata, int commit_id)
 		"INSERT INTO CommitCanvasMetadatas (commit_id, canvas_metadata_id) "
 		"VALUES (?, ?)";
 	
-	if (sqlite3_prepare_v2(database, sql, -1, &stmt, NULL) != SQLITE_OK) {
+	if (prepare_cached(sql, &stmt) != SQLITE_OK) {
 		sqlite3_exec(database, "ROLLBACK", NULL, NULL, NULL);
-		pthread_mutex_unlock(&database_mutex);
 		return false;
 	}
 	
@@ -282,7 +1247,7 @@ bool add_canvas_metadata_to_db(CanvasMetadata metadata, int commit_id)
 		success = true;
 	}
 	
-	sqlite3_finalize(stmt);
+	release_cached(stmt);
 	
 	// Commit or rollback transaction
 	if (success) {
@@ -295,90 +1260,81 @@ bool add_canvas_metadata_to_db(CanvasMetadata metadata, int commit_id)
 		sqlite3_exec(database, "ROLLBACK", NULL, NULL, NULL);
 	}
 	
-	pthread_mutex_unlock(&database_mutex);
 	return success;
 }
 
-int find_existing_commit(const char* hash)
+int add_commit_to_db(int instance_id, CommitInfo info)
 {
-	sqlite3_stmt* exists_stmt = NULL;
-	const char* exists_sql = "SELECT id FROM COMMITS WHERE hash = ?;";
-
-	int rc = sqlite3_prepare_v2(database, exists_sql, -1, &exists_stmt, 0);
-	if (rc != SQLITE_OK) {
-		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare statement: %s", sqlite3_errmsg(database));
-		return false;
-	}
-
-	sqlite3_bind_text(exists_stmt, 1, hash, -1, SQLITE_STATIC);
-	rc = sqlite3_step(exists_stmt);
-
-	if (rc == SQLITE_ROW) {
-		int commit_id = sqlite3_column_int(exists_stmt, 0);
-		sqlite3_finalize(exists_stmt);
-		return commit_id;
-	}
-	else if (rc == SQLITE_DONE) {
-		// Does not exist
-		sqlite3_finalize(exists_stmt);
-		return 0;
-	}
-	else {
-		// Error
-		log_message(LOG_ERROR, LOG_HEADER"Error executing statement: %s", sqlite3_errmsg(database));
-		sqlite3_finalize(exists_stmt);
-		return -1;
-	}
+	int* commit_ids = add_commits_to_db(instance_id, &info, 1);
+	int commit_id = commit_ids == NULL ? -1 : commit_ids[0];
+	free(commit_ids);
+	return commit_id;
 }
 
-int add_commit_to_db(int instance_id, CommitInfo info)
+// STRICT: Call on database thread only
+static void insert_commits(int instance_id, const CommitInfo* infos, int count, int** out_commit_ids)
 {
-	pthread_mutex_lock(&database_mutex);
+	*out_commit_ids = NULL;
+	sqlite3_stmt* stmt;
+	const char* sql = "INSERT INTO Commits (instance_id, hash, date) VALUES (?, ?, ?) "
+		"ON CONFLICT (hash) DO UPDATE SET hash = excluded.hash RETURNING id;";
 
-	int existing_commit_id = find_existing_commit(info.commit_hash);
-	if (existing_commit_id > 0) {
-		pthread_mutex_unlock(&database_mutex);
-		return existing_commit_id;
-	}
-	if (existing_commit_id == -1) {
-		pthread_mutex_unlock(&database_mutex);
-		return -1;
+	if (prepare_cached(sql, &stmt) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare commits statement: %s\n", sqlite3_errmsg(database));
+		return;
 	}
 
-	int rc;
-	const char* sql = "INSERT INTO Commits (instance_id, hash, date) VALUES (?, ?, ?);";
-	sqlite3_stmt* stmt  = NULL;
-
-	rc = sqlite3_prepare_v2(database, sql, -1, &stmt, 0);
-	if (rc != SQLITE_OK) {
-		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare statement: %s\n", sqlite3_errmsg(database));
-		pthread_mutex_unlock(&database_mutex);
-		return -1;
+	int* commit_ids = malloc(sizeof(int) * (size_t) (count > 0 ? count : 1));
+	char* err_msg = NULL;
+	if (commit_ids == NULL || sqlite3_exec(database, "BEGIN", NULL, NULL, &err_msg) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to begin commits transaction: %s\n", err_msg ? err_msg : "Out of memory");
+		sqlite3_free(err_msg);
+		free(commit_ids);
+		return;
 	}
 
-	sqlite3_bind_int(stmt, 1, instance_id);
-	sqlite3_bind_text(stmt, 2, info.commit_hash, -1, SQLITE_STATIC);
-	sqlite3_bind_int64(stmt, 3, info.date);
-
-	rc = sqlite3_step(stmt);
-	sqlite3_finalize(stmt);
-
-	if (rc != SQLITE_DONE) {
-		log_message(LOG_ERROR, LOG_HEADER"Failed to insert commit: %s\n", sqlite3_errmsg(database));
-		pthread_mutex_unlock(&database_mutex);
-		return -1;
+	for (int i = 0; i < count; i++) {
+		release_cached(stmt);
+		sqlite3_bind_int(stmt, 1, instance_id);
+		sqlite3_bind_text(stmt, 2, infos[i].commit_hash, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 3, infos[i].date);
+		commit_ids[i] = -1;
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			commit_ids[i] = sqlite3_column_int(stmt, 0);
+		}
+		else {
+			log_message(LOG_ERROR, LOG_HEADER"Failed to insert commit %s: %s\n", infos[i].commit_hash, sqlite3_errmsg(database));
+		}
 	}
+	release_cached(stmt);
 
-	// Get the ID of the newly inserted commit
-	int commit_id = sqlite3_last_insert_rowid(database);
+	if (sqlite3_exec(database, "COMMIT", NULL, NULL, &err_msg) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to commit %d commits: %s\n", count, err_msg);
+		sqlite3_free(err_msg);
+		sqlite3_exec(database, "ROLLBACK", NULL, NULL, NULL);
+		free(commit_ids);
+		commit_ids = NULL;
+	}
+	*out_commit_ids = commit_ids;
+}
 
-	pthread_mutex_unlock(&database_mutex);
-	return commit_id;
+// Commits already known, by hash, are left as they are but still return their ID
+int* add_commits_to_db(int instance_id, const CommitInfo* infos, int count)
+{
+	int* commit_ids = NULL;
+	av_alist commits_alist;
+	av_start_void(commits_alist, &insert_commits);
+	av_int(commits_alist, instance_id);
+	av_ptr(commits_alist, const CommitInfo*, infos);
+	av_int(commits_alist, count);
+	av_ptr(commits_alist, int**, &commit_ids);
+	database_thread_call(commits_alist);
+	return commit_ids;
 }
 
 int find_existing_instance(const Config* config)
 {
-	pthread_mutex_lock(&database_mutex);
+	DatabaseReader* reader = lock_reader();
 	int instance_id = -1;
 	sqlite3_stmt* stmt;
 
@@ -386,8 +1342,8 @@ int find_existing_instance(const Config* config)
 		"SELECT id FROM Instances "
 		"WHERE repo_url = ? AND game_server_url = ?";
 	
-	if (sqlite3_prepare_v2(database, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		pthread_mutex_unlock(&database_mutex);
+	if (prepare_reader_cached(reader, sql, &stmt) != SQLITE_OK) {
+		unlock_reader(reader);
 		return -1;
 	}
 
@@ -398,46 +1354,62 @@ int find_existing_instance(const Config* config)
 		instance_id = sqlite3_column_int(stmt, 0);
 	}
 	
-	sqlite3_finalize(stmt);
-	pthread_mutex_unlock(&database_mutex);
+	release_cached(stmt);
+	unlock_reader(reader);
 	return instance_id;
 }
 
-bool add_instance_to_db(const Config* config)
+// STRICT: Call on database thread only
+static void insert_instance(const Config* config, bool* out_added)
 {
-	pthread_mutex_lock(&database_mutex);
+	*out_added = false;
 	const char* sql = "INSERT INTO Instances (repo_url, game_server_url) VALUES (?, ?);";
 	sqlite3_stmt* stmt;
 	int rc;
 
-	rc = sqlite3_prepare_v2(database, sql, -1, &stmt, 0);
+	rc = prepare_cached(sql, &stmt);
 	if (rc != SQLITE_OK) {
 		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare statement: %s\n", sqlite3_errmsg(database));
-		pthread_mutex_unlock(&database_mutex);
-		return false;
+		return;
 	}
 
 	sqlite3_bind_text(stmt, 1, config->repo_url, -1, SQLITE_STATIC);
 	sqlite3_bind_text(stmt, 2, config->game_server_base_url, -1, SQLITE_STATIC);
 
 	rc = sqlite3_step(stmt);
-	sqlite3_finalize(stmt);
+	release_cached(stmt);
 
 	if (rc != SQLITE_DONE) {
 		log_message(LOG_ERROR, LOG_HEADER"Failed to insert instance: %s\n", sqlite3_errmsg(database));
-		pthread_mutex_unlock(&database_mutex);
-		return false;
+		return;
 	}
+	*out_added = true;
+}
 
-	pthread_mutex_unlock(&database_mutex);
-	return true;
+bool add_instance_to_db(const Config* config)
+{
+	bool added = false;
+	av_alist instance_alist;
+	av_start_void(instance_alist, &insert_instance);
+	av_ptr(instance_alist, const Config*, config);
+	av_ptr(instance_alist, bool*, &added);
+	database_thread_call(instance_alist);
+	return added;
+}
+
+// STRICT: Call on database thread only
+static void read_last_insert_rowid(int* out_id)
+{
+	*out_id = (int) sqlite3_last_insert_rowid(database);
 }
 
 int get_last_instance_id()
 {
-	pthread_mutex_lock(&database_mutex);
-	int id = sqlite3_last_insert_rowid(database);
-	pthread_mutex_unlock(&database_mutex);
+	int id = 0;
+	av_alist rowid_alist;
+	av_start_void(rowid_alist, &read_last_insert_rowid);
+	av_ptr(rowid_alist, int*, &id);
+	database_thread_call(rowid_alist);
 	return id;
 }
 
@@ -449,18 +1421,224 @@ int database_create_callback(void* data, int argc, char** argv, char** col_name)
 	return 0;
 }
 
-bool try_create_database()
+// Tables created by an older schema.sql are left as they were, so later columns are added here.
+// STRICT: Call on database thread only
+static bool add_column_if_missing(const char* table, const char* column, const char* definition)
+{
+	sqlite3_stmt* stmt;
+	AUTOFREE char* info_sql = NULL;
+	asprintf(&info_sql, "PRAGMA table_info(%s)", table);
+	if (sqlite3_prepare_v2(database, info_sql, -1, &stmt, 0) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare table info statement: %s\n", sqlite3_errmsg(database));
+		return false;
+	}
+
+	bool found = false;
+	while (!found && sqlite3_step(stmt) == SQLITE_ROW) {
+		found = strcmp((const char*) sqlite3_column_text(stmt, 1), column) == 0;
+	}
+	sqlite3_finalize(stmt);
+	if (found) {
+		return true;
+	}
+
+	char* err_msg = NULL;
+	AUTOFREE char* alter_sql = NULL;
+	asprintf(&alter_sql, "ALTER TABLE %s ADD COLUMN %s %s", table, column, definition);
+	if (sqlite3_exec(database, alter_sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to add column %s to %s: %s\n", column, table, err_msg);
+		sqlite3_free(err_msg);
+		return false;
+	}
+	log_message(LOG_INFO, LOG_HEADER"Added column %s to %s", column, table);
+	return true;
+}
+
+// STRICT: Call on database thread only
+static bool exec_migration_sql(const char* sql)
+{
+	char* err_msg = NULL;
+	if (sqlite3_exec(database, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to run migration: %s\n", err_msg);
+		sqlite3_free(err_msg);
+		return false;
+	}
+	return true;
+}
+
+static bool migrate_pack_columns()
+{
+	return add_column_if_missing("Saves", "pack_path", "TEXT")
+		&& add_column_if_missing("Saves", "pack_offset", "INTEGER")
+		&& add_column_if_missing("Saves", "pack_length", "INTEGER");
+}
+
+static bool migrate_saves_commit_type_index()
+{
+	return exec_migration_sql("CREATE INDEX IF NOT EXISTS idx_saves_commit_type ON Saves (commit_id, type)");
+}
+
+static bool migrate_saves_save_path_index()
+{
+	return exec_migration_sql("CREATE INDEX IF NOT EXISTS idx_saves_save_path ON Saves (save_path)");
+}
+
+// Foreign keys can't be altered, so the table is rebuilt. Databases created since the fix already have it
+static bool migrate_commit_canvas_metadatas_key()
+{
+	sqlite3_stmt* stmt;
+	const char* sql = "SELECT COUNT(*) FROM pragma_foreign_key_list('CommitCanvasMetadatas') WHERE \"table\" = 'CanvasMetadata'";
+	if (sqlite3_prepare_v2(database, sql, -1, &stmt, 0) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare foreign key statement: %s\n", sqlite3_errmsg(database));
+		return false;
+	}
+	bool broken = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) > 0;
+	sqlite3_finalize(stmt);
+	if (!broken) {
+		return true;
+	}
+
+	return exec_migration_sql(
+		"CREATE TABLE CommitCanvasMetadatasMigrated ("
+			"commit_id INTEGER NOT NULL, "
+			"canvas_metadata_id INTEGER NOT NULL, "
+			"PRIMARY KEY (commit_id, canvas_metadata_id), "
+			"FOREIGN KEY (commit_id) REFERENCES Commits(id) ON DELETE CASCADE, "
+			"FOREIGN KEY (canvas_metadata_id) REFERENCES CanvasMetadatas(id) ON DELETE CASCADE); "
+		"INSERT INTO CommitCanvasMetadatasMigrated (commit_id, canvas_metadata_id) "
+			"SELECT commit_id, canvas_metadata_id FROM CommitCanvasMetadatas; "
+		"DROP TABLE CommitCanvasMetadatas; "
+		"ALTER TABLE CommitCanvasMetadatasMigrated RENAME TO CommitCanvasMetadatas;");
+}
+
+typedef struct schema_migration {
+	int version; // Stored as the database's user_version once applied
+	const char* description;
+	bool (*apply)();
+} SchemaMigration;
+
+// Applied in order to every database older than their version. Each must be safe to apply to a database that
+// already has its change, as schema.sql creates new databases in their latest form
+static const SchemaMigration schema_migrations[] = {
+	{ 1, "Add pack columns to Saves", migrate_pack_columns },
+	{ 2, "Index Saves by commit & type", migrate_saves_commit_type_index },
+	{ 3, "Index Saves by save path", migrate_saves_save_path_index },
+	{ 4, "Point CommitCanvasMetadatas at CanvasMetadatas", migrate_commit_canvas_metadatas_key }
+};
+
+// STRICT: Call on database thread only. Each migration commits along with the version it brings the database
+// to, so one that's interrupted is simply applied again. Readers carry on while indexes are built
+static bool migrate_schema()
+{
+	sqlite3_stmt* stmt;
+	int version = 0;
+	if (sqlite3_prepare_v2(database, "PRAGMA user_version", -1, &stmt, 0) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to prepare schema version statement: %s\n", sqlite3_errmsg(database));
+		return false;
+	}
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		version = sqlite3_column_int(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+
+	int migration_count = (int) (sizeof(schema_migrations) / sizeof(schema_migrations[0]));
+	for (int i = 0; i < migration_count; i++) {
+		const SchemaMigration* migration = &schema_migrations[i];
+		if (migration->version <= version) {
+			continue;
+		}
+
+		AUTOFREE char* version_sql = NULL;
+		asprintf(&version_sql, "PRAGMA user_version = %d", migration->version);
+		if (!exec_migration_sql("BEGIN IMMEDIATE")) {
+			return false;
+		}
+		if (!migration->apply() || !exec_migration_sql(version_sql) || !exec_migration_sql("COMMIT")) {
+			sqlite3_exec(database, "ROLLBACK", NULL, NULL, NULL);
+			log_message(LOG_ERROR, LOG_HEADER"Failed to migrate schema to version %d (%s)\n", migration->version, migration->description);
+			return false;
+		}
+		version = migration->version;
+		log_message(LOG_INFO, LOG_HEADER"Migrated schema to version %d (%s)", migration->version, migration->description);
+	}
+	return true;
+}
+
+// Any step of a plan that scans a whole table, rather than searching or scanning an index, is a regression
+static bool is_query_plan_indexed(const char* detail)
+{
+	return strncmp(detail, "SCAN ", 5) != 0 || strstr(detail, "INDEX") != NULL || strstr(detail, "CONSTANT ROW") != NULL;
+}
+
+bool check_query_plans()
+{
+	const char* hot_queries[HOT_WRITER_QUERY_COUNT + HOT_READER_QUERY_COUNT];
+	memcpy(hot_queries, hot_writer_queries, sizeof(hot_writer_queries));
+	memcpy(hot_queries + HOT_WRITER_QUERY_COUNT, hot_reader_queries, sizeof(hot_reader_queries));
+	int query_count = HOT_WRITER_QUERY_COUNT + HOT_READER_QUERY_COUNT;
+
+	// Plans only read the schema, so are made on a reader
+	DatabaseReader* reader = lock_reader();
+	int unindexed = 0;
+	for (int i = 0; i < query_count; i++) {
+		sqlite3_stmt* stmt;
+		AUTOFREE char* explain_sql = NULL;
+		asprintf(&explain_sql, "EXPLAIN QUERY PLAN %s", hot_queries[i]);
+		if (sqlite3_prepare_v2(reader->connection, explain_sql, -1, &stmt, 0) != SQLITE_OK) {
+			log_message(LOG_ERROR, LOG_HEADER"Failed to prepare query plan of '%s': %s\n", hot_queries[i],
+				sqlite3_errmsg(reader->connection));
+			unindexed++;
+			continue;
+		}
+		bool indexed = true;
+		log_message(LOG_INFO, LOG_HEADER"Query plan of '%s':", hot_queries[i]);
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			const char* detail = (const char*) sqlite3_column_text(stmt, 3);
+			bool step_indexed = is_query_plan_indexed(detail);
+			log_message(step_indexed ? LOG_INFO : LOG_ERROR, LOG_HEADER"  %s%s", detail, step_indexed ? "" : " (not indexed)");
+			indexed = indexed && step_indexed;
+		}
+		sqlite3_finalize(stmt);
+		if (!indexed) {
+			unindexed++;
+		}
+	}
+	unlock_reader(reader);
+
+	log_message(unindexed == 0 ? LOG_INFO : LOG_ERROR, LOG_HEADER"%d of %d hot queries are served by an index",
+		query_count - unindexed, query_count);
+	return unindexed == 0;
+}
+
+// STRICT: Call on database thread only
+static void open_writer(bool* out_opened)
 {
-	pthread_mutex_lock(&database_mutex);
+	*out_opened = false;
 	char* err_msg = NULL;
 	const char* schema_file = "schema.sql";
 
-	// Open database connection
-	int result = sqlite3_open_v2("instance_tracker.db", &database, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL);
+	// Statements of a previous connection can't be used with this one
+	finalize_cached_statements(&cached_statements);
+	close_database_readers();
+	if (database != NULL) {
+		sqlite3_close(database);
+		database = NULL;
+	}
+
+	// Open database connection, only ever used on the database thread
+	int result = sqlite3_open_v2(DATABASE_FILE_NAME, &database, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL);
 	if (result != SQLITE_OK) {
 		log_message(LOG_ERROR, LOG_HEADER"Cannot open database: %s\n", sqlite3_errmsg(database));
-		pthread_mutex_unlock(&database_mutex);
-		return false;
+		return;
+	}
+	// WAL lets readers carry on while a write is in progress, & only needs syncing at checkpoints when NORMAL
+	if (sqlite3_exec(database, "PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL; " DATABASE_TUNING_SQL,
+			NULL, NULL, &err_msg) != SQLITE_OK) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to configure database: %s\n", err_msg);
+		sqlite3_free(err_msg);
+		sqlite3_close(database);
+		database = NULL;
+		return;
 	}
 
 	// Read schema file
@@ -468,8 +1646,8 @@ bool try_create_database()
 	if (!file) {
 		log_message(LOG_ERROR, LOG_HEADER"Cannot open schema file: %s\n", schema_file);
 		sqlite3_close(database);
-		pthread_mutex_unlock(&database_mutex);
-		return false;
+		database = NULL;
+		return;
 	}
 
 	// Get file size
@@ -483,8 +1661,8 @@ bool try_create_database()
 		log_message(LOG_ERROR, LOG_HEADER"Memory allocation failed\n");
 		fclose(file);
 		sqlite3_close(database);
-		pthread_mutex_unlock(&database_mutex);
-		return false;
+		database = NULL;
+		return;
 	}
 
 	// Read the schema from the file
@@ -498,36 +1676,75 @@ bool try_create_database()
 		log_message(LOG_ERROR, LOG_HEADER"Failed to create database: %s\n", err_msg);
 		sqlite3_free(err_msg);
 		sqlite3_close(database);
-		pthread_mutex_unlock(&database_mutex);
-		return false;
+		database = NULL;
+		return;
+	}
+	if (!migrate_schema()) {
+		sqlite3_close(database);
+		database = NULL;
+		return;
+	}
+	// Hot statements are compiled against the migrated schema, which they need the indexes of
+	if (!prepare_hot_statements(database, &cached_statements, hot_writer_queries, HOT_WRITER_QUERY_COUNT)) {
+		finalize_cached_statements(&cached_statements);
+		sqlite3_close(database);
+		database = NULL;
+		return;
+	}
+	if (!open_database_readers()) {
+		finalize_cached_statements(&cached_statements);
+		sqlite3_close(database);
+		database = NULL;
+		return;
 	}
 
-	pthread_mutex_unlock(&database_mutex);
-	return true;
+	*out_opened = true;
 }
 
-WorkQueue database_thread_work_queue;
+bool try_create_database()
+{
+	bool opened = false;
+	av_alist open_alist;
+	av_start_void(open_alist, &open_writer);
+	av_ptr(open_alist, bool*, &opened);
+	database_thread_call(open_alist);
+	return opened;
+}
 
+// Work is posted from any thread, waiting while the queue is full rather than overflowing it
 void database_thread_post(av_alist work)
 {
+	pthread_mutex_lock(&database_work_mutex);
+	while ((database_thread_work_queue.rear + 1) % database_thread_work_queue.capacity == database_thread_work_queue.front) {
+		pthread_cond_wait(&database_work_popped, &database_work_mutex);
+	}
 	push_work_queue(&database_thread_work_queue, work);
+	pthread_cond_signal(&database_work_pushed);
+	pthread_mutex_unlock(&database_work_mutex);
 }
 
 void* start_db_work_loop(void* data)
 {
 	while (true) {
+		pthread_mutex_lock(&database_work_mutex);
 		while (!database_thread_work_queue.replenished) {
-			usleep(10000); // Wait for 10ms
+			pthread_cond_wait(&database_work_pushed, &database_work_mutex);
 		}
-
 		av_alist work = pop_work_queue(&database_thread_work_queue);
+		pthread_cond_broadcast(&database_work_popped);
+		pthread_mutex_unlock(&database_work_mutex);
+
 		av_call(work);
 	}
 }
 
+// The database thread, & the writer connection it owns, outlive every generation
 void start_database()
 {
-	pthread_mutex_init(&database_mutex, NULL);
+	if (database_thread_started) {
+		return;
+	}
 	init_work_queue(&database_thread_work_queue, DEFAULT_WORK_QUEUE_SIZE);
 	pthread_create(&database_thread_id, NULL, start_db_work_loop, NULL);
+	database_thread_started = true;
 }
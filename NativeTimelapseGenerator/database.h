@@ -4,22 +4,105 @@
 #include "main_thread.h"
 #include "workers/worker_structs.h"
 
-// BETTER: Call on database thread for non-blocking
+// A save stored inside a pack file, save_path is where it's unpacked to
+typedef struct packed_save {
+	int save_id;
+	char* save_path;
+	char* pack_path;
+	int64_t pack_offset;
+	int64_t pack_length;
+} PackedSave;
+
+// A completed save, waiting to be recorded with the next batch
+typedef struct pending_save {
+	CommitInfo;
+	SaveJobType type;
+	uint64_t content_hash; // Registered along with the save, 0 if unhashed
+	char* save_path;
+	char* pack_path; // Null unless packed
+	int64_t pack_offset;
+	int64_t pack_length; // Byte length of the save, packed or not
+} PendingSave;
+
+// Called on the batch thread once per batch, once it's committed or failed to be. committed holds whether each of
+// saves (an stb array) was recorded. Takes ownership of every save_path, report is false once stopping, when the
+// main thread no longer takes results
+typedef void (*SaveCommittedCallback)(PendingSave* saves, const bool* committed, bool report);
+
+// STRICT: Call on main thread only
+void start_save_batches(SaveCommittedCallback on_committed, SaveDurability durability);
+// Takes ownership of both paths. Saves are committed in batches of many rows, in a single transaction each
+void queue_save_to_db(PendingSave save);
+// STRICT: Call on main thread only, commits every queued save
+void stop_save_batches();
+// A save that's a file of its own, with the commit it was saved for
+typedef struct loose_save {
+	char* save_path;
+	SaveJobType type;
+	char* commit_hash;
+	time_t date;
+} LooseSave;
+
+// Returns stb array of every save that isn't packed, once per save path
+LooseSave* get_loose_saves();
+// Points every save at save_path to new_save_path instead
+bool move_save_in_db(const char* save_path, const char* new_save_path);
+// Removes every save whose file or pack no longer holds it, i.e after a crash without durable saves.
+// Returns the number of saves removed, or -1 on failure
+int reconcile_saves_in_db();
+// Runs on the database thread & waits for it
 bool add_save_to_db(int commit_id, SaveJobType type, const char* save_path);
+// Runs on the database thread & waits for it
+bool add_packed_save_to_db(int commit_id, SaveJobType type, const char* save_path, const char* pack_path,
+	int64_t pack_offset, int64_t pack_length);
+// BETTER: Call on database thread for non-blocking
+PackedSave* get_packed_saves();
+// BETTER: Call on database thread for non-blocking
+bool find_packed_save(const char* save_path, PackedSave* out_save);
+// Runs on the database thread & waits for it
+bool unpack_save_in_db(const char* pack_path, int64_t pack_offset);
+// Save types a commit already has, as a bitmask of 1 << type
+typedef struct commit_saves {
+	int key; // Commit ID
+	uint32_t value;
+} CommitSaves;
+
+// Returns stb hashmap of every commit of the instance with at least one save, loaded in a single query
+CommitSaves* get_commit_saves(int instance_id);
 // BETTER: Call on database thread for non-blocking
 bool check_save_exists(int commit_id, SaveJobType type);
 // BETTER: Call on database thread for non-blocking
-bool add_canvas_metadata_to_db(CanvasMetadata metadata, int commit_id);
+int find_content_hash(uint64_t hash, SaveJobType type);
+// Runs on the database thread & waits for it
+bool add_content_hash_to_db(uint64_t hash, SaveJobType type, int commit_id);
+// Runs on the database thread & waits for it
+bool add_save_reference_to_db(int commit_id, int source_commit_id, SaveJobType type);
+// Runs on the database thread & waits for it
+bool add_commit_stats_to_db(int commit_id, int64_t changed_pixels, int64_t total_pixels);
 // BETTER: Call on database thread for non-blocking
+int64_t find_commit_changed_pixels(int commit_id);
+// STRICT: Call on database thread only, post it with database_thread_post
+bool add_canvas_metadata_to_db(CanvasMetadata metadata, int commit_id);
+// Runs on the database thread & waits for it
 int add_commit_to_db(int instance_id, CommitInfo info);
+// Runs on the database thread & waits for it
+// Adds every commit in a single transaction. Returns malloc allocated array of each commit's ID in the order
+// given, -1 for any that couldn't be added, or null if the transaction failed
+int* add_commits_to_db(int instance_id, const CommitInfo* infos, int count);
 // BETTER: Call on database thread for non-blocking
 int find_existing_instance(const Config* config);
-// BETTER: Call on database thread for non-blocking
+// Runs on the database thread & waits for it
 bool add_instance_to_db(const Config* config);
-// BETTER: Call on database thread for non-blocking
+// Runs on the database thread & waits for it
 int get_last_instance_id();
-// BETTER: Call on database thread for non-blocking
+// Runs on the database thread & waits for it
 bool try_create_database();
+// Logs the query plan of every query run per commit or per save, failing if any of them scans a whole table
+bool check_query_plans();
 
+// Runs the work on the database thread. Waits rather than overflowing the thread's queue
 void database_thread_post(av_alist work);
-void start_database();
\ No newline at end of file
+// Starts the database thread once, later calls do nothing
+void start_database();
+// Finalises every cached statement, they're compiled again on their next use
+void free_statement_cache();
\ No newline at end of file
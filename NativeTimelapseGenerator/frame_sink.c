@@ -0,0 +1,209 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "console.h"
+#include "memory_utils.h"
+#include "frame_sink.h"
+
+#define LOG_HEADER "[frame sink] "
+
+// FRAME SINK
+static pthread_t frame_sink_thread_id;
+static FILE* frame_sink_pipe = NULL;
+static ReorderBuffer frame_sink_buffer;
+static size_t frame_sink_frame_size = 0;
+// Read by the workers pushing frames & the sink thread
+static atomic_bool frame_sink_running = false;
+static atomic_bool frame_sink_stopping = false;
+// Set once the encoder stops accepting data, later frames are only drained
+static bool frame_sink_failed = false;
+static int frames_written = 0;
+static int frames_skipped = 0;
+
+size_t get_frame_sink_frame_size(int width, int height)
+{
+	size_t chroma_width = (size_t) (width + 1) / 2;
+	size_t chroma_height = (size_t) (height + 1) / 2;
+	return (size_t) width * (size_t) height + 2 * chroma_width * chroma_height;
+}
+
+static inline uint8_t clamp_chroma(int value)
+{
+	return (uint8_t) (value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+// Full range BT.601 (JFIF) in 8 bit fixed point, the coefficients of each row sum to 256 or 0.
+// Loops are kept branchless over plain arrays so that they are auto-vectorised
+static void convert_luma_row(const uint32_t* restrict row, int width, uint8_t* restrict out)
+{
+	for (int x = 0; x < width; x++) {
+		uint32_t pixel = row[x];
+		uint32_t r = (pixel >> 16) & 0xFF;
+		uint32_t g = (pixel >> 8) & 0xFF;
+		uint32_t b = pixel & 0xFF;
+		out[x] = (uint8_t) ((77 * r + 150 * g + 29 * b + 128) >> 8);
+	}
+}
+
+// Each chroma sample is the average of a 2x2 block, so sums of 4 are scaled down by a further 2 bits
+static void convert_chroma_row(const uint32_t* restrict row_0, const uint32_t* restrict row_1, int width,
+	uint8_t* restrict u_out, uint8_t* restrict v_out)
+{
+	int pairs = width / 2;
+	for (int x = 0; x < pairs; x++) {
+		uint32_t p0 = row_0[2 * x];
+		uint32_t p1 = row_0[2 * x + 1];
+		uint32_t p2 = row_1[2 * x];
+		uint32_t p3 = row_1[2 * x + 1];
+		int r = (int) (((p0 >> 16) & 0xFF) + ((p1 >> 16) & 0xFF) + ((p2 >> 16) & 0xFF) + ((p3 >> 16) & 0xFF));
+		int g = (int) (((p0 >> 8) & 0xFF) + ((p1 >> 8) & 0xFF) + ((p2 >> 8) & 0xFF) + ((p3 >> 8) & 0xFF));
+		int b = (int) ((p0 & 0xFF) + (p1 & 0xFF) + (p2 & 0xFF) + (p3 & 0xFF));
+		u_out[x] = clamp_chroma(((-43 * r - 85 * g + 128 * b + 512) >> 10) + 128);
+		v_out[x] = clamp_chroma(((128 * r - 107 * g - 21 * b + 512) >> 10) + 128);
+	}
+
+	// Odd widths leave a final column on its own
+	if (width & 1) {
+		uint32_t p0 = row_0[width - 1];
+		uint32_t p2 = row_1[width - 1];
+		int r = (int) (((p0 >> 16) & 0xFF) + ((p2 >> 16) & 0xFF)) * 2;
+		int g = (int) (((p0 >> 8) & 0xFF) + ((p2 >> 8) & 0xFF)) * 2;
+		int b = (int) ((p0 & 0xFF) + (p2 & 0xFF)) * 2;
+		u_out[pairs] = clamp_chroma(((-43 * r - 85 * g + 128 * b + 512) >> 10) + 128);
+		v_out[pairs] = clamp_chroma(((128 * r - 107 * g - 21 * b + 512) >> 10) + 128);
+	}
+}
+
+void argb32_to_yuv420(const uint32_t* pixels, int stride, int width, int height, uint8_t* out)
+{
+	int chroma_width = (width + 1) / 2;
+	int chroma_height = (height + 1) / 2;
+	uint8_t* y_plane = out;
+	uint8_t* u_plane = y_plane + (size_t) width * (size_t) height;
+	uint8_t* v_plane = u_plane + (size_t) chroma_width * (size_t) chroma_height;
+
+	for (int y = 0; y < height; y++) {
+		convert_luma_row(pixels + (size_t) y * (size_t) stride, width, y_plane + (size_t) y * (size_t) width);
+	}
+	for (int y = 0; y < chroma_height; y++) {
+		const uint32_t* row_0 = pixels + (size_t) (y * 2) * (size_t) stride;
+		// Odd heights pair the final row with itself
+		const uint32_t* row_1 = y * 2 + 1 < height ? row_0 + stride : row_0;
+		convert_chroma_row(row_0, row_1, width,
+			u_plane + (size_t) y * (size_t) chroma_width, v_plane + (size_t) y * (size_t) chroma_width);
+	}
+}
+
+static void write_frame(uint8_t* frame)
+{
+	if (frame_sink_failed) {
+		return;
+	}
+
+	if (fwrite("FRAME\n", 1, 6, frame_sink_pipe) != 6
+		|| fwrite(frame, 1, frame_sink_frame_size, frame_sink_pipe) != frame_sink_frame_size) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to write frame %d to encoder, it may have exited: %s",
+			frames_written, strerror(errno));
+		frame_sink_failed = true;
+		return;
+	}
+	frames_written++;
+}
+
+void* start_frame_sink_loop(void* data)
+{
+	while (true) {
+		void* frame = NULL;
+		if (!pop_reorder_buffer(&frame_sink_buffer, &frame)) {
+			// Frames behind a gap that never arrived can't be written once stopping
+			if (frame_sink_stopping) {
+				break;
+			}
+			usleep(10000); // Wait for 10ms
+			continue;
+		}
+
+		if (frame == NULL) {
+			frames_skipped++;
+			continue;
+		}
+		write_frame(frame);
+		free(frame);
+	}
+	return NULL;
+}
+
+bool start_frame_sink(const char* command, int width, int height, int frame_rate)
+{
+	if (frame_sink_running) {
+		log_message(LOG_ERROR, LOG_HEADER"Frame sink is already running");
+		return false;
+	}
+	if (width <= 0 || height <= 0 || frame_rate <= 0) {
+		log_message(LOG_ERROR, LOG_HEADER"Invalid frame sink size %dx%d at %d fps", width, height, frame_rate);
+		return false;
+	}
+
+	// An encoder that exits early must surface as a write error, rather than kill the process
+	signal(SIGPIPE, SIG_IGN);
+
+	frame_sink_pipe = popen(command, "w");
+	if (frame_sink_pipe == NULL) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to start encoder '%s': %s", command, strerror(errno));
+		return false;
+	}
+
+	frame_sink_frame_size = get_frame_sink_frame_size(width, height);
+	frame_sink_stopping = false;
+	frame_sink_failed = false;
+	frames_written = 0;
+	frames_skipped = 0;
+	// Frames are full range, which encoders assume Y4M isn't unless told otherwise
+	fprintf(frame_sink_pipe, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg XCOLORRANGE=FULL\n", width, height, frame_rate);
+
+	init_reorder_buffer(&frame_sink_buffer, 0, DEFAULT_REORDER_WINDOW);
+	pthread_create(&frame_sink_thread_id, NULL, start_frame_sink_loop, NULL);
+	frame_sink_running = true;
+	log_message(LOG_INFO, LOG_HEADER"Streaming %dx%d frames at %d fps to '%s'", width, height, frame_rate, command);
+	return true;
+}
+
+bool is_frame_sink_running()
+{
+	return frame_sink_running;
+}
+
+void push_frame_sink(int frame_index, uint8_t* frame)
+{
+	push_reorder_buffer(&frame_sink_buffer, frame_index, frame);
+}
+
+void skip_frame_sink(int frame_index)
+{
+	push_reorder_buffer(&frame_sink_buffer, frame_index, NULL);
+}
+
+void stop_frame_sink()
+{
+	if (!frame_sink_running) {
+		return;
+	}
+
+	frame_sink_stopping = true;
+	pthread_join(frame_sink_thread_id, NULL);
+
+	size_t dropped = get_reorder_buffer_pending(&frame_sink_buffer);
+	free_reorder_buffer(&frame_sink_buffer, free);
+	int status = pclose(frame_sink_pipe);
+	frame_sink_pipe = NULL;
+	frame_sink_running = false;
+
+	log_message(LOG_INFO, LOG_HEADER"Frame sink stopped after %d frames (%d skipped, %zu still out of order), encoder exited with status %d",
+		frames_written, frames_skipped, dropped, status);
+}
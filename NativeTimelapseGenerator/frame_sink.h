@@ -0,0 +1,21 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Streams composite frames, in commit order, as a Y4M (4:2:0, full range) video to a child process
+
+// Size of a single YUV 4:2:0 frame, Y plane followed by the U & V planes
+size_t get_frame_sink_frame_size(int width, int height);
+// Converts an opaque ARGB32 frame into a frame_sink_frame_size buffer
+void argb32_to_yuv420(const uint32_t* pixels, int stride, int width, int height, uint8_t* out);
+
+// STRICT: Call on main thread only, command is run through the shell, i.e "ffmpeg -i - out.mp4"
+bool start_frame_sink(const char* command, int width, int height, int frame_rate);
+bool is_frame_sink_running();
+// Takes ownership of a frame_sink_frame_size malloc allocated frame
+void push_frame_sink(int frame_index, uint8_t* frame);
+// Frames that failed to download or render must still be skipped, otherwise every later frame is held back
+void skip_frame_sink(int frame_index);
+// STRICT: Call on main thread only, writes every frame that can be written and closes the stream
+void stop_frame_sink();
@@ -0,0 +1,216 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "console.h"
+#include "memory_utils.h"
+#include "heatmap.h"
+#include "lib/stb/stb_ds.h"
+
+#define LOG_HEADER "[heatmap] "
+
+typedef struct heatmap_board {
+	CommitInfo;
+	int width;
+	int height;
+	uint8_t* board;
+} HeatmapBoard;
+
+// HEATMAP
+static ReorderBuffer heatmap_buffer;
+// Held while advancing, so boards are only ever diffed one at a time and in order
+static pthread_mutex_t heatmap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool heatmap_running = false; // Read by workers
+static int heatmap_width = 0;
+static int heatmap_height = 0;
+static time_t first_date = 0;
+static uint8_t* previous_board = NULL;
+static uint32_t* change_counts = NULL;
+// Seconds since the first commit plus one, so that 0 is left meaning never changed
+static uint32_t* last_changed = NULL;
+static uint32_t max_change_count = 0;
+static int frames_advanced = 0;
+static int frames_skipped = 0;
+
+static void free_heatmap_board(void* data)
+{
+	HeatmapBoard* board = (HeatmapBoard*) data;
+	free(board->board);
+	free(board);
+}
+
+void free_heatmap_frame(HeatmapFrame* frame)
+{
+	free(frame->heat);
+	free(frame->age);
+	frame->heat = NULL;
+	frame->age = NULL;
+}
+
+// Branchless over plain arrays so that it is auto-vectorised, returns the new highest change count
+static uint32_t diff_heatmap_boards(const uint8_t* restrict previous, const uint8_t* restrict board, size_t size,
+	uint32_t stamp, uint32_t max_count, uint32_t* restrict counts, uint32_t* restrict changed_stamps)
+{
+	for (size_t i = 0; i < size; i++) {
+		uint32_t changed = previous[i] != board[i];
+		counts[i] += changed;
+		changed_stamps[i] = changed ? stamp : changed_stamps[i];
+		max_count = counts[i] > max_count ? counts[i] : max_count;
+	}
+	return max_count;
+}
+
+// Levels are scaled through fixed point reciprocals, heat against the most changed pixel & age against
+// the time since the first commit. Changed pixels have an age level of 1 to 255, the latest being 255
+static void quantise_heatmap(const uint32_t* restrict counts, const uint32_t* restrict changed_stamps, size_t size,
+	uint32_t max_count, uint32_t stamp, uint8_t* restrict heat, uint8_t* restrict age)
+{
+	uint64_t heat_scale = max_count == 0 ? 0 : (255ull << 32) / max_count;
+	uint64_t age_scale = (254ull << 32) / stamp;
+	for (size_t i = 0; i < size; i++) {
+		heat[i] = (uint8_t) (((uint64_t) counts[i] * heat_scale) >> 32);
+		uint32_t elapsed = stamp > changed_stamps[i] ? stamp - changed_stamps[i] : 0;
+		uint8_t level = (uint8_t) (255 - (((uint64_t) elapsed * age_scale) >> 32));
+		age[i] = changed_stamps[i] == 0 ? 0 : level;
+	}
+}
+
+static bool reset_heatmap(int width, int height, time_t date)
+{
+	size_t size = (size_t) width * (size_t) height;
+	free(previous_board);
+	free(change_counts);
+	free(last_changed);
+	previous_board = malloc(size);
+	change_counts = calloc(size, sizeof(uint32_t));
+	last_changed = calloc(size, sizeof(uint32_t));
+	if (previous_board == NULL || change_counts == NULL || last_changed == NULL) {
+		free(previous_board);
+		free(change_counts);
+		free(last_changed);
+		previous_board = NULL;
+		change_counts = NULL;
+		last_changed = NULL;
+		heatmap_width = 0;
+		heatmap_height = 0;
+		return false;
+	}
+	heatmap_width = width;
+	heatmap_height = height;
+	first_date = date;
+	max_change_count = 0;
+	return true;
+}
+
+static bool advance_heatmap_board(HeatmapBoard* board, HeatmapFrame* out_frame)
+{
+	size_t size = (size_t) board->width * (size_t) board->height;
+	bool first_board = previous_board == NULL;
+	if (board->width != heatmap_width || board->height != heatmap_height) {
+		if (!first_board) {
+			log_message(LOG_WARNING, LOG_HEADER"Canvas of commit %s changed size to %dx%d, restarting heatmap",
+				board->commit_hash, board->width, board->height);
+		}
+		if (!reset_heatmap(board->width, board->height, board->date)) {
+			log_message(LOG_ERROR, LOG_HEADER"Failed to allocate %dx%d heatmap", board->width, board->height);
+			return false;
+		}
+		first_board = true;
+	}
+
+	// Commits are walked by time, but dates that go backwards still mustn't wrap around
+	uint32_t stamp = board->date > first_date ? (uint32_t) (board->date - first_date) + 1 : 1;
+	if (!first_board) {
+		max_change_count = diff_heatmap_boards(previous_board, board->board, size, stamp, max_change_count,
+			change_counts, last_changed);
+	}
+	memcpy(previous_board, board->board, size);
+
+	*out_frame = (HeatmapFrame) {
+		.commit_id = board->commit_id,
+		.commit_hash = board->commit_hash,
+		.date = board->date,
+		.frame_index = board->frame_index,
+		.width = board->width,
+		.height = board->height,
+		.heat = malloc(size),
+		.age = malloc(size)
+	};
+	if (out_frame->heat == NULL || out_frame->age == NULL) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to allocate heatmap frame of commit %s", board->commit_hash);
+		free_heatmap_frame(out_frame);
+		return false;
+	}
+	quantise_heatmap(change_counts, last_changed, size, max_change_count, stamp, out_frame->heat, out_frame->age);
+	return true;
+}
+
+void start_heatmap()
+{
+	init_reorder_buffer(&heatmap_buffer, 0, DEFAULT_REORDER_WINDOW);
+	heatmap_width = 0;
+	heatmap_height = 0;
+	frames_advanced = 0;
+	frames_skipped = 0;
+	heatmap_running = true;
+	log_message(LOG_INFO, LOG_HEADER"Accumulating pixel activity across every canvas");
+}
+
+bool is_heatmap_running()
+{
+	return heatmap_running;
+}
+
+HeatmapFrame* advance_heatmap(int frame_index, CommitInfo info, int width, int height, uint8_t* board)
+{
+	HeatmapBoard* item = NULL;
+	if (board != NULL) {
+		item = malloc(sizeof(HeatmapBoard));
+		*item = (HeatmapBoard) { .width = width, .height = height, .board = board };
+		item->commit_id = info.commit_id;
+		item->commit_hash = info.commit_hash;
+		item->date = info.date;
+		item->frame_index = frame_index;
+	}
+	push_reorder_buffer(&heatmap_buffer, frame_index, item);
+
+	// Whoever pushes last drains every board that is now in order, including those pushed by others
+	HeatmapFrame* frames = NULL;
+	pthread_mutex_lock(&heatmap_mutex);
+	void* data = NULL;
+	while (pop_reorder_buffer(&heatmap_buffer, &data)) {
+		if (data == NULL) {
+			frames_skipped++;
+			continue;
+		}
+		HeatmapFrame frame;
+		if (advance_heatmap_board((HeatmapBoard*) data, &frame)) {
+			arrput(frames, frame);
+			frames_advanced++;
+		}
+		free_heatmap_board(data);
+	}
+	pthread_mutex_unlock(&heatmap_mutex);
+	return frames;
+}
+
+void stop_heatmap()
+{
+	if (!heatmap_running) {
+		return;
+	}
+
+	size_t dropped = get_reorder_buffer_pending(&heatmap_buffer);
+	free_reorder_buffer(&heatmap_buffer, free_heatmap_board);
+	free(previous_board);
+	free(change_counts);
+	free(last_changed);
+	previous_board = NULL;
+	change_counts = NULL;
+	last_changed = NULL;
+	heatmap_running = false;
+
+	log_message(LOG_INFO, LOG_HEADER"Heatmap stopped after %d frames (%d skipped, %zu still out of order)",
+		frames_advanced, frames_skipped, dropped);
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "workers/worker_structs.h"
+
+// Running per pixel activity across every canvas, advanced strictly in commit order. Each commit costs a
+// single diff against the previous board, rather than rereading the history before it
+
+// Snapshot of the activity as of a single commit, as 8 bit levels ready to be coloured
+typedef struct heatmap_frame {
+	CommitInfo;
+	int width;
+	int height;
+	uint8_t* heat; // Changes of each pixel, relative to the most changed pixel
+	uint8_t* age; // Recency of each pixel's last change, 0 if it has never changed
+} HeatmapFrame;
+
+// STRICT: Call on main thread only
+void start_heatmap();
+bool is_heatmap_running();
+// Takes ownership of board, null if the commit's canvas failed to download. Returns stb array of every frame
+// that could be advanced in order, possibly none, or several that were waiting on this commit
+HeatmapFrame* advance_heatmap(int frame_index, CommitInfo info, int width, int height, uint8_t* board);
+void free_heatmap_frame(HeatmapFrame* frame);
+// STRICT: Call on main thread only, once every worker has stopped
+void stop_heatmap();
@@ -9,11 +9,39 @@
 
 #include "console.h"
 #include "main_thread.h"
+#include "lib/stb/stb_ds.h"
 
 const char* argp_program_version = "NativeTimelapseGenerator 1.0";
 const char* argp_program_bug_address = "<zekiahamoako@outlook.com>, <admin@rplace.live>";
 static char doc[] = "NativeTimelapseGenerator Generator -- A program to generate timelapses from rplace canvas data";
 static char args_doc[] = "";
+
+// Long only options
+enum option_key {
+	OPTION_FRAME_SIZE = 256,
+	OPTION_FRAME_LAYER,
+	OPTION_FRAME_CONTROL,
+	OPTION_FRAME_SINK,
+	OPTION_FRAME_RATE,
+	OPTION_APNG,
+	OPTION_CROP,
+	OPTION_SCALE,
+	OPTION_CANVAS_OUTPUT,
+	OPTION_HEATMAP,
+	OPTION_TEXT_TRACK,
+	OPTION_SAMPLE_INTERVAL,
+	OPTION_DURATION,
+	OPTION_FRAME_BUDGET,
+	OPTION_KEYFRAME_INTERVAL,
+	OPTION_PACK_SAVES,
+	OPTION_UNPACK_ARCHIVES,
+	OPTION_DURABILITY,
+	OPTION_SAVE_LAYOUT,
+	OPTION_MIGRATE_LAYOUT
+};
+
+#define MAX_RENDER_SCALE 64
+
 static struct argp_option options[] = {
 	{"cli-only", 'c', 0, 0, "Disable CLI"},
 	{"repo-url", 'r', "URL", 0, "Repository URL"},
@@ -21,14 +49,131 @@ static struct argp_option options[] = {
 	{"download-root-url", 'd', "URL", 0, "Download root URL"},
 	{"game-server-root-url", 'g', "URL", 0, "Game server root URL (HTTP)"},
 	{"max-top-placers", 'p', "NUMBER", 0, "Max top placers listed"},
+	{"frame-size", OPTION_FRAME_SIZE, "WIDTHxHEIGHT", 0, "Assemble a single composite frame per commit instead of separate renders"},
+	{"frame-layer", OPTION_FRAME_LAYER, "LAYER=X,Y,WIDTH,HEIGHT", 0, "Place a composite frame layer (board, date, top_placers, canvas_control), zero size hides it"},
+	{"frame-control", OPTION_FRAME_CONTROL, 0, 0, "Include the canvas control view in the default composite frame layout"},
+	{"frame-sink", OPTION_FRAME_SINK, "COMMAND", 0, "Stream composite frames in commit order as Y4M to COMMAND's stdin, instead of saving them"},
+	{"frame-rate", OPTION_FRAME_RATE, "FPS", 0, "Frame rate of the frame sink's stream & the animated PNG"},
+	{"apng", OPTION_APNG, "FILE", 0, "Append every canvas, in commit order, to a single animated PNG"},
+	{"crop", OPTION_CROP, "X,Y,WIDTH,HEIGHT", 0, "Only render this region of the canvas & canvas control"},
+	{"scale", OPTION_SCALE, "NUMBER", 0, "Integer upscale of canvas & canvas control renders"},
+	{"canvas-output", OPTION_CANVAS_OUTPUT, "SPEC", 0, "Add an output to every canvas render, rendered in the same pass as the others. SPEC is full, "
+		"thumb:FACTOR, crop:X,Y,WIDTH,HEIGHT or upscale:FACTOR, joined with '+', i.e crop:0,0,500,500+thumb:2. Replaces --crop & --scale for canvases"},
+	{"heatmap", OPTION_HEATMAP, 0, 0, "Also render heatmap & pixel age frames, accumulated across every canvas in commit order"},
+	{"text-track", OPTION_TEXT_TRACK, "FILE", 0, "Write dates & top placers as a timed .ass or .vtt text track keyed to frame numbers, "
+		"plus a JSON sidecar, instead of rendering them for every commit"},
+	{"sample-interval", OPTION_SAMPLE_INTERVAL, "SECONDS", 0, "Only process the first commit within each interval of history"},
+	{"frame-budget", OPTION_FRAME_BUDGET, "FRAMES", 0, "Only process this many commits, picked in proportion to how much each changed the canvas"},
+	{"duration", OPTION_DURATION, "SECONDS", 0, "Only process enough commits for a video this long at --frame-rate, unless --sample-interval is set"},
+	{"keyframe-interval", OPTION_KEYFRAME_INTERVAL, "COMMITS", 0, "Store canvas downloads as a keyframe every COMMITS commits, "
+		"with run length encoded deltas against the previous canvas between them"},
+	{"pack-saves", OPTION_PACK_SAVES, 0, 0, "Append saves to a pack file per save type in packs/, instead of writing a file per save"},
+	{"unpack-archives", OPTION_UNPACK_ARCHIVES, 0, 0, "Write every packed save out to its own file, then exit"},
+	{"durability", OPTION_DURABILITY, "MODE", 0, "How saves are made durable: sync (sync each save before recording it), "
+		"periodic (sync & record saves together every second) or relaxed (never sync, reconcile saves on startup)"},
+	{"save-layout", OPTION_SAVE_LAYOUT, "LAYOUT", 0, "Directories saves of each type are spread across: flat (a single directory), "
+		"date (a directory per year & month of the commit) or hash (a directory per first 2 characters of the commit hash)"},
+	{"migrate-layout", OPTION_MIGRATE_LAYOUT, 0, 0, "Move every save that isn't packed into --save-layout, then exit"},
 	{0}
 };
 
 struct arguments {
 	Config;
 	bool cli_only;
+	bool frame_control;
+	// Layers placed with --frame-layer, applied over the default layout
+	FrameLayout frame_layer_overrides;
+	bool frame_layer_overridden[4];
 };
 
+static const char* frame_layer_names[] = { "board", "date", "top_placers", "canvas_control" };
+
+static FrameRect* get_frame_layer(FrameLayout* layout, int layer)
+{
+	FrameRect* layers[] = { &layout->board, &layout->date, &layout->top_placers, &layout->canvas_control };
+	return layers[layer];
+}
+
+static bool parse_frame_layer(struct arguments* arguments, const char* arg)
+{
+	const char* separator = strchr(arg, '=');
+	if (separator == NULL) {
+		return false;
+	}
+	size_t name_length = (size_t) (separator - arg);
+	for (int i = 0; i < 4; i++) {
+		if (strlen(frame_layer_names[i]) == name_length && strncmp(arg, frame_layer_names[i], name_length) == 0) {
+			FrameRect* rect = get_frame_layer(&arguments->frame_layer_overrides, i);
+			if (sscanf(separator + 1, "%d,%d,%d,%d", &rect->x, &rect->y, &rect->width, &rect->height) != 4) {
+				return false;
+			}
+			// Zero sized hides the layer, anything else must be a real rect, checked against the frame size once all options are parsed
+			bool hidden = rect->width == 0 && rect->height == 0;
+			if (!hidden && (rect->x < 0 || rect->y < 0 || rect->width <= 0 || rect->height <= 0)) {
+				return false;
+			}
+			arguments->frame_layer_overridden[i] = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Parses parts joined by '+', the output's name joins the name of each part with '_'
+static bool parse_canvas_output(const char* arg, RenderOutput* output)
+{
+	*output = (RenderOutput) { .name = NULL, .region = { 0 }, .upscale = 1, .downscale = 1 };
+	char* spec = strdup(arg);
+	char* name = NULL;
+	char* save_ptr = NULL;
+	bool valid = true;
+	for (char* part = strtok_r(spec, "+", &save_ptr); part != NULL && valid; part = strtok_r(NULL, "+", &save_ptr)) {
+		char* part_name = NULL;
+		FrameRect* region = &output->region;
+		int factor = 0;
+		if (strcmp(part, "full") == 0) {
+			part_name = strdup("full");
+		}
+		else if (sscanf(part, "thumb:%d", &factor) == 1) {
+			valid = factor >= 1 && factor <= MAX_RENDER_SCALE && output->upscale == 1;
+			output->downscale = factor;
+			asprintf(&part_name, "thumb%d", factor);
+		}
+		else if (sscanf(part, "upscale:%d", &factor) == 1) {
+			valid = factor >= 1 && factor <= MAX_RENDER_SCALE && output->downscale == 1;
+			output->upscale = factor;
+			asprintf(&part_name, "upscale%d", factor);
+		}
+		else if (sscanf(part, "crop:%d,%d,%d,%d", &region->x, &region->y, &region->width, &region->height) == 4) {
+			valid = region->x >= 0 && region->y >= 0 && region->width > 0 && region->height > 0;
+			asprintf(&part_name, "crop_%d_%d_%d_%d", region->x, region->y, region->width, region->height);
+		}
+		else {
+			valid = false;
+			break;
+		}
+
+		if (name == NULL) {
+			name = part_name;
+		}
+		else {
+			char* joined_name = NULL;
+			asprintf(&joined_name, "%s_%s", name, part_name);
+			free(name);
+			free(part_name);
+			name = joined_name;
+		}
+	}
+	free(spec);
+
+	if (!valid || name == NULL) {
+		free(name);
+		return false;
+	}
+	output->name = name;
+	return true;
+}
+
 static error_t parse_opt(int key, char* arg, struct argp_state* state) {
 	struct arguments* arguments = state->input;
 	
@@ -51,6 +196,124 @@ static error_t parse_opt(int key, char* arg, struct argp_state* state) {
 		case 'p':
 			arguments->max_top_placers = atoi(arg);
 			break;
+		case OPTION_FRAME_SIZE:
+			if (sscanf(arg, "%dx%d", &arguments->frame_layout.width, &arguments->frame_layout.height) != 2
+				|| arguments->frame_layout.width <= 0 || arguments->frame_layout.height <= 0) {
+				argp_error(state, "Invalid frame size '%s', expected WIDTHxHEIGHT", arg);
+			}
+			break;
+		case OPTION_FRAME_LAYER:
+			if (!parse_frame_layer(arguments, arg)) {
+				argp_error(state, "Invalid frame layer '%s', expected LAYER=X,Y,WIDTH,HEIGHT", arg);
+			}
+			break;
+		case OPTION_FRAME_CONTROL:
+			arguments->frame_control = true;
+			break;
+		case OPTION_FRAME_SINK:
+			arguments->frame_sink_command = strdup(arg);
+			break;
+		case OPTION_FRAME_RATE:
+			arguments->frame_rate = atoi(arg);
+			if (arguments->frame_rate <= 0) {
+				argp_error(state, "Invalid frame rate '%s'", arg);
+			}
+			break;
+		case OPTION_APNG:
+			arguments->apng_file_name = strdup(arg);
+			break;
+		case OPTION_CROP:
+			if (sscanf(arg, "%d,%d,%d,%d", &arguments->crop.x, &arguments->crop.y, &arguments->crop.width, &arguments->crop.height) != 4
+				|| arguments->crop.x < 0 || arguments->crop.y < 0 || arguments->crop.width <= 0 || arguments->crop.height <= 0) {
+				argp_error(state, "Invalid crop '%s', expected X,Y,WIDTH,HEIGHT", arg);
+			}
+			break;
+		case OPTION_SCALE:
+			arguments->scale = atoi(arg);
+			if (arguments->scale < 1 || arguments->scale > MAX_RENDER_SCALE) {
+				argp_error(state, "Invalid scale '%s', expected 1 to %d", arg, MAX_RENDER_SCALE);
+			}
+			break;
+		case OPTION_HEATMAP:
+			arguments->heatmap = true;
+			break;
+		case OPTION_TEXT_TRACK:
+			arguments->text_track_file_name = strdup(arg);
+			break;
+		case OPTION_SAMPLE_INTERVAL:
+			arguments->sample_interval = atoi(arg);
+			if (arguments->sample_interval <= 0) {
+				argp_error(state, "Invalid sample interval '%s'", arg);
+			}
+			break;
+		case OPTION_DURATION:
+			arguments->target_duration = atoi(arg);
+			if (arguments->target_duration <= 0) {
+				argp_error(state, "Invalid duration '%s'", arg);
+			}
+			break;
+		case OPTION_FRAME_BUDGET:
+			arguments->frame_budget = atoi(arg);
+			if (arguments->frame_budget <= 0) {
+				argp_error(state, "Invalid frame budget '%s'", arg);
+			}
+			break;
+		case OPTION_KEYFRAME_INTERVAL:
+			arguments->keyframe_interval = atoi(arg);
+			if (arguments->keyframe_interval <= 0) {
+				argp_error(state, "Invalid keyframe interval '%s'", arg);
+			}
+			break;
+		case OPTION_PACK_SAVES:
+			arguments->pack_saves = true;
+			break;
+		case OPTION_UNPACK_ARCHIVES:
+			arguments->unpack_archives = true;
+			break;
+		case OPTION_DURABILITY:
+			if (strcmp(arg, "sync") == 0) {
+				arguments->save_durability = SAVE_DURABILITY_SYNC;
+			}
+			else if (strcmp(arg, "periodic") == 0) {
+				arguments->save_durability = SAVE_DURABILITY_PERIODIC;
+			}
+			else if (strcmp(arg, "relaxed") == 0) {
+				arguments->save_durability = SAVE_DURABILITY_RELAXED;
+			}
+			else {
+				argp_error(state, "Invalid durability '%s', expected sync, periodic or relaxed", arg);
+			}
+			break;
+		case OPTION_SAVE_LAYOUT:
+			if (strcmp(arg, "flat") == 0) {
+				arguments->save_layout = SAVE_LAYOUT_FLAT;
+			}
+			else if (strcmp(arg, "date") == 0) {
+				arguments->save_layout = SAVE_LAYOUT_DATE;
+			}
+			else if (strcmp(arg, "hash") == 0) {
+				arguments->save_layout = SAVE_LAYOUT_HASH;
+			}
+			else {
+				argp_error(state, "Invalid save layout '%s', expected flat, date or hash", arg);
+			}
+			break;
+		case OPTION_MIGRATE_LAYOUT:
+			arguments->migrate_layout = true;
+			break;
+		case OPTION_CANVAS_OUTPUT: {
+			RenderOutput output;
+			if (arrlen(arguments->canvas_outputs) >= MAX_CANVAS_OUTPUTS) {
+				argp_error(state, "Too many canvas outputs, at most %d can be rendered", MAX_CANVAS_OUTPUTS);
+			}
+			else if (!parse_canvas_output(arg, &output)) {
+				argp_error(state, "Invalid canvas output '%s', expected full, thumb:FACTOR, crop:X,Y,WIDTH,HEIGHT or upscale:FACTOR joined with '+'", arg);
+			}
+			else {
+				arrput(arguments->canvas_outputs, output);
+			}
+			break;
+		}
 		case ARGP_KEY_ARG:
 			if (state->arg_num >= 0) {
 				argp_usage(state);
@@ -60,6 +323,23 @@ static error_t parse_opt(int key, char* arg, struct argp_state* state) {
 			if (state->arg_num < 0) {
 				argp_usage(state);
 			}
+			if (arguments->frame_layout.width > 0) {
+				int frame_width = arguments->frame_layout.width;
+				int frame_height = arguments->frame_layout.height;
+				arguments->frame_layout = default_frame_layout(frame_width, frame_height, arguments->frame_control);
+				for (int i = 0; i < 4; i++) {
+					if (!arguments->frame_layer_overridden[i]) {
+						continue;
+					}
+					FrameRect* rect = get_frame_layer(&arguments->frame_layer_overrides, i);
+					if ((rect->width > 0 || rect->height > 0)
+						&& (rect->x + rect->width > frame_width || rect->y + rect->height > frame_height)) {
+						argp_error(state, "Frame layer '%s' at %d,%d,%d,%d doesn't fit within the %dx%d frame", frame_layer_names[i],
+							rect->x, rect->y, rect->width, rect->height, frame_width, frame_height);
+					}
+					*get_frame_layer(&arguments->frame_layout, i) = *rect;
+				}
+			}
 			break;
 		default:
 			return ARGP_ERR_UNKNOWN;
@@ -82,6 +362,24 @@ int main(int argc, char *argv[]) {
 		.game_server_base_url = "https://server.rplace.live",
 		.commit_hashes_file_name = NULL,
 		.max_top_placers = 10,
+		.frame_layout = { 0 },
+		.frame_sink_command = NULL,
+		.frame_rate = 24,
+		.apng_file_name = NULL,
+		.crop = { 0 },
+		.scale = 1,
+		.canvas_outputs = NULL,
+		.heatmap = false,
+		.text_track_file_name = NULL,
+		.sample_interval = 0,
+		.target_duration = 0,
+		.frame_budget = 0,
+		.keyframe_interval = 0,
+		.pack_saves = false,
+		.unpack_archives = false,
+		.save_durability = SAVE_DURABILITY_PERIODIC,
+		.save_layout = SAVE_LAYOUT_FLAT,
+		.migrate_layout = false,
 		.cli_only = false
 	};
 
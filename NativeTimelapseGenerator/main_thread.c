@@ -20,6 +20,14 @@
 #include "main_thread.h"
 #include "memory_utils.h"
 #include "database.h"
+#include "frame_sink.h"
+#include "apng_writer.h"
+#include "heatmap.h"
+#include "text_track.h"
+#include "commit_stats.h"
+#include "save_pack.h"
+#include "canvas_codec.h"
+#include "save_writer.h"
 #define STB_DS_IMPLEMENTATION
 #include "lib/stb/stb_ds.h"
 
@@ -273,6 +281,26 @@ void push_completed(SaveResult result)
 	main_thread_post(save_alist);
 }
 
+// STRICT: Call on main thread
+void collect_save_batch_stats(SaveResult* results)
+{
+	for (int i = 0; i < arrlen(results); i++) {
+		collect_save_stats(results[i]);
+	}
+	arrfree(results);
+}
+
+// Called by save batch thread
+void push_completed_batch(SaveResult* results)
+{
+	completed_saves += (int) arrlen(results);
+	completed_saves_since += (int) arrlen(results);
+	av_alist save_batch_alist;
+	av_start_void(save_batch_alist, &collect_save_batch_stats);
+	av_ptr(save_batch_alist, SaveResult*, results);
+	main_thread_post(save_batch_alist);
+}
+
 // Forward declarations
 void* read_commit_hashes(int instance_id, FILE* file);
 FILE* commit_hashes_stream = NULL;
@@ -281,7 +309,8 @@ FILE* commit_hashes_stream = NULL;
 DownloadJob pop_download_stack(int worker_id)
 {
 	DownloadJob result = { 0 };
-	while (!pop_stack(&download_stack, &result)) {
+	// Oldest first, so that frames complete in roughly the order the frame sink needs them
+	while (!pop_stack_front(&download_stack, &result)) {
 		usleep(10000); // Wait for 10ms
 	}
 	return result;
@@ -291,7 +320,7 @@ DownloadJob pop_download_stack(int worker_id)
 RenderJob pop_render_stack(int worker_id)
 {
 	RenderJob result = { 0 };
-	while (!pop_stack(&render_stack, &result)) {
+	while (!pop_stack_front(&render_stack, &result)) {
 		usleep(10000); // Wait for 10ms
 	}
 	return result;
@@ -307,17 +336,69 @@ SaveJob pop_save_stack(int worker_id)
 	return result;
 }
 
+// Frame sink, APNG writer, heatmap & text track position of the next designated commit
+int next_frame_index = 0;
+
+// Save types every commit already had when generation started, so designating never queries per commit
+CommitSaves* commit_saves = NULL;
+
+bool has_commit_save(int commit_id, SaveJobType type)
+{
+	ptrdiff_t index = hmgeti(commit_saves, commit_id);
+	return index >= 0 && (commit_saves[index].value & (1u << type)) != 0;
+}
+
 // STRICT: Called by main thread
 void designate_jobs(int commit_id, CommitInfo info)
 {
 	// TODO: Implement missing cases
 
-	// Check canvas download and rendering
-	if (!check_save_exists(commit_id, SAVE_CANVAS_DOWNLOAD)) {
+	// Composite frames replace every separate render, only the raw downloads are still saved
+	if (_config.frame_layout.width > 0) {
+		// Streamed frames aren't saved, so every commit is needed for the video
+		bool streaming = is_frame_sink_running() || is_apng_writer_running();
+		if (streaming || !has_commit_save(commit_id, SAVE_COMPOSITE_RENDER)) {
+			DownloadJob download_composite_job = {
+				.commit_id = commit_id,
+				.commit_hash = info.commit_hash,
+				.date = info.date,
+				.frame_index = streaming ? next_frame_index++ : 0,
+				.type = DOWNLOAD_COMPOSITE
+			};
+			push_download_stack(download_composite_job);
+		}
+		return;
+	}
+
+	// Check canvas download and rendering, the APNG writer & heatmap need every canvas in order. Every
+	// download of a commit shares its frame index, as the text track's cues follow the canvas frames
+	bool animating = is_apng_writer_running() || is_heatmap_running();
+	bool texting = is_text_track_running();
+	bool encoding = is_canvas_codec_running();
+	bool counting = is_commit_stats_counting_downloads();
+	int frame_index = animating || texting || encoding || counting ? next_frame_index++ : 0;
+	bool canvas_saved = !animating && has_commit_save(commit_id, SAVE_CANVAS_DOWNLOAD);
+	if (canvas_saved && counting) {
+		skip_commit_stats(frame_index);
+	}
+	if (canvas_saved && encoding) {
+		// Never reaches the codec, which would otherwise hold back every later canvas
+		SaveJob skip_canvas_job = {
+			.commit_id = commit_id,
+			.commit_hash = info.commit_hash,
+			.date = info.date,
+			.frame_index = frame_index,
+			.type = SAVE_CANVAS_DOWNLOAD,
+			.data = NULL
+		};
+		push_save_stack(skip_canvas_job);
+	}
+	if (!canvas_saved) {
 		DownloadJob download_canvas_job = {
 			.commit_id = commit_id,
 			.commit_hash = info.commit_hash,
 			.date = info.date,
+			.frame_index = frame_index,
 			.type = DOWNLOAD_CANVAS
 		};
 		push_download_stack(download_canvas_job);
@@ -336,12 +417,13 @@ void designate_jobs(int commit_id, CommitInfo info)
 		push_download_stack(render_canvas_job);
 	}*/
 
-	// Check placers download and rendering
-	if (!check_save_exists(commit_id, SAVE_PLACERS_DOWNLOAD)) {
+	// Check placers download and rendering, the text track needs every commit's top placers
+	if (texting || !has_commit_save(commit_id, SAVE_PLACERS_DOWNLOAD)) {
 		DownloadJob download_placers_job = {
 			.commit_id = commit_id,
 			.commit_hash = info.commit_hash,
 			.date = info.date,
+			.frame_index = frame_index,
 			.type = DOWNLOAD_PLACERS
 		};
 		push_download_stack(download_placers_job);
@@ -369,8 +451,8 @@ void designate_jobs(int commit_id, CommitInfo info)
 		}*/
 	}
 
-	// Check date rendering
-	if (!check_save_exists(commit_id, SAVE_DATE_RENDER)) {
+	// Check date rendering, the text track carries dates instead
+	if (!texting && !has_commit_save(commit_id, SAVE_DATE_RENDER)) {
 		RenderJob render_date_job = {
 			.commit_id = commit_id,
 			.commit_hash = info.commit_hash,
@@ -381,10 +463,234 @@ void designate_jobs(int commit_id, CommitInfo info)
 	}
 }
 
+// Buckets of sample_interval seconds since the first commit that already have a commit designated
+typedef struct sample_bucket {
+	int64_t key;
+	bool value;
+} SampleBucket;
+
+time_t sample_interval = 0;
+time_t sample_start = 0;
+SampleBucket* sampled_buckets = NULL;
+int sampled_commits = 0;
+int unsampled_commits = 0;
+
+// Dates of the earliest & latest commit, read without designating anything
+bool find_commit_date_range(FILE* file, time_t* out_first, time_t* out_last)
+{
+	fseek(file, 0, SEEK_SET);
+	char line[MAX_HASHES_LINE_LEN];
+	bool found = false;
+	while (fgets(line, MAX_HASHES_LINE_LEN, file) != NULL) {
+		if (strncmp(line, "Date: ", 6) != 0) {
+			continue;
+		}
+		time_t date = strtoll(line + 6, NULL, 10);
+		*out_first = !found || date < *out_first ? date : *out_first;
+		*out_last = !found || date > *out_last ? date : *out_last;
+		found = true;
+	}
+	fseek(file, 0, SEEK_SET);
+	return found;
+}
+
 // STRICT: Called by main thread
+void init_commit_sampling(FILE* file, const Config* config)
+{
+	hmfree(sampled_buckets);
+	sampled_commits = 0;
+	unsampled_commits = 0;
+	sample_interval = config->sample_interval;
+	if (sample_interval <= 0 && config->target_duration <= 0) {
+		return;
+	}
+
+	time_t first_date = 0;
+	time_t last_date = 0;
+	if (!find_commit_date_range(file, &first_date, &last_date)) {
+		sample_interval = 0;
+		return;
+	}
+	sample_start = first_date;
+	if (sample_interval <= 0) {
+		// Enough buckets for one frame each, rounded up so that the target is never exceeded
+		int64_t frames = (int64_t) config->target_duration * (config->frame_rate > 0 ? config->frame_rate : 1);
+		int64_t span = (int64_t) (last_date - first_date) + 1;
+		sample_interval = (time_t) ((span + frames - 1) / frames);
+	}
+	log_message(LOG_INFO, LOG_HEADER"Sampling at most one commit every %lld seconds", (long long) sample_interval);
+}
+
+// STRICT: Called by main thread, true if the commit is the first seen within its bucket. Commits are seen in
+// date order, so that is always the bucket's earliest
+bool sample_commit(time_t date)
+{
+	if (sample_interval <= 0) {
+		return true;
+	}
+	int64_t bucket = (int64_t) ((date - sample_start) / sample_interval);
+	if (hmgetp_null(sampled_buckets, bucket) != NULL) {
+		unsampled_commits++;
+		return false;
+	}
+	hmput(sampled_buckets, bucket, true);
+	sampled_commits++;
+	return true;
+}
+
+// Every sampled commit, held back until the frame budget has been spent over them
+typedef struct budget_commit {
+	int commit_id;
+	CommitInfo info;
+} BudgetCommit;
+
+BudgetCommit* budget_commits = NULL;
+
+// STRICT: Called by main thread. Systematic sampling over cumulative activity, so that frames land in
+// proportion to changed pixels. Each commit also weighs a single pixel, so a history with no changes
+// still falls back to evenly spaced commits
+void select_budget_commits()
+{
+	int commits_size = (int) arrlen(budget_commits);
+	int64_t* weights = malloc(sizeof(int64_t) * (size_t) (commits_size > 0 ? commits_size : 1));
+	int64_t total_weight = 0;
+	for (int i = 0; i < commits_size; i++) {
+		int64_t changed_pixels = find_commit_changed_pixels(budget_commits[i].commit_id);
+		weights[i] = (changed_pixels > 0 ? changed_pixels : 0) + 1;
+		total_weight += weights[i];
+	}
+
+	int selected = 0;
+	double step = (double) total_weight / (double) _config.frame_budget;
+	double next_threshold = 0.0;
+	int64_t cumulative_weight = 0;
+	for (int i = 0; i < commits_size; i++) {
+		cumulative_weight += weights[i];
+		// A commit busier than a whole step still only takes a single frame
+		if (_config.frame_budget >= commits_size || (double) cumulative_weight > next_threshold) {
+			designate_jobs(budget_commits[i].commit_id, budget_commits[i].info);
+			selected++;
+			while (next_threshold < (double) cumulative_weight) {
+				next_threshold += step;
+			}
+		}
+	}
+	free(weights);
+
+	log_message(LOG_INFO, LOG_HEADER"Selected %d of %d commits for a budget of %d frames", selected, commits_size, _config.frame_budget);
+	arrfree(budget_commits);
+}
+
+// Called by whichever worker counts the final commit
+void on_commit_stats_complete()
+{
+	av_alist select_alist;
+	av_start_void(select_alist, &select_budget_commits);
+	main_thread_post(select_alist);
+}
+
+// STRICT: Called by main thread. Commits are only selected once every one of them has stats. Stats are kept from
+// earlier runs' downloads, so only commits that were never counted are downloaded here, each run of them after
+// the commit before it so that the first is still compared against its real predecessor
+void spend_frame_budget()
+{
+	int commits_size = (int) arrlen(budget_commits);
+	bool* missing = malloc(sizeof(bool) * (size_t) (commits_size > 0 ? commits_size : 1));
+	int stats_size = 0;
+	for (int i = 0; i < commits_size; i++) {
+		missing[i] = find_commit_changed_pixels(budget_commits[i].commit_id) == -1;
+		if (missing[i]) {
+			stats_size += i > 0 && !missing[i - 1] ? 2 : 1;
+		}
+	}
+	if (stats_size == 0) {
+		free(missing);
+		select_budget_commits();
+		return;
+	}
+
+	log_message(LOG_INFO, LOG_HEADER"Downloading %d canvases to count commits without stats", stats_size);
+	start_commit_stats(stats_size, on_commit_stats_complete);
+	int stats_index = 0;
+	for (int i = 0; i < commits_size; i++) {
+		if (!missing[i]) {
+			continue;
+		}
+		if (i > 0 && !missing[i - 1]) {
+			DownloadJob download_baseline_job = {
+				.commit_id = budget_commits[i - 1].commit_id,
+				.commit_hash = budget_commits[i - 1].info.commit_hash,
+				.date = budget_commits[i - 1].info.date,
+				.frame_index = stats_index++,
+				.type = DOWNLOAD_STATS,
+				.stats_baseline = true
+			};
+			push_download_stack(download_baseline_job);
+		}
+		DownloadJob download_stats_job = {
+			.commit_id = budget_commits[i].commit_id,
+			.commit_hash = budget_commits[i].info.commit_hash,
+			.date = budget_commits[i].info.date,
+			.frame_index = stats_index++,
+			.type = DOWNLOAD_STATS
+		};
+		push_download_stack(download_stats_job);
+	}
+	free(missing);
+}
+
+// Commits read from the log are added to the database this many at a time, in a single transaction each
+#define COMMIT_IMPORT_BATCH_SIZE 1024
+
+int imported_commits = 0;
+double import_duration_ms = 0.0;
+
+// STRICT: Called by main thread. Takes ownership of every commit of the batch
+void import_commit_batch(int instance_id, CommitInfo* batch)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int* commit_ids = add_commits_to_db(instance_id, batch, (int) arrlen(batch));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	import_duration_ms += (double) (end.tv_sec - start.tv_sec) * 1000.0 + (double) (end.tv_nsec - start.tv_nsec) / 1000000.0;
+
+	for (int i = 0; i < arrlen(batch); i++) {
+		int commit_id = commit_ids == NULL ? -1 : commit_ids[i];
+		if (commit_id == -1) {
+			log_message(LOG_ERROR, LOG_HEADER"Failed to add commit to database: %s", batch[i].commit_hash);
+			free(batch[i].commit_hash);
+		}
+		else if (_config.frame_budget > 0) {
+			// Activity is only known once every commit has been read
+			arrput(budget_commits, ((BudgetCommit) { .commit_id = commit_id, .info = batch[i] }));
+			imported_commits++;
+		}
+		else {
+			// Push collected infos to the stacks to be processed
+			designate_jobs(commit_id, batch[i]);
+			imported_commits++;
+		}
+	}
+	free(commit_ids);
+}
+
+// Earliest first, commits at the same second are ordered by hash so that every run agrees
+int compare_commit_dates(const void* a, const void* b)
+{
+	const CommitInfo* commit_a = (const CommitInfo*) a;
+	const CommitInfo* commit_b = (const CommitInfo*) b;
+	if (commit_a->date != commit_b->date) {
+		return commit_a->date < commit_b->date ? -1 : 1;
+	}
+	return strcmp(commit_a->commit_hash, commit_b->commit_hash);
+}
+
+// STRICT: Called by main thread. Every commit of the log is read before any is designated, as frame indices
+// must follow commit dates whichever order the log is in
 void* read_commit_hashes(int instance_id, FILE* file)
 {
 	CommitInfo new_canvas_info = { 0 };
+	CommitInfo* commits = NULL; // stb array
 	char line[MAX_HASHES_LINE_LEN];
 	char* result = NULL;
 	int line_index = 0;
@@ -403,39 +709,69 @@ void* read_commit_hashes(int instance_id, FILE* file)
 			size_t hash_len = result_len - 8;
 			char* commit_hash = malloc(hash_len + 1);
 			strcpy(commit_hash, result + 8);
+			// A commit without a date is dropped
+			free(new_canvas_info.commit_hash);
 			new_canvas_info.commit_hash = commit_hash;            
 		}
 		else if (strncmp(result, "Date: ", 6) == 0) {
-			size_t date_len = strlen(result) - 6;
-			char* date = malloc(date_len + 1);
-			strcpy(date, result + 6);
-			time_t date_int = strtoll(date, NULL, 10);
+			time_t date_int = strtoll(result + 6, NULL, 10);
 			new_canvas_info.date = date_int;
-
-			int commit_id = add_commit_to_db(instance_id, new_canvas_info);
-			if (commit_id == -1) {
-				log_message(LOG_ERROR, LOG_HEADER"Failed to add commit to database: %s", 
-					new_canvas_info.commit_hash, new_canvas_info.commit_hash);
+			if (new_canvas_info.commit_hash == NULL) {
+				log_message(LOG_ERROR, LOG_HEADER"(Line %d) Ignoring date without a commit", line_index);
+				continue;
 			}
-			else {
-				// Push collected infos to the stacks to be processed
-				designate_jobs(commit_id, new_canvas_info);
-			}
-
+			arrput(commits, new_canvas_info);
 			// Wipe for reuse
 			memset(&new_canvas_info, 0, sizeof(CommitInfo));
+		}
+	}
+	free(new_canvas_info.commit_hash);
+	qsort(commits, (size_t) arrlen(commits), sizeof(CommitInfo), compare_commit_dates);
+
+	CommitInfo* batch = NULL; // stb array
+	int commit_index = 0;
+	while (commit_index < arrlen(commits)) {
+		CommitInfo info = commits[commit_index++];
+		// Commits outside of the sample never enter the download stack
+		if (!sample_commit(info.date)) {
+			free(info.commit_hash);
+			continue;
+		}
 
-			// We can buffer more (stack will dynamically resize), but we will pause here to allow other 
-			// jobs a chance to run on main thread
-			if (download_stack.top > DEFAULT_STACK_SIZE) {
-				// We will come back later
-				log_message(LOG_INFO, LOG_HEADER"Bufferred %d commit records into download stack. Pausing until needs replenish", download_stack.top + 1);
-				break;
-			}
+		arrput(batch, info);
+		if (arrlen(batch) < COMMIT_IMPORT_BATCH_SIZE) {
+			continue;
+		}
+		import_commit_batch(instance_id, batch);
+		arrsetlen(batch, 0);
+
+		// We can buffer more (stack will dynamically resize), but we will pause here to allow other 
+		// jobs a chance to run on main thread
+		long download_stack_size = get_stack_size(&download_stack);
+		if (download_stack_size > DEFAULT_STACK_SIZE) {
+			// We will come back later
+			log_message(LOG_INFO, LOG_HEADER"Bufferred %ld commit records into download stack. Pausing until needs replenish", download_stack_size);
+			break;
 		}
 	}
+	if (arrlen(batch) > 0) {
+		import_commit_batch(instance_id, batch);
+	}
+	arrfree(batch);
+	// Only left after pausing, these are later than every designated commit
+	while (commit_index < arrlen(commits)) {
+		free(commits[commit_index++].commit_hash);
+	}
+	arrfree(commits);
+	log_message(LOG_INFO, LOG_HEADER"Imported %d commits into the database in %.1fms", imported_commits, import_duration_ms);
 
-	if (download_stack.top < 0) {
+	if (sample_interval > 0) {
+		log_message(LOG_INFO, LOG_HEADER"Sampled %d commits, skipping %d", sampled_commits, unsampled_commits);
+	}
+	if (_config.frame_budget > 0) {
+		spend_frame_budget();
+	}
+	if (get_stack_size(&download_stack) <= 0) {
 		stop_console();
 		log_message(LOG_ERROR, LOG_HEADER"Could not find any unprocessed backups from commit_hashes.txt\n");
 		exit(EXIT_SUCCESS);
@@ -488,7 +824,8 @@ void append_new_commits_to_log(git_repository* repo, const char* log_file_name)
 		return;
 	}
 
-	git_revwalk_sorting(walker, GIT_SORT_TIME);
+	// Oldest first, commit order is also frame order
+	git_revwalk_sorting(walker, GIT_SORT_TIME | GIT_SORT_REVERSE);
 	git_revwalk_push_head(walker);
 
 	FILE* log_file = fopen(log_file_name, "a");
@@ -587,7 +924,8 @@ const char* get_repo_commit_hashes(const char* repo_url)
 	}
 	log_message(LOG_INFO, LOG_HEADER"Revwalk created successfully.");
 
-	git_revwalk_sorting(walker, GIT_SORT_TIME);
+	// Oldest first, commit order is also frame order
+	git_revwalk_sorting(walker, GIT_SORT_TIME | GIT_SORT_REVERSE);
 	git_revwalk_push_head(walker);
 
 	FILE* log_file = fopen(log_file_name, "w");
@@ -616,7 +954,7 @@ const char* get_repo_commit_hashes(const char* repo_url)
 		AUTOFREE char* commit_date = NULL;
 		asprintf(&commit_date, "%ld", commit_time);
 
-		fprintf(log_file, LOG_HEADER"Commit: %s\nAuthor: %s\nDate: %s\n", commit_hash, author_name, commit_date);
+		fprintf(log_file, "Commit: %s\nAuthor: %s\nDate: %s\n", commit_hash, author_name, commit_date);
 		commit_count++;
 
 		if (commit_count % 100 == 0) {
@@ -660,6 +998,30 @@ NOSANITIZE void start_generation(Config config)
 		exit(EXIT_FAILURE);
 	}
 
+	set_save_layout(config.save_layout);
+	if (config.unpack_archives) {
+		bool unpacked = unpack_save_packs();
+		stop_console();
+		exit(unpacked ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	if (config.migrate_layout) {
+		bool migrated = migrate_save_layout();
+		stop_console();
+		exit(migrated ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	// Saves that didn't outlive the last run must be generated again
+	if (config.save_durability != SAVE_DURABILITY_SYNC && reconcile_saves_in_db() == -1) {
+		stop_console();
+		log_message(LOG_ERROR, LOG_HEADER"Couldn't reconcile saves with the disk\n");
+		exit(EXIT_FAILURE);
+	}
+	bool sync_saves = config.save_durability == SAVE_DURABILITY_SYNC;
+	if (config.pack_saves && !start_save_packs(sync_saves)) {
+		stop_console();
+		log_message(LOG_ERROR, LOG_HEADER"Couldn't start save packs\n");
+		exit(EXIT_FAILURE);
+	}
+
 	// Add new instance to DB
 	int instance_id = find_existing_instance(&config);;
 	if (instance_id == -1 && !add_instance_to_db(&config)) {
@@ -706,8 +1068,62 @@ NOSANITIZE void start_generation(Config config)
 	}
 	commit_hashes_stream = file;
 
+	// Must be running before any jobs are designated, so that they are given frame indices
+	if (config.frame_sink_command && strlen(config.frame_sink_command) > 0) {
+		if (config.frame_layout.width <= 0) {
+			log_message(LOG_ERROR, LOG_HEADER"Frame sink requires composite frames (--frame-size), ignoring it");
+		}
+		else if (!start_frame_sink(config.frame_sink_command, config.frame_layout.width,
+			config.frame_layout.height, config.frame_rate)) {
+			stop_console();
+			log_message(LOG_ERROR, LOG_HEADER"Couldn't start frame sink\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (config.apng_file_name && strlen(config.apng_file_name) > 0
+		&& !start_apng_writer(config.apng_file_name, config.frame_rate)) {
+		stop_console();
+		log_message(LOG_ERROR, LOG_HEADER"Couldn't start APNG writer\n");
+		exit(EXIT_FAILURE);
+	}
+	if (config.heatmap) {
+		if (config.frame_layout.width > 0) {
+			log_message(LOG_ERROR, LOG_HEADER"Heatmap isn't available with composite frames (--frame-size), ignoring it");
+		}
+		else {
+			start_heatmap();
+		}
+	}
+	if (config.keyframe_interval > 0) {
+		if (config.frame_layout.width > 0) {
+			log_message(LOG_ERROR, LOG_HEADER"Canvas codec isn't available with composite frames (--frame-size), ignoring it");
+		}
+		else {
+			start_canvas_codec(config.keyframe_interval);
+		}
+	}
+	if (config.text_track_file_name && strlen(config.text_track_file_name) > 0) {
+		if (config.frame_layout.width > 0) {
+			log_message(LOG_ERROR, LOG_HEADER"Text track isn't available with composite frames (--frame-size), ignoring it");
+		}
+		else if (!start_text_track(config.text_track_file_name, config.frame_rate)) {
+			stop_console();
+			log_message(LOG_ERROR, LOG_HEADER"Couldn't start text track\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	long file_lines = flines(file);
 	log_message(LOG_INFO, LOG_HEADER"Detected %d lines in %s", file_lines, log_file_name);
+	init_commit_sampling(file, &config);
+	// Every commit is designated in order, so each canvas download can be counted against the one before it
+	if (config.frame_budget <= 0 && sample_interval <= 0 && config.frame_layout.width == 0) {
+		start_commit_stats(0, NULL);
+	}
+	// Every commit's existing saves are loaded at once, rather than queried as each commit is designated
+	hmfree(commit_saves);
+	commit_saves = get_commit_saves(instance_id);
+	log_message(LOG_INFO, LOG_HEADER"Found existing saves of %d commits", (int) hmlen(commit_saves));
 	read_commit_hashes(instance_id, file);
 
 	// Create required directories
@@ -717,6 +1133,17 @@ NOSANITIZE void start_generation(Config config)
 	make_save_dir("date_renders");
 	make_save_dir("top_placer_renders");
 	make_save_dir("canvas_control_renders");
+	make_save_dir("composite_renders");
+	make_save_dir("heatmap_renders");
+	make_save_dir("age_renders");
+
+	// Saves are recorded by the batches, so they must outlive the writer
+	start_save_batches(on_saves_committed, config.save_durability);
+	if (!start_save_writer(on_save_written, sync_saves)) {
+		stop_console();
+		log_message(LOG_ERROR, LOG_HEADER"Couldn't start save writer\n");
+		exit(EXIT_FAILURE);
+	}
 
 	// Start workers
 	log_message(LOG_INFO, LOG_HEADER"Starting backup generation...");
@@ -751,11 +1178,25 @@ void stop_generation()
 	remove_all_workers(download_workers);
 	remove_all_workers(render_workers);
 	remove_all_workers(save_workers);
+	// Writes still in flight are recorded, but no longer reported to the freed work queue
+	stop_save_writer();
+	stop_save_batches();
 
 	// Cleanup shared worker data
 	remove_download_worker_shared();
 	remove_render_worker_shared();
 	remove_save_worker_shared();
+
+	// Workers are gone, so no more frames can arrive
+	stop_frame_sink();
+	stop_apng_writer();
+	stop_heatmap();
+	stop_text_track();
+	stop_commit_stats();
+	stop_canvas_codec();
+	stop_save_packs();
+	hmfree(commit_saves);
+	free_statement_cache();
 	
 	log_message(LOG_INFO, LOG_HEADER"Backup generation stopped.");
 }
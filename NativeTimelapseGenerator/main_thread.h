@@ -13,6 +13,7 @@
 #include "workers/render_worker.h"
 #include "workers/save_worker.h"
 #include "workers/worker_structs.h"
+#include "save_layout.h"
 
 #define MAX_HASHES_LINE_LEN 256
 
@@ -27,6 +28,33 @@ typedef struct config {
 	char* game_server_base_url;
 	char* commit_hashes_file_name;
 	size_t max_top_placers;
+	FrameLayout frame_layout;
+	// Composite frames are streamed to this command's stdin instead of being saved, can be null
+	char* frame_sink_command;
+	int frame_rate;
+	// Every canvas is appended to this animated PNG, can be null
+	char* apng_file_name;
+	// Canvas & canvas control renders only cover this region, zero sized for the whole canvas
+	FrameRect crop;
+	int scale; // Integer upscale of canvas & canvas control renders
+	// stb array, every canvas render produces each of these. When empty, a single output of crop & scale
+	RenderOutput* canvas_outputs;
+	bool heatmap; // Render heatmap & pixel age frames of every canvas, in commit order
+	// Dates & top placers are written to this text track instead of being rendered, can be null
+	char* text_track_file_name;
+	// At most one commit is designated per bucket of this many seconds, 0 designates every commit
+	int sample_interval;
+	// Seconds of output at frame_rate, derives sample_interval from the span of the history if it isn't set
+	int target_duration;
+	// Frames spent proportionally to how much each commit changed the canvas, 0 designates every commit
+	int frame_budget;
+	// Canvas downloads are stored as a keyframe every this many commits, with deltas between. 0 stores raw boards
+	int keyframe_interval;
+	bool pack_saves; // Append saves to a pack file per type, instead of writing a file per save
+	bool unpack_archives; // Write every packed save out to its own file & exit, instead of generating
+	SaveDurability save_durability;
+	SaveLayout save_layout; // Directories that saves of each type are spread across
+	bool migrate_layout; // Move every save that isn't packed into save_layout & exit, instead of generating
 } Config;
 
 // Generic thread data for each worker
@@ -95,4 +123,6 @@ void push_save_stack(SaveJob job);
 
 // Called by save worker
 SaveJob pop_save_stack(int worker_id);
-void push_completed(SaveResult job);
\ No newline at end of file
+void push_completed(SaveResult job);
+// Takes ownership of results (an stb array), posted to the main thread as one piece of work
+void push_completed_batch(SaveResult* results);
\ No newline at end of file
@@ -1,16 +1,20 @@
+#include <errno.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
 #include <avcall.h>
 
 #include "console.h"
 #include "memory_utils.h"
+#include "lib/stb/stb_ds.h"
 
 void init_stack(Stack* stack, size_t item_size, ssize_t default_size)
 {
 	stack->items = malloc(item_size * default_size);
 	stack->item_size = item_size;
 	stack->top = -1;
+	stack->bottom = 0;
 	stack->max_size = default_size;
 	pthread_mutex_init(&stack->mutex, NULL);
 	stack->replenished = false;
@@ -20,6 +24,14 @@ int push_stack(Stack* stack, void* item)
 {
 	pthread_mutex_lock(&stack->mutex);
 
+	// Reclaim space freed from the front before growing
+	if (stack->top >= stack->max_size - 1 && stack->bottom > 0) {
+		long count = stack->top - stack->bottom + 1;
+		memmove(stack->items, (char*)stack->items + (size_t) stack->bottom * stack->item_size, (size_t) count * stack->item_size);
+		stack->top = count - 1;
+		stack->bottom = 0;
+	}
+
 	// Resize if the stack is full
 	if (stack->top >= stack->max_size - 1) {
 		ssize_t new_size = stack->max_size * 2; // Double the size
@@ -46,7 +58,7 @@ bool pop_stack(Stack* stack, void* item)
 {
 	pthread_mutex_lock(&stack->mutex);
 
-	if (stack->top < 0) {
+	if (stack->top < stack->bottom) {
 		memset(item, 0, stack->item_size);
 		pthread_mutex_unlock(&stack->mutex);
 		return false;
@@ -55,11 +67,46 @@ bool pop_stack(Stack* stack, void* item)
 	// Retrieve the item from the stack
 	memcpy(item, (char*)stack->items + stack->top * stack->item_size, stack->item_size);
 	stack->top--;
+	if (stack->top < stack->bottom) {
+		stack->top = -1;
+		stack->bottom = 0;
+	}
 
 	pthread_mutex_unlock(&stack->mutex);
 	return true;
 }
 
+// Pops the oldest item, so items are processed in the order they were pushed
+bool pop_stack_front(Stack* stack, void* item)
+{
+	pthread_mutex_lock(&stack->mutex);
+
+	if (stack->top < stack->bottom) {
+		memset(item, 0, stack->item_size);
+		pthread_mutex_unlock(&stack->mutex);
+		return false;
+	}
+
+	// Retrieve the item from the bottom of the stack
+	memcpy(item, (char*)stack->items + (size_t) stack->bottom * stack->item_size, stack->item_size);
+	stack->bottom++;
+	if (stack->top < stack->bottom) {
+		stack->top = -1;
+		stack->bottom = 0;
+	}
+
+	pthread_mutex_unlock(&stack->mutex);
+	return true;
+}
+
+long get_stack_size(Stack* stack)
+{
+	pthread_mutex_lock(&stack->mutex);
+	long size = stack->top - stack->bottom + 1;
+	pthread_mutex_unlock(&stack->mutex);
+	return size;
+}
+
 void free_stack(Stack* stack)
 {
 	free(stack->items);
@@ -137,3 +184,168 @@ void free_work_queue(WorkQueue* work_queue)
 	free(work_queue->work);
 	pthread_mutex_destroy(&work_queue->mutex);
 }
+
+void init_reorder_buffer(ReorderBuffer* buffer, int first_index, int window)
+{
+	buffer->pending = NULL;
+	buffer->next_index = first_index;
+	buffer->window = window;
+	pthread_mutex_init(&buffer->mutex, NULL);
+	pthread_cond_init(&buffer->advanced, NULL);
+}
+
+// Blocks while index is a whole window ahead of the next index in sequence. Skips hold nothing, so never wait
+void push_reorder_buffer(ReorderBuffer* buffer, int index, void* item)
+{
+	pthread_mutex_lock(&buffer->mutex);
+	while (item != NULL && buffer->window > 0 && index >= buffer->next_index + buffer->window) {
+		int waited_index = buffer->next_index;
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += REORDER_BUFFER_STALL_SECONDS;
+		if (pthread_cond_timedwait(&buffer->advanced, &buffer->mutex, &deadline) == ETIMEDOUT
+			&& buffer->next_index == waited_index) {
+			log_message(LOG_WARNING, "Reorder buffer index %d has been missing for %ds, holding %d anyway",
+				waited_index, REORDER_BUFFER_STALL_SECONDS, index);
+			break;
+		}
+	}
+	hmput(buffer->pending, index, item);
+	pthread_mutex_unlock(&buffer->mutex);
+}
+
+// Returns false until the next index in sequence arrives, item is NULL if that index was skipped
+bool pop_reorder_buffer(ReorderBuffer* buffer, void** item)
+{
+	pthread_mutex_lock(&buffer->mutex);
+
+	ptrdiff_t position = hmgeti(buffer->pending, buffer->next_index);
+	if (position < 0) {
+		pthread_mutex_unlock(&buffer->mutex);
+		return false;
+	}
+
+	*item = buffer->pending[position].value;
+	hmdel(buffer->pending, buffer->next_index);
+	buffer->next_index++;
+	pthread_cond_broadcast(&buffer->advanced);
+
+	pthread_mutex_unlock(&buffer->mutex);
+	return true;
+}
+
+size_t get_reorder_buffer_pending(ReorderBuffer* buffer)
+{
+	pthread_mutex_lock(&buffer->mutex);
+	size_t pending = (size_t) hmlen(buffer->pending);
+	pthread_mutex_unlock(&buffer->mutex);
+	return pending;
+}
+
+void free_reorder_buffer(ReorderBuffer* buffer, void (*free_item)(void*))
+{
+	pthread_mutex_lock(&buffer->mutex);
+	for (int i = 0; i < hmlen(buffer->pending); i++) {
+		if (free_item && buffer->pending[i].value) {
+			free_item(buffer->pending[i].value);
+		}
+	}
+	hmfree(buffer->pending);
+	pthread_mutex_unlock(&buffer->mutex);
+	pthread_mutex_destroy(&buffer->mutex);
+	pthread_cond_destroy(&buffer->advanced);
+}
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh_rotl64(uint64_t value, int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t xxh_read64(const uint8_t* data)
+{
+	uint64_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static inline uint32_t xxh_read32(const uint8_t* data)
+{
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static inline uint64_t xxh_round64(uint64_t accumulator, uint64_t input)
+{
+	accumulator += input * XXH_PRIME64_2;
+	accumulator = xxh_rotl64(accumulator, 31);
+	return accumulator * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh_merge_round64(uint64_t accumulator, uint64_t value)
+{
+	accumulator ^= xxh_round64(0, value);
+	return accumulator * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// Assumes a little endian host, as does the rest of the program
+uint64_t xxhash64(const void* data, size_t size, uint64_t seed)
+{
+	const uint8_t* position = (const uint8_t*) data;
+	const uint8_t* end = position + size;
+	uint64_t hash;
+
+	if (size >= 32) {
+		uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		uint64_t v2 = seed + XXH_PRIME64_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH_PRIME64_1;
+		const uint8_t* limit = end - 32;
+		do {
+			v1 = xxh_round64(v1, xxh_read64(position));
+			v2 = xxh_round64(v2, xxh_read64(position + 8));
+			v3 = xxh_round64(v3, xxh_read64(position + 16));
+			v4 = xxh_round64(v4, xxh_read64(position + 24));
+			position += 32;
+		} while (position <= limit);
+
+		hash = xxh_rotl64(v1, 1) + xxh_rotl64(v2, 7) + xxh_rotl64(v3, 12) + xxh_rotl64(v4, 18);
+		hash = xxh_merge_round64(hash, v1);
+		hash = xxh_merge_round64(hash, v2);
+		hash = xxh_merge_round64(hash, v3);
+		hash = xxh_merge_round64(hash, v4);
+	}
+	else {
+		hash = seed + XXH_PRIME64_5;
+	}
+	hash += (uint64_t) size;
+
+	while (position + 8 <= end) {
+		hash ^= xxh_round64(0, xxh_read64(position));
+		hash = xxh_rotl64(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+		position += 8;
+	}
+	if (position + 4 <= end) {
+		hash ^= (uint64_t) xxh_read32(position) * XXH_PRIME64_1;
+		hash = xxh_rotl64(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		position += 4;
+	}
+	while (position < end) {
+		hash ^= (uint64_t) *position * XXH_PRIME64_5;
+		hash = xxh_rotl64(hash, 11) * XXH_PRIME64_1;
+		position++;
+	}
+
+	hash ^= hash >> 33;
+	hash *= XXH_PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= XXH_PRIME64_3;
+	hash ^= hash >> 32;
+	return hash;
+}
@@ -24,6 +24,7 @@ typedef struct stack {
 	void* items;
 	size_t item_size;
 	long top;
+	long bottom; // Oldest item, taken by pop_stack_front
 	ssize_t max_size;
 	pthread_mutex_t mutex;
 	bool replenished;
@@ -31,6 +32,8 @@ typedef struct stack {
 void init_stack(Stack* stack, size_t item_size, ssize_t max_size);
 int push_stack(Stack* stack, void* item);
 bool pop_stack(Stack* stack, void* item);
+bool pop_stack_front(Stack* stack, void* item);
+long get_stack_size(Stack* stack);
 void free_stack(Stack* stack);
 
 #define DEFAULT_WORK_QUEUE_SIZE 64
@@ -46,4 +49,31 @@ typedef struct work_queue {
 void init_work_queue(WorkQueue* queue, size_t capacity);
 void push_work_queue(WorkQueue* queue, av_alist work);
 av_alist pop_work_queue(WorkQueue* queue);
-void free_work_queue(WorkQueue* work_queue);
\ No newline at end of file
+void free_work_queue(WorkQueue* work_queue);
+
+typedef struct reorder_entry {
+	int key; // Sequence index
+	void* value; // NULL for skipped indices
+} ReorderEntry;
+
+// Items at most this far ahead of the next index in sequence are held, later pushes wait for it to catch up
+#define DEFAULT_REORDER_WINDOW 32
+// A push that has waited this long without the sequence moving is let through anyway, the index it waits on
+// may belong to a job that's queued behind the producers that are waiting
+#define REORDER_BUFFER_STALL_SECONDS 5
+
+// Releases items strictly in sequence order, regardless of the order they were completed in
+typedef struct reorder_buffer {
+	ReorderEntry* pending; // stb hash map
+	int next_index;
+	int window; // 0 for no limit
+	pthread_mutex_t mutex;
+	pthread_cond_t advanced; // Signalled whenever next_index moves
+} ReorderBuffer;
+void init_reorder_buffer(ReorderBuffer* buffer, int first_index, int window);
+void push_reorder_buffer(ReorderBuffer* buffer, int index, void* item);
+bool pop_reorder_buffer(ReorderBuffer* buffer, void** item);
+size_t get_reorder_buffer_pending(ReorderBuffer* buffer);
+void free_reorder_buffer(ReorderBuffer* buffer, void (*free_item)(void*));
+// XXH64, fast non-cryptographic hash for detecting identical content
+uint64_t xxhash64(const void* data, size_t size, uint64_t seed);
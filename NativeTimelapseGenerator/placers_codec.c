@@ -0,0 +1,292 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "console.h"
+#include "save_pack.h"
+#include "placers_codec.h"
+#include "lib/stb/stb_ds.h"
+
+#define LOG_HEADER "[placers codec] "
+
+// Raw placers begin with a big endian id, which would have to be over a billion to match
+#define PLACERS_CODEC_MAGIC "RPPL"
+#define PLACERS_CODEC_VERSION 1
+#define PLACERS_CODEC_HEADER_SIZE 28
+
+// Header: magic, version, index bits, 2 reserved, then u32 LE pixel count, dictionary size, run count, bit packed
+// index bytes & run length bytes. Followed by the dictionary as u32 LE ids, the run indices, then each run's
+// length - 1 as a varint
+typedef struct placers_header {
+	uint8_t index_bits;
+	uint32_t length;
+	uint32_t dictionary_size;
+	uint32_t run_count;
+	const uint8_t* dictionary;
+	const uint8_t* indices;
+	size_t indices_size;
+	const uint8_t* lengths;
+	size_t lengths_size;
+} PlacersHeader;
+
+typedef struct placer_index_entry {
+	UserIntId key;
+	uint32_t value; // Dictionary index
+} PlacerIndexEntry;
+
+static inline uint32_t read_u32_le(const uint8_t* data)
+{
+	return (uint32_t) data[0] | (uint32_t) data[1] << 8 | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24;
+}
+
+static inline void write_u32_le(uint8_t* data, uint32_t value)
+{
+	for (int i = 0; i < 4; i++) {
+		data[i] = (uint8_t) (value >> (i * 8));
+	}
+}
+
+static bool read_placers_header(const PackedPlacers* placers, PlacersHeader* out_header)
+{
+	const uint8_t* data = placers->data;
+	if (data == NULL || placers->size < PLACERS_CODEC_HEADER_SIZE || memcmp(data, PLACERS_CODEC_MAGIC, 4) != 0
+		|| data[4] != PLACERS_CODEC_VERSION || data[5] > 32) {
+		return false;
+	}
+	PlacersHeader header = {
+		.index_bits = data[5],
+		.length = read_u32_le(data + 8),
+		.dictionary_size = read_u32_le(data + 12),
+		.run_count = read_u32_le(data + 16),
+		.indices_size = read_u32_le(data + 20),
+		.lengths_size = read_u32_le(data + 24)
+	};
+	size_t dictionary_bytes = (size_t) header.dictionary_size * 4;
+	if (placers->size != PLACERS_CODEC_HEADER_SIZE + dictionary_bytes + header.indices_size + header.lengths_size
+		|| header.indices_size != ((size_t) header.run_count * header.index_bits + 7) / 8) {
+		return false;
+	}
+	header.dictionary = data + PLACERS_CODEC_HEADER_SIZE;
+	header.indices = header.dictionary + dictionary_bytes;
+	header.lengths = header.indices + header.indices_size;
+	*out_header = header;
+	return true;
+}
+
+bool pack_placers(const uint8_t* data, size_t size, PackedPlacers* out_placers, PlacerCounts* out_counts)
+{
+	size_t length = size / sizeof(UserIntId);
+	if (data == NULL || length > UINT32_MAX) {
+		return false;
+	}
+
+	// Ids are only looked up once per run, rather than once per pixel
+	PlacerIndexEntry* index_map = NULL;
+	UserIntId* int_ids = NULL;
+	uint32_t* counts = NULL;
+	uint32_t* run_indices = NULL;
+	uint32_t* run_lengths = NULL;
+	size_t position = 0;
+	while (position < length) {
+		uint32_t raw;
+		memcpy(&raw, data + position * 4, 4);
+		size_t end = position + 1;
+		while (end < length && memcmp(data + end * 4, &raw, 4) == 0) {
+			end++;
+		}
+
+		const uint8_t* bytes = data + position * 4;
+		UserIntId int_id = (UserIntId) bytes[0] << 24 | (UserIntId) bytes[1] << 16 | (UserIntId) bytes[2] << 8 | bytes[3];
+		ptrdiff_t entry = hmgeti(index_map, int_id);
+		uint32_t index = entry >= 0 ? index_map[entry].value : (uint32_t) arrlen(int_ids);
+		if (entry < 0) {
+			hmput(index_map, int_id, index);
+			arrput(int_ids, int_id);
+			arrput(counts, 0);
+		}
+		counts[index] += (uint32_t) (end - position);
+		arrput(run_indices, index);
+		arrput(run_lengths, (uint32_t) (end - position));
+		position = end;
+	}
+	hmfree(index_map);
+
+	uint32_t dictionary_size = (uint32_t) arrlen(int_ids);
+	uint32_t run_count = (uint32_t) arrlen(run_indices);
+	uint8_t index_bits = 0;
+	while (((uint64_t) 1 << index_bits) < dictionary_size) {
+		index_bits++;
+	}
+	size_t indices_size = ((size_t) run_count * index_bits + 7) / 8;
+	// Sized for the longest varints, then trimmed once the lengths are known
+	size_t capacity = PLACERS_CODEC_HEADER_SIZE + (size_t) dictionary_size * 4 + indices_size + (size_t) run_count * 5;
+	uint8_t* packed = calloc(capacity, 1);
+	if (packed == NULL) {
+		arrfree(int_ids);
+		arrfree(counts);
+		arrfree(run_indices);
+		arrfree(run_lengths);
+		return false;
+	}
+
+	uint8_t* dictionary = packed + PLACERS_CODEC_HEADER_SIZE;
+	for (uint32_t i = 0; i < dictionary_size; i++) {
+		write_u32_le(dictionary + (size_t) i * 4, int_ids[i]);
+	}
+	uint8_t* indices = dictionary + (size_t) dictionary_size * 4;
+	uint64_t bit_buffer = 0;
+	int bit_count = 0;
+	size_t indices_position = 0;
+	for (uint32_t i = 0; i < run_count; i++) {
+		bit_buffer |= (uint64_t) run_indices[i] << bit_count;
+		bit_count += index_bits;
+		while (bit_count >= 8) {
+			indices[indices_position++] = (uint8_t) bit_buffer;
+			bit_buffer >>= 8;
+			bit_count -= 8;
+		}
+	}
+	if (bit_count > 0) {
+		indices[indices_position++] = (uint8_t) bit_buffer;
+	}
+	uint8_t* lengths = indices + indices_size;
+	size_t lengths_size = 0;
+	for (uint32_t i = 0; i < run_count; i++) {
+		uint32_t value = run_lengths[i] - 1;
+		while (value >= 0x80) {
+			lengths[lengths_size++] = (uint8_t) (value | 0x80);
+			value >>= 7;
+		}
+		lengths[lengths_size++] = (uint8_t) value;
+	}
+
+	memcpy(packed, PLACERS_CODEC_MAGIC, 4);
+	packed[4] = PLACERS_CODEC_VERSION;
+	packed[5] = index_bits;
+	write_u32_le(packed + 8, (uint32_t) length);
+	write_u32_le(packed + 12, dictionary_size);
+	write_u32_le(packed + 16, run_count);
+	write_u32_le(packed + 20, (uint32_t) indices_size);
+	write_u32_le(packed + 24, (uint32_t) lengths_size);
+	size_t packed_size = PLACERS_CODEC_HEADER_SIZE + (size_t) dictionary_size * 4 + indices_size + lengths_size;
+	uint8_t* trimmed = realloc(packed, packed_size);
+	*out_placers = (PackedPlacers) { .data = trimmed != NULL ? trimmed : packed, .size = packed_size };
+
+	if (out_counts != NULL) {
+		*out_counts = (PlacerCounts) { .int_ids = malloc((size_t) dictionary_size * sizeof(UserIntId) + 1),
+			.counts = malloc((size_t) dictionary_size * sizeof(uint32_t) + 1), .size = dictionary_size };
+		if (out_counts->int_ids != NULL && out_counts->counts != NULL) {
+			memcpy(out_counts->int_ids, int_ids, (size_t) dictionary_size * sizeof(UserIntId));
+			memcpy(out_counts->counts, counts, (size_t) dictionary_size * sizeof(uint32_t));
+		}
+		else {
+			free_placer_counts(out_counts);
+		}
+	}
+	arrfree(int_ids);
+	arrfree(counts);
+	arrfree(run_indices);
+	arrfree(run_lengths);
+	return true;
+}
+
+void free_placer_counts(PlacerCounts* counts)
+{
+	free(counts->int_ids);
+	free(counts->counts);
+	*counts = (PlacerCounts) { 0 };
+}
+
+size_t get_packed_placers_length(const PackedPlacers* placers)
+{
+	PlacersHeader header;
+	return read_placers_header(placers, &header) ? header.length : 0;
+}
+
+bool unpack_placers(const PackedPlacers* placers, UserIntId* out, size_t out_length)
+{
+	PlacersHeader header;
+	if (!read_placers_header(placers, &header) || out_length < header.length) {
+		return false;
+	}
+	UserIntId* dictionary = malloc((size_t) header.dictionary_size * sizeof(UserIntId) + 1);
+	if (dictionary == NULL) {
+		return false;
+	}
+	for (uint32_t i = 0; i < header.dictionary_size; i++) {
+		dictionary[i] = read_u32_le(header.dictionary + (size_t) i * 4);
+	}
+
+	uint64_t bit_buffer = 0;
+	int bit_count = 0;
+	size_t indices_position = 0;
+	size_t lengths_position = 0;
+	size_t written = 0;
+	uint32_t index_mask = header.index_bits == 32 ? UINT32_MAX : ((uint32_t) 1 << header.index_bits) - 1;
+	bool valid = true;
+	for (uint32_t run = 0; run < header.run_count && valid; run++) {
+		while (bit_count < header.index_bits) {
+			bit_buffer |= (uint64_t) header.indices[indices_position++] << bit_count;
+			bit_count += 8;
+		}
+		uint32_t index = (uint32_t) bit_buffer & index_mask;
+		bit_buffer >>= header.index_bits;
+		bit_count -= header.index_bits;
+
+		uint64_t run_length = 0;
+		int shift = 0;
+		uint8_t byte = 0x80;
+		while ((byte & 0x80) && lengths_position < header.lengths_size && shift < 35) {
+			byte = header.lengths[lengths_position++];
+			run_length |= (uint64_t) (byte & 0x7F) << shift;
+			shift += 7;
+		}
+		run_length++;
+		valid = (byte & 0x80) == 0 && index < header.dictionary_size && run_length <= header.length - written;
+		if (valid) {
+			UserIntId int_id = dictionary[index];
+			for (uint64_t i = 0; i < run_length; i++) {
+				out[written + i] = int_id;
+			}
+			written += run_length;
+		}
+	}
+	free(dictionary);
+	return valid && written == header.length;
+}
+
+UserIntId* decode_placers_download(const char* save_path, size_t* out_length)
+{
+	size_t size = 0;
+	uint8_t* data = read_save(save_path, &size);
+	if (data == NULL) {
+		return NULL;
+	}
+
+	PackedPlacers placers = { .data = data, .size = size };
+	size_t length = get_packed_placers_length(&placers);
+	UserIntId* int_ids = NULL;
+	if (length > 0) {
+		int_ids = malloc(length * sizeof(UserIntId));
+		if (int_ids != NULL && !unpack_placers(&placers, int_ids, length)) {
+			free(int_ids);
+			int_ids = NULL;
+		}
+	}
+	else {
+		// Raw downloads are big endian ids
+		length = size / sizeof(UserIntId);
+		int_ids = malloc(length * sizeof(UserIntId) + 1);
+		for (size_t i = 0; int_ids != NULL && i < length; i++) {
+			const uint8_t* bytes = data + i * 4;
+			int_ids[i] = (UserIntId) bytes[0] << 24 | (UserIntId) bytes[1] << 16 | (UserIntId) bytes[2] << 8 | bytes[3];
+		}
+	}
+	free(data);
+
+	if (int_ids == NULL) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to decode placers download %s", save_path);
+		return NULL;
+	}
+	*out_length = length;
+	return int_ids;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "workers/worker_structs.h"
+
+// Boards have a few thousand distinct placers at most, laid out in long runs, so placers are packed once
+// after download into a dictionary of ids & bit packed runs. The packed form is both saved & held in memory
+// until render, instead of 4 bytes per pixel
+
+// Pixels placed by each distinct placer of a board, in dictionary order
+typedef struct placer_counts {
+	UserIntId* int_ids;
+	uint32_t* counts;
+	size_t size;
+} PlacerCounts;
+
+// Packs big endian placer ids, as downloaded. Counts can be null, otherwise both of its arrays are malloc allocated
+bool pack_placers(const uint8_t* data, size_t size, PackedPlacers* out_placers, PlacerCounts* out_counts);
+void free_placer_counts(PlacerCounts* counts);
+// Pixels covered by packed placers, 0 if they aren't packed placers at all
+size_t get_packed_placers_length(const PackedPlacers* placers);
+// Out must have room for get_packed_placers_length ids
+bool unpack_placers(const PackedPlacers* placers, UserIntId* out, size_t out_length);
+
+// Decodes a saved placers download, packed or raw. Returns a malloc allocated array of ids, or null
+UserIntId* decode_placers_download(const char* save_path, size_t* out_length);
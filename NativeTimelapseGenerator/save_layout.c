@@ -0,0 +1,225 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "console.h"
+#include "memory_utils.h"
+#include "database.h"
+#include "save_pack.h"
+#include "canvas_codec.h"
+#include "save_layout.h"
+
+#include "lib/stb/stb_ds.h"
+
+#define LOG_HEADER "[save layout] "
+
+typedef struct created_directory {
+	char* key;
+	bool value;
+} CreatedDirectory;
+
+typedef struct moved_save {
+	char* key; // Previous save path
+	char* value; // Save path in the current layout
+} MovedSave;
+
+// SAVE LAYOUT
+static SaveLayout save_layout = SAVE_LAYOUT_FLAT;
+// Every directory already created, so each save only costs a lookup rather than a mkdir per directory
+static pthread_mutex_t created_directories_mutex = PTHREAD_MUTEX_INITIALIZER;
+static CreatedDirectory* created_directories = NULL; // stb string hashmap
+
+void set_save_layout(SaveLayout layout)
+{
+	save_layout = layout;
+}
+
+SaveLayout get_save_layout()
+{
+	return save_layout;
+}
+
+void get_save_shard(time_t date, const char* commit_hash, char* out_shard, size_t shard_size)
+{
+	out_shard[0] = '\0';
+	switch (save_layout) {
+		case SAVE_LAYOUT_DATE: {
+			struct tm timeinfo;
+			if (gmtime_r(&date, &timeinfo) != NULL) {
+				snprintf(out_shard, shard_size, "%04d/%02d/", timeinfo.tm_year + 1900, timeinfo.tm_mon + 1);
+			}
+			break;
+		}
+		case SAVE_LAYOUT_HASH: {
+			if (commit_hash != NULL && strlen(commit_hash) >= 2) {
+				snprintf(out_shard, shard_size, "%.2s/", commit_hash);
+			}
+			break;
+		}
+		case SAVE_LAYOUT_FLAT: {
+			break;
+		}
+	}
+}
+
+bool make_save_shard(const char* save_path)
+{
+	AUTOFREE char* directory = strdup(save_path);
+	char* separator = strrchr(directory, '/');
+	if (separator == NULL) {
+		return true;
+	}
+	*separator = '\0';
+
+	pthread_mutex_lock(&created_directories_mutex);
+	if (created_directories == NULL) {
+		sh_new_strdup(created_directories);
+	}
+	bool created = shgeti(created_directories, directory) >= 0;
+	if (!created) {
+		// Each parent in turn, then the directory itself
+		created = true;
+		for (char* next = strchr(directory, '/'); created; next = strchr(next + 1, '/')) {
+			if (next != NULL) {
+				*next = '\0';
+			}
+			created = mkdir(directory, 0777) == 0 || errno == EEXIST;
+			if (next == NULL) {
+				break;
+			}
+			*next = '/';
+		}
+		if (created) {
+			shput(created_directories, directory, true);
+		}
+		else {
+			log_message(LOG_ERROR, LOG_HEADER"Failed to create save directory %s: %s", directory, strerror(errno));
+		}
+	}
+	pthread_mutex_unlock(&created_directories_mutex);
+	return created;
+}
+
+// Where save_path belongs in the current layout, keeping its save type's directory & file name
+static char* get_migrated_path(const LooseSave* save)
+{
+	const char* type_end = strchr(save->save_path, '/');
+	const char* name = strrchr(save->save_path, '/');
+	if (type_end == NULL) {
+		return NULL;
+	}
+	char shard[32];
+	get_save_shard(save->date, save->commit_hash, shard, sizeof(shard));
+	char* migrated_path = NULL;
+	asprintf(&migrated_path, "%.*s/%s%s", (int) (type_end - save->save_path), save->save_path, shard, name + 1);
+	return migrated_path;
+}
+
+// Shard directories left empty by a move are removed, up to the save type's directory
+static void remove_empty_shards(const char* save_path)
+{
+	AUTOFREE char* directory = strdup(save_path);
+	char* separator = strrchr(directory, '/');
+	while (separator != NULL && strchr(directory, '/') != separator) {
+		*separator = '\0';
+		if (rmdir(directory) == -1) {
+			break;
+		}
+		pthread_mutex_lock(&created_directories_mutex);
+		shdel(created_directories, directory);
+		pthread_mutex_unlock(&created_directories_mutex);
+		separator = strrchr(directory, '/');
+	}
+}
+
+// Deltas refer to the canvas they're based on by its save path, which may have just moved
+static bool rebase_moved_canvas(const char* save_path, MovedSave* moved)
+{
+	size_t size = 0;
+	AUTOFREE uint8_t* data = read_save(save_path, &size);
+	if (data == NULL) {
+		return false;
+	}
+	AUTOFREE char* base_path = get_canvas_download_base(data, size);
+	ptrdiff_t base = base_path == NULL ? -1 : shgeti(moved, base_path);
+	if (base < 0) {
+		return true;
+	}
+
+	size_t rebased_size = 0;
+	AUTOFREE uint8_t* rebased = rebase_canvas_download(data, size, moved[base].value, &rebased_size);
+	AUTOFREE char* temporary_path = NULL;
+	asprintf(&temporary_path, "%s.tmp", save_path);
+	FILE* file = rebased == NULL ? NULL : fopen(temporary_path, "wb");
+	bool written = file != NULL && fwrite(rebased, 1, rebased_size, file) == rebased_size;
+	if (file != NULL && fclose(file) != 0) {
+		written = false;
+	}
+	// Replaced in a single step, so the delta is never left half written
+	if (!written || rename(temporary_path, save_path) == -1) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to rebase canvas download %s onto %s", save_path, moved[base].value);
+		remove(temporary_path);
+		return false;
+	}
+	return true;
+}
+
+bool migrate_save_layout()
+{
+	LooseSave* saves = get_loose_saves();
+	MovedSave* moved = NULL; // stb string hashmap
+	sh_new_strdup(moved);
+	int migrated = 0;
+	int failed = 0;
+	for (int i = 0; i < arrlen(saves); i++) {
+		char* migrated_path = get_migrated_path(&saves[i]);
+		if (migrated_path == NULL || strcmp(migrated_path, saves[i].save_path) == 0) {
+			free(migrated_path);
+			continue;
+		}
+		if (!make_save_shard(migrated_path) || rename(saves[i].save_path, migrated_path) == -1) {
+			log_message(LOG_ERROR, LOG_HEADER"Failed to move %s to %s: %s", saves[i].save_path, migrated_path, strerror(errno));
+			free(migrated_path);
+			failed++;
+			continue;
+		}
+		if (!move_save_in_db(saves[i].save_path, migrated_path)) {
+			// Put back, so that the database still points at it
+			rename(migrated_path, saves[i].save_path);
+			free(migrated_path);
+			failed++;
+			continue;
+		}
+		remove_empty_shards(saves[i].save_path);
+		if (saves[i].type == SAVE_CANVAS_DOWNLOAD) {
+			shput(moved, saves[i].save_path, strdup(migrated_path));
+		}
+		free(saves[i].save_path);
+		saves[i].save_path = migrated_path;
+		migrated++;
+	}
+
+	// Every canvas download is checked, as a delta that stayed put may still be based on one that moved
+	for (int i = 0; i < arrlen(saves) && shlen(moved) > 0; i++) {
+		if (saves[i].type == SAVE_CANVAS_DOWNLOAD && !rebase_moved_canvas(saves[i].save_path, moved)) {
+			failed++;
+		}
+	}
+
+	for (int i = 0; i < shlen(moved); i++) {
+		free(moved[i].value);
+	}
+	shfree(moved);
+	for (int i = 0; i < arrlen(saves); i++) {
+		free(saves[i].save_path);
+		free(saves[i].commit_hash);
+	}
+	arrfree(saves);
+
+	log_message(LOG_INFO, LOG_HEADER"Migrated %d saves into the current layout (%d failed)", migrated, failed);
+	return failed == 0;
+}
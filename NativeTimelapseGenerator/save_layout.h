@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+
+// Spreads the saves of each type across shard directories within its directory, rather than a single flat directory
+// of hundreds of thousands of entries. Saves records each save's shard as part of its save_path
+
+typedef enum save_layout:uint8_t {
+	SAVE_LAYOUT_FLAT = 0, // canvas_renders/<save>
+	SAVE_LAYOUT_DATE = 1, // canvas_renders/<year>/<month>/<save>, by commit date
+	SAVE_LAYOUT_HASH = 2 // canvas_renders/<first 2 characters of commit hash>/<save>
+} SaveLayout;
+
+// STRICT: Call on main thread only, before any save worker has started
+void set_save_layout(SaveLayout layout);
+SaveLayout get_save_layout();
+// Shard of a commit's saves within each save type's directory, i.e "2024/05/". Empty when flat
+void get_save_shard(time_t date, const char* commit_hash, char* out_shard, size_t shard_size);
+// Creates every directory above save_path that hasn't been created yet. Safe to call from any thread
+bool make_save_shard(const char* save_path);
+// STRICT: Call on main thread only, before generation. Moves every save that isn't packed into the current layout
+bool migrate_save_layout();
@@ -0,0 +1,323 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "console.h"
+#include "memory_utils.h"
+#include "database.h"
+#include "save_pack.h"
+#include "save_layout.h"
+#include "lib/stb/stb_ds.h"
+
+#define LOG_HEADER "[save pack] "
+
+#define SAVE_PACK_DIRECTORY "packs"
+// Packs are rolled over once full, keeping each one a manageable size to copy & back up
+#define MAX_SAVE_PACK_SIZE (1024LL * 1024 * 1024)
+#define SAVE_PACK_TYPE_COUNT 10
+
+typedef struct save_pack {
+	pthread_mutex_t mutex;
+	int fd;
+	int index;
+	char* path;
+	// Where the next save goes, reserved under the mutex then written without it
+	int64_t size;
+	// Descriptors of packs rolled over from, appends reserved before a rollover may still be writing through them
+	int* retired_fds; // stb array, closed by stop_save_packs
+} SavePack;
+
+// SAVE PACKS
+static bool save_packs_running = false;
+static bool save_packs_sync = false;
+static SavePack save_packs[SAVE_PACK_TYPE_COUNT];
+// Named after the directory the save type would otherwise be written to
+static const char* save_pack_names[SAVE_PACK_TYPE_COUNT] = {
+	[SAVE_CANVAS_DOWNLOAD] = "canvas_downloads",
+	[SAVE_CANVAS_RENDER] = "canvas_renders",
+	[SAVE_DATE_RENDER] = "date_renders",
+	[SAVE_PLACERS_DOWNLOAD] = "placer_downloads",
+	[SAVE_TOP_PLACERS_RENDER] = "top_placer_renders",
+	[SAVE_CANVAS_CONTROL_RENDER] = "canvas_control_renders",
+	[SAVE_COMPOSITE_RENDER] = "composite_renders",
+	[SAVE_HEATMAP_RENDER] = "heatmap_renders",
+	[SAVE_AGE_RENDER] = "age_renders"
+};
+
+bool is_save_type_packable(SaveJobType type)
+{
+	return type < SAVE_PACK_TYPE_COUNT && save_pack_names[type] != NULL;
+}
+
+// Must be called with the pack's mutex held
+static bool open_save_pack(SavePack* pack, SaveJobType type, int index)
+{
+	if (pack->fd != -1) {
+		arrput(pack->retired_fds, pack->fd);
+		pack->fd = -1;
+	}
+	free(pack->path);
+	asprintf(&pack->path, SAVE_PACK_DIRECTORY"/%s_%d.pack", save_pack_names[type], index);
+
+	// Not O_APPEND, as pwrite on an append only descriptor ignores its offset
+	pack->fd = open(pack->path, O_WRONLY | O_CREAT, 0666);
+	if (pack->fd == -1) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to open pack %s: %s", pack->path, strerror(errno));
+		return false;
+	}
+	struct stat pack_stat;
+	if (fstat(pack->fd, &pack_stat) == -1) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to read size of pack %s: %s", pack->path, strerror(errno));
+		return false;
+	}
+	pack->index = index;
+	pack->size = pack_stat.st_size;
+	return true;
+}
+
+// Continues the latest pack of an earlier run, rather than starting another beside it
+static int find_latest_save_pack(SaveJobType type)
+{
+	int index = 0;
+	while (true) {
+		AUTOFREE char* path = NULL;
+		asprintf(&path, SAVE_PACK_DIRECTORY"/%s_%d.pack", save_pack_names[type], index + 1);
+		if (access(path, F_OK) != 0) {
+			return index;
+		}
+		index++;
+	}
+}
+
+bool start_save_packs(bool sync_appends)
+{
+	if (mkdir(SAVE_PACK_DIRECTORY, 0777) == -1 && errno != EEXIST) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to create %s directory: %s", SAVE_PACK_DIRECTORY, strerror(errno));
+		return false;
+	}
+
+	for (int type = 0; type < SAVE_PACK_TYPE_COUNT; type++) {
+		save_packs[type] = (SavePack) { .fd = -1, .index = 0, .path = NULL, .size = 0, .retired_fds = NULL };
+		pthread_mutex_init(&save_packs[type].mutex, NULL);
+		if (is_save_type_packable(type) && !open_save_pack(&save_packs[type], type, find_latest_save_pack(type))) {
+			return false;
+		}
+	}
+	save_packs_sync = sync_appends;
+	save_packs_running = true;
+	log_message(LOG_INFO, LOG_HEADER"Appending saves to packs in %s", SAVE_PACK_DIRECTORY);
+	return true;
+}
+
+bool is_save_packs_running()
+{
+	return save_packs_running;
+}
+
+bool append_save_pack(SaveJobType type, const uint8_t* data, size_t size, char** out_pack_path, int64_t* out_offset,
+	char** error_msg)
+{
+	if (!is_save_type_packable(type)) {
+		asprintf(error_msg, "Save type %d can't be packed", type);
+		return false;
+	}
+
+	// Only the reservation is serialised, each save's bytes are written in parallel
+	SavePack* pack = &save_packs[type];
+	pthread_mutex_lock(&pack->mutex);
+	if (pack->size > 0 && pack->size + (int64_t) size > MAX_SAVE_PACK_SIZE
+		&& !open_save_pack(pack, type, pack->index + 1)) {
+		pthread_mutex_unlock(&pack->mutex);
+		asprintf(error_msg, "Couldn't roll over to a new %s pack", save_pack_names[type]);
+		return false;
+	}
+	int fd = pack->fd;
+	int64_t offset = pack->size;
+	pack->size += (int64_t) size;
+	*out_pack_path = strdup(pack->path);
+	pthread_mutex_unlock(&pack->mutex);
+
+	size_t written = 0;
+	while (written < size) {
+		ssize_t result = pwrite(fd, data + written, size - written, (off_t) (offset + (int64_t) written));
+		if (result == -1 && errno == EINTR) {
+			continue;
+		}
+		if (result <= 0) {
+			asprintf(error_msg, "Couldn't write the complete save to pack %s: %s", *out_pack_path, strerror(errno));
+			free(*out_pack_path);
+			*out_pack_path = NULL;
+			return false;
+		}
+		written += (size_t) result;
+	}
+	if (save_packs_sync && fdatasync(fd) == -1) {
+		asprintf(error_msg, "Couldn't sync save to pack %s: %s", *out_pack_path, strerror(errno));
+		free(*out_pack_path);
+		*out_pack_path = NULL;
+		return false;
+	}
+	*out_offset = offset;
+	return true;
+}
+
+void stop_save_packs()
+{
+	if (!save_packs_running) {
+		return;
+	}
+
+	for (int type = 0; type < SAVE_PACK_TYPE_COUNT; type++) {
+		SavePack* pack = &save_packs[type];
+		if (pack->fd != -1) {
+			// Saves are already indexed, so their bytes must outlive a crash as well
+			fsync(pack->fd);
+			close(pack->fd);
+		}
+		for (int i = 0; i < arrlen(pack->retired_fds); i++) {
+			fsync(pack->retired_fds[i]);
+			close(pack->retired_fds[i]);
+		}
+		arrfree(pack->retired_fds);
+		free(pack->path);
+		pthread_mutex_destroy(&pack->mutex);
+		*pack = (SavePack) { .fd = -1 };
+	}
+	save_packs_running = false;
+}
+
+bool map_save_pack(const char* pack_path, int64_t offset, int64_t length, MappedSave* out_save)
+{
+	*out_save = (MappedSave) { 0 };
+	int fd = open(pack_path, O_RDONLY);
+	if (fd == -1) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to open pack %s: %s", pack_path, strerror(errno));
+		return false;
+	}
+
+	// Touching a mapped page past the end of the file raises SIGBUS, so a pack cut short by a crash fails here instead
+	struct stat pack_stat;
+	if (fstat(fd, &pack_stat) == -1 || offset < 0 || length < 0 || offset + length > pack_stat.st_size) {
+		log_message(LOG_ERROR, LOG_HEADER"Pack %s is too short to hold %lld bytes at %lld", pack_path, (long long) length, (long long) offset);
+		close(fd);
+		return false;
+	}
+
+	// Mappings must start on a page boundary, so the save sits somewhere after the start of its mapping
+	long page_size = sysconf(_SC_PAGESIZE);
+	int64_t mapping_offset = offset - offset % page_size;
+	size_t mapping_size = (size_t) (offset - mapping_offset + length);
+	void* mapping = length > 0 ? mmap(NULL, mapping_size, PROT_READ, MAP_PRIVATE, fd, (off_t) mapping_offset) : NULL;
+	// The mapping holds its own reference to the file, so it stays valid however the descriptor's number is reused
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to map %lld bytes of pack %s: %s", (long long) length, pack_path, strerror(errno));
+		return false;
+	}
+
+	*out_save = (MappedSave) {
+		.data = (const uint8_t*) mapping + (offset - mapping_offset),
+		.size = (size_t) length,
+		.mapping = mapping,
+		.mapping_size = mapping_size
+	};
+	return true;
+}
+
+void unmap_save_pack(MappedSave* save)
+{
+	if (save->mapping != NULL) {
+		munmap(save->mapping, save->mapping_size);
+	}
+	*save = (MappedSave) { 0 };
+}
+
+uint8_t* read_save(const char* save_path, size_t* out_size)
+{
+	PackedSave packed;
+	if (find_packed_save(save_path, &packed)) {
+		MappedSave mapped;
+		uint8_t* data = NULL;
+		if (map_save_pack(packed.pack_path, packed.pack_offset, packed.pack_length, &mapped)) {
+			data = malloc(mapped.size > 0 ? mapped.size : 1);
+			if (data != NULL) {
+				memcpy(data, mapped.data, mapped.size);
+				*out_size = mapped.size;
+			}
+			unmap_save_pack(&mapped);
+		}
+		free(packed.save_path);
+		free(packed.pack_path);
+		return data;
+	}
+
+	FILE* file = fopen(save_path, "rb");
+	if (file == NULL) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to open save %s: %s", save_path, strerror(errno));
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	uint8_t* data = size >= 0 ? malloc((size_t) size > 0 ? (size_t) size : 1) : NULL;
+	if (data == NULL || fread(data, 1, (size_t) size, file) != (size_t) size) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to read save %s", save_path);
+		free(data);
+		fclose(file);
+		return NULL;
+	}
+	fclose(file);
+	*out_size = (size_t) size;
+	return data;
+}
+
+static bool write_unpacked_save(const PackedSave* save)
+{
+	MappedSave mapped;
+	if (!map_save_pack(save->pack_path, save->pack_offset, save->pack_length, &mapped)) {
+		return false;
+	}
+	madvise(mapped.mapping, mapped.mapping_size, MADV_SEQUENTIAL);
+
+	// Save directories are created by generation, which may never have run with packs in use
+	FILE* file = make_save_shard(save->save_path) ? fopen(save->save_path, "wb") : NULL;
+	bool written = file != NULL && fwrite(mapped.data, 1, mapped.size, file) == mapped.size;
+	if (file != NULL && fclose(file) != 0) {
+		written = false;
+	}
+	unmap_save_pack(&mapped);
+	if (!written) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to unpack %s: %s", save->save_path, strerror(errno));
+	}
+	return written;
+}
+
+bool unpack_save_packs()
+{
+	PackedSave* saves = get_packed_saves();
+	int unpacked = 0;
+	int failed = 0;
+	// Ordered by pack & offset, so each pack is read through from start to end
+	for (int i = 0; i < arrlen(saves); i++) {
+		if (write_unpacked_save(&saves[i]) && unpack_save_in_db(saves[i].pack_path, saves[i].pack_offset)) {
+			unpacked++;
+		}
+		else {
+			failed++;
+		}
+	}
+	for (int i = 0; i < arrlen(saves); i++) {
+		free(saves[i].save_path);
+		free(saves[i].pack_path);
+	}
+	arrfree(saves);
+
+	log_message(LOG_INFO, LOG_HEADER"Unpacked %d saves (%d failed), packs can be removed once nothing failed", unpacked, failed);
+	return failed == 0;
+}
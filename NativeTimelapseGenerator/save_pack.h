@@ -0,0 +1,35 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "workers/worker_structs.h"
+
+// Appends saves of each type to large pack files instead of a file per save. Saves indexes each save
+// by its pack, offset & length, and save_path still records where it would be as a file of its own
+
+// A save mapped out of its pack, data is only valid until it's unmapped
+typedef struct mapped_save {
+	const uint8_t* data;
+	size_t size;
+	void* mapping;
+	size_t mapping_size;
+} MappedSave;
+
+// STRICT: Call on main thread only. sync_appends syncs each save to disk before its append returns
+bool start_save_packs(bool sync_appends);
+bool is_save_packs_running();
+// False for types that are never packed
+bool is_save_type_packable(SaveJobType type);
+// Safe to call from any number of save workers at once. out_pack_path is malloc allocated
+bool append_save_pack(SaveJobType type, const uint8_t* data, size_t size, char** out_pack_path, int64_t* out_offset,
+	char** error_msg);
+// STRICT: Call on main thread only, once every save worker has stopped
+void stop_save_packs();
+
+bool map_save_pack(const char* pack_path, int64_t offset, int64_t length, MappedSave* out_save);
+void unmap_save_pack(MappedSave* save);
+// Reads a save from its own file, or from its pack. Returns malloc allocated data, or null
+uint8_t* read_save(const char* save_path, size_t* out_size);
+// Writes every packed save out to its save_path, as if packs were never used
+bool unpack_save_packs();
@@ -0,0 +1,316 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "console.h"
+#include "save_writer.h"
+#include "lib/stb/stb_ds.h"
+
+#define LOG_HEADER "[save writer] "
+
+// Writes are held back once this many are queued or in flight, so payloads can't pile up in memory
+#define MAX_SAVE_WRITES 256
+#define SAVE_WRITER_THREAD_COUNT 4
+
+typedef struct save_write {
+	SaveJob job;
+	char* save_path;
+	bool owns_data;
+	int fd;
+	size_t written;
+} SaveWrite;
+
+// SAVE WRITER
+static pthread_mutex_t save_writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Signalled whenever writes are queued, completed or the writer is stopping
+static pthread_cond_t save_writer_cond = PTHREAD_COND_INITIALIZER;
+static SaveWrite** queued_writes = NULL; // stb array
+static int writes_in_flight = 0; // Queued or submitted, but not yet completed
+static bool save_writer_running = false;
+static bool save_writer_stopping = false;
+static bool save_writer_sync = false;
+static SaveWrittenCallback save_written_callback = NULL;
+static pthread_t* save_writer_threads = NULL; // stb array
+static int saves_written = 0;
+static int saves_failed = 0;
+#ifdef HAVE_LIBURING
+#define SAVE_WRITER_QUEUE_DEPTH MAX_SAVE_WRITES
+static struct io_uring save_ring;
+static bool save_ring_ready = false;
+#endif
+
+static void finish_save_write(SaveWrite* write, int error)
+{
+	if (error == 0 && save_writer_sync && fdatasync(write->fd) == -1) {
+		error = errno;
+	}
+	close(write->fd);
+	if (error != 0) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to write save %s: %s", write->save_path, strerror(error));
+		free(write->save_path);
+	}
+	else {
+		// Only recorded now, so a save in the database is always one that is completely on disk
+		save_written_callback(write->job, write->save_path);
+	}
+	if (write->owns_data) {
+		free(write->job.data);
+	}
+	free(write);
+
+	pthread_mutex_lock(&save_writer_mutex);
+	if (error != 0) {
+		saves_failed++;
+	}
+	else {
+		saves_written++;
+	}
+	writes_in_flight--;
+	pthread_cond_broadcast(&save_writer_cond);
+	pthread_mutex_unlock(&save_writer_mutex);
+}
+
+// Takes every queued write, waiting for at least one unless writes are already in flight. Null once stopped
+static SaveWrite** take_queued_writes(bool wait)
+{
+	pthread_mutex_lock(&save_writer_mutex);
+	while (wait && arrlen(queued_writes) == 0 && !(save_writer_stopping && writes_in_flight == 0)) {
+		pthread_cond_wait(&save_writer_cond, &save_writer_mutex);
+	}
+	SaveWrite** writes = queued_writes;
+	queued_writes = NULL;
+	pthread_mutex_unlock(&save_writer_mutex);
+	return writes;
+}
+
+static bool is_save_writer_drained()
+{
+	pthread_mutex_lock(&save_writer_mutex);
+	bool drained = save_writer_stopping && writes_in_flight == 0;
+	pthread_mutex_unlock(&save_writer_mutex);
+	return drained;
+}
+
+// Fallback for when io_uring isn't available, each thread writes one save at a time
+static void* start_save_writer_thread(void* data)
+{
+	while (true) {
+		pthread_mutex_lock(&save_writer_mutex);
+		while (arrlen(queued_writes) == 0 && !save_writer_stopping) {
+			pthread_cond_wait(&save_writer_cond, &save_writer_mutex);
+		}
+		if (arrlen(queued_writes) == 0) {
+			pthread_mutex_unlock(&save_writer_mutex);
+			break;
+		}
+		SaveWrite* write = queued_writes[0];
+		arrdel(queued_writes, 0);
+		pthread_mutex_unlock(&save_writer_mutex);
+
+		int error = 0;
+		while (write->written < write->job.size) {
+			ssize_t result = pwrite(write->fd, write->job.data + write->written, write->job.size - write->written,
+				(off_t) write->written);
+			if (result == -1 && errno == EINTR) {
+				continue;
+			}
+			if (result <= 0) {
+				error = result == 0 ? EIO : errno;
+				break;
+			}
+			write->written += (size_t) result;
+		}
+		finish_save_write(write, error);
+	}
+	return NULL;
+}
+
+#ifdef HAVE_LIBURING
+static bool prep_ring_write(SaveWrite* write)
+{
+	struct io_uring_sqe* sqe = io_uring_get_sqe(&save_ring);
+	if (sqe == NULL) {
+		// Submission queue is full, make room by submitting what's already there
+		io_uring_submit(&save_ring);
+		sqe = io_uring_get_sqe(&save_ring);
+		if (sqe == NULL) {
+			return false;
+		}
+	}
+	io_uring_prep_write(sqe, write->fd, write->job.data + write->written, (unsigned) (write->job.size - write->written),
+		(uint64_t) write->written);
+	io_uring_sqe_set_data(sqe, write);
+	return true;
+}
+
+// The only thread to touch the ring. Every write queued since the last pass is submitted as a single batch,
+// then completions are reaped, waiting at most a millisecond so newly queued writes aren't held back
+static void* start_save_ring_thread(void* data)
+{
+	SaveWrite** retries = NULL;
+	while (!is_save_writer_drained()) {
+		bool in_flight = io_uring_cq_ready(&save_ring) > 0;
+		pthread_mutex_lock(&save_writer_mutex);
+		in_flight = in_flight || writes_in_flight > arrlen(queued_writes) + arrlen(retries);
+		pthread_mutex_unlock(&save_writer_mutex);
+
+		SaveWrite** writes = take_queued_writes(!in_flight && arrlen(retries) == 0);
+		for (int i = 0; i < arrlen(writes); i++) {
+			arrput(retries, writes[i]);
+		}
+		arrfree(writes);
+		int prepared = 0;
+		while (prepared < arrlen(retries) && prep_ring_write(retries[prepared])) {
+			prepared++;
+		}
+		arrdeln(retries, 0, prepared);
+		if (prepared > 0) {
+			io_uring_submit(&save_ring);
+		}
+
+		struct io_uring_cqe* cqe = NULL;
+		struct __kernel_timespec timeout = { .tv_sec = 0, .tv_nsec = 1000000 };
+		if (io_uring_wait_cqe_timeout(&save_ring, &cqe, &timeout) != 0) {
+			continue;
+		}
+		unsigned head;
+		unsigned reaped = 0;
+		io_uring_for_each_cqe(&save_ring, head, cqe) {
+			reaped++;
+			// Older kernels wait with a timeout of liburing's own, which completes like any other
+			if (cqe->user_data == LIBURING_UDATA_TIMEOUT) {
+				continue;
+			}
+			SaveWrite* write = io_uring_cqe_get_data(cqe);
+			int result = cqe->res;
+			if (result < 0 && result != -EINTR && result != -EAGAIN) {
+				finish_save_write(write, -result);
+				continue;
+			}
+			if (result == 0) {
+				finish_save_write(write, EIO);
+				continue;
+			}
+			write->written += result > 0 ? (size_t) result : 0;
+			if (write->written < write->job.size) {
+				// Short writes are resubmitted with the next batch
+				arrput(retries, write);
+			}
+			else {
+				finish_save_write(write, 0);
+			}
+		}
+		io_uring_cq_advance(&save_ring, reaped);
+	}
+	arrfree(retries);
+	return NULL;
+}
+#endif
+
+bool start_save_writer(SaveWrittenCallback on_written, bool sync_writes)
+{
+	if (save_writer_running) {
+		log_message(LOG_ERROR, LOG_HEADER"Save writer is already running");
+		return false;
+	}
+
+	save_written_callback = on_written;
+	save_writer_sync = sync_writes;
+	save_writer_stopping = false;
+	writes_in_flight = 0;
+	saves_written = 0;
+	saves_failed = 0;
+#ifdef HAVE_LIBURING
+	int result = io_uring_queue_init(SAVE_WRITER_QUEUE_DEPTH, &save_ring, 0);
+	save_ring_ready = result == 0;
+	if (save_ring_ready) {
+		pthread_t thread_id;
+		pthread_create(&thread_id, NULL, start_save_ring_thread, NULL);
+		arrput(save_writer_threads, thread_id);
+		save_writer_running = true;
+		log_message(LOG_INFO, LOG_HEADER"Writing saves through io_uring, %d writes at a time", SAVE_WRITER_QUEUE_DEPTH);
+		return true;
+	}
+	// Commonly blocked by container seccomp profiles
+	log_message(LOG_WARNING, LOG_HEADER"io_uring unavailable (%s), writing saves on threads instead", strerror(-result));
+#endif
+
+	for (int i = 0; i < SAVE_WRITER_THREAD_COUNT; i++) {
+		pthread_t thread_id;
+		pthread_create(&thread_id, NULL, start_save_writer_thread, NULL);
+		arrput(save_writer_threads, thread_id);
+	}
+	save_writer_running = true;
+	log_message(LOG_INFO, LOG_HEADER"Writing saves on %d threads", SAVE_WRITER_THREAD_COUNT);
+	return true;
+}
+
+bool is_save_writer_running()
+{
+	return save_writer_running;
+}
+
+void submit_save_write(SaveJob job, char* save_path, bool owns_data)
+{
+	int fd = open(save_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd == -1) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to open save %s for writing: %s", save_path, strerror(errno));
+		free(save_path);
+		if (owns_data) {
+			free(job.data);
+		}
+		return;
+	}
+
+	SaveWrite* write = malloc(sizeof(SaveWrite));
+	*write = (SaveWrite) { .job = job, .save_path = save_path, .owns_data = owns_data, .fd = fd, .written = 0 };
+	if (job.size == 0) {
+		pthread_mutex_lock(&save_writer_mutex);
+		writes_in_flight++;
+		pthread_mutex_unlock(&save_writer_mutex);
+		finish_save_write(write, 0);
+		return;
+	}
+
+	pthread_mutex_lock(&save_writer_mutex);
+	while (writes_in_flight >= MAX_SAVE_WRITES) {
+		pthread_cond_wait(&save_writer_cond, &save_writer_mutex);
+	}
+	arrput(queued_writes, write);
+	writes_in_flight++;
+	pthread_cond_broadcast(&save_writer_cond);
+	pthread_mutex_unlock(&save_writer_mutex);
+}
+
+void stop_save_writer()
+{
+	if (!save_writer_running) {
+		return;
+	}
+
+	pthread_mutex_lock(&save_writer_mutex);
+	save_writer_stopping = true;
+	pthread_cond_broadcast(&save_writer_cond);
+	pthread_mutex_unlock(&save_writer_mutex);
+	for (int i = 0; i < arrlen(save_writer_threads); i++) {
+		pthread_join(save_writer_threads[i], NULL);
+	}
+	arrfree(save_writer_threads);
+	arrfree(queued_writes);
+#ifdef HAVE_LIBURING
+	if (save_ring_ready) {
+		io_uring_queue_exit(&save_ring);
+		save_ring_ready = false;
+	}
+#endif
+	save_writer_running = false;
+
+	log_message(LOG_INFO, LOG_HEADER"Save writer stopped after %d saves (%d failed)", saves_written, saves_failed);
+}
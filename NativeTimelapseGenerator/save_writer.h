@@ -0,0 +1,18 @@
+#pragma once
+#include <stdbool.h>
+
+#include "workers/worker_structs.h"
+
+// Writes saves to their own files asynchronously, through io_uring when available or a pool of writer threads
+// otherwise, so that filesystem latency never holds a save worker up. Saves are only recorded once written
+
+// Called on a writer thread once a save is completely written. Takes ownership of save_path
+typedef void (*SaveWrittenCallback)(SaveJob job, char* save_path);
+
+// STRICT: Call on main thread only. sync_writes syncs each save to disk before it's reported as written
+bool start_save_writer(SaveWrittenCallback on_written, bool sync_writes);
+bool is_save_writer_running();
+// Takes ownership of save_path, and of job's data if owns_data. Blocks while too many writes are in flight
+void submit_save_write(SaveJob job, char* save_path, bool owns_data);
+// STRICT: Call on main thread only, once every save worker has stopped. Waits for every write in flight
+void stop_save_writer();
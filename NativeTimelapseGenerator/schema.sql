@@ -1,3 +1,6 @@
+-- Creates a new database in its latest form. Indexes, & changes to existing databases, are schema migrations
+-- in database.c, tracked by the database's user_version.
+
 -- Stores rplace canvas instances that are being tracked by the timelapse generator.
 CREATE TABLE IF NOT EXISTS Instances (
 	id INTEGER PRIMARY KEY,
@@ -51,7 +54,7 @@ CREATE TABLE IF NOT EXISTS CommitCanvasMetadatas (
 	canvas_metadata_id INTEGER NOT NULL,        -- ID of the associated canvas metadata.
 	PRIMARY KEY (commit_id, canvas_metadata_id),
 	FOREIGN KEY (commit_id) REFERENCES Commits(id) ON DELETE CASCADE,
-	FOREIGN KEY (canvas_metadata_id) REFERENCES CanvasMetadata(id) ON DELETE CASCADE
+	FOREIGN KEY (canvas_metadata_id) REFERENCES CanvasMetadatas(id) ON DELETE CASCADE
 );
 
 -- Stores details of cached users for each repo / server.
@@ -81,7 +84,27 @@ CREATE TABLE IF NOT EXISTS Saves (
 	commit_id INTEGER NOT NULL,        -- ID of the associated commit.
 	start_date INTEGER NOT NULL,       -- Timestamp of when the canvas render was started (UNIX epoch time).
 	finish_date INTEGER NOT NULL,      -- Timestamp of when the canvas render was completed (UNIX epoch time).
-	type INTEGER NOT NULL,             -- Type of render (1: CANVAS_DOWNLOAD, 2: CANVAS_RENDER, 3: DATE_RENDER, 4: PLACERS_DOWNLOAD, 5: TOP_PLACERS_RENDER, 6: CANVAS_CONTROL_RENDER).
-	save_path TEXT NOT NULL,           -- File path where the render is stored.
+	type INTEGER NOT NULL,             -- Type of render (1: CANVAS_DOWNLOAD, 2: CANVAS_RENDER, 3: DATE_RENDER, 4: PLACERS_DOWNLOAD, 5: TOP_PLACERS_RENDER, 6: CANVAS_CONTROL_RENDER, 7: COMPOSITE_RENDER, 8: HEATMAP_RENDER, 9: AGE_RENDER).
+	save_path TEXT NOT NULL,           -- File path where the render is stored, or is unpacked to if it's in a pack.
+	pack_path TEXT,                    -- Pack file holding the save, null if it's a file of its own.
+	pack_offset INTEGER,               -- Byte offset of the save within its pack.
+	pack_length INTEGER,               -- Byte length of the save, within its pack or as a file of its own.
+	FOREIGN KEY (commit_id) REFERENCES Commits(id)
+);
+
+-- First commit each distinct download was seen in, later identical downloads reuse its saves.
+CREATE TABLE IF NOT EXISTS ContentHashes (
+	hash INTEGER NOT NULL,      -- XXH64 of the download, seeded with the canvas metadata it's rendered with.
+	type INTEGER NOT NULL,      -- Save type of the download (1: CANVAS_DOWNLOAD, 4: PLACERS_DOWNLOAD).
+	commit_id INTEGER NOT NULL, -- ID of the commit whose saves are reused.
+	PRIMARY KEY (hash, type),
 	FOREIGN KEY (commit_id) REFERENCES Commits(id)
 );
+
+-- Activity of each commit against the commit before it, used to spend a frame budget where the canvas changes.
+CREATE TABLE IF NOT EXISTS CommitStats (
+	commit_id INTEGER PRIMARY KEY,      -- ID of the commit.
+	changed_pixels INTEGER NOT NULL,    -- Pixels that differ from the previous commit's canvas, 0 for the first.
+	total_pixels INTEGER NOT NULL,      -- Pixels in the commit's canvas.
+	FOREIGN KEY (commit_id) REFERENCES Commits(id) ON DELETE CASCADE
+);
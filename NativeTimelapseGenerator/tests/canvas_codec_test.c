@@ -0,0 +1,150 @@
+// Encodes a sequence of boards through the canvas codec, saving each in the working directory, then checks that
+// every one decodes back to the board it was encoded from. Run by ctest, see CMakeLists.txt
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "database.h"
+#include "canvas_codec.h"
+#define STB_DS_IMPLEMENTATION
+#include "lib/stb/stb_ds.h"
+
+#define KEYFRAME_INTERVAL 3
+#define BOARD_COUNT 7
+
+typedef struct test_board {
+	size_t size;
+	bool keyframe; // Expected kind once encoded
+} TestBoard;
+
+// Every third board is a keyframe, & the board that changes size forces one early
+static const TestBoard test_boards[BOARD_COUNT] = {
+	{ .size = 4096, .keyframe = true },
+	{ .size = 4096, .keyframe = false },
+	{ .size = 4096, .keyframe = false },
+	{ .size = 4096, .keyframe = true },
+	{ .size = 6000, .keyframe = true },
+	{ .size = 6000, .keyframe = false },
+	{ .size = 6000, .keyframe = false }
+};
+
+static uint8_t* boards[BOARD_COUNT];
+
+// Long runs of a few colours with a handful of pixels changed each commit, like a real canvas
+static uint8_t* generate_board(int index, size_t size)
+{
+	uint8_t* board = malloc(size);
+	for (size_t i = 0; i < size; i++) {
+		board[i] = (uint8_t) ((i / 300) % 5);
+	}
+	for (int i = 0; i <= index; i++) {
+		for (size_t pixel = (size_t) i * 37; pixel < size; pixel += 997) {
+			board[pixel] = (uint8_t) (7 + i);
+		}
+	}
+	// Literals shorter than a run, right at the end of the board
+	board[size - 1] = (uint8_t) (31 - index);
+	board[size - 3] = (uint8_t) (20 + index);
+	return board;
+}
+
+static char* get_board_path(int index)
+{
+	char* path = NULL;
+	asprintf(&path, "canvas_codec_test_%d", index);
+	return path;
+}
+
+static bool write_file(const char* path, const uint8_t* data, size_t size)
+{
+	FILE* file = fopen(path, "wb");
+	bool written = file != NULL && fwrite(data, 1, size, file) == size;
+	if (file != NULL && fclose(file) != 0) {
+		written = false;
+	}
+	return written;
+}
+
+static bool save_encoded_canvases(EncodedCanvas* canvases, int* saved)
+{
+	bool valid = true;
+	for (int i = 0; i < arrlen(canvases); i++) {
+		EncodedCanvas canvas = canvases[i];
+		int index = canvas.job.frame_index;
+		char* base_path = get_canvas_download_base(canvas.job.data, canvas.job.size);
+		if ((base_path == NULL) != test_boards[index].keyframe) {
+			fprintf(stderr, "Board %d was encoded as a %s\n", index, base_path == NULL ? "keyframe" : "delta");
+			valid = false;
+		}
+		free(base_path);
+		if (!write_file(canvas.save_path, canvas.job.data, canvas.job.size)) {
+			fprintf(stderr, "Failed to write %s\n", canvas.save_path);
+			valid = false;
+		}
+		free(canvas.job.data);
+		free(canvas.save_path);
+		(*saved)++;
+	}
+	arrfree(canvases);
+	return valid;
+}
+
+int main()
+{
+	unlink("instance_tracker.db");
+	unlink("instance_tracker.db-wal");
+	unlink("instance_tracker.db-shm");
+
+	// Saves that aren't packed are read straight from their files, once the database says so
+	start_database();
+	if (!try_create_database()) {
+		fprintf(stderr, "Failed to create scratch database\n");
+		return EXIT_FAILURE;
+	}
+
+	start_canvas_codec(KEYFRAME_INTERVAL);
+	bool valid = true;
+	int saved = 0;
+	// The second board is pushed before the first, so it waits for it
+	int push_order[BOARD_COUNT] = { 1, 0, 2, 3, 4, 5, 6 };
+	for (int i = 0; i < BOARD_COUNT; i++) {
+		int index = push_order[i];
+		boards[index] = generate_board(index, test_boards[index].size);
+		SaveJob job = { .frame_index = index, .commit_id = index + 1, .commit_hash = "test", .type = SAVE_CANVAS_DOWNLOAD,
+			.data = boards[index], .size = test_boards[index].size };
+		char* path = get_board_path(index);
+		valid = save_encoded_canvases(advance_canvas_codec(job, path), &saved) && valid;
+		free(path);
+	}
+	stop_canvas_codec();
+	if (saved != BOARD_COUNT) {
+		fprintf(stderr, "Only %d of %d boards were encoded\n", saved, BOARD_COUNT);
+		valid = false;
+	}
+
+	for (int i = 0; i < BOARD_COUNT && valid; i++) {
+		char* path = get_board_path(i);
+		size_t size = 0;
+		uint8_t* decoded = decode_canvas_download(path, &size);
+		if (decoded == NULL || size != test_boards[i].size || memcmp(decoded, boards[i], size) != 0) {
+			fprintf(stderr, "Board %d didn't decode to the board it was encoded from\n", i);
+			valid = false;
+		}
+		free(decoded);
+		free(path);
+	}
+	// Only once every board is decoded, as deltas are read back through the boards before them
+	for (int i = 0; i < BOARD_COUNT; i++) {
+		char* path = get_board_path(i);
+		unlink(path);
+		free(path);
+		free(boards[i]);
+	}
+	free_statement_cache();
+
+	if (valid) {
+		printf("%d boards round tripped through keyframes & deltas\n", BOARD_COUNT);
+	}
+	return valid ? EXIT_SUCCESS : EXIT_FAILURE;
+}
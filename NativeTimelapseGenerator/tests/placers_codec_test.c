@@ -0,0 +1,143 @@
+// Packs placers downloads through the placers codec, saving each in the working directory, then checks that
+// every one decodes back to the placers it was packed from. Run by ctest, see CMakeLists.txt
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "database.h"
+#include "placers_codec.h"
+#define STB_DS_IMPLEMENTATION
+#include "lib/stb/stb_ds.h"
+
+typedef struct test_placers {
+	const char* name;
+	int width;
+	int height;
+	uint32_t dictionary_size;
+	int run_length; // Pixels per run, runs carry on across rows
+} TestPlacers;
+
+static const TestPlacers test_placers[] = {
+	// No index bits at all, every run is the same placer
+	{ .name = "single placer", .width = 64, .height = 64, .dictionary_size = 1, .run_length = 100 },
+	// 3 bit indices, so runs keep crossing byte boundaries, over a width that isn't a power of two
+	{ .name = "odd width", .width = 37, .height = 23, .dictionary_size = 7, .run_length = 5 },
+	// 13 bit indices, every run spans 2 or 3 bytes, with run lengths over a single varint byte
+	{ .name = "long runs", .width = 1000, .height = 1500, .dictionary_size = 5000, .run_length = 300 },
+	// Runs of a single pixel
+	{ .name = "no runs", .width = 333, .height = 3, .dictionary_size = 333, .run_length = 1 }
+};
+#define TEST_PLACERS_COUNT ((int) (sizeof(test_placers) / sizeof(test_placers[0])))
+
+// Ids cycle through the dictionary, a run at a time. Returns the ids & the big endian download they came from
+static UserIntId* generate_placers(const TestPlacers* test, uint8_t** out_download, size_t* out_length)
+{
+	size_t length = (size_t) test->width * (size_t) test->height;
+	UserIntId* int_ids = malloc(length * sizeof(UserIntId));
+	uint8_t* download = malloc(length * sizeof(UserIntId));
+	for (size_t i = 0; i < length; i++) {
+		// Large ids, so that every byte of each is used
+		uint32_t entry = (uint32_t) (i / (size_t) test->run_length) % test->dictionary_size;
+		int_ids[i] = entry == 0 ? 0 : 0x01000000u + entry * 2654435761u % 0x7F000000u;
+		download[i * 4] = (uint8_t) (int_ids[i] >> 24);
+		download[i * 4 + 1] = (uint8_t) (int_ids[i] >> 16);
+		download[i * 4 + 2] = (uint8_t) (int_ids[i] >> 8);
+		download[i * 4 + 3] = (uint8_t) int_ids[i];
+	}
+	*out_download = download;
+	*out_length = length;
+	return int_ids;
+}
+
+static bool write_file(const char* path, const uint8_t* data, size_t size)
+{
+	FILE* file = fopen(path, "wb");
+	bool written = file != NULL && fwrite(data, 1, size, file) == size;
+	if (file != NULL && fclose(file) != 0) {
+		written = false;
+	}
+	return written;
+}
+
+// Decodes the save at path, which must hold exactly int_ids
+static bool check_placers_download(const char* name, const char* path, const UserIntId* int_ids, size_t length)
+{
+	size_t decoded_length = 0;
+	UserIntId* decoded = decode_placers_download(path, &decoded_length);
+	bool matched = decoded != NULL && decoded_length == length && memcmp(decoded, int_ids, length * sizeof(UserIntId)) == 0;
+	if (!matched) {
+		fprintf(stderr, "%s: %s didn't decode to the placers it was saved from\n", name, path);
+	}
+	free(decoded);
+	return matched;
+}
+
+static bool check_placers(const TestPlacers* test)
+{
+	uint8_t* download = NULL;
+	size_t length = 0;
+	UserIntId* int_ids = generate_placers(test, &download, &length);
+	PackedPlacers packed = { 0 };
+	PlacerCounts counts = { 0 };
+	bool valid = pack_placers(download, length * sizeof(UserIntId), &packed, &counts);
+	if (!valid) {
+		fprintf(stderr, "%s: failed to pack placers\n", test->name);
+	}
+
+	// Every distinct placer is counted once, & the counts cover the whole board
+	uint64_t counted = 0;
+	for (size_t i = 0; valid && i < counts.size; i++) {
+		counted += counts.counts[i];
+	}
+	if (valid && (counts.size != test->dictionary_size || counted != length)) {
+		fprintf(stderr, "%s: counted %zu placers over %llu pixels, expected %u over %zu\n", test->name, counts.size,
+			(unsigned long long) counted, test->dictionary_size, length);
+		valid = false;
+	}
+	if (valid && get_packed_placers_length(&packed) != length) {
+		fprintf(stderr, "%s: packed placers cover %zu pixels, expected %zu\n", test->name,
+			get_packed_placers_length(&packed), length);
+		valid = false;
+	}
+
+	// Packed & raw downloads are both read back as saves
+	const char* packed_path = "placers_codec_test_packed";
+	const char* raw_path = "placers_codec_test_raw";
+	valid = valid && write_file(packed_path, packed.data, packed.size) && write_file(raw_path, download, length * sizeof(UserIntId))
+		&& check_placers_download(test->name, packed_path, int_ids, length)
+		&& check_placers_download(test->name, raw_path, int_ids, length);
+	unlink(packed_path);
+	unlink(raw_path);
+
+	free_placer_counts(&counts);
+	free(packed.data);
+	free(download);
+	free(int_ids);
+	return valid;
+}
+
+int main()
+{
+	unlink("instance_tracker.db");
+	unlink("instance_tracker.db-wal");
+	unlink("instance_tracker.db-shm");
+
+	// Saves that aren't packed are read straight from their files, once the database says so
+	start_database();
+	if (!try_create_database()) {
+		fprintf(stderr, "Failed to create scratch database\n");
+		return EXIT_FAILURE;
+	}
+
+	int passed = 0;
+	for (int i = 0; i < TEST_PLACERS_COUNT; i++) {
+		if (check_placers(&test_placers[i])) {
+			passed++;
+		}
+	}
+	free_statement_cache();
+
+	printf("%d of %d placers downloads round tripped through the dictionary\n", passed, TEST_PLACERS_COUNT);
+	return passed == TEST_PLACERS_COUNT ? EXIT_SUCCESS : EXIT_FAILURE;
+}
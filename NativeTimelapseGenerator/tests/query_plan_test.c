@@ -0,0 +1,107 @@
+// Creates a scratch database in the working directory as it was before schema migrations, with a row in each table
+// they change, then opens it, migrating it to the latest schema. Fails if a row was lost along the way, or if any hot
+// query's plan scans a whole table rather than using an index. Run by ctest, see CMakeLists.txt
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+#include "database.h"
+#define STB_DS_IMPLEMENTATION
+#include "lib/stb/stb_ds.h"
+
+// The tables schema migrations change, as schema.sql created them before user_version was tracked. Saves have no
+// pack columns, & CommitCanvasMetadatas' foreign key names CanvasMetadata
+static const char* pre_migration_schema =
+	"CREATE TABLE Instances (id INTEGER PRIMARY KEY, repo_url TEXT NOT NULL, game_server_url TEXT NOT NULL, "
+		"UNIQUE (repo_url, game_server_url));"
+	"CREATE TABLE Palettes (id INTEGER PRIMARY KEY, size INTEGER NOT NULL, hash TEXT UNIQUE);"
+	"CREATE TABLE Commits (id INTEGER PRIMARY KEY, instance_id INTEGER NOT NULL, hash TEXT NOT NULL UNIQUE, "
+		"date INTEGER NOT NULL, FOREIGN KEY (instance_id) REFERENCES Instances(id) ON DELETE CASCADE);"
+	"CREATE TABLE CanvasMetadatas (id INTEGER PRIMARY KEY, palette_id INTEGER NOT NULL, "
+		"first_seen_commit_id INTEGER NOT NULL, width INTEGER NOT NULL CHECK (width > 0), "
+		"height INTEGER NOT NULL CHECK (height > 0), FOREIGN KEY (palette_id) REFERENCES Palettes(id), "
+		"FOREIGN KEY (first_seen_commit_id) REFERENCES Commits(id));"
+	"CREATE TABLE CommitCanvasMetadatas (commit_id INTEGER NOT NULL, canvas_metadata_id INTEGER NOT NULL, "
+		"PRIMARY KEY (commit_id, canvas_metadata_id), FOREIGN KEY (commit_id) REFERENCES Commits(id) ON DELETE CASCADE, "
+		"FOREIGN KEY (canvas_metadata_id) REFERENCES CanvasMetadata(id) ON DELETE CASCADE);"
+	"CREATE TABLE Saves (id INTEGER PRIMARY KEY, commit_id INTEGER NOT NULL, start_date INTEGER NOT NULL, "
+		"finish_date INTEGER NOT NULL, type INTEGER NOT NULL, save_path TEXT NOT NULL, "
+		"FOREIGN KEY (commit_id) REFERENCES Commits(id));"
+	"INSERT INTO Instances (id, repo_url, game_server_url) VALUES (1, 'repo', 'server');"
+	"INSERT INTO Palettes (id, size, hash) VALUES (1, 2, 'palette');"
+	"INSERT INTO Commits (id, instance_id, hash, date) VALUES (1, 1, 'commit', 1000);"
+	"INSERT INTO CanvasMetadatas (id, palette_id, first_seen_commit_id, width, height) VALUES (1, 1, 1, 500, 500);"
+	"INSERT INTO CommitCanvasMetadatas (commit_id, canvas_metadata_id) VALUES (1, 1);"
+	"INSERT INTO Saves (id, commit_id, start_date, finish_date, type, save_path) VALUES (1, 1, 1000, 1001, 1, 'save');";
+
+// Each query must return exactly one row, whose first column is expected
+static bool check_query(sqlite3* database, const char* sql, int expected)
+{
+	sqlite3_stmt* stmt;
+	if (sqlite3_prepare_v2(database, sql, -1, &stmt, 0) != SQLITE_OK) {
+		fprintf(stderr, "Failed to prepare %s: %s\n", sql, sqlite3_errmsg(database));
+		return false;
+	}
+	bool matched = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) == expected
+		&& sqlite3_step(stmt) == SQLITE_DONE;
+	if (!matched) {
+		fprintf(stderr, "%s didn't return %d once migrated\n", sql, expected);
+	}
+	sqlite3_finalize(stmt);
+	return matched;
+}
+
+static bool create_pre_migration_database()
+{
+	sqlite3* database = NULL;
+	char* err_msg = NULL;
+	bool created = sqlite3_open("instance_tracker.db", &database) == SQLITE_OK
+		&& sqlite3_exec(database, pre_migration_schema, NULL, NULL, &err_msg) == SQLITE_OK;
+	if (!created) {
+		fprintf(stderr, "Failed to create pre migration database: %s\n", err_msg ? err_msg : sqlite3_errmsg(database));
+	}
+	sqlite3_free(err_msg);
+	sqlite3_close(database);
+	return created;
+}
+
+static bool check_migrated_database()
+{
+	sqlite3* database = NULL;
+	if (sqlite3_open_v2("instance_tracker.db", &database, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Failed to reopen migrated database\n");
+		sqlite3_close(database);
+		return false;
+	}
+	bool migrated = check_query(database, "PRAGMA user_version", 4);
+	migrated = check_query(database, "SELECT COUNT(*) FROM Saves WHERE id = 1 AND commit_id = 1 AND save_path = 'save' "
+		"AND pack_path IS NULL AND pack_offset IS NULL AND pack_length IS NULL", 1) && migrated;
+	migrated = check_query(database, "SELECT COUNT(*) FROM CommitCanvasMetadatas WHERE commit_id = 1 AND canvas_metadata_id = 1", 1)
+		&& migrated;
+	migrated = check_query(database, "SELECT COUNT(*) FROM pragma_foreign_key_list('CommitCanvasMetadatas') "
+		"WHERE \"table\" = 'CanvasMetadatas'", 1) && migrated;
+	sqlite3_close(database);
+	return migrated;
+}
+
+int main()
+{
+	// Every migration is applied to a database that predates them
+	unlink("instance_tracker.db");
+	unlink("instance_tracker.db-wal");
+	unlink("instance_tracker.db-shm");
+	if (!create_pre_migration_database()) {
+		return EXIT_FAILURE;
+	}
+
+	start_database();
+	if (!try_create_database()) {
+		fprintf(stderr, "Failed to open scratch database\n");
+		return EXIT_FAILURE;
+	}
+	bool migrated = check_migrated_database();
+	bool indexed = check_query_plans();
+	free_statement_cache();
+	return migrated && indexed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,18 @@
+// Stands in for the console in tests, which the code under test only needs to log through
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "console.h"
+
+void log_message(LogType type, const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vfprintf(type == LOG_INFO ? stdout : stderr, format, args);
+	va_end(args);
+	fputc('\n', type == LOG_INFO ? stdout : stderr);
+}
+
+void stop_console()
+{
+}
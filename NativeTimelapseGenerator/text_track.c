@@ -0,0 +1,392 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "console.h"
+#include "memory_utils.h"
+#include "text_track.h"
+#include "lib/stb/stb_ds.h"
+#include "lib/parson/parson.h"
+
+#define LOG_HEADER "[text track] "
+
+typedef enum text_track_format:uint8_t {
+	TEXT_TRACK_ASS = 1,
+	TEXT_TRACK_VTT = 2
+} TextTrackFormat;
+
+typedef struct text_track_frame {
+	int frame_index;
+	time_t date;
+	Placer* top_placers;
+	size_t top_placers_size;
+} TextTrackFrame;
+
+// Consecutive frames with identical text are merged into a single cue
+typedef struct pending_cue {
+	char* text;
+	int start_frame;
+	int end_frame;
+} PendingCue;
+
+typedef struct cue_colour {
+	uint32_t key; // 0xRRGGBB
+	bool value;
+} CueColour;
+
+// TEXT TRACK
+static ReorderBuffer text_track_buffer;
+// Held while writing, so cues are only ever written one at a time and in order
+static pthread_mutex_t text_track_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool text_track_running = false; // Read by workers
+static TextTrackFormat text_track_format = 0;
+static char* text_track_file_name = NULL;
+static FILE* text_track_file = NULL;
+// WebVTT styles must come before any cue, so cues are held here until every colour is known
+static FILE* cue_file = NULL;
+static CueColour* cue_colours = NULL;
+static int text_track_frame_rate = 0;
+static PendingCue date_cue = { 0 };
+static PendingCue placers_cue = { 0 };
+static JSON_Value* sidecar_value = NULL;
+static int frames_written = 0;
+static int frames_skipped = 0;
+
+static void free_text_track_frame(void* data)
+{
+	TextTrackFrame* frame = (TextTrackFrame*) data;
+	for (size_t i = 0; i < frame->top_placers_size; i++) {
+		free((char*) frame->top_placers[i].chat_name);
+	}
+	free(frame->top_placers);
+	free(frame);
+}
+
+static uint32_t get_colour_key(Colour colour)
+{
+	return ((uint32_t) colour.r << 16) | ((uint32_t) colour.g << 8) | colour.b;
+}
+
+// Chat names are user provided, so anything the format would interpret is replaced
+static void append_escaped_name(char** text, const char* name)
+{
+	for (const char* character = name; *character != '\0'; character++) {
+		char value = *character;
+		if (value == '\n' || value == '\r') {
+			value = ' ';
+		}
+		if (text_track_format == TEXT_TRACK_ASS && (value == '{' || value == '}' || value == '\\')) {
+			value = ' ';
+		}
+		if (text_track_format == TEXT_TRACK_VTT && (value == '<' || value == '>' || value == '&')) {
+			const char* entity = value == '<' ? "&lt;" : value == '>' ? "&gt;" : "&amp;";
+			memcpy(arraddnptr(*text, strlen(entity)), entity, strlen(entity));
+			continue;
+		}
+		arrput(*text, value);
+	}
+}
+
+// Returns stb array holding a null terminated string
+static char* format_placers_text(const TextTrackFrame* frame)
+{
+	char* text = NULL;
+	for (size_t i = 0; i < frame->top_placers_size; i++) {
+		const Placer* placer = &frame->top_placers[i];
+		char prefix[64];
+		char suffix[64];
+		Colour colour = placer->colour;
+		if (text_track_format == TEXT_TRACK_ASS) {
+			// ASS colours are in BGR order
+			snprintf(prefix, sizeof(prefix), "%s{\\c&H%02X%02X%02X&}", i > 0 ? "\\N" : "", colour.b, colour.g, colour.r);
+		}
+		else {
+			snprintf(prefix, sizeof(prefix), "%s<c.c%06X>", i > 0 ? "\n" : "", get_colour_key(colour));
+			hmput(cue_colours, get_colour_key(colour), true);
+		}
+		memcpy(arraddnptr(text, strlen(prefix)), prefix, strlen(prefix));
+		append_escaped_name(&text, placer->chat_name != NULL ? placer->chat_name : "Anonymous");
+		snprintf(suffix, sizeof(suffix), " (#%d) : %d pixels%s", placer->int_id, placer->pixels_placed,
+			text_track_format == TEXT_TRACK_VTT ? "</c>" : "");
+		memcpy(arraddnptr(text, strlen(suffix)), suffix, strlen(suffix));
+	}
+	arrput(text, '\0');
+	return text;
+}
+
+static void write_cue_time(FILE* file, int frame)
+{
+	long long milliseconds = (long long) frame * 1000 / text_track_frame_rate;
+	long long seconds = milliseconds / 1000;
+	if (text_track_format == TEXT_TRACK_ASS) {
+		fprintf(file, "%lld:%02lld:%02lld.%02lld", seconds / 3600, seconds / 60 % 60, seconds % 60, milliseconds % 1000 / 10);
+	}
+	else {
+		fprintf(file, "%02lld:%02lld:%02lld.%03lld", seconds / 3600, seconds / 60 % 60, seconds % 60, milliseconds % 1000);
+	}
+}
+
+static void write_cue(const PendingCue* cue, bool date)
+{
+	if (cue->text == NULL || cue->text[0] == '\0') {
+		return;
+	}
+
+	FILE* file = text_track_format == TEXT_TRACK_ASS ? text_track_file : cue_file;
+	if (text_track_format == TEXT_TRACK_ASS) {
+		fputs("Dialogue: 0,", file);
+		write_cue_time(file, cue->start_frame);
+		fputc(',', file);
+		write_cue_time(file, cue->end_frame);
+		fprintf(file, ",%s,,0,0,0,,%s\n", date ? "Date" : "Placers", cue->text);
+	}
+	else {
+		write_cue_time(file, cue->start_frame);
+		fputs(" --> ", file);
+		write_cue_time(file, cue->end_frame);
+		fprintf(file, date ? " line:0 position:100%% align:end\n%s\n\n" : " line:0 position:0%% align:start\n%s\n\n", cue->text);
+	}
+}
+
+// Takes ownership of text, an stb array
+static void advance_cue(PendingCue* cue, bool date, char* text, int frame)
+{
+	if (cue->text != NULL && cue->end_frame == frame && strcmp(cue->text, text) == 0) {
+		cue->end_frame = frame + 1;
+		arrfree(text);
+		return;
+	}
+	write_cue(cue, date);
+	arrfree(cue->text);
+	*cue = (PendingCue) { .text = text, .start_frame = frame, .end_frame = frame + 1 };
+}
+
+static void append_sidecar_frame(int frame_index, const TextTrackFrame* frame, const char* date_text)
+{
+	JSON_Value* frame_value = json_value_init_object();
+	JSON_Object* frame_object = json_value_get_object(frame_value);
+	json_object_set_number(frame_object, "frame", frame_index);
+	json_object_set_number(frame_object, "date", (double) frame->date);
+	json_object_set_string(frame_object, "date_text", date_text);
+
+	JSON_Value* placers_value = json_value_init_array();
+	JSON_Array* placers_array = json_value_get_array(placers_value);
+	for (size_t i = 0; i < frame->top_placers_size; i++) {
+		const Placer* placer = &frame->top_placers[i];
+		JSON_Value* placer_value = json_value_init_object();
+		JSON_Object* placer_object = json_value_get_object(placer_value);
+		char colour_text[8];
+		snprintf(colour_text, sizeof(colour_text), "#%06X", get_colour_key(placer->colour));
+		json_object_set_number(placer_object, "int_id", placer->int_id);
+		if (placer->chat_name != NULL) {
+			json_object_set_string(placer_object, "chat_name", placer->chat_name);
+		}
+		else {
+			json_object_set_null(placer_object, "chat_name");
+		}
+		json_object_set_number(placer_object, "pixels_placed", placer->pixels_placed);
+		json_object_set_string(placer_object, "colour", colour_text);
+		json_array_append_value(placers_array, placer_value);
+	}
+	json_object_set_value(frame_object, "top_placers", placers_value);
+	json_array_append_value(json_value_get_array(sidecar_value), frame_value);
+}
+
+static void write_text_track_frame(int frame_index, const TextTrackFrame* frame)
+{
+	// Same format as date renders
+	char date_text[256];
+	strftime(date_text, sizeof(date_text), "%a %d %b %Y %H:%M", gmtime(&frame->date));
+	append_sidecar_frame(frame_index, frame, date_text);
+
+	char* date_cue_text = NULL;
+	memcpy(arraddnptr(date_cue_text, strlen(date_text) + 1), date_text, strlen(date_text) + 1);
+	advance_cue(&date_cue, true, date_cue_text, frame_index);
+	advance_cue(&placers_cue, false, format_placers_text(frame), frame_index);
+	frames_written++;
+}
+
+static void drain_text_track()
+{
+	pthread_mutex_lock(&text_track_mutex);
+	void* data = NULL;
+	while (pop_reorder_buffer(&text_track_buffer, &data)) {
+		if (data == NULL) {
+			frames_skipped++;
+			continue;
+		}
+		TextTrackFrame* frame = (TextTrackFrame*) data;
+		write_text_track_frame(frame->frame_index, frame);
+		free_text_track_frame(data);
+	}
+	pthread_mutex_unlock(&text_track_mutex);
+}
+
+static void write_ass_header(FILE* file)
+{
+	fputs("[Script Info]\n"
+		"ScriptType: v4.00+\n"
+		"PlayResX: 1920\n"
+		"PlayResY: 1080\n"
+		"WrapStyle: 2\n"
+		"\n"
+		"[V4+ Styles]\n"
+		"Format: Name, Fontname, Fontsize, PrimaryColour, SecondaryColour, OutlineColour, BackColour, Bold, Italic, "
+		"Underline, StrikeOut, ScaleX, ScaleY, Spacing, Angle, BorderStyle, Outline, Shadow, Alignment, MarginL, MarginR, MarginV, Encoding\n"
+		"Style: Date,Sans,64,&H00FFFFFF,&H000000FF,&H00000000,&H80000000,1,0,0,0,100,100,0,0,1,3,0,9,32,32,32,1\n"
+		"Style: Placers,Sans,40,&H00FFFFFF,&H000000FF,&H00000000,&H80000000,0,0,0,0,100,100,0,0,1,2,0,7,32,32,32,1\n"
+		"\n"
+		"[Events]\n"
+		"Format: Layer, Start, End, Style, Name, MarginL, MarginR, MarginV, Effect, Text\n", file);
+}
+
+bool start_text_track(const char* file_name, int frame_rate)
+{
+	if (text_track_running) {
+		log_message(LOG_ERROR, LOG_HEADER"Text track is already running");
+		return false;
+	}
+	const char* extension = strrchr(file_name, '.');
+	if (extension != NULL && strcmp(extension, ".ass") == 0) {
+		text_track_format = TEXT_TRACK_ASS;
+	}
+	else if (extension != NULL && strcmp(extension, ".vtt") == 0) {
+		text_track_format = TEXT_TRACK_VTT;
+	}
+	else {
+		log_message(LOG_ERROR, LOG_HEADER"Unknown text track format of '%s', expected a .ass or .vtt file", file_name);
+		return false;
+	}
+	if (frame_rate <= 0) {
+		log_message(LOG_ERROR, LOG_HEADER"Invalid text track frame rate %d", frame_rate);
+		return false;
+	}
+
+	text_track_file = fopen(file_name, "w");
+	if (text_track_file == NULL) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to open text track '%s': %s", file_name, strerror(errno));
+		return false;
+	}
+	if (text_track_format == TEXT_TRACK_ASS) {
+		write_ass_header(text_track_file);
+	}
+	else {
+		cue_file = tmpfile();
+		if (cue_file == NULL) {
+			log_message(LOG_ERROR, LOG_HEADER"Failed to create temporary cue file: %s", strerror(errno));
+			fclose(text_track_file);
+			text_track_file = NULL;
+			return false;
+		}
+	}
+
+	text_track_file_name = strdup(file_name);
+	text_track_frame_rate = frame_rate;
+	frames_written = 0;
+	frames_skipped = 0;
+	date_cue = (PendingCue) { 0 };
+	placers_cue = (PendingCue) { 0 };
+	sidecar_value = json_value_init_array();
+	init_reorder_buffer(&text_track_buffer, 0, DEFAULT_REORDER_WINDOW);
+	text_track_running = true;
+	log_message(LOG_INFO, LOG_HEADER"Writing dates & top placers at %d fps to '%s'", frame_rate, file_name);
+	return true;
+}
+
+bool is_text_track_running()
+{
+	return text_track_running;
+}
+
+void push_text_track(int frame_index, time_t date, const Placer* top_placers, size_t top_placers_size)
+{
+	TextTrackFrame* frame = malloc(sizeof(TextTrackFrame));
+	*frame = (TextTrackFrame) { .frame_index = frame_index, .date = date, .top_placers = NULL, .top_placers_size = 0 };
+	if (top_placers_size > 0) {
+		frame->top_placers = malloc(sizeof(Placer) * top_placers_size);
+		for (size_t i = 0; i < top_placers_size; i++) {
+			frame->top_placers[i] = top_placers[i];
+			frame->top_placers[i].chat_name = top_placers[i].chat_name ? strdup(top_placers[i].chat_name) : NULL;
+		}
+		frame->top_placers_size = top_placers_size;
+	}
+	push_reorder_buffer(&text_track_buffer, frame_index, frame);
+	drain_text_track();
+}
+
+void skip_text_track(int frame_index)
+{
+	push_reorder_buffer(&text_track_buffer, frame_index, NULL);
+	drain_text_track();
+}
+
+// WebVTT needs a class per colour declared up front, so the header is only written once every cue is known
+static bool finish_vtt_file()
+{
+	fputs("WEBVTT\n\nSTYLE\n", text_track_file);
+	for (int i = 0; i < hmlen(cue_colours); i++) {
+		fprintf(text_track_file, "::cue(.c%06X) { color: #%06X; }\n", cue_colours[i].key, cue_colours[i].key);
+	}
+	fputc('\n', text_track_file);
+
+	rewind(cue_file);
+	char buffer[16 * 1024];
+	size_t read = 0;
+	while ((read = fread(buffer, 1, sizeof(buffer), cue_file)) > 0) {
+		if (fwrite(buffer, 1, read, text_track_file) != read) {
+			return false;
+		}
+	}
+	return !ferror(cue_file);
+}
+
+static char* get_sidecar_file_name(const char* file_name)
+{
+	const char* extension = strrchr(file_name, '.');
+	char* sidecar_name = NULL;
+	asprintf(&sidecar_name, "%.*s.json", (int) (extension - file_name), file_name);
+	return sidecar_name;
+}
+
+void stop_text_track()
+{
+	if (!text_track_running) {
+		return;
+	}
+
+	pthread_mutex_lock(&text_track_mutex);
+	write_cue(&date_cue, true);
+	write_cue(&placers_cue, false);
+	arrfree(date_cue.text);
+	arrfree(placers_cue.text);
+	bool written = text_track_format == TEXT_TRACK_ASS || finish_vtt_file();
+	if (fclose(text_track_file) != 0 || !written) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to write text track '%s'", text_track_file_name);
+	}
+	if (cue_file != NULL) {
+		fclose(cue_file);
+	}
+	text_track_file = NULL;
+	cue_file = NULL;
+	hmfree(cue_colours);
+
+	char* sidecar_name = get_sidecar_file_name(text_track_file_name);
+	if (json_serialize_to_file_pretty(sidecar_value, sidecar_name) != 0) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to write text track sidecar '%s'", sidecar_name);
+	}
+	json_value_free(sidecar_value);
+	sidecar_value = NULL;
+	pthread_mutex_unlock(&text_track_mutex);
+
+	size_t dropped = get_reorder_buffer_pending(&text_track_buffer);
+	free_reorder_buffer(&text_track_buffer, free_text_track_frame);
+	text_track_running = false;
+	log_message(LOG_INFO, LOG_HEADER"Text track stopped after %d frames (%d skipped, %zu still out of order), sidecar written to '%s'",
+		frames_written, frames_skipped, dropped, sidecar_name);
+	free(sidecar_name);
+	free(text_track_file_name);
+	text_track_file_name = NULL;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "workers/worker_structs.h"
+
+// Writes each commit's date & top placers, in commit order, as a timed text track keyed to frame numbers,
+// so that text is only ever rasterised by the player or final encode. The track is ASS (.ass) or
+// WebVTT (.vtt) depending on its extension, with a JSON sidecar of the same data next to it
+
+// STRICT: Call on main thread only
+bool start_text_track(const char* file_name, int frame_rate);
+bool is_text_track_running();
+// Copies the top placers
+void push_text_track(int frame_index, time_t date, const Placer* top_placers, size_t top_placers_size);
+// Frames whose placers failed to download must still be skipped, otherwise every later frame is held back
+void skip_text_track(int frame_index);
+// STRICT: Call on main thread only, writes every cue that can be written and finalises both files
+void stop_text_track();
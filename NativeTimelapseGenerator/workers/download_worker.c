@@ -15,6 +15,13 @@
 #include "../memory_utils.h"
 #include "../main_thread.h"
 #include "../database.h"
+#include "../frame_sink.h"
+#include "../apng_writer.h"
+#include "../heatmap.h"
+#include "../text_track.h"
+#include "../commit_stats.h"
+#include "../canvas_codec.h"
+#include "../placers_codec.h"
 
 #include "../lib/stb/stb_ds.h"
 #include "../lib/parson/parson.h"
@@ -79,13 +86,6 @@ size_t fetch_memory_callback(void* contents, size_t size, size_t nmemb, void* us
 	return real_size;
 }
 
-uint32_t swap32(uint32_t value) {
-	return ((value >> 24) & 0xff) |
-			((value >> 8) & 0xff00) |
-			((value << 8) & 0xff0000) |
-			((value << 24) & 0xff000000);
-}
-
 static struct fetch_result fetch_url(const char* url, CURL* curl_handle)
 {
 	struct fetch_result fetch = {
@@ -215,40 +215,21 @@ User* get_user(const WorkerInfo* worker_info, UserIntId int_id)
 	return user;
 }
 
-typedef struct placer_counts_entry {
-	UserIntId key; // user_int_id
-	uint32_t value; // pixels_placed
-} PlacerCountsEntry;
-
-struct top_placers get_top_placers(const WorkerInfo* worker_info, UserIntId* placers, size_t placers_size, size_t max_count)
+// Counts come from the packed placers' dictionary, so pixels never have to be counted one by one
+struct top_placers get_top_placers(const WorkerInfo* worker_info, const PlacerCounts* placer_counts, size_t max_count)
 {
-	if (!placers || placers_size == 0 || max_count == 0) {
+	if (!placer_counts || placer_counts->size == 0 || max_count == 0) {
 		struct top_placers result = { 0 };
 		return result;
 	}
 
-	// Count placer occurrances
-	PlacerCountsEntry* placer_counts_map = NULL;
-	for (uint32_t i = 0; i < placers_size; i++) {
-		UserIntId user_int_id = placers[i];
-		PlacerCountsEntry* entry = hmgetp_null(placer_counts_map, user_int_id);
-		if (!entry) {
-			hmput(placer_counts_map, user_int_id, 1);
-		}
-		else {
-			uint32_t current_placed = entry->value;
-			hmput(placer_counts_map, user_int_id, current_placed + 1);
-
-		}
-	}
-
 	Placer* top_placers = calloc(max_count, sizeof(User));
 
 	// Iterate placer counts hashmap (once)
 	size_t current_count = 0;
-	for (int i = 0; i < hmlen(placer_counts_map); i++) {
-		UserIntId user_int_id = placer_counts_map[i].key;
-		uint32_t placed = placer_counts_map[i].value;
+	for (size_t i = 0; i < placer_counts->size; i++) {
+		UserIntId user_int_id = placer_counts->int_ids[i];
+		uint32_t placed = placer_counts->counts[i];
 
 		// Find insertion position
 		size_t insert_pos = current_count;
@@ -299,11 +280,98 @@ struct top_placers get_top_placers(const WorkerInfo* worker_info, UserIntId* pla
 		} 
 	}
 
-	hmfree(placer_counts_map);
-	struct top_placers result = { .placers = top_placers, .size = max_count };
+	struct top_placers result = { .placers = top_placers, .size = current_count };
 	return result;
 }
 
+// Seeded with the metadata a download is rendered with, so that equal hashes also mean equal renders
+static uint64_t hash_download(const CanvasMetadata* metadata, struct fetch_result data)
+{
+	uint64_t seed = ((uint64_t) (uint32_t) metadata->width << 32) | (uint32_t) metadata->height;
+	seed = xxhash64(metadata->palette, sizeof(Colour) * (size_t) metadata->palette_size, seed);
+	uint64_t hash = xxhash64(data.memory, data.size, seed);
+	return hash != 0 ? hash : 1; // Zero means unhashed
+}
+
+// Reuses the saves of the first commit with identical content instead of saving the download again,
+// returns that commit, or -1 if this content hasn't been saved before
+static int reference_duplicate_download(int commit_id, uint64_t content_hash, SaveJobType type)
+{
+	int duplicate_commit_id = find_content_hash(content_hash, type);
+	if (duplicate_commit_id == -1 || duplicate_commit_id == commit_id
+		|| !add_save_reference_to_db(commit_id, duplicate_commit_id, type)) {
+		return -1;
+	}
+	return duplicate_commit_id;
+}
+
+// Canvases the codec won't be given must still be skipped, otherwise every later canvas is held back
+static void skip_canvas_codec(DownloadJob job)
+{
+	if (!is_canvas_codec_running()) {
+		return;
+	}
+	SaveJob skip_job = {
+		.commit_id = job.commit_id,
+		.commit_hash = job.commit_hash,
+		.date = job.date,
+		.frame_index = job.frame_index,
+		.type = SAVE_CANVAS_DOWNLOAD,
+		.data = NULL,
+		.size = 0
+	};
+	push_save_stack(skip_job);
+}
+
+// Board data is copied, a download without any memory skips this commit's heatmap frame
+static DownloadResult create_heatmap_result(DownloadJob job, int width, int height, struct fetch_result canvas_data)
+{
+	uint8_t* board = NULL;
+	if (canvas_data.memory != NULL && (size_t) width * (size_t) height <= canvas_data.size) {
+		board = malloc((size_t) width * (size_t) height);
+		if (board != NULL) {
+			memcpy(board, canvas_data.memory, (size_t) width * (size_t) height);
+		}
+	}
+
+	DownloadResult heatmap_result = {
+		// Inherited from WorkerResult
+		.download_error = DOWNLOAD_ERROR_NONE,
+		.error_msg = NULL,
+		// Members
+		.job_type = JOB_TYPE_RENDER,
+		.render_job = {
+			// Inherited from WorkerJob
+			.commit_id = job.commit_id,
+			.commit_hash = job.commit_hash,
+			.date = job.date,
+			.frame_index = job.frame_index,
+			// Members
+			.type = RENDER_HEATMAP,
+			.heatmap = {
+				.width = width,
+				.height = height,
+				.size = board == NULL ? 0 : (size_t) width * (size_t) height,
+				.data = board
+			}
+		}
+	};
+	return heatmap_result;
+}
+
+// Counted from its own copy, as the download itself may be freed or saved
+static void push_download_commit_stats(DownloadJob job, const CanvasMetadata* metadata, struct fetch_result canvas_data)
+{
+	size_t size = (size_t) metadata->width * (size_t) metadata->height;
+	uint8_t* board = canvas_data.size >= size ? malloc(size) : NULL;
+	if (board == NULL) {
+		skip_commit_stats(job.frame_index);
+		return;
+	}
+	memcpy(board, canvas_data.memory, size);
+	push_commit_stats(job.frame_index, job.commit_id, metadata->width, metadata->height, board, true);
+}
+
 DownloadResult* download(const WorkerInfo* worker_info, DownloadJob job)
 {
 	const Config* config = worker_info->config;
@@ -324,6 +392,7 @@ DownloadResult* download(const WorkerInfo* worker_info, DownloadJob job)
 	av_alist metadata_save_alist;
 	av_start_void(metadata_save_alist, &add_canvas_metadata_to_db);
 	av_struct(metadata_save_alist, CanvasMetadata, metadata); 
+	av_int(metadata_save_alist, job.commit_id);
 	database_thread_post(metadata_save_alist);
 
 	switch (job.type) {
@@ -341,7 +410,66 @@ DownloadResult* download(const WorkerInfo* worker_info, DownloadJob job)
 				return results;
 			}
 
+			// Changes are counted from canvases that are downloaded anyway, so a frame budget rarely needs a pass of its own
+			if (is_commit_stats_counting_downloads()) {
+				push_download_commit_stats(job, &metadata, canvas_data);
+			}
+
+			// The animated PNG takes the place of full canvas renders
 			DownloadResult* results = NULL;
+			bool animating = is_apng_writer_running();
+			if (animating) {
+				push_apng_writer(job.frame_index, metadata.width, metadata.height, canvas_data.memory,
+					canvas_data.size, metadata.palette, metadata.palette_size);
+			}
+			// The heatmap owns its own copy, as the download itself may be freed or saved
+			if (is_heatmap_running()) {
+				arrput(results, create_heatmap_result(job, metadata.width, metadata.height, canvas_data));
+			}
+			if ((animating || is_heatmap_running()) && check_save_exists(job.commit_id, SAVE_CANVAS_DOWNLOAD)) {
+				skip_canvas_codec(job);
+				free(canvas_data.memory);
+				return results;
+			}
+
+			// Identical canvases render identically, so the earlier render can be reused as well
+			uint64_t canvas_hash = hash_download(&metadata, canvas_data);
+			int duplicate_commit_id = reference_duplicate_download(job.commit_id, canvas_hash, SAVE_CANVAS_DOWNLOAD);
+			if (duplicate_commit_id != -1) {
+				skip_canvas_codec(job);
+				if (animating || add_save_reference_to_db(job.commit_id, duplicate_commit_id, SAVE_CANVAS_RENDER)) {
+					free(canvas_data.memory);
+					return results;
+				}
+
+				// The earlier render is missing, so only the render is still needed
+				DownloadResult canvas_render_result = {
+					// Inherited from WorkerResult
+					.download_error = DOWNLOAD_ERROR_NONE,
+					.error_msg = NULL,
+					// Members
+					.job_type = JOB_TYPE_RENDER,
+					.render_job = {
+						// Inherited from WorkerJob
+						.commit_id = job.commit_id,
+						.commit_hash = job.commit_hash,
+						.date = job.date,
+						// Members
+						.type = RENDER_CANVAS,
+						.canvas = {
+							.width = metadata.width,
+							.height = metadata.height,
+							.palette_size = metadata.palette_size,
+							.palette = metadata.palette,
+							.size = canvas_data.size,
+							.data = canvas_data.memory
+						}
+					}
+				};
+				arrput(results, canvas_render_result);
+				return results;
+			}
+
 			DownloadResult canvas_save_result = {
 				// Inherited from WorkerResult
 				.download_error = DOWNLOAD_ERROR_NONE,
@@ -353,13 +481,18 @@ DownloadResult* download(const WorkerInfo* worker_info, DownloadJob job)
 					.commit_id = job.commit_id,
 					.commit_hash = job.commit_hash,
 					.date = job.date,
+					.frame_index = job.frame_index,
 					// Members
 					.type = SAVE_CANVAS_DOWNLOAD,
 					.data = canvas_data.memory,
-					.size = canvas_data.size
+					.size = canvas_data.size,
+					.content_hash = canvas_hash
 				}
 			};
 			arrput(results, canvas_save_result);
+			if (animating) {
+				return results;
+			}
 
 			DownloadResult canvas_render_result = {
 				// Inherited from WorkerResult
@@ -387,6 +520,31 @@ DownloadResult* download(const WorkerInfo* worker_info, DownloadJob job)
 			arrput(results, canvas_render_result);
 			return results;
 		}
+		case DOWNLOAD_STATS: {
+			AUTOFREE char* canvas_url = NULL;
+			asprintf(&canvas_url, "%s/%s/place", config->download_base_url, job.commit_hash);
+
+			DownloadResult* results = NULL;
+			struct fetch_result canvas_data = fetch_url(canvas_url, instance->curl_handle);
+			if (canvas_data.error != CURLE_OK) {
+				char* error_msg = NULL;
+				asprintf(&error_msg, "Failed to fetch canvas data: %s", canvas_data.error_msg);
+				DownloadResult result = (DownloadResult) { .download_error = DOWNLOAD_FAIL_FETCH, .error_msg = error_msg };
+				arrput(results, result);
+				return results;
+			}
+			if (canvas_data.size < (size_t) metadata.width * (size_t) metadata.height) {
+				free(canvas_data.memory);
+				DownloadResult result = (DownloadResult) { .download_error = DOWNLOAD_FAIL_BADFILE, .error_msg = strdup("Canvas data was smaller than canvas dimensions") };
+				arrput(results, result);
+				return results;
+			}
+
+			// Nothing is saved, the canvas is only counted against the previous commit's
+			push_commit_stats(job.frame_index, job.commit_id, metadata.width, metadata.height, canvas_data.memory,
+				!job.stats_baseline);
+			return results;
+		}
 		case DOWNLOAD_PLACERS: {
 			AUTOFREE char* placers_url = NULL;
 			asprintf(&placers_url, "%s/%s/placers", config->download_base_url, job.commit_hash);
@@ -400,18 +558,35 @@ DownloadResult* download(const WorkerInfo* worker_info, DownloadJob job)
 				return results;
 			}
 
-			// Placers is big endian, we assume we are little endian, so a swap must be performed
-			uint32_t* placers_data_u32 = (uint32_t*)(void*)placers_data.memory;
-			UserIntId* placers = (UserIntId*) malloc(placers_data.size);
-			size_t placers_u32_size = placers_data.size / sizeof(UserIntId);
-			for (size_t i = 0; i < placers_u32_size; i++) {
-				placers[i] = swap32(placers_data_u32[i]);
+			// Identical placers render identically, so earlier renders can be reused as well. The text track
+			// needs every commit's top placers, so they are never skipped while it's running
+			DownloadResult* results = NULL;
+			bool texting = is_text_track_running();
+			uint64_t placers_hash = hash_download(&metadata, placers_data);
+			int duplicate_commit_id = reference_duplicate_download(job.commit_id, placers_hash, SAVE_PLACERS_DOWNLOAD);
+			bool top_placers_rendered = !texting && duplicate_commit_id != -1
+				&& add_save_reference_to_db(job.commit_id, duplicate_commit_id, SAVE_TOP_PLACERS_RENDER);
+			bool canvas_control_rendered = duplicate_commit_id != -1
+				&& add_save_reference_to_db(job.commit_id, duplicate_commit_id, SAVE_CANVAS_CONTROL_RENDER);
+			if (top_placers_rendered && canvas_control_rendered) {
+				free(placers_data.memory);
+				return results;
+			}
+
+			// Only the packed placers are kept, a fraction of the size of the download
+			PackedPlacers placers;
+			PlacerCounts placer_counts;
+			bool packed = pack_placers(placers_data.memory, placers_data.size, &placers, &placer_counts);
+			free(placers_data.memory);
+			if (!packed) {
+				DownloadResult result = (DownloadResult) { .download_error = DOWNLOAD_FAIL_PLACERS, .error_msg = strdup("Failed to pack placers data") };
+				arrput(results, result);
+				return results;
 			}
 
 			// Produce download result
-			DownloadResult* results = NULL;
-			struct top_placers top_placers = get_top_placers(worker_info, placers,
-				placers_u32_size, config->max_top_placers);
+			struct top_placers top_placers = get_top_placers(worker_info, &placer_counts, config->max_top_placers);
+			free_placer_counts(&placer_counts);
 
 			DownloadResult placers_save_result = {
 				// Inherited from WorkerResult
@@ -426,11 +601,14 @@ DownloadResult* download(const WorkerInfo* worker_info, DownloadJob job)
 					.date = job.date,
 					// Members
 					.type = SAVE_PLACERS_DOWNLOAD,
-					.data = placers_data.memory,
-					.size = placers_data.size
+					.data = placers.data,
+					.size = placers.size,
+					.content_hash = placers_hash
 				}
 			};
-			arrput(results, placers_save_result);
+			if (duplicate_commit_id == -1) {
+				arrput(results, placers_save_result);
+			}
 
 			DownloadResult top_placers_result = {
 				// Inherited from WorkerResult
@@ -451,7 +629,30 @@ DownloadResult* download(const WorkerInfo* worker_info, DownloadJob job)
 					}
 				}
 			};
-			arrput(results, top_placers_result);
+			DownloadResult text_track_result = {
+				// Inherited from WorkerResult
+				.download_error = DOWNLOAD_ERROR_NONE,
+				.error_msg = NULL,
+				// Members
+				.job_type = JOB_TYPE_SAVE,
+				.save_job = {
+					// Inherited from WorkerJob
+					.commit_id = job.commit_id,
+					.commit_hash = job.commit_hash,
+					.date = job.date,
+					.frame_index = job.frame_index,
+					// Members
+					.type = SAVE_TEXT_TRACK,
+					.top_placers = top_placers.placers,
+					.top_placers_size = top_placers.size
+				}
+			};
+			if (texting) {
+				arrput(results, text_track_result);
+			}
+			else if (!top_placers_rendered) {
+				arrput(results, top_placers_result);
+			}
 
 			DownloadResult canvas_control_result = {
 				// Inherited from WorkerResult
@@ -473,12 +674,155 @@ DownloadResult* download(const WorkerInfo* worker_info, DownloadJob job)
 						// Members
 						.width = metadata.width,
 						.height = metadata.height,
-						.placers = placers,
-						.placers_size = placers_u32_size
+						.packed_placers = placers
 					}
 				}
 			};
-			arrput(results, canvas_control_result);
+			if (!canvas_control_rendered) {
+				arrput(results, canvas_control_result);
+			}
+
+			// Duplicates with their canvas control already rendered leave nothing holding the packed placers, and the
+			// text track keeps its own copy of the top placers
+			if (duplicate_commit_id != -1 && canvas_control_rendered) {
+				free(placers.data);
+			}
+			if ((texting || top_placers_rendered) && canvas_control_rendered) {
+				free(top_placers.placers);
+			}
+			return results;
+		}
+		case DOWNLOAD_COMPOSITE: {
+			AUTOFREE char* canvas_url = NULL;
+			asprintf(&canvas_url, "%s/%s/place", config->download_base_url, job.commit_hash);
+			struct fetch_result canvas_data = fetch_url(canvas_url, instance->curl_handle);
+			if (canvas_data.error != CURLE_OK) {
+				char* error_msg = NULL;
+				asprintf(&error_msg, "Failed to fetch canvas data: %s", canvas_data.error_msg);
+				DownloadResult* results = NULL;
+				DownloadResult result = (DownloadResult) { .download_error = DOWNLOAD_FAIL_FETCH, .error_msg = error_msg };
+				arrput(results, result);
+				return results;
+			}
+
+			AUTOFREE char* placers_url = NULL;
+			asprintf(&placers_url, "%s/%s/placers", config->download_base_url, job.commit_hash);
+			struct fetch_result placers_data = fetch_url(placers_url, instance->curl_handle);
+			if (placers_data.error != CURLE_OK) {
+				free(canvas_data.memory);
+				char* error_msg = NULL;
+				asprintf(&error_msg, "Failed to fetch placers data: %s", placers_data.error_msg);
+				DownloadResult* results = NULL;
+				DownloadResult result = (DownloadResult) { .download_error = DOWNLOAD_FAIL_FETCH, .error_msg = error_msg };
+				arrput(results, result);
+				return results;
+			}
+
+			PackedPlacers placers;
+			PlacerCounts placer_counts;
+			uint64_t placers_hash = hash_download(&metadata, placers_data);
+			bool packed = pack_placers(placers_data.memory, placers_data.size, &placers, &placer_counts);
+			free(placers_data.memory);
+			if (!packed) {
+				free(canvas_data.memory);
+				DownloadResult* results = NULL;
+				DownloadResult result = (DownloadResult) { .download_error = DOWNLOAD_FAIL_PLACERS, .error_msg = strdup("Failed to pack placers data") };
+				arrput(results, result);
+				return results;
+			}
+			struct top_placers top_placers = get_top_placers(worker_info, &placer_counts, config->max_top_placers);
+			free_placer_counts(&placer_counts);
+			if (is_apng_writer_running()) {
+				push_apng_writer(job.frame_index, metadata.width, metadata.height, canvas_data.memory,
+					canvas_data.size, metadata.palette, metadata.palette_size);
+			}
+
+			// Raw downloads are still saved, unless identical to an earlier commit's. All render layers go
+			// into the single composite frame, which can't be reused as the date always differs
+			DownloadResult* results = NULL;
+			uint64_t canvas_hash = hash_download(&metadata, canvas_data);
+			bool canvas_duplicate = reference_duplicate_download(job.commit_id, canvas_hash, SAVE_CANVAS_DOWNLOAD) != -1;
+			bool placers_duplicate = reference_duplicate_download(job.commit_id, placers_hash, SAVE_PLACERS_DOWNLOAD) != -1;
+			DownloadResult canvas_save_result = {
+				// Inherited from WorkerResult
+				.download_error = DOWNLOAD_ERROR_NONE,
+				.error_msg = NULL,
+				// Members
+				.job_type = JOB_TYPE_SAVE,
+				.save_job = {
+					// Inherited from WorkerJob
+					.commit_id = job.commit_id,
+					.commit_hash = job.commit_hash,
+					.date = job.date,
+					// Members
+					.type = SAVE_CANVAS_DOWNLOAD,
+					.data = canvas_data.memory,
+					.size = canvas_data.size,
+					.content_hash = canvas_hash
+				}
+			};
+			if (!canvas_duplicate) {
+				arrput(results, canvas_save_result);
+			}
+
+			DownloadResult placers_save_result = {
+				// Inherited from WorkerResult
+				.download_error = DOWNLOAD_ERROR_NONE,
+				.error_msg = NULL,
+				// Members
+				.job_type = JOB_TYPE_SAVE,
+				.save_job = {
+					// Inherited from WorkerJob
+					.commit_id = job.commit_id,
+					.commit_hash = job.commit_hash,
+					.date = job.date,
+					// Members
+					.type = SAVE_PLACERS_DOWNLOAD,
+					.data = placers.data,
+					.size = placers.size,
+					.content_hash = placers_hash
+				}
+			};
+			if (!placers_duplicate) {
+				arrput(results, placers_save_result);
+			}
+
+			DownloadResult composite_result = {
+				// Inherited from WorkerResult
+				.download_error = DOWNLOAD_ERROR_NONE,
+				.error_msg = NULL,
+				// Members
+				.job_type = JOB_TYPE_RENDER,
+				.render_job = {
+					// Inherited from WorkerJob
+					.commit_id = job.commit_id,
+					.commit_hash = job.commit_hash,
+					.date = job.date,
+					.frame_index = job.frame_index,
+					// Members
+					.type = RENDER_COMPOSITE,
+					.composite = {
+						.canvas = {
+							.width = metadata.width,
+							.height = metadata.height,
+							.palette_size = metadata.palette_size,
+							.palette = metadata.palette,
+							.size = canvas_data.size,
+							.data = canvas_data.memory
+						},
+						.canvas_control = {
+							// Inherited from RenderJobTopPlacers
+							.top_placers = top_placers.placers,
+							.top_placers_size = top_placers.size,
+							// Members
+							.width = metadata.width,
+							.height = metadata.height,
+							.packed_placers = placers
+						}
+					}
+				}
+			};
+			arrput(results, composite_result);
 			return results;
 		}
 		default: {
@@ -527,6 +871,26 @@ void* start_download_worker(void* data)
 				log_message(LOG_ERROR, LOG_HEADER"Download %s failed with error %d message %s",
 					worker_info->worker_id, job.commit_hash, result.download_error, result.error_msg);
 				free(result.error_msg);
+				if (job.type == DOWNLOAD_COMPOSITE && is_frame_sink_running()) {
+					skip_frame_sink(job.frame_index);
+				}
+				if ((job.type == DOWNLOAD_CANVAS || job.type == DOWNLOAD_COMPOSITE) && is_apng_writer_running()) {
+					skip_apng_writer(job.frame_index);
+				}
+				if (job.type == DOWNLOAD_STATS || (job.type == DOWNLOAD_CANVAS && is_commit_stats_counting_downloads())) {
+					skip_commit_stats(job.frame_index);
+				}
+				if (job.type == DOWNLOAD_PLACERS && is_text_track_running()) {
+					skip_text_track(job.frame_index);
+				}
+				if (job.type == DOWNLOAD_CANVAS) {
+					skip_canvas_codec(job);
+				}
+				// Skipped through the render stack, where any frames waiting on this one are rendered
+				if (job.type == DOWNLOAD_CANVAS && is_heatmap_running()) {
+					DownloadResult skip_result = create_heatmap_result(job, 0, 0, (struct fetch_result) { 0 });
+					push_render_stack(skip_result.render_job);
+				}
 				continue;
 			}
 
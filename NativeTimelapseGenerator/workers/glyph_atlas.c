@@ -0,0 +1,231 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cairo/cairo.h>
+
+#include "glyph_atlas.h"
+
+// Offsets of the shadow & glow layers were tuned at a 96px font size, scale them with it
+static int effect_unit(int font_size)
+{
+	int unit = font_size / 48;
+	return unit < 1 ? 1 : unit;
+}
+
+static void draw_glyph_layers(cairo_t* effect_cr, cairo_t* text_cr, const GlyphAtlas* atlas, const char* glyph_text, double pen_x, double pen_y)
+{
+	int unit = effect_unit(atlas->font_size);
+
+	if (atlas->style == GLYPH_ATLAS_STYLE_SHADOW) {
+		// Draw drop shadow
+		cairo_set_source_rgba(effect_cr, 0, 0, 0, 0.5); // Black with 50% opacity
+		cairo_move_to(effect_cr, pen_x + unit, pen_y + unit); // Offset for shadow
+		cairo_show_text(effect_cr, glyph_text);
+
+		// Draw text
+		cairo_set_source_rgb(text_cr, 1, 1, 1); // White
+		cairo_move_to(text_cr, pen_x, pen_y);
+		cairo_show_text(text_cr, glyph_text);
+	}
+	else if (atlas->style == GLYPH_ATLAS_STYLE_GLOW) {
+		// Draw glow effect by layering text with decreasing opacity
+		for (int i = 6; i > 0; i--) {
+			cairo_set_source_rgba(effect_cr, 0, 1, 0, 0.05 + 0.1 * (6 - i));
+			cairo_move_to(effect_cr, pen_x, pen_y + i * unit);
+			cairo_show_text(effect_cr, glyph_text);
+		}
+
+		// Draw main text
+		cairo_set_source_rgb(text_cr, 0, 1, 0);
+		cairo_move_to(text_cr, pen_x, pen_y);
+		cairo_show_text(text_cr, glyph_text);
+	}
+}
+
+static cairo_t* create_atlas_context(uint32_t* pixels, const GlyphAtlas* atlas, cairo_surface_t** out_surface)
+{
+	cairo_font_weight_t weight = atlas->style == GLYPH_ATLAS_STYLE_GLOW
+		? CAIRO_FONT_WEIGHT_BOLD
+		: CAIRO_FONT_WEIGHT_NORMAL;
+	int width = atlas->stride;
+	int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+	cairo_surface_t* surface = cairo_image_surface_create_for_data((unsigned char*) pixels,
+		CAIRO_FORMAT_ARGB32, width, atlas->cell_height, stride);
+	cairo_t* cr = cairo_create(surface);
+
+	cairo_select_font_face(cr, "Monospace", CAIRO_FONT_SLANT_NORMAL, weight);
+	cairo_set_font_size(cr, atlas->font_size);
+	cairo_set_antialias(cr, CAIRO_ANTIALIAS_GRAY);
+
+	*out_surface = surface;
+	return cr;
+}
+
+GlyphAtlas* create_glyph_atlas(GlyphAtlasStyle style, int font_size)
+{
+	GlyphAtlas* atlas = calloc(1, sizeof(GlyphAtlas));
+	if (atlas == NULL) {
+		return NULL;
+	}
+	atlas->style = style;
+	atlas->font_size = font_size;
+
+	// Measure every glyph & the font once with a throwaway context
+	cairo_surface_t* measure_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
+	cairo_t* measure_cr = cairo_create(measure_surface);
+	cairo_select_font_face(measure_cr, "Monospace", CAIRO_FONT_SLANT_NORMAL,
+		style == GLYPH_ATLAS_STYLE_GLOW ? CAIRO_FONT_WEIGHT_BOLD : CAIRO_FONT_WEIGHT_NORMAL);
+	cairo_set_font_size(measure_cr, font_size);
+
+	cairo_font_extents_t font_extents;
+	cairo_font_extents(measure_cr, &font_extents);
+
+	double max_advance = 0;
+	char glyph_text[2] = { 0 };
+	for (int i = 0; i < GLYPH_ATLAS_SIZE; i++) {
+		glyph_text[0] = (char) (GLYPH_ATLAS_FIRST_CHAR + i);
+		cairo_text_extents_t text_extents;
+		cairo_text_extents(measure_cr, glyph_text, &text_extents);
+		atlas->extents[i] = (GlyphExtents) {
+			.x_bearing = text_extents.x_bearing,
+			.y_bearing = text_extents.y_bearing,
+			.width = text_extents.width,
+			.height = text_extents.height,
+			.x_advance = text_extents.x_advance
+		};
+		if (text_extents.x_advance > max_advance) {
+			max_advance = text_extents.x_advance;
+		}
+	}
+	cairo_destroy(measure_cr);
+	cairo_surface_destroy(measure_surface);
+
+	// Padding must fit the effect offsets as well as any ink overhanging the advance
+	int padding = font_size / 4 + 6 * effect_unit(font_size);
+	atlas->origin_x = padding;
+	atlas->origin_y = padding + (int) ceil(font_extents.ascent);
+	atlas->cell_width = (int) ceil(max_advance) + padding * 2;
+	atlas->cell_height = (int) ceil(font_extents.ascent + font_extents.descent) + padding * 2;
+	atlas->stride = atlas->cell_width * GLYPH_ATLAS_SIZE;
+
+	size_t pixel_count = (size_t) atlas->stride * (size_t) atlas->cell_height;
+	atlas->effect_pixels = calloc(pixel_count, sizeof(uint32_t));
+	atlas->text_pixels = calloc(pixel_count, sizeof(uint32_t));
+	if (atlas->effect_pixels == NULL || atlas->text_pixels == NULL) {
+		free_glyph_atlas(atlas);
+		return NULL;
+	}
+
+	// Rasterise each glyph into its own cell, so that cells never bleed into each other
+	cairo_surface_t* effect_surface = NULL;
+	cairo_surface_t* text_surface = NULL;
+	cairo_t* effect_cr = create_atlas_context(atlas->effect_pixels, atlas, &effect_surface);
+	cairo_t* text_cr = create_atlas_context(atlas->text_pixels, atlas, &text_surface);
+	for (int i = 0; i < GLYPH_ATLAS_SIZE; i++) {
+		glyph_text[0] = (char) (GLYPH_ATLAS_FIRST_CHAR + i);
+		double pen_x = i * atlas->cell_width + atlas->origin_x;
+		draw_glyph_layers(effect_cr, text_cr, atlas, glyph_text, pen_x, atlas->origin_y);
+	}
+	cairo_destroy(effect_cr);
+	cairo_destroy(text_cr);
+	cairo_surface_flush(effect_surface);
+	cairo_surface_flush(text_surface);
+	cairo_surface_destroy(effect_surface);
+	cairo_surface_destroy(text_surface);
+
+	return atlas;
+}
+
+void free_glyph_atlas(GlyphAtlas* atlas)
+{
+	if (atlas == NULL) {
+		return;
+	}
+	free(atlas->effect_pixels);
+	free(atlas->text_pixels);
+	free(atlas);
+}
+
+GlyphExtents measure_glyph_atlas_text(const GlyphAtlas* atlas, const char* text)
+{
+	GlyphExtents result = { 0 };
+	double min_x = INFINITY;
+	double min_y = INFINITY;
+	double max_x = -INFINITY;
+	double max_y = -INFINITY;
+	double pen_x = 0;
+
+	for (const char* c = text; *c != '\0'; c++) {
+		if (*c < GLYPH_ATLAS_FIRST_CHAR || *c > GLYPH_ATLAS_LAST_CHAR) {
+			continue;
+		}
+		const GlyphExtents* glyph = &atlas->extents[*c - GLYPH_ATLAS_FIRST_CHAR];
+		// Inkless glyphs (spaces) only contribute to the advance, like cairo_text_extents
+		if (glyph->width > 0 && glyph->height > 0) {
+			min_x = fmin(min_x, pen_x + glyph->x_bearing);
+			max_x = fmax(max_x, pen_x + glyph->x_bearing + glyph->width);
+			min_y = fmin(min_y, glyph->y_bearing);
+			max_y = fmax(max_y, glyph->y_bearing + glyph->height);
+		}
+		pen_x += glyph->x_advance;
+	}
+
+	result.x_advance = pen_x;
+	if (min_x <= max_x) {
+		result.x_bearing = min_x;
+		result.y_bearing = min_y;
+		result.width = max_x - min_x;
+		result.height = max_y - min_y;
+	}
+	return result;
+}
+
+static void blit_glyph_cell(const uint32_t* cell, int cell_stride, int cell_width, int cell_height,
+	uint32_t* pixels, int stride, int width, int height, int destination_x, int destination_y)
+{
+	int start_x = destination_x < 0 ? -destination_x : 0;
+	int start_y = destination_y < 0 ? -destination_y : 0;
+	int end_x = width - destination_x < cell_width ? width - destination_x : cell_width;
+	int end_y = height - destination_y < cell_height ? height - destination_y : cell_height;
+
+	for (int y = start_y; y < end_y; y++) {
+		const uint32_t* source_row = cell + (size_t) y * (size_t) cell_stride;
+		uint32_t* destination_row = pixels + (size_t) (destination_y + y) * (size_t) stride + destination_x;
+		for (int x = start_x; x < end_x; x++) {
+			uint32_t source = source_row[x];
+			if (source == 0) {
+				continue;
+			}
+			destination_row[x] = (source >> 24) == 255
+				? source
+				: blend_over_argb32(destination_row[x], source);
+		}
+	}
+}
+
+void draw_glyph_atlas_text(const GlyphAtlas* atlas, const char* text, uint32_t* pixels, int stride, int width, int height)
+{
+	// Calculate text position with proper alignment
+	GlyphExtents extents = measure_glyph_atlas_text(atlas, text);
+	double x = floor((width - extents.width) / 2 - extents.x_bearing);
+	double y = floor((height - extents.height) / 2 - extents.y_bearing);
+
+	// Effect layer of every glyph goes beneath the text layer of every glyph, as when drawn with cairo
+	const uint32_t* layers[] = { atlas->effect_pixels, atlas->text_pixels };
+	for (size_t layer = 0; layer < sizeof(layers) / sizeof(layers[0]); layer++) {
+		double pen_x = x;
+		for (const char* c = text; *c != '\0'; c++) {
+			if (*c < GLYPH_ATLAS_FIRST_CHAR || *c > GLYPH_ATLAS_LAST_CHAR) {
+				continue;
+			}
+			int glyph_index = *c - GLYPH_ATLAS_FIRST_CHAR;
+			const GlyphExtents* glyph = &atlas->extents[glyph_index];
+			if (glyph->width > 0 && glyph->height > 0) {
+				const uint32_t* cell = layers[layer] + (size_t) glyph_index * (size_t) atlas->cell_width;
+				blit_glyph_cell(cell, atlas->stride, atlas->cell_width, atlas->cell_height, pixels, stride, width, height,
+					(int) lround(pen_x) - atlas->origin_x, (int) y - atlas->origin_y);
+			}
+			pen_x += glyph->x_advance;
+		}
+	}
+}
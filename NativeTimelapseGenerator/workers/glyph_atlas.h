@@ -0,0 +1,56 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Printable ASCII, covers everything strftime & the top placers text can produce
+#define GLYPH_ATLAS_FIRST_CHAR ' '
+#define GLYPH_ATLAS_LAST_CHAR '~'
+#define GLYPH_ATLAS_SIZE (GLYPH_ATLAS_LAST_CHAR - GLYPH_ATLAS_FIRST_CHAR + 1)
+
+typedef enum glyph_atlas_style:uint8_t {
+	GLYPH_ATLAS_STYLE_SHADOW = 0, // White text with a 50% opacity black drop shadow
+	GLYPH_ATLAS_STYLE_GLOW = 1 // Bold green text with a layered downwards glow
+} GlyphAtlasStyle;
+
+typedef struct glyph_extents {
+	double x_bearing;
+	double y_bearing;
+	double width;
+	double height;
+	double x_advance;
+} GlyphExtents;
+
+// Pre-rasterised glyphs for a single font & style, rendered once with cairo and
+// then composited into frames without touching cairo again
+typedef struct glyph_atlas {
+	GlyphAtlasStyle style;
+	int font_size;
+	// Every glyph occupies a cell_width * cell_height cell, with the pen at (origin_x, origin_y)
+	int cell_width;
+	int cell_height;
+	int origin_x;
+	int origin_y;
+	int stride; // In pixels
+	GlyphExtents extents[GLYPH_ATLAS_SIZE];
+	// Premultiplied ARGB32, effect layer (shadow / glow) is composited beneath the text layer
+	uint32_t* effect_pixels;
+	uint32_t* text_pixels;
+} GlyphAtlas;
+
+// Premultiplied ARGB32 source-over
+static inline uint32_t blend_over_argb32(uint32_t destination, uint32_t source)
+{
+	uint32_t inverse_alpha = 255 - (source >> 24);
+	uint32_t rb = (destination & 0x00FF00FF) * inverse_alpha;
+	uint32_t ag = ((destination >> 8) & 0x00FF00FF) * inverse_alpha;
+	rb = ((rb + ((rb >> 8) & 0x00FF00FF) + 0x00800080) >> 8) & 0x00FF00FF;
+	ag = (ag + ((ag >> 8) & 0x00FF00FF) + 0x00800080) & 0xFF00FF00;
+	return source + rb + ag;
+}
+
+GlyphAtlas* create_glyph_atlas(GlyphAtlasStyle style, int font_size);
+void free_glyph_atlas(GlyphAtlas* atlas);
+// Equivalent to cairo_text_extents for a string drawn with the atlas' font
+GlyphExtents measure_glyph_atlas_text(const GlyphAtlas* atlas, const char* text);
+// Composites text centred within a premultiplied ARGB32 buffer, characters outside of the atlas are skipped
+void draw_glyph_atlas_text(const GlyphAtlas* atlas, const char* text, uint32_t* pixels, int stride, int width, int height);
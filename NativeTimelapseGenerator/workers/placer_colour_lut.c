@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "placer_colour_lut.h"
+#include "../lib/stb/stb_ds.h"
+
+bool init_placer_colour_lut(PlacerColourLut* lut)
+{
+	lut->pages = malloc(sizeof(uint8_t*) * PLACER_LUT_PAGE_COUNT);
+	lut->empty_page = calloc(PLACER_LUT_PAGE_SIZE, sizeof(uint8_t));
+	lut->used_pages = NULL;
+	lut->free_pages = NULL;
+	if (lut->pages == NULL || lut->empty_page == NULL) {
+		return false;
+	}
+	for (int i = 0; i < PLACER_LUT_PAGE_COUNT; i++) {
+		lut->pages[i] = lut->empty_page;
+	}
+	return true;
+}
+
+void free_placer_colour_lut(PlacerColourLut* lut)
+{
+	for (int i = 0; i < arrlen(lut->used_pages); i++) {
+		free(lut->pages[lut->used_pages[i]]);
+	}
+	for (int i = 0; i < arrlen(lut->free_pages); i++) {
+		free(lut->free_pages[i]);
+	}
+	arrfree(lut->used_pages);
+	arrfree(lut->free_pages);
+	free(lut->pages);
+	free(lut->empty_page);
+	*lut = (PlacerColourLut) { 0 };
+}
+
+bool fill_placer_colour_lut(PlacerColourLut* lut, const Placer* top_placers, int top_placers_size)
+{
+	if (lut->pages == NULL) {
+		return false;
+	}
+
+	// Return pages used by the previous job to the pool
+	for (int i = 0; i < arrlen(lut->used_pages); i++) {
+		int page_number = lut->used_pages[i];
+		memset(lut->pages[page_number], 0, PLACER_LUT_PAGE_SIZE);
+		arrput(lut->free_pages, lut->pages[page_number]);
+		lut->pages[page_number] = lut->empty_page;
+	}
+	arrclear(lut->used_pages);
+
+	for (int i = 0; i < top_placers_size; i++) {
+		UserIntId int_id = top_placers[i].int_id;
+		int page_number = (int) (int_id >> PLACER_LUT_PAGE_BITS);
+		if (lut->pages[page_number] == lut->empty_page) {
+			uint8_t* page = arrlen(lut->free_pages) > 0
+				? arrpop(lut->free_pages)
+				: calloc(PLACER_LUT_PAGE_SIZE, sizeof(uint8_t));
+			if (page == NULL) {
+				return false;
+			}
+			lut->pages[page_number] = page;
+			arrput(lut->used_pages, page_number);
+		}
+		lut->pages[page_number][int_id & (PLACER_LUT_PAGE_SIZE - 1)] = (uint8_t) (i + 1);
+	}
+	return true;
+}
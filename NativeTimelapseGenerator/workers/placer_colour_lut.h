@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "worker_structs.h"
+
+#define PLACER_LUT_PAGE_BITS 16
+#define PLACER_LUT_PAGE_SIZE (1 << PLACER_LUT_PAGE_BITS)
+#define PLACER_LUT_PAGE_COUNT (1 << (32 - PLACER_LUT_PAGE_BITS))
+
+// Two level UserIntId -> palette index table. Pages without any top placer all point to the
+// same zeroed page, so a lookup is always two loads and never a branch or hash
+typedef struct placer_colour_lut
+{
+	uint8_t** pages; // PLACER_LUT_PAGE_COUNT entries
+	uint8_t* empty_page;
+	int* used_pages; // stb array, page numbers to reset before the next job
+	uint8_t** free_pages; // stb array, pooled pages
+} PlacerColourLut;
+
+bool init_placer_colour_lut(PlacerColourLut* lut);
+void free_placer_colour_lut(PlacerColourLut* lut);
+// Maps each top placer to palette index i + 1, leaving index 0 for everyone else
+bool fill_placer_colour_lut(PlacerColourLut* lut, const Placer* top_placers, int top_placers_size);
+
+static inline uint8_t lookup_placer_colour_lut(const PlacerColourLut* lut, UserIntId int_id)
+{
+	return lut->pages[int_id >> PLACER_LUT_PAGE_BITS][int_id & (PLACER_LUT_PAGE_SIZE - 1)];
+}
@@ -11,6 +11,7 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <cairo/cairo.h>
+#include <zlib.h>
 
 #include "worker_enums.h"
 #include "worker_structs.h"
@@ -19,10 +20,19 @@
 #include "../console.h"
 #include "../main_thread.h"
 #include "../memory_utils.h"
+#include "../frame_sink.h"
+#include "../heatmap.h"
+#include "../placers_codec.h"
 #include "../lib/stb/stb_ds.h"
 
 #define LOG_HEADER "[render worker %d] "
 
+#define DATE_IMAGE_WIDTH 1280
+#define DATE_IMAGE_HEIGHT 128
+#define DATE_FONT_SIZE 96
+#define TOP_PLACERS_IMAGE_WIDTH 1280
+#define TOP_PLACERS_FONT_SIZE 96
+
 Colour default_palette[32] = {
 	{ .r = 109, .g = 0, .b = 26, .a = 255 },
 	{ .r = 190, .g = 0, .b = 57, .a = 255 },
@@ -66,38 +76,208 @@ struct image_result {
 	char* error_msg;
 };
 
-cairo_status_t cairo_write(void* closure, const unsigned char* data, unsigned int length)
+void write_encode_buffer(png_structp png_ptr, png_bytep data, size_t length)
+{
+	EncodeBuffer* buffer = (EncodeBuffer*) png_get_io_ptr(png_ptr);
+	if (buffer->failed) {
+		return;
+	}
+	if (buffer->size + length > buffer->capacity) {
+		size_t new_capacity = buffer->capacity == 0 ? 64 * 1024 : buffer->capacity;
+		while (new_capacity < buffer->size + length) {
+			new_capacity *= 2;
+		}
+		uint8_t* new_data = realloc(buffer->data, new_capacity);
+		if (new_data == NULL) {
+			// No setjmp is installed, so png_error would abort. The rest of the image is dropped & the failure reported once taken
+			buffer->failed = true;
+			return;
+		}
+		buffer->data = new_data;
+		buffer->capacity = new_capacity;
+	}
+	memcpy(buffer->data + buffer->size, data, length);
+	buffer->size += length;
+}
+
+void flush_encode_buffer(png_structp png_ptr)
+{
+}
+
+// Direct libpng output into the worker's scratch buffer
+void start_encode_buffer(png_structp png_ptr, EncodeBuffer* buffer)
+{
+	buffer->size = 0;
+	buffer->failed = false;
+	png_set_write_fn(png_ptr, buffer, write_encode_buffer, flush_encode_buffer);
+}
+
+// Copy encoded output out of the scratch buffer, as the result is owned by the save worker
+bool take_encode_buffer(EncodeBuffer* buffer, struct image_result* result)
+{
+	if (buffer->failed) {
+		result->data = NULL;
+		result->size = 0;
+		result->error = RENDER_FAIL_DRAW;
+		result->error_msg = strdup("Failed to grow encode buffer");
+		buffer->size = 0;
+		return false;
+	}
+	result->data = malloc(buffer->size);
+	if (result->data == NULL) {
+		result->error = RENDER_FAIL_DRAW;
+		result->error_msg = strdup("Failed to allocate encoded image");
+		return false;
+	}
+	memcpy(result->data, buffer->data, buffer->size);
+	result->size = buffer->size;
+	buffer->size = 0;
+	return true;
+}
+
+// Encodes a premultiplied ARGB32 buffer (cairo's native format) to an RGBA PNG
+struct image_result encode_argb32_image(RenderWorkerInstance* instance, const uint32_t* pixels, int stride, int width, int height, int compression_level)
+{
+	struct image_result result = { .error = RENDER_ERROR_NONE, .error_msg = NULL };
+
+	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (png_ptr == NULL) {
+		result.error = RENDER_FAIL_DRAW;
+		result.error_msg = strdup("PNG create write struct failed. png_ptr was null");
+		return result;
+	}
+
+	png_infop info_ptr = png_create_info_struct(png_ptr);
+	if (info_ptr == NULL) {
+		result.error = RENDER_FAIL_DRAW;
+		result.error_msg = strdup("PNG create info struct failed. info_ptr was null");
+		png_destroy_write_struct(&png_ptr, NULL);
+		return result;
+	}
+
+	AUTOFREE png_bytep row = malloc(sizeof(Colour) * (size_t) width);
+	if (row == NULL) {
+		result.error = RENDER_FAIL_DRAW;
+		result.error_msg = strdup("Failed to allocate image row");
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		return result;
+	}
+
+	start_encode_buffer(png_ptr, &instance->encode_buffer);
+	png_set_compression_level(png_ptr, compression_level);
+	png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(png_ptr, info_ptr);
+
+	// Unpremultiply each row into straight RGBA
+	for (int y = 0; y < height; y++) {
+		const uint32_t* source_row = pixels + (size_t) y * (size_t) stride;
+		for (int x = 0; x < width; x++) {
+			uint32_t pixel = source_row[x];
+			uint32_t alpha = pixel >> 24;
+			png_bytep channels = &row[sizeof(Colour) * x];
+			if (alpha == 0) {
+				memset(channels, 0, sizeof(Colour));
+				continue;
+			}
+			channels[0] = (png_byte) ((((pixel >> 16) & 0xFF) * 255 + alpha / 2) / alpha);
+			channels[1] = (png_byte) ((((pixel >> 8) & 0xFF) * 255 + alpha / 2) / alpha);
+			channels[2] = (png_byte) (((pixel & 0xFF) * 255 + alpha / 2) / alpha);
+			channels[3] = (png_byte) alpha;
+		}
+		png_write_row(png_ptr, row);
+	}
+	png_write_end(png_ptr, NULL);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+
+	if (!take_encode_buffer(&instance->encode_buffer, &result)) {
+		// Carries the error, so the worker loop logs it & queues no save, as for any other failed render
+		return result;
+	}
+	return result;
+}
+
+// Encodes a buffer of palette indices to a paletted PNG, rows are handed to libpng without any copy
+struct image_result encode_paletted_image(RenderWorkerInstance* instance, const uint8_t* pixels, int width, int height,
+	const png_color* palette, int palette_size)
 {
-	FILE* stream = (FILE*) closure;
-	if (fwrite(data, 1, length, stream) != length) {
-		return CAIRO_STATUS_WRITE_ERROR;
+	struct image_result result = { .error = RENDER_ERROR_NONE, .error_msg = NULL };
+
+	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (png_ptr == NULL) {
+		result.error = RENDER_FAIL_DRAW;
+		result.error_msg = strdup("PNG create write struct failed. png_ptr was null");
+		return result;
+	}
+
+	png_infop info_ptr = png_create_info_struct(png_ptr);
+	if (info_ptr == NULL) {
+		result.error = RENDER_FAIL_DRAW;
+		result.error_msg = strdup("PNG create info struct failed. info_ptr was null");
+		png_destroy_write_struct(&png_ptr, NULL);
+		return result;
+	}
+
+	start_encode_buffer(png_ptr, &instance->encode_buffer);
+	png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_set_PLTE(png_ptr, info_ptr, palette, palette_size);
+	png_write_info(png_ptr, info_ptr);
+	for (int y = 0; y < height; y++) {
+		png_write_row(png_ptr, pixels + (size_t) y * (size_t) width);
 	}
+	png_write_end(png_ptr, NULL);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
 
-	return CAIRO_STATUS_SUCCESS;
+	if (!take_encode_buffer(&instance->encode_buffer, &result)) {
+		// Carries the error, so the worker loop logs it & queues no save, as for any other failed render
+		return result;
+	}
+	return result;
 }
 
-struct image_result generate_top_placers_image(Placer* top_placers, size_t top_placers_size)
+struct image_result generate_top_placers_image(RenderWorkerInstance* instance, Placer* top_placers, size_t top_placers_size)
 {
 	struct image_result result = {
 		.error = RENDER_ERROR_NONE,
 		.error_msg = NULL
 	};
-	int font_size = 96;
-	int text_image_width = 1280;
+	int font_size = TOP_PLACERS_FONT_SIZE;
+	int text_image_width = TOP_PLACERS_IMAGE_WIDTH;
 	int text_image_height = font_size * (int)top_placers_size;
-	cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, text_image_width, text_image_height);
-	cairo_t* cr = cairo_create(surface);
+	if (text_image_height == 0) {
+		result.error = RENDER_FAIL_DRAW;
+		result.error_msg = strdup("Top placers list was empty");
+		return result;
+	}
 
-	// Transparent background
-	cairo_set_source_rgba(cr, 0, 0, 0, 0);
-	cairo_paint(cr);
+	// Surface & context live for as long as the worker, only regrown for longer lists
+	if (instance->top_placers_surface_height < text_image_height) {
+		if (instance->top_placers_cr != NULL) {
+			cairo_destroy(instance->top_placers_cr);
+			cairo_surface_destroy(instance->top_placers_surface);
+		}
+		if (instance->top_placers_font == NULL) {
+			instance->top_placers_font = cairo_toy_font_face_create("Monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+		}
+		instance->top_placers_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, text_image_width, text_image_height);
+		instance->top_placers_cr = cairo_create(instance->top_placers_surface);
+		instance->top_placers_surface_height = text_image_height;
 
-	// Set text color and font
-	cairo_select_font_face(cr, "Monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-	cairo_set_font_size(cr, font_size);
+		// Set text font
+		cairo_set_font_face(instance->top_placers_cr, instance->top_placers_font);
+		cairo_set_font_size(instance->top_placers_cr, font_size);
 
-	// Enable grayscale antialiasing
-	cairo_set_antialias(cr, CAIRO_ANTIALIAS_GRAY);
+		// Enable grayscale antialiasing
+		cairo_set_antialias(instance->top_placers_cr, CAIRO_ANTIALIAS_GRAY);
+	}
+	cairo_surface_t* surface = instance->top_placers_surface;
+	cairo_t* cr = instance->top_placers_cr;
+
+	// Transparent background, only the region that will be encoded needs clearing
+	cairo_surface_flush(surface);
+	uint8_t* surface_data = cairo_image_surface_get_data(surface);
+	int surface_stride = cairo_image_surface_get_stride(surface);
+	memset(surface_data, 0, (size_t) surface_stride * (size_t) text_image_height);
+	cairo_surface_mark_dirty(surface);
 
 	// Draw text
 	for (int i = 0; i < top_placers_size; i++) {
@@ -112,39 +292,43 @@ struct image_result generate_top_placers_image(Placer* top_placers, size_t top_p
 	}
 
 	// Finish drawing
-	cairo_destroy(cr);
+	cairo_surface_flush(surface);
 
-	// Write to memory buffer
-	unsigned char* buffer = NULL;
-	unsigned long buffer_size = 0;
-	FILE* memory_stream = open_memstream((char**) &buffer, &buffer_size);
-	if (memory_stream == NULL) {
-		result.error = RENDER_FAIL_DRAW;
-		result.error_msg = strdup("Failed to open date image memory stream");
-		cairo_surface_destroy(surface);
-		return result;
+	return encode_argb32_image(instance, (const uint32_t*)(void*) surface_data, surface_stride / (int) sizeof(uint32_t),
+		text_image_width, text_image_height, Z_DEFAULT_COMPRESSION);
+}
+
+static png_bytep get_row_buffer(RenderWorkerInstance* instance, size_t size)
+{
+	if (instance->row_buffer_size < size) {
+		png_bytep new_row_buffer = realloc(instance->row_buffer, size);
+		if (new_row_buffer == NULL) {
+			return NULL;
+		}
+		instance->row_buffer = new_row_buffer;
+		instance->row_buffer_size = size;
 	}
-	if (cairo_surface_write_to_png_stream(surface, cairo_write, memory_stream) != CAIRO_STATUS_SUCCESS) {
-		result.error = RENDER_FAIL_DRAW;
-		result.error_msg = strdup("Failed to write to date image memory stream");
-		fclose(memory_stream);
-		cairo_surface_destroy(surface);
-		return result;
+	return instance->row_buffer;
+}
+
+// Clips the configured crop to the canvas, a zero sized crop covers the whole canvas. False if nothing is left
+static bool get_crop_region(const FrameRect* crop, int width, int height, FrameRect* out_region)
+{
+	if (crop == NULL || crop->width <= 0 || crop->height <= 0) {
+		*out_region = (FrameRect) { .x = 0, .y = 0, .width = width, .height = height };
+		return width > 0 && height > 0;
 	}
-	fclose(memory_stream);
-	cairo_surface_destroy(surface);
 
-	result.data = buffer;
-	result.size = buffer_size;
-	return result;
+	int start_x = crop->x < 0 ? 0 : crop->x;
+	int start_y = crop->y < 0 ? 0 : crop->y;
+	int end_x = crop->x + crop->width > width ? width : crop->x + crop->width;
+	int end_y = crop->y + crop->height > height ? height : crop->y + crop->height;
+	*out_region = (FrameRect) { .x = start_x, .y = start_y, .width = end_x - start_x, .height = end_y - start_y };
+	return out_region->width > 0 && out_region->height > 0;
 }
 
-typedef struct {
-	UserIntId key;	// int_id
-	Placer*  value;	// Pointer to the placer
-} PlacerLookupEntry;
-
-struct image_result generate_canvas_control_image(int width, int height, uint32_t* placers, Placer* top_placers, int top_placers_size)
+struct image_result generate_canvas_control_image(RenderWorkerInstance* instance, int width, int height, uint32_t* placers, size_t placers_size,
+	Placer* top_placers, int top_placers_size, const FrameRect* crop, int scale)
 {
 	struct image_result result = { .error = RENDER_ERROR_NONE, .error_msg = NULL };
 	if (width == 0 || height == 0) {
@@ -152,6 +336,41 @@ struct image_result generate_canvas_control_image(int width, int height, uint32_
 		result.error_msg = strdup("Placers width or height was zero");
 		return result;
 	}
+	if (placers_size < (size_t) width * (size_t) height) {
+		result.error = RENDER_FAIL_DRAW;
+		result.error_msg = strdup("Placers data was smaller than canvas dimensions");
+		return result;
+	}
+	// Only the cropped region is ever expanded, each of its pixels becomes a scale * scale block
+	FrameRect region;
+	if (!get_crop_region(crop, width, height, &region)) {
+		result.error = RENDER_FAIL_DRAW;
+		result.error_msg = strdup("Crop region was outside of the canvas");
+		return result;
+	}
+	if (scale < 1) {
+		scale = 1;
+	}
+	int output_width = region.width * scale;
+	int output_height = region.height * scale;
+	// Palette index 0 is reserved for transparent pixels
+	if (top_placers_size > PNG_MAX_PALETTE_LENGTH - 1) {
+		top_placers_size = PNG_MAX_PALETTE_LENGTH - 1;
+	}
+
+	// Create a lookup table for top placers
+	if (!fill_placer_colour_lut(&instance->placer_lut, top_placers, top_placers_size)) {
+		result.error = RENDER_FAIL_DRAW;
+		result.error_msg = strdup("Failed to allocate top placers lookup table");
+		return result;
+	}
+
+	png_bytep row = get_row_buffer(instance, (size_t) output_width);
+	if (row == NULL) {
+		result.error = RENDER_FAIL_DRAW;
+		result.error_msg = strdup("Failed to allocate image row");
+		return result;
+	}
 
 	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
 	if (png_ptr == NULL) {
@@ -169,311 +388,915 @@ struct image_result generate_canvas_control_image(int width, int height, uint32_
 		return result;
 	}
 
-	char* stream_buffer = NULL;
-	size_t stream_length = 0;
-	FILE* memory_stream = open_memstream(&stream_buffer, &stream_length);
-	if (memory_stream == NULL) {
-		result.error = RENDER_FAIL_DRAW;
-		result.error_msg = strdup("Failed to open canvas image memory stream");
-		png_destroy_write_struct(&png_ptr, &info_ptr);
-		return result;
+	// Top placer colours are a palette, so rows are written as indices straight from the lookup table
+	png_color png_palette[PNG_MAX_PALETTE_LENGTH] = { 0 };
+	png_byte png_alpha[PNG_MAX_PALETTE_LENGTH] = { 0 };
+	for (int i = 0; i < top_placers_size; i++) {
+		Colour colour = top_placers[i].colour;
+		png_palette[i + 1] = (png_color) { .red = colour.r, .green = colour.g, .blue = colour.b };
+		png_alpha[i + 1] = colour.a;
 	}
 
-	png_init_io(png_ptr, memory_stream);
-	png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	start_encode_buffer(png_ptr, &instance->encode_buffer);
+	png_set_IHDR(png_ptr, info_ptr, output_width, output_height, 8, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_set_PLTE(png_ptr, info_ptr, png_palette, top_placers_size + 1);
+	png_set_tRNS(png_ptr, info_ptr, png_alpha, top_placers_size + 1, NULL);
 	png_write_info(png_ptr, info_ptr);
 
-	png_bytep row_pointers[height];
-
-	// Create a lookup table for top placers
-	PlacerLookupEntry* placers_lookup_map = NULL;
-	for (int i = 0; i < top_placers_size; i++) {
-		UserIntId int_id = top_placers[i].int_id;
-		hmput(placers_lookup_map, int_id, &top_placers[i]);
-	}
-
-	// Transform byte array data into PNG
-	for (int y = 0; y < height; y++) {
-		row_pointers[y] = (png_bytep) calloc(sizeof(Colour) * width, sizeof(png_byte));
-		for (int x = 0; x < width; x++) {
-			int index = y * width + x;
-			UserIntId user_int_id = placers[index];
-			Placer* top_placer = hmget(placers_lookup_map, user_int_id);
-			if (top_placer == NULL) {
-				memset(&row_pointers[y][sizeof(Colour) * x], 0, sizeof(Colour));
-				continue;
+	// Transform placer ids into palette indices, scaled rows are expanded once then written repeatedly
+	const PlacerColourLut* lut = &instance->placer_lut;
+	for (int y = region.y; y < region.y + region.height; y++) {
+		const UserIntId* placers_row = placers + (size_t) y * (size_t) width + region.x;
+		if (scale == 1) {
+			for (int x = 0; x < region.width; x++) {
+				row[x] = lookup_placer_colour_lut(lut, placers_row[x]);
 			}
-
-			for (size_t p = 0; p < sizeof(Colour); p++) { // r g b colour components
-				row_pointers[y][sizeof(Colour) * x + p] = top_placer->colour.channels[p];
+		}
+		else {
+			for (int x = 0; x < region.width; x++) {
+				memset(row + (size_t) x * (size_t) scale, lookup_placer_colour_lut(lut, placers_row[x]), (size_t) scale);
 			}
 		}
-	}
-
-	png_write_image(png_ptr, row_pointers);
-
-	for (int i = 0; i < height; i++) {
-		free(row_pointers[i]);
+		for (int repeat = 0; repeat < scale; repeat++) {
+			png_write_row(png_ptr, row);
+		}
 	}
 	png_write_end(png_ptr, NULL);
 
-	fflush(memory_stream);
-	fclose(memory_stream);
 	png_destroy_write_struct(&png_ptr, &info_ptr);
-	
-	result.data = (uint8_t*) stream_buffer;
-	result.size = stream_length;
+
+	if (!take_encode_buffer(&instance->encode_buffer, &result)) {
+		// Carries the error, so the worker loop logs it & queues no save, as for any other failed render
+		return result;
+	}
 	return result;
 }
 
-struct image_result generate_date_image(time_t date, int style)
+static void clear_date_cache(RenderWorkerInstance* instance)
+{
+	for (int i = 0; i < shlen(instance->date_cache); i++) {
+		free(instance->date_cache[i].value.data);
+	}
+	shfree(instance->date_cache);
+	sh_new_strdup(instance->date_cache);
+}
+
+struct image_result generate_date_image(RenderWorkerInstance* instance, time_t date, int style)
 {
 	struct image_result result = { .error = RENDER_ERROR_NONE, .error_msg = NULL };
+	if (style < 0 || style >= DATE_STYLE_COUNT) {
+		result.error = RENDER_FAIL_DRAW;
+		result.error_msg = strdup("Invalid date image style");
+		return result;
+	}
 
 	char date_text[64];
 	strftime(date_text, sizeof(date_text), "%a %d %b %Y %H:%M", gmtime(&date));
 
-	int text_image_width = 1280;
-	int text_image_height = 128;
-	cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, text_image_width, text_image_height);
-	cairo_t* cr = cairo_create(surface);
+	// Commits within the same minute produce identical images
+	char cache_key[80];
+	snprintf(cache_key, sizeof(cache_key), "%d:%s", style, date_text);
+	DateCacheEntry* cached = shgetp_null(instance->date_cache, cache_key);
+	if (cached != NULL) {
+		result.data = malloc(cached->value.size);
+		if (result.data == NULL) {
+			result.error = RENDER_FAIL_DRAW;
+			result.error_msg = strdup("Failed to allocate cached date image");
+			return result;
+		}
+		memcpy(result.data, cached->value.data, cached->value.size);
+		result.size = cached->value.size;
+		return result;
+	}
 
-	if (style == 0) {
-		// Transparent background
-		cairo_set_source_rgba(cr, 0, 0, 0, 0);
-		cairo_paint(cr);
+	GlyphAtlas* atlas = instance->date_atlases[style];
+	if (atlas == NULL) {
+		atlas = create_glyph_atlas((GlyphAtlasStyle) style, DATE_FONT_SIZE);
+		if (atlas == NULL) {
+			result.error = RENDER_FAIL_DRAW;
+			result.error_msg = strdup("Failed to create date glyph atlas");
+			return result;
+		}
+		instance->date_atlases[style] = atlas;
+	}
 
-		// Set text color and font
-		cairo_select_font_face(cr, "Monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-		cairo_set_font_size(cr, 96);
+	// Transparent background
+	memset(instance->date_pixels, 0, sizeof(uint32_t) * DATE_IMAGE_WIDTH * DATE_IMAGE_HEIGHT);
+	draw_glyph_atlas_text(atlas, date_text, instance->date_pixels, DATE_IMAGE_WIDTH, DATE_IMAGE_WIDTH, DATE_IMAGE_HEIGHT);
 
-		// Enable grayscale antialiasing
-		cairo_set_antialias(cr, CAIRO_ANTIALIAS_GRAY);
+	result = encode_argb32_image(instance, instance->date_pixels, DATE_IMAGE_WIDTH, DATE_IMAGE_WIDTH, DATE_IMAGE_HEIGHT, Z_BEST_SPEED);
+	if (result.error != RENDER_ERROR_NONE) {
+		return result;
+	}
 
-		// Calculate text position with proper alignment
-		cairo_text_extents_t extents;
-		cairo_text_extents(cr, date_text, &extents);
-		double x = floor((text_image_width - extents.width) / 2 - extents.x_bearing);
-		double y = floor((text_image_height - extents.height) / 2 - extents.y_bearing);
+	// Cache a private copy, as the result is handed over to the save worker
+	if (shlen(instance->date_cache) >= DATE_CACHE_MAX_ENTRIES) {
+		clear_date_cache(instance);
+	}
+	uint8_t* cache_data = malloc(result.size);
+	if (cache_data != NULL) {
+		memcpy(cache_data, result.data, result.size);
+		DateCacheEntry entry = { .key = cache_key, .value = { .data = cache_data, .size = result.size } };
+		shputs(instance->date_cache, entry);
+	}
+	return result;
+}
 
-		// Draw drop shadow
-		cairo_set_source_rgba(cr, 0, 0, 0, 0.5); // Black with 50% opacity
-		cairo_move_to(cr, x + 2, y + 2); // Offset for shadow
-		cairo_show_text(cr, date_text);
+// State of one output while its rows are being written
+struct canvas_output_state {
+	FrameRect region;
+	int upscale;
+	int downscale;
+	int output_width;
+	int output_height;
+	int rows_summed;
+	// ceil(2^32 / downscale^2), box sums (plus half for rounding) are divided through this
+	uint64_t reciprocal;
+	uint32_t half_area;
+	CanvasOutputBuffers* buffers;
+	png_structp png_ptr;
+	png_infop info_ptr;
+};
 
-		// Draw text
-		cairo_set_source_rgb(cr, 1, 1, 1); // White
-		cairo_move_to(cr, x, y);
-		cairo_show_text(cr, date_text);
+static void* reserve_output_buffer(void** buffer, size_t* buffer_size, size_t size)
+{
+	if (*buffer_size < size) {
+		void* new_buffer = realloc(*buffer, size);
+		if (new_buffer == NULL) {
+			return NULL;
+		}
+		*buffer = new_buffer;
+		*buffer_size = size;
 	}
-	else if (style == 1) {
-		// Transparent background
-		cairo_set_source_rgba(cr, 0, 0, 0, 0);
-		cairo_paint(cr);
+	return *buffer;
+}
 
-		// Set font and font size
-		cairo_select_font_face(cr, "Monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
-		cairo_set_font_size(cr, 96);
+// Adds every downscale wide block of source to its per channel sum, kept as plain byte loops to be auto-vectorised.
+// Channels are written out rather than looped over, as -O2 doesn't unroll the inner loop before vectorising
+static void accumulate_box_row(const uint8_t* restrict source, int output_width, int downscale, uint32_t* restrict sums)
+{
+	for (int x = 0; x < output_width; x++) {
+		const uint8_t* block = source + (size_t) x * (size_t) downscale * 4;
+		uint32_t* sum = sums + (size_t) x * 4;
+		for (int i = 0; i < downscale; i++) {
+			sum[0] += block[i * 4];
+			sum[1] += block[i * 4 + 1];
+			sum[2] += block[i * 4 + 2];
+			sum[3] += block[i * 4 + 3];
+		}
+	}
+}
 
-		// Enable grayscale antialiasing
-		cairo_set_antialias(cr, CAIRO_ANTIALIAS_GRAY);
+// Sums are below 256 * area, and area is at most 2^12, so the reciprocal multiply is an exact rounded division
+static void resolve_box_row(uint32_t* restrict sums, size_t count, uint64_t reciprocal, uint32_t half_area, uint8_t* restrict out)
+{
+	for (size_t i = 0; i < count; i++) {
+		out[i] = (uint8_t) (((uint64_t) (sums[i] + half_area) * reciprocal) >> 32);
+		sums[i] = 0;
+	}
+}
+
+static void upscale_row(const Colour* restrict source, int width, int upscale, Colour* restrict out)
+{
+	for (int x = 0; x < width; x++) {
+		for (int repeat = 0; repeat < upscale; repeat++) {
+			out[x * upscale + repeat] = source[x];
+		}
+	}
+}
 
-		// Calculate text position with proper alignment
-		cairo_text_extents_t extents;
-		cairo_text_extents(cr, date_text, &extents);
-		double x = floor((text_image_width - extents.width) / 2 - extents.x_bearing);
-		double y = floor((text_image_height - extents.height) / 2 - extents.y_bearing);
+static void destroy_canvas_outputs(struct canvas_output_state* states, int states_size)
+{
+	for (int i = 0; i < states_size; i++) {
+		png_destroy_write_struct(&states[i].png_ptr, &states[i].info_ptr);
+	}
+}
 
-		// Draw glow effect by layering text with decreasing opacity
-		for (int i = 6; i > 0; i--) {
-			cairo_set_source_rgba(cr, 0, 1, 0, 0.05 + 0.1 * (6 - i));
-			cairo_move_to(cr, x, y + i * 2);
-			cairo_show_text(cr, date_text);
+static bool start_canvas_output(RenderWorkerInstance* instance, int index, const RenderOutput* output, int width, int height,
+	struct canvas_output_state* state, struct image_result* result)
+{
+	*state = (struct canvas_output_state) { 0 };
+	if (!get_crop_region(&output->region, width, height, &state->region)) {
+		result->error = RENDER_FAIL_DRAW;
+		result->error_msg = strdup("Output region was outside of the canvas");
+		return false;
+	}
+	state->downscale = output->downscale < 1 ? 1 : output->downscale;
+	// Downscaling takes priority, the two are never combined
+	state->upscale = output->upscale < 1 || state->downscale > 1 ? 1 : output->upscale;
+	// Remaining columns & rows that don't fill a whole block are dropped
+	state->output_width = state->region.width / state->downscale * state->upscale;
+	state->output_height = state->region.height / state->downscale * state->upscale;
+	if (state->output_width == 0 || state->output_height == 0) {
+		result->error = RENDER_FAIL_DRAW;
+		result->error_msg = strdup("Output region was smaller than its downscale");
+		return false;
+	}
+	uint32_t area = (uint32_t) (state->downscale * state->downscale);
+	state->reciprocal = ((1ull << 32) + area - 1) / area;
+	state->half_area = area / 2;
+
+	CanvasOutputBuffers* buffers = &instance->canvas_output_buffers[index];
+	state->buffers = buffers;
+	size_t row_size = sizeof(Colour) * (size_t) state->output_width;
+	if (reserve_output_buffer((void**) &buffers->row, &buffers->row_size, row_size) == NULL) {
+		result->error = RENDER_FAIL_DRAW;
+		result->error_msg = strdup("Failed to allocate image row");
+		return false;
+	}
+	if (state->downscale > 1) {
+		size_t sums_size = sizeof(uint32_t) * 4 * (size_t) state->output_width;
+		if (reserve_output_buffer((void**) &buffers->sums, &buffers->sums_size, sums_size) == NULL) {
+			result->error = RENDER_FAIL_DRAW;
+			result->error_msg = strdup("Failed to allocate box filter row");
+			return false;
 		}
+		memset(buffers->sums, 0, sums_size);
+	}
 
-		// Draw main text
-		cairo_set_source_rgb(cr, 0, 1, 0);
-		cairo_move_to(cr, x, y);
-		cairo_show_text(cr, date_text);
+	state->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (state->png_ptr == NULL) {
+		result->error = RENDER_FAIL_DRAW;
+		result->error_msg = strdup("PNG create write struct failed. png_ptr was null");
+		return false;
+	}
+	state->info_ptr = png_create_info_struct(state->png_ptr);
+	if (state->info_ptr == NULL) {
+		result->error = RENDER_FAIL_DRAW;
+		result->error_msg = strdup("PNG create info struct failed. info_ptr was null");
+		return false;
 	}
 
-	// Finish drawing
-	cairo_destroy(cr);
+	start_encode_buffer(state->png_ptr, &buffers->encode_buffer);
+	png_set_IHDR(state->png_ptr, state->info_ptr, state->output_width, state->output_height, 8, PNG_COLOR_TYPE_RGBA,
+		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(state->png_ptr, state->info_ptr);
+	return true;
+}
 
-	// Write to memory buffer
-	unsigned char* buffer = NULL;
-	unsigned long buffer_size = 0;
-	FILE* memory_stream = open_memstream((char**) &buffer, &buffer_size);
-	if (memory_stream == NULL) {
-		result.error = RENDER_FAIL_DRAW;
-		result.error_msg = strdup("Failed to open date image memory stream");
-		cairo_surface_destroy(surface);
-		return result;
+// Hands a row of the canvas, already expanded to colours from the output's first column, to the output
+static void write_canvas_output_row(struct canvas_output_state* state, int y, const Colour* source)
+{
+	png_bytep row = state->buffers->row;
+	if (state->downscale > 1) {
+		if (y - state->region.y >= state->output_height * state->downscale) {
+			return;
+		}
+		accumulate_box_row((const uint8_t*) source, state->output_width, state->downscale, state->buffers->sums);
+		if (++state->rows_summed < state->downscale) {
+			return;
+		}
+		resolve_box_row(state->buffers->sums, 4 * (size_t) state->output_width, state->reciprocal, state->half_area, row);
+		state->rows_summed = 0;
+		png_write_row(state->png_ptr, row);
 	}
-	if (cairo_surface_write_to_png_stream(surface, cairo_write, memory_stream) != CAIRO_STATUS_SUCCESS) {
-		result.error = RENDER_FAIL_DRAW;
-		result.error_msg = strdup("Failed to write to date image memory stream");
-		fclose(memory_stream);
-		cairo_surface_destroy(surface);
-		return result;
+	else if (state->upscale > 1) {
+		upscale_row(source, state->region.width, state->upscale, (Colour*) row);
+		for (int repeat = 0; repeat < state->upscale; repeat++) {
+			png_write_row(state->png_ptr, row);
+		}
 	}
-	fclose(memory_stream);
-	cairo_surface_destroy(surface);
+	else {
+		png_write_row(state->png_ptr, (png_const_bytep) source);
+	}
+}
 
-	result.data = buffer;
-	result.size = buffer_size;
-	return result;
+// Produces every output from a single pass over the board, each board row is expanded to colours only once,
+// across the span covering every output. Fills one result per output, on failure only results[0] is set
+bool generate_canvas_images(RenderWorkerInstance* instance, int width, int height, uint8_t* board, size_t board_size,
+	int palette_size, Colour* palette, const RenderOutput* outputs, int outputs_size, struct image_result* results)
+{
+	results[0] = (struct image_result) { .error = RENDER_ERROR_NONE, .error_msg = NULL };
+	if (width == 0 || height == 0) {
+		results[0].error = RENDER_FAIL_DRAW;
+		results[0].error_msg = strdup("Board width or height was zero");
+		return false;
+	}
+	if (board_size < (size_t) width * (size_t) height) {
+		results[0].error = RENDER_FAIL_DRAW;
+		results[0].error_msg = strdup("Board data was smaller than canvas dimensions");
+		return false;
+	}
+	if (outputs_size < 1 || outputs_size > MAX_CANVAS_OUTPUTS) {
+		results[0].error = RENDER_FAIL_DRAW;
+		results[0].error_msg = strdup("Invalid number of canvas outputs");
+		return false;
+	}
+
+	// Grown up front, as each output's encode buffer is handed to libpng by address
+	while (arrlen(instance->canvas_output_buffers) < outputs_size) {
+		arrput(instance->canvas_output_buffers, (CanvasOutputBuffers) { 0 });
+	}
+
+	struct canvas_output_state states[MAX_CANVAS_OUTPUTS];
+	int span_start = width, span_end = 0, rows_start = height, rows_end = 0;
+	for (int i = 0; i < outputs_size; i++) {
+		if (!start_canvas_output(instance, i, &outputs[i], width, height, &states[i], &results[0])) {
+			destroy_canvas_outputs(states, i + 1);
+			return false;
+		}
+		FrameRect region = states[i].region;
+		span_start = region.x < span_start ? region.x : span_start;
+		span_end = region.x + region.width > span_end ? region.x + region.width : span_end;
+		rows_start = region.y < rows_start ? region.y : rows_start;
+		rows_end = region.y + region.height > rows_end ? region.y + region.height : rows_end;
+	}
+
+	Colour* row_colours = (Colour*) get_row_buffer(instance, sizeof(Colour) * (size_t) (span_end - span_start));
+	if (row_colours == NULL) {
+		destroy_canvas_outputs(states, outputs_size);
+		results[0].error = RENDER_FAIL_DRAW;
+		results[0].error_msg = strdup("Failed to allocate image row");
+		return false;
+	}
+
+	// Use default palette if provided palette is null or size is zero
+	if (palette == NULL || palette_size == 0) {
+		palette = default_palette;
+		palette_size = 32;
+	}
+	Colour colours[256];
+	for (int i = 0; i < 256; i++) {
+		colours[i] = palette[i < palette_size ? i : 0];
+	}
+
+	for (int y = rows_start; y < rows_end; y++) {
+		const uint8_t* board_row = board + (size_t) y * (size_t) width;
+		for (int x = span_start; x < span_end; x++) {
+			row_colours[x - span_start] = colours[board_row[x]];
+		}
+		for (int i = 0; i < outputs_size; i++) {
+			struct canvas_output_state* state = &states[i];
+			if (y >= state->region.y && y < state->region.y + state->region.height) {
+				write_canvas_output_row(state, y, row_colours + (state->region.x - span_start));
+			}
+		}
+	}
+
+	for (int i = 0; i < outputs_size; i++) {
+		png_write_end(states[i].png_ptr, NULL);
+	}
+	destroy_canvas_outputs(states, outputs_size);
+
+	for (int i = 0; i < outputs_size; i++) {
+		results[i] = (struct image_result) { .error = RENDER_ERROR_NONE, .error_msg = NULL };
+		if (!take_encode_buffer(&states[i].buffers->encode_buffer, &results[i])) {
+			for (int j = 0; j < i; j++) {
+				free(results[j].data);
+			}
+			results[0] = results[i];
+			return false;
+		}
+	}
+	return true;
 }
 
-struct image_result generate_canvas_image(int width, int height, uint8_t* board, int palette_size, Colour* palette)
+FrameLayout default_frame_layout(int width, int height, bool canvas_control)
 {
-	struct image_result result = {
-		.error = RENDER_ERROR_NONE,
-		.error_msg = NULL
+	FrameLayout layout = { .width = width, .height = height };
+
+	// Board takes the largest square it can, text & control view go in a side (or bottom) panel
+	FrameRect panel = { 0 };
+	if (width >= height) {
+		int panel_width = width - height < width / 4 ? width / 4 : width - height;
+		layout.board = (FrameRect) { .x = 0, .y = 0, .width = width - panel_width, .height = height };
+		panel = (FrameRect) { .x = width - panel_width, .y = 0, .width = panel_width, .height = height };
+	}
+	else {
+		int panel_height = height - width < height / 4 ? height / 4 : height - width;
+		layout.board = (FrameRect) { .x = 0, .y = 0, .width = width, .height = height - panel_height };
+		panel = (FrameRect) { .x = 0, .y = height - panel_height, .width = width, .height = panel_height };
+	}
+
+	int date_height = panel.height / 8;
+	layout.date = (FrameRect) { .x = panel.x, .y = panel.y, .width = panel.width, .height = date_height };
+	int top_placers_height = canvas_control ? panel.height * 3 / 8 : panel.height - date_height;
+	layout.top_placers = (FrameRect) { .x = panel.x, .y = panel.y + date_height, .width = panel.width, .height = top_placers_height };
+	if (canvas_control) {
+		int control_y = panel.y + date_height + top_placers_height;
+		layout.canvas_control = (FrameRect) { .x = panel.x, .y = control_y, .width = panel.width, .height = panel.y + panel.height - control_y };
+	}
+	return layout;
+}
+
+// Largest rect with the source's aspect ratio, centred within the layer's rect
+static FrameRect fit_frame_rect(FrameRect rect, int source_width, int source_height)
+{
+	double scale = fmin((double) rect.width / source_width, (double) rect.height / source_height);
+	int width = (int) (source_width * scale);
+	int height = (int) (source_height * scale);
+	return (FrameRect) {
+		.x = rect.x + (rect.width - width) / 2,
+		.y = rect.y + (rect.height - height) / 2,
+		.width = width,
+		.height = height
 	};
-	if (width == 0 || height == 0) {
+}
+
+static const int* get_scale_map(RenderWorkerInstance* instance, int source_width, int destination_width)
+{
+	if (instance->scale_map_size < (size_t) destination_width) {
+		int* new_scale_map = realloc(instance->scale_map, sizeof(int) * (size_t) destination_width);
+		if (new_scale_map == NULL) {
+			return NULL;
+		}
+		instance->scale_map = new_scale_map;
+		instance->scale_map_size = (size_t) destination_width;
+	}
+	for (int x = 0; x < destination_width; x++) {
+		instance->scale_map[x] = (int) ((int64_t) x * source_width / destination_width);
+	}
+	return instance->scale_map;
+}
+
+static uint32_t premultiply_argb32(Colour colour)
+{
+	uint32_t alpha = colour.a;
+	uint32_t red = (colour.r * alpha + 127) / 255;
+	uint32_t green = (colour.g * alpha + 127) / 255;
+	uint32_t blue = (colour.b * alpha + 127) / 255;
+	return (alpha << 24) | (red << 16) | (green << 8) | blue;
+}
+
+static bool draw_frame_board(RenderWorkerInstance* instance, uint32_t* frame, int frame_stride, FrameRect rect, const RenderJobCanvas* canvas,
+	const FrameRect* crop)
+{
+	FrameRect region;
+	if (canvas->size < (size_t) canvas->width * (size_t) canvas->height
+		|| !get_crop_region(crop, canvas->width, canvas->height, &region)) {
+		return false;
+	}
+
+	// Use default palette if provided palette is null or size is zero
+	const Colour* palette = canvas->palette;
+	int palette_size = canvas->palette_size;
+	if (palette == NULL || palette_size == 0) {
+		palette = default_palette;
+		palette_size = 32;
+	}
+	uint32_t colours[256];
+	for (int i = 0; i < 256; i++) {
+		colours[i] = premultiply_argb32(palette[i < palette_size ? i : 0]);
+	}
+
+	FrameRect fit = fit_frame_rect(rect, region.width, region.height);
+	const int* scale_map = get_scale_map(instance, region.width, fit.width);
+	if (scale_map == NULL) {
+		return false;
+	}
+	for (int y = 0; y < fit.height; y++) {
+		int source_y = region.y + (int) ((int64_t) y * region.height / fit.height);
+		const uint8_t* source_row = canvas->data + (size_t) source_y * (size_t) canvas->width + region.x;
+		uint32_t* destination_row = frame + (size_t) (fit.y + y) * (size_t) frame_stride + fit.x;
+		for (int x = 0; x < fit.width; x++) {
+			destination_row[x] = colours[source_row[scale_map[x]]];
+		}
+	}
+	return true;
+}
+
+static bool draw_frame_canvas_control(RenderWorkerInstance* instance, uint32_t* frame, int frame_stride, FrameRect rect, const RenderJobCanvasControl* canvas_control,
+	const FrameRect* crop)
+{
+	int width = canvas_control->width;
+	int height = canvas_control->height;
+	FrameRect region;
+	if (canvas_control->placers_size < (size_t) width * (size_t) height
+		|| !get_crop_region(crop, width, height, &region)) {
+		return false;
+	}
+	int top_placers_size = (int) canvas_control->top_placers_size;
+	if (top_placers_size > 255) {
+		top_placers_size = 255;
+	}
+	if (!fill_placer_colour_lut(&instance->placer_lut, canvas_control->top_placers, top_placers_size)) {
+		return false;
+	}
+	uint32_t colours[256] = { 0 };
+	for (int i = 0; i < top_placers_size; i++) {
+		colours[i + 1] = premultiply_argb32(canvas_control->top_placers[i].colour);
+	}
+
+	FrameRect fit = fit_frame_rect(rect, region.width, region.height);
+	const int* scale_map = get_scale_map(instance, region.width, fit.width);
+	if (scale_map == NULL) {
+		return false;
+	}
+	const PlacerColourLut* lut = &instance->placer_lut;
+	for (int y = 0; y < fit.height; y++) {
+		int source_y = region.y + (int) ((int64_t) y * region.height / fit.height);
+		const UserIntId* source_row = canvas_control->placers + (size_t) source_y * (size_t) width + region.x;
+		uint32_t* destination_row = frame + (size_t) (fit.y + y) * (size_t) frame_stride + fit.x;
+		for (int x = 0; x < fit.width; x++) {
+			uint32_t colour = colours[lookup_placer_colour_lut(lut, source_row[scale_map[x]])];
+			if (colour != 0) {
+				destination_row[x] = blend_over_argb32(destination_row[x], colour);
+			}
+		}
+	}
+	return true;
+}
+
+static bool draw_frame_date(RenderWorkerInstance* instance, uint32_t* frame, int frame_stride, FrameRect rect, time_t date)
+{
+	// Monospace glyphs advance ~0.6em, and the date text is at most 21 characters wide
+	int font_size = rect.height * 3 / 4;
+	if (font_size > rect.width * 10 / (6 * 22)) {
+		font_size = rect.width * 10 / (6 * 22);
+	}
+	if (font_size <= 0) {
+		return true;
+	}
+	if (instance->frame_date_atlas == NULL || instance->frame_date_atlas->font_size != font_size) {
+		free_glyph_atlas(instance->frame_date_atlas);
+		instance->frame_date_atlas = create_glyph_atlas(GLYPH_ATLAS_STYLE_SHADOW, font_size);
+		if (instance->frame_date_atlas == NULL) {
+			return false;
+		}
+	}
+
+	char date_text[64];
+	strftime(date_text, sizeof(date_text), "%a %d %b %Y %H:%M", gmtime(&date));
+	uint32_t* layer = frame + (size_t) rect.y * (size_t) frame_stride + rect.x;
+	draw_glyph_atlas_text(instance->frame_date_atlas, date_text, layer, frame_stride, rect.width, rect.height);
+	return true;
+}
+
+static bool draw_frame_top_placers(RenderWorkerInstance* instance, uint32_t* frame, int frame_stride, FrameRect rect, const Placer* top_placers, size_t top_placers_size)
+{
+	if (top_placers_size == 0) {
+		return true;
+	}
+	// Fit a typical "name (#id) : count pixels" line of ~40 characters, each ~0.6 of the font size wide, across the layer
+	int font_size = rect.height / (int) top_placers_size;
+	if (font_size > rect.width / 24) {
+		font_size = rect.width / 24;
+	}
+	if (font_size > TOP_PLACERS_FONT_SIZE) {
+		font_size = TOP_PLACERS_FONT_SIZE;
+	}
+	if (font_size <= 0) {
+		return true;
+	}
+	if (instance->top_placers_font == NULL) {
+		instance->top_placers_font = cairo_toy_font_face_create("Monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+	}
+
+	// Draw straight into the frame, the wrapping surface doesn't own or copy any pixels
+	uint32_t* layer = frame + (size_t) rect.y * (size_t) frame_stride + rect.x;
+	cairo_surface_t* surface = cairo_image_surface_create_for_data((unsigned char*) layer, CAIRO_FORMAT_ARGB32,
+		rect.width, rect.height, frame_stride * (int) sizeof(uint32_t));
+	cairo_t* cr = cairo_create(surface);
+	cairo_set_font_face(cr, instance->top_placers_font);
+	cairo_set_font_size(cr, font_size);
+	cairo_set_antialias(cr, CAIRO_ANTIALIAS_GRAY);
+
+	cairo_font_extents_t font_extents;
+	cairo_font_extents(cr, &font_extents);
+	for (size_t i = 0; i < top_placers_size; i++) {
+		Placer placer = top_placers[i];
+		cairo_set_source_rgb(cr, placer.colour.r / 255.0, placer.colour.g / 255.0, placer.colour.b / 255.0);
+
+		AUTOFREE char* top_placer_text = NULL;
+		asprintf(&top_placer_text, "%s (#%d) : %d pixels", placer.chat_name, placer.int_id, placer.pixels_placed);
+
+		cairo_move_to(cr, 0, (double) i * font_size + font_extents.ascent);
+		cairo_show_text(cr, top_placer_text);
+	}
+
+	cairo_destroy(cr);
+	cairo_surface_flush(surface);
+	cairo_surface_destroy(surface);
+	return true;
+}
+
+// Clips a layer to the frame, layers are drawn without bounds checks of their own. False if nothing is left
+static bool clip_frame_rect(FrameRect rect, int width, int height, FrameRect* out_rect)
+{
+	int start_x = rect.x < 0 ? 0 : rect.x;
+	int start_y = rect.y < 0 ? 0 : rect.y;
+	int end_x = rect.x + rect.width > width ? width : rect.x + rect.width;
+	int end_y = rect.y + rect.height > height ? height : rect.y + rect.height;
+	*out_rect = (FrameRect) { .x = start_x, .y = start_y, .width = end_x - start_x, .height = end_y - start_y };
+	return out_rect->width > 0 && out_rect->height > 0;
+}
+
+// Assembles every layer of a commit's frame into instance->frame_pixels, with a stride of the layout width
+struct image_result draw_composite_frame(RenderWorkerInstance* instance, const FrameLayout* layout, const FrameRect* crop, time_t date, RenderJobComposite* composite)
+{
+	struct image_result result = { .error = RENDER_ERROR_NONE, .error_msg = NULL };
+	if (layout->width <= 0 || layout->height <= 0) {
 		result.error = RENDER_FAIL_DRAW;
-		result.error_msg = strdup("Board width or height was zero");
+		result.error_msg = strdup("Frame layout width or height was zero");
 		return result;
 	}
 
-	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (png_ptr == NULL) {
+	size_t frame_pixels_size = (size_t) layout->width * (size_t) layout->height;
+	if (instance->frame_pixels_size < frame_pixels_size) {
+		uint32_t* new_frame_pixels = realloc(instance->frame_pixels, sizeof(uint32_t) * frame_pixels_size);
+		if (new_frame_pixels == NULL) {
+			result.error = RENDER_FAIL_DRAW;
+			result.error_msg = strdup("Failed to allocate frame");
+			return result;
+		}
+		instance->frame_pixels = new_frame_pixels;
+		instance->frame_pixels_size = frame_pixels_size;
+	}
+	uint32_t* frame = instance->frame_pixels;
+	int frame_stride = layout->width;
+
+	// Opaque black background
+	for (size_t i = 0; i < frame_pixels_size; i++) {
+		frame[i] = 0xFF000000;
+	}
+
+	FrameRect layer;
+	if (clip_frame_rect(layout->board, layout->width, layout->height, &layer)
+		&& !draw_frame_board(instance, frame, frame_stride, layer, &composite->canvas, crop)) {
 		result.error = RENDER_FAIL_DRAW;
-		result.error_msg = strdup("PNG create write struct failed. png_ptr was null");
-		png_destroy_write_struct(&png_ptr, NULL);
+		result.error_msg = strdup("Failed to draw frame board layer");
 		return result;
 	}
-
-	png_infop info_ptr = png_create_info_struct(png_ptr);
-	if (info_ptr == NULL) {
+	if (clip_frame_rect(layout->canvas_control, layout->width, layout->height, &layer)
+		&& !draw_frame_canvas_control(instance, frame, frame_stride, layer, &composite->canvas_control, crop)) {
 		result.error = RENDER_FAIL_DRAW;
-		result.error_msg = strdup("PNG create info struct failed. info_ptr was null");
-		png_destroy_write_struct(&png_ptr, NULL);
+		result.error_msg = strdup("Failed to draw frame canvas control layer");
 		return result;
 	}
-
-	char* stream_buffer = NULL;
-	size_t stream_length = 0;
-	FILE* memory_stream = open_memstream(&stream_buffer, &stream_length);
-	if (memory_stream == NULL) {
+	if (clip_frame_rect(layout->date, layout->width, layout->height, &layer)
+		&& !draw_frame_date(instance, frame, frame_stride, layer, date)) {
 		result.error = RENDER_FAIL_DRAW;
-		result.error_msg = strdup("Failed to open canvas image memory stream");
-		png_destroy_write_struct(&png_ptr, &info_ptr);
+		result.error_msg = strdup("Failed to draw frame date layer");
+		return result;
+	}
+	if (clip_frame_rect(layout->top_placers, layout->width, layout->height, &layer)
+		&& !draw_frame_top_placers(instance, frame, frame_stride, layer,
+			composite->canvas_control.top_placers, composite->canvas_control.top_placers_size)) {
+		result.error = RENDER_FAIL_DRAW;
+		result.error_msg = strdup("Failed to draw frame top placers layer");
 		return result;
 	}
 
-	png_init_io(png_ptr, memory_stream);
-	png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-	png_write_info(png_ptr, info_ptr);
+	return result;
+}
 
-	png_bytep row_pointers[height];
-	
-	// Use default palette if provided palette is null or size is zero
-	if (palette == NULL || palette_size == 0) {
-		palette = default_palette;
-		palette_size = 32;
+// Only the final frame is ever encoded
+struct image_result generate_composite_image(RenderWorkerInstance* instance, const FrameLayout* layout, const FrameRect* crop, time_t date, RenderJobComposite* composite)
+{
+	struct image_result result = draw_composite_frame(instance, layout, crop, date, composite);
+	if (result.error != RENDER_ERROR_NONE) {
+		return result;
 	}
+	return encode_argb32_image(instance, instance->frame_pixels, layout->width, layout->width, layout->height, Z_DEFAULT_COMPRESSION);
+}
 
-	// Transform byte array data into PNG
-	for (int y = 0; y < height; y++) {
-		row_pointers[y] = (png_bytep) calloc(sizeof(Colour) * width, sizeof(png_byte));
-		for (int x = 0; x < width; x++) {
-			int index = y * width + x;
-			uint8_t colour_index = board[index];
-			if (colour_index >= palette_size) {
-				colour_index = 0;
-			}
-			for (int p = 0; p < sizeof(Colour); p++) { // r g b colour components
-				row_pointers[y][sizeof(Colour) * x + p] = palette[colour_index].channels[p];
-			}
-		}
+// Converts the frame on this worker, leaving the frame sink thread only to write it out
+struct image_result stream_composite_image(RenderWorkerInstance* instance, const FrameLayout* layout, const FrameRect* crop, time_t date, RenderJobComposite* composite, int frame_index)
+{
+	struct image_result result = draw_composite_frame(instance, layout, crop, date, composite);
+	if (result.error != RENDER_ERROR_NONE) {
+		return result;
 	}
 
-	png_write_image(png_ptr, row_pointers);
+	uint8_t* frame = malloc(get_frame_sink_frame_size(layout->width, layout->height));
+	if (frame == NULL) {
+		result.error = RENDER_FAIL_DRAW;
+		result.error_msg = strdup("Failed to allocate frame sink frame");
+		return result;
+	}
+	argb32_to_yuv420(instance->frame_pixels, layout->width, layout->width, layout->height, frame);
+	push_frame_sink(frame_index, frame);
+	return result;
+}
 
-	for (int i = 0; i < height; i++) {
-		free(row_pointers[i]);
+// Linear gradient through evenly spaced stops, level 0 is always the first stop
+static void fill_gradient_palette(png_color* palette, const png_color* stops, int stops_size)
+{
+	for (int i = 0; i < 256; i++) {
+		int position = i * (stops_size - 1);
+		int stop = position / 255;
+		int weight = position % 255;
+		png_color from = stops[stop];
+		png_color to = stops[stop + 1 < stops_size ? stop + 1 : stop];
+		palette[i] = (png_color) {
+			.red = (png_byte) ((from.red * (255 - weight) + to.red * weight + 127) / 255),
+			.green = (png_byte) ((from.green * (255 - weight) + to.green * weight + 127) / 255),
+			.blue = (png_byte) ((from.blue * (255 - weight) + to.blue * weight + 127) / 255)
+		};
 	}
-	png_write_end(png_ptr, NULL);
+}
 
-	fflush(memory_stream);
-	fclose(memory_stream);
-	png_destroy_write_struct(&png_ptr, &info_ptr);
-	
-	result.data = (uint8_t*) stream_buffer;
-	result.size = stream_length;
+// Heat runs from black (untouched) through red & yellow to white (most changed), age from dark blue
+// (changed long ago) to white (just changed), with pixels that never changed left black
+static void get_heatmap_palettes(png_color* heat_palette, png_color* age_palette)
+{
+	static const png_color heat_stops[] = { { 0, 0, 0 }, { 200, 0, 0 }, { 255, 200, 0 }, { 255, 255, 255 } };
+	static const png_color age_stops[] = { { 10, 10, 60 }, { 0, 120, 200 }, { 120, 230, 255 }, { 255, 255, 255 } };
+	fill_gradient_palette(heat_palette, heat_stops, 4);
+	fill_gradient_palette(age_palette, age_stops, 4);
+	age_palette[0] = (png_color) { 0, 0, 0 };
+}
+
+static RenderResult create_render_result(RenderJob job, SaveJobType save_type, struct image_result image, const char* variant)
+{
+	RenderResult result = {
+		// Inherited from WorkerResult
+		.render_error = RENDER_ERROR_NONE,
+		.error_msg = NULL,
+		// Members
+		.save_job = {
+			// Inherited from WorkerJob
+			.commit_id = job.commit_id,
+			.commit_hash = job.commit_hash,
+			.date = job.date,
+			// Members
+			.type = save_type,
+			.data = image.data,
+			.size = image.size,
+			.variant = variant
+		}
+	};
 	return result;
 }
 
-RenderResult render(RenderJob job)
+// Points the job's placers at the worker's own buffer, unpacked from its packed placers
+static bool unpack_job_placers(RenderWorkerInstance* instance, RenderJobCanvasControl* canvas_control)
+{
+	size_t length = get_packed_placers_length(&canvas_control->packed_placers);
+	if (length == 0) {
+		return false;
+	}
+	if (instance->placers_buffer_size < length) {
+		UserIntId* placers_buffer = realloc(instance->placers_buffer, length * sizeof(UserIntId));
+		if (placers_buffer == NULL) {
+			return false;
+		}
+		instance->placers_buffer = placers_buffer;
+		instance->placers_buffer_size = length;
+	}
+	if (!unpack_placers(&canvas_control->packed_placers, instance->placers_buffer, length)) {
+		return false;
+	}
+	canvas_control->placers = instance->placers_buffer;
+	canvas_control->placers_size = length;
+	return true;
+}
+
+// Returns stb array of results, one per image to save. Canvases produce one per configured output
+RenderResult* render(const WorkerInfo* worker_info, RenderJob job)
 {
+	RenderWorkerInstance* instance = worker_info->render_worker_instance;
+	const Config* config = worker_info->config;
 	SaveJobType save_type = { 0};
 	struct image_result image = { 0 };
+	RenderResult* results = NULL;
 
 	switch (job.type) {
 		case RENDER_CANVAS: {
-			image = generate_canvas_image(job.canvas.width, job.canvas.height,
-				job.canvas.data, job.canvas.size, job.canvas.palette);
-			if (image.error != RENDER_ERROR_NONE) {
-				return (RenderResult) { .render_error = image.error, .error_msg = image.error_msg };
+			// Without configured outputs, a single unnamed output follows the crop & scale
+			RenderOutput default_output = { .name = NULL, .region = config->crop, .upscale = config->scale, .downscale = 1 };
+			const RenderOutput* outputs = &default_output;
+			int outputs_size = 1;
+			if (arrlen(config->canvas_outputs) > 0) {
+				outputs = config->canvas_outputs;
+				outputs_size = (int) arrlen(config->canvas_outputs);
 			}
-			save_type = SAVE_CANVAS_RENDER;
-			break;
+
+			struct image_result images[MAX_CANVAS_OUTPUTS];
+			if (!generate_canvas_images(instance, job.canvas.width, job.canvas.height, job.canvas.data, job.canvas.size,
+					job.canvas.palette_size, job.canvas.palette, outputs, outputs_size, images)) {
+				arrput(results, ((RenderResult) { .render_error = images[0].error, .error_msg = images[0].error_msg }));
+				return results;
+			}
+			for (int i = 0; i < outputs_size; i++) {
+				arrput(results, create_render_result(job, SAVE_CANVAS_RENDER, images[i], outputs[i].name));
+			}
+			return results;
 		}
 		case RENDER_DATE: {
-			image = generate_date_image(job.date, 0);
-			if (image.error != RENDER_ERROR_NONE) {
-				return (RenderResult) { .render_error = image.error, .error_msg = image.error_msg };
-			}
+			image = generate_date_image(instance, job.date, 0);
 			save_type = SAVE_DATE_RENDER;
 			break;
 		}
 		case RENDER_TOP_PLACERS: {
-			image = generate_top_placers_image(
+			image = generate_top_placers_image(instance,
 				job.top_placers.top_placers, job.top_placers.top_placers_size);
-			if (image.error != RENDER_ERROR_NONE) {
-				return (RenderResult) { .render_error = image.error, .error_msg = image.error_msg };
-			}
 			save_type = SAVE_TOP_PLACERS_RENDER;
 			break;
 		}
 		case RENDER_CANVAS_CONTROL: {
-			image = generate_canvas_control_image(job.canvas_control.width, job.canvas_control.height,
-				job.canvas_control.placers, job.canvas_control.top_placers, job.canvas_control.top_placers_size);
-			if (image.error != RENDER_ERROR_NONE) {
-				return (RenderResult) { .render_error = image.error, .error_msg = image.error_msg };
+			if (!unpack_job_placers(instance, &job.canvas_control)) {
+				arrput(results, ((RenderResult) { .render_error = RENDER_FAIL_DRAW, .error_msg = strdup("Failed to unpack placers") }));
+				return results;
 			}
+			image = generate_canvas_control_image(instance, job.canvas_control.width, job.canvas_control.height,
+				job.canvas_control.placers, job.canvas_control.placers_size, job.canvas_control.top_placers, job.canvas_control.top_placers_size,
+				&config->crop, config->scale);
 			save_type = SAVE_CANVAS_CONTROL_RENDER;
 			break;
 		}
+		case RENDER_HEATMAP: {
+			// Frames come out in commit order, so may belong to other commits waiting on this one
+			CommitInfo info = { .commit_id = job.commit_id, .commit_hash = job.commit_hash, .date = job.date };
+			HeatmapFrame* frames = advance_heatmap(job.frame_index, info, job.heatmap.width, job.heatmap.height, job.heatmap.data);
+			png_color heat_palette[256];
+			png_color age_palette[256];
+			get_heatmap_palettes(heat_palette, age_palette);
+			for (int i = 0; i < arrlen(frames); i++) {
+				HeatmapFrame* frame = &frames[i];
+				RenderJob frame_job = { .commit_id = frame->commit_id, .commit_hash = frame->commit_hash, .date = frame->date };
+				struct image_result heat_image = encode_paletted_image(instance, frame->heat, frame->width, frame->height, heat_palette, 256);
+				struct image_result age_image = encode_paletted_image(instance, frame->age, frame->width, frame->height, age_palette, 256);
+				RenderResult heat_result = heat_image.error != RENDER_ERROR_NONE
+					? (RenderResult) { .render_error = heat_image.error, .error_msg = heat_image.error_msg }
+					: create_render_result(frame_job, SAVE_HEATMAP_RENDER, heat_image, NULL);
+				RenderResult age_result = age_image.error != RENDER_ERROR_NONE
+					? (RenderResult) { .render_error = age_image.error, .error_msg = age_image.error_msg }
+					: create_render_result(frame_job, SAVE_AGE_RENDER, age_image, NULL);
+				arrput(results, heat_result);
+				arrput(results, age_result);
+				free_heatmap_frame(frame);
+			}
+			arrfree(frames);
+			return results;
+		}
+		case RENDER_COMPOSITE: {
+			// Placers are only unpacked for layouts that draw them
+			const FrameRect* canvas_control_layer = &config->frame_layout.canvas_control;
+			if (canvas_control_layer->width > 0 && canvas_control_layer->height > 0
+				&& !unpack_job_placers(instance, &job.composite.canvas_control)) {
+				if (is_frame_sink_running()) {
+					skip_frame_sink(job.frame_index);
+				}
+				arrput(results, ((RenderResult) { .render_error = RENDER_FAIL_DRAW, .error_msg = strdup("Failed to unpack placers") }));
+				return results;
+			}
+			if (is_frame_sink_running()) {
+				image = stream_composite_image(instance, &config->frame_layout, &config->crop, job.date, &job.composite, job.frame_index);
+				if (image.error != RENDER_ERROR_NONE) {
+					skip_frame_sink(job.frame_index);
+					arrput(results, ((RenderResult) { .render_error = image.error, .error_msg = image.error_msg }));
+				}
+				// Nothing is left to save
+				return results;
+			}
+			image = generate_composite_image(instance, &config->frame_layout, &config->crop, job.date, &job.composite);
+			save_type = SAVE_COMPOSITE_RENDER;
+			break;
+		}
 		default: {
-			return (RenderResult) { .render_error = RENDER_FAIL_TYPE, .error_msg = strdup("Invalid render job type") };
+			arrput(results, ((RenderResult) { .render_error = RENDER_FAIL_TYPE, .error_msg = strdup("Invalid render job type") }));
+			return results;
 		}
 	}
 
-	RenderResult result = {
-		// Inherited from WorkerResult
-		.render_error = RENDER_ERROR_NONE,
-		.error_msg = NULL,
-		// Members
-		.save_job = {
-			// Inherited from WorkerJob
-			.commit_id = job.commit_id,
-			.commit_hash = job.commit_hash,
-			.date = job.date,
-			// Members
-			.type = save_type,
-			.data = image.data,
-			.size = image.size
-		}
-	};
-	return result;
+	if (image.error != RENDER_ERROR_NONE) {
+		arrput(results, ((RenderResult) { .render_error = image.error, .error_msg = image.error_msg }));
+		return results;
+	}
+	arrput(results, create_render_result(job, save_type, image, NULL));
+	return results;
 }
 
 void on_render_worker_thread_exit(void* data)
 {
 	const WorkerInfo* worker_info = (const WorkerInfo*) data;
+	RenderWorkerInstance* instance = worker_info->render_worker_instance;
+
+	for (int i = 0; i < DATE_STYLE_COUNT; i++) {
+		free_glyph_atlas(instance->date_atlases[i]);
+		instance->date_atlases[i] = NULL;
+	}
+	clear_date_cache(instance);
+	shfree(instance->date_cache);
+	free(instance->date_pixels);
+	instance->date_pixels = NULL;
+	if (instance->top_placers_cr != NULL) {
+		cairo_destroy(instance->top_placers_cr);
+		cairo_surface_destroy(instance->top_placers_surface);
+	}
+	if (instance->top_placers_font != NULL) {
+		cairo_font_face_destroy(instance->top_placers_font);
+	}
+	free(instance->encode_buffer.data);
+	instance->encode_buffer = (EncodeBuffer) { 0 };
+	free_placer_colour_lut(&instance->placer_lut);
+	free(instance->row_buffer);
+	instance->row_buffer = NULL;
+	free(instance->frame_pixels);
+	instance->frame_pixels = NULL;
+	free_glyph_atlas(instance->frame_date_atlas);
+	instance->frame_date_atlas = NULL;
+	free(instance->scale_map);
+	instance->scale_map = NULL;
+	for (int i = 0; i < arrlen(instance->canvas_output_buffers); i++) {
+		free(instance->canvas_output_buffers[i].encode_buffer.data);
+		free(instance->canvas_output_buffers[i].row);
+		free(instance->canvas_output_buffers[i].sums);
+	}
+	arrfree(instance->canvas_output_buffers);
+	free(instance->placers_buffer);
+	instance->placers_buffer = NULL;
 
 	log_message(LOG_INFO, LOG_HEADER"Render worker %d exiting",
 		worker_info->worker_id, worker_info->worker_id);
@@ -485,21 +1308,39 @@ void* start_render_worker(void* data)
 	const WorkerInfo* worker_info = (const WorkerInfo*) data;
 	pthread_cleanup_push(on_render_worker_thread_exit, worker_info);
 
-	log_message(LOG_INFO, LOG_HEADER"Started render worker with thread id %d",
-		worker_info->worker_id, worker_info->thread_id);
+	// Initialise instance members
+	RenderWorkerInstance* instance = worker_info->render_worker_instance;
+	*instance = (RenderWorkerInstance) { 0 };
+	sh_new_strdup(instance->date_cache);
+	instance->date_pixels = malloc(sizeof(uint32_t) * DATE_IMAGE_WIDTH * DATE_IMAGE_HEIGHT);
+	bool started = instance->date_pixels != NULL;
+	if (!started) {
+		log_message(LOG_ERROR, LOG_HEADER"Failed to allocate date image, render worker won't start", worker_info->worker_id);
+	}
+	else {
+		if (!init_placer_colour_lut(&instance->placer_lut)) {
+			log_message(LOG_ERROR, LOG_HEADER"Failed to allocate top placers lookup table", worker_info->worker_id);
+		}
+		log_message(LOG_INFO, LOG_HEADER"Started render worker with thread id %d",
+			worker_info->worker_id, worker_info->thread_id);
+	}
 
 	// Enter render loop
-	while (!worker_info->should_cancel) {
+	while (started && !worker_info->should_cancel) {
 		RenderJob job = pop_render_stack(worker_info->worker_id);
 
-		RenderResult result = render(job);
-		if (result.render_error != RENDER_ERROR_NONE) {
-			log_message(LOG_ERROR, LOG_HEADER"Render %s failed with error %d message %s",
-				worker_info->worker_id, job.commit_hash, result.render_error, result.error_msg);
-			free(result.error_msg);
-			continue;
+		RenderResult* results = render(worker_info, job);
+		for (int i = 0; i < arrlen(results); i++) {
+			RenderResult result = results[i];
+			if (result.render_error != RENDER_ERROR_NONE) {
+				log_message(LOG_ERROR, LOG_HEADER"Render %s failed with error %d message %s",
+					worker_info->worker_id, job.commit_hash, result.render_error, result.error_msg);
+				free(result.error_msg);
+				continue;
+			}
+			push_save_stack(result.save_job);
 		}
-		push_save_stack(result.save_job);
+		arrfree(results);
 	}
 
 	pthread_cleanup_pop(1);
@@ -1,7 +1,14 @@
 #pragma once
 #include <stdint.h>
+#include <stdbool.h>
+#include <cairo/cairo.h>
 
 #include "worker_structs.h"
+#include "glyph_atlas.h"
+#include "placer_colour_lut.h"
+
+#define DATE_STYLE_COUNT 2
+#define DATE_CACHE_MAX_ENTRIES 256
 
 struct region_info
 {
@@ -15,9 +22,60 @@ typedef struct render_worker_shared
 {
 } RenderWorkerShared;
 
+typedef struct date_cache_entry
+{
+	char* key; // style & date text
+	struct {
+		uint8_t* data; // Encoded PNG
+		size_t size;
+	} value;
+} DateCacheEntry;
+
+// Growable PNG output buffer, reused between jobs so encoding doesn't reallocate from scratch
+typedef struct encode_buffer
+{
+	uint8_t* data;
+	size_t size;
+	size_t capacity;
+	bool failed; // Couldn't grow, so the encoded output is incomplete
+} EncodeBuffer;
+
+// Reusable buffers of a single canvas output
+typedef struct canvas_output_buffers
+{
+	EncodeBuffer encode_buffer;
+	uint8_t* row;
+	size_t row_size;
+	uint32_t* sums; // Box filter accumulator, one per channel
+	size_t sums_size;
+} CanvasOutputBuffers;
+
 // Instance / worker / per thread members
 typedef struct render_worker_instance
 {
+	GlyphAtlas* date_atlases[DATE_STYLE_COUNT]; // Built on first use of each style
+	DateCacheEntry* date_cache; // stb string hash map
+	uint32_t* date_pixels; // Reusable ARGB32 date image buffer
+	cairo_font_face_t* top_placers_font;
+	cairo_surface_t* top_placers_surface; // Grown to fit the largest top placers list seen
+	cairo_t* top_placers_cr;
+	int top_placers_surface_height;
+	EncodeBuffer encode_buffer;
+	PlacerColourLut placer_lut;
+	uint8_t* row_buffer; // Reusable single PNG row
+	size_t row_buffer_size;
+	uint32_t* frame_pixels; // Reusable ARGB32 composite frame
+	size_t frame_pixels_size;
+	GlyphAtlas* frame_date_atlas; // Sized to the frame layout's date layer
+	int* scale_map; // Destination x -> source x for nearest neighbour scaling
+	size_t scale_map_size;
+	CanvasOutputBuffers* canvas_output_buffers; // stb array, one per canvas output
+	UserIntId* placers_buffer; // Reusable unpacked placers, jobs only hold their packed placers
+	size_t placers_buffer_size;
 } RenderWorkerInstance;
 
+// Used for canvases without a palette of their own
+extern Colour default_palette[32];
+
+FrameLayout default_frame_layout(int width, int height, bool canvas_control);
 void* start_render_worker(void* data);
\ No newline at end of file
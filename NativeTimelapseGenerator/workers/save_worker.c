@@ -11,98 +11,214 @@
 #include "../console.h"
 #include "../main_thread.h"
 #include "../database.h"
+#include "../text_track.h"
+#include "../save_pack.h"
+#include "../canvas_codec.h"
+#include "../save_writer.h"
+#include "../save_layout.h"
+
+#include "../lib/stb/stb_ds.h"
 
 #define LOG_HEADER "[save worker %d] "
 
-// Reusable file-saving function
-static int save_file(const char* path, const uint8_t* data, size_t size, char** error_msg)
+static SaveResult create_save_result(SaveJob job, char* save_path)
+{
+	SaveResult result = {
+		// Inherited from WorkerResult
+		.save_error = SAVE_ERROR_NONE,
+		.error_msg = NULL,
+		// Inherited from CommitInfo
+		.commit_id = job.commit_id,
+		.commit_hash = job.commit_hash,
+		.date = job.date,
+		// Members
+		.save_type = job.type,
+		.save_path = save_path
+	};
+	return result;
+}
+
+static PendingSave create_pending_save(SaveJob job, char* save_path)
 {
-	FILE* file = fopen(path, "wb");
-	if (!file) {
-		if (error_msg) {
-			asprintf(error_msg, "Couldn't open file %s for writing", path);
+	PendingSave save = {
+		// Inherited from CommitInfo
+		.commit_id = job.commit_id,
+		.commit_hash = job.commit_hash,
+		.date = job.date,
+		// Members
+		.type = job.type,
+		.content_hash = job.content_hash,
+		.save_path = save_path,
+		.pack_path = NULL
+	};
+	return save;
+}
+
+void on_save_written(SaveJob job, char* save_path)
+{
+	PendingSave pending = create_pending_save(job, save_path);
+	pending.pack_length = (int64_t) job.size;
+	queue_save_to_db(pending);
+}
+
+void on_saves_committed(PendingSave* saves, const bool* committed, bool report)
+{
+	SaveResult* results = NULL;
+	for (int i = 0; i < arrlen(saves); i++) {
+		PendingSave save = saves[i];
+		if (committed == NULL || !committed[i]) {
+			log_message(LOG_ERROR, "[save worker] Failed to write save %s to database", save.save_path);
+			free(save.save_path);
+			continue;
+		}
+		if (!report) {
+			free(save.save_path);
+			continue;
 		}
-		return -1;
+
+		SaveResult result = {
+			// Inherited from WorkerResult
+			.save_error = SAVE_ERROR_NONE,
+			.error_msg = NULL,
+			// Inherited from CommitInfo
+			.commit_id = save.commit_id,
+			.commit_hash = save.commit_hash,
+			.date = save.date,
+			// Members
+			.save_type = save.type,
+			.save_path = save.save_path
+		};
+		arrput(results, result);
 	}
 
-	size_t written = fwrite(data, sizeof(uint8_t), size, file);
-	fclose(file);
+	if (arrlen(results) > 0) {
+		push_completed_batch(results);
+	}
+	else {
+		arrfree(results);
+	}
+}
 
-	if (written != size) {
-		if (error_msg) {
-			asprintf(error_msg, "Couldn't write the complete file %s", path);
+// Takes ownership of save_path, and of job's data if owns_data. Saves only produce a result once their
+// database row is committed, with the rest of its batch
+static void write_save(SaveJob job, char* save_path, bool owns_data, SaveResult** results)
+{
+	if (is_save_packs_running() && is_save_type_packable(job.type)) {
+		// Appended to its type's pack, save_path is only where it would be unpacked to
+		char* error_msg = NULL;
+		char* pack_path = NULL;
+		int64_t pack_offset = 0;
+		bool appended = append_save_pack(job.type, job.data, job.size, &pack_path, &pack_offset, &error_msg);
+		if (owns_data) {
+			free(job.data);
+		}
+		if (!appended) {
+			free(save_path);
+			arrput(*results, ((SaveResult) { .save_error = SAVE_ERROR_FILESYSTEM, .error_msg = error_msg }));
+			return;
 		}
-		return -1;
+		PendingSave pending = create_pending_save(job, save_path);
+		pending.pack_path = pack_path;
+		pending.pack_offset = pack_offset;
+		pending.pack_length = (int64_t) job.size;
+		queue_save_to_db(pending);
+		return;
 	}
 
-	return 0;
+	if (!make_save_shard(save_path)) {
+		free(save_path);
+		if (owns_data) {
+			free(job.data);
+		}
+		arrput(*results, ((SaveResult) { .save_error = SAVE_ERROR_FILESYSTEM, .error_msg = strdup("Failed to create save directory") }));
+		return;
+	}
+	submit_save_write(job, save_path, owns_data);
 }
 
-SaveResult save(SaveJob job)
+SaveResult* save(SaveJob job)
 {
+	SaveResult* results = NULL;
 	char timestamp[64];
 	struct tm timeinfo;
 	if (gmtime_r(&job.date, &timeinfo) == NULL) {
-		return (SaveResult) { .save_error = SAVE_ERROR_DATETIME, .error_msg = strdup("Failed to convert time to GMT") };
+		arrput(results, ((SaveResult) { .save_error = SAVE_ERROR_DATETIME, .error_msg = strdup("Failed to convert time to GMT") }));
+		return results;
 	}
 	if (strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", &timeinfo) == 0) {
-		return (SaveResult) { .save_error = SAVE_ERROR_DATETIME, .error_msg = strdup("Failed to format timestamp") };
+		arrput(results, ((SaveResult) { .save_error = SAVE_ERROR_DATETIME, .error_msg = strdup("Failed to format timestamp") }));
+		return results;
+	}
+
+	// Cues go into a single file that is finalised once generation stops
+	if (job.type == SAVE_TEXT_TRACK) {
+		push_text_track(job.frame_index, job.date, job.top_placers, job.top_placers_size);
+		arrput(results, create_save_result(job, NULL));
+		return results;
 	}
 
+	// Directories of the current layout are only created as each save needs them
+	char shard[32];
+	get_save_shard(job.date, job.commit_hash, shard, sizeof(shard));
 	char* save_path = NULL;
 	switch (job.type) {
 		case SAVE_PLACERS_DOWNLOAD: {
-			asprintf(&save_path, "placer_downloads/%s_%d_%s", timestamp, job.commit_id, job.commit_hash);
+			asprintf(&save_path, "placer_downloads/%s%s_%d_%s", shard, timestamp, job.commit_id, job.commit_hash);
 			break;
 		}
 		case SAVE_CANVAS_DOWNLOAD: {
-			asprintf(&save_path, "canvas_downloads/%s_%d_%s", timestamp, job.commit_id, job.commit_hash);
+			asprintf(&save_path, "canvas_downloads/%s%s_%d_%s", shard, timestamp, job.commit_id, job.commit_hash);
 			break;
 		}
 		case SAVE_CANVAS_RENDER: {
-			asprintf(&save_path, "canvas_renders/%s_%d_%s.png", timestamp, job.commit_id, job.commit_hash);
+			// Each output of a canvas with multiple outputs is told apart by its variant
+			asprintf(&save_path, "canvas_renders/%s%s_%d_%s%s%s.png", shard, timestamp, job.commit_id, job.commit_hash,
+				job.variant ? "_" : "", job.variant ? job.variant : "");
 			break;
 		}
 		case SAVE_DATE_RENDER: {
-			asprintf(&save_path, "date_renders/%s_%d_%s.png", timestamp, job.commit_id, job.commit_hash);
+			asprintf(&save_path, "date_renders/%s%s_%d_%s.png", shard, timestamp, job.commit_id, job.commit_hash);
 			break;
 		}
 		case SAVE_TOP_PLACERS_RENDER: {
-			asprintf(&save_path, "top_placer_renders/%s_%d_%s.png", timestamp, job.commit_id, job.commit_hash);
+			asprintf(&save_path, "top_placer_renders/%s%s_%d_%s.png", shard, timestamp, job.commit_id, job.commit_hash);
 			break;
 		}
 		case SAVE_CANVAS_CONTROL_RENDER: {
-			asprintf(&save_path, "canvas_control_renders/%s_%d_%s.png", timestamp, job.commit_id, job.commit_hash);
+			asprintf(&save_path, "canvas_control_renders/%s%s_%d_%s.png", shard, timestamp, job.commit_id, job.commit_hash);
+			break;
+		}
+		case SAVE_COMPOSITE_RENDER: {
+			asprintf(&save_path, "composite_renders/%s%s_%d_%s.png", shard, timestamp, job.commit_id, job.commit_hash);
+			break;
+		}
+		case SAVE_HEATMAP_RENDER: {
+			asprintf(&save_path, "heatmap_renders/%s%s_%d_%s.png", shard, timestamp, job.commit_id, job.commit_hash);
+			break;
+		}
+		case SAVE_AGE_RENDER: {
+			asprintf(&save_path, "age_renders/%s%s_%d_%s.png", shard, timestamp, job.commit_id, job.commit_hash);
 			break;
 		}
 		default: {
-			return (SaveResult) { .save_error = SAVE_FAIL_TYPE, .error_msg = strdup("Invalid save job type") };
+			arrput(results, ((SaveResult) { .save_error = SAVE_FAIL_TYPE, .error_msg = strdup("Invalid save job type") }));
+			return results;
 		}
 	}
 
-	// Save file locally  to filesystem
-	char* error_msg = NULL;
-	if (save_file(save_path, job.data, job.size, &error_msg) != 0) {
-		return (SaveResult) { .save_error = SAVE_ERROR_FILESYSTEM, .error_msg = error_msg };
-	}
-	// Ensure saves are written to database
-	if (!add_save_to_db(job.commit_id, job.type, save_path)) {
-		return (SaveResult) { .save_error = SAVE_ERROR_DATABASE, .error_msg = strdup("Failed to write save to database") };
+	// Canvases come out in commit order, so may belong to other commits waiting on this one
+	if (job.type == SAVE_CANVAS_DOWNLOAD && is_canvas_codec_running()) {
+		EncodedCanvas* canvases = advance_canvas_codec(job, save_path);
+		free(save_path);
+		for (int i = 0; i < arrlen(canvases); i++) {
+			write_save(canvases[i].job, canvases[i].save_path, true, &results);
+		}
+		arrfree(canvases);
+		return results;
 	}
 
-	SaveResult result = {
-		// Inherited from WorkerResult
-		.save_error = SAVE_ERROR_NONE,
-		.error_msg = NULL,
-		// Inherited from CommitInfo
-		.commit_id = job.commit_id,
-		.commit_hash = job.commit_hash,
-		.date = job.date,
-		// Members
-		.save_type = job.type,
-		.save_path = save_path
-	};
-	return result;
+	write_save(job, save_path, false, &results);
+	return results;
 }
 
 void on_save_worker_thread_exit(void* data)
@@ -126,15 +242,19 @@ void* start_save_worker(void* data)
 	while (!worker_info->should_cancel) {
 		SaveJob job = pop_save_stack(worker_info->worker_id);
 
-		SaveResult result = save(job);
-		if (result.save_error != SAVE_ERROR_NONE) {
-			log_message(LOG_ERROR, LOG_HEADER"Save worker %d failed with error %d message %s",
-				worker_info->worker_id, result.save_error, result.error_msg);
-			free(result.error_msg);
-			continue;
-		}
+		SaveResult* results = save(job);
+		for (int i = 0; i < arrlen(results); i++) {
+			SaveResult result = results[i];
+			if (result.save_error != SAVE_ERROR_NONE) {
+				log_message(LOG_ERROR, LOG_HEADER"Save worker %d failed with error %d message %s",
+					worker_info->worker_id, result.save_error, result.error_msg);
+				free(result.error_msg);
+				continue;
+			}
 
-		push_completed(result);
+			push_completed(result);
+		}
+		arrfree(results);
 	}
 
 	pthread_cleanup_pop(1);
@@ -1,6 +1,11 @@
 #pragma once
+#include <stdbool.h>
+
 #include "worker_structs.h"
 
+// Defined by database.h
+typedef struct pending_save PendingSave;
+
 // Shared between all save workers
 typedef struct save_worker_data
 {
@@ -11,4 +16,8 @@ typedef struct save_worker_instance
 {
 } SaveWorkerInstance;
 
+// Save writer callback, queues a save to be recorded only once it's completely written
+void on_save_written(SaveJob job, char* save_path);
+// Save batch callback, a save is only reported as complete once its row is committed
+void on_saves_committed(PendingSave* saves, const bool* committed, bool report);
 void* start_save_worker(void* data);
\ No newline at end of file
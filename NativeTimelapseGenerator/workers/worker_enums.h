@@ -22,4 +22,13 @@ typedef enum save_error {
 	SAVE_ERROR_FILESYSTEM = 2,
 	SAVE_ERROR_DATABASE = 3,
 	SAVE_FAIL_TYPE = 4
-} SaveError;
\ No newline at end of file
+} SaveError;
+
+typedef enum save_durability {
+	// Each save is synced to disk before its row is committed
+	SAVE_DURABILITY_SYNC = 0,
+	// Saves are synced to disk & their rows committed together, once every interval
+	SAVE_DURABILITY_PERIODIC = 1,
+	// Nothing is synced, rows of saves lost to a crash are removed by the reconciliation on startup
+	SAVE_DURABILITY_RELAXED = 2
+} SaveDurability;
\ No newline at end of file
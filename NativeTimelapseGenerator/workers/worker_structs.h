@@ -1,4 +1,5 @@
 #pragma once
+#include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
 
@@ -35,6 +36,13 @@ typedef struct placer {
 	Colour colour;
 } Placer;
 
+// Placer ids of every pixel as a dictionary of distinct ids, with runs of bit packed dictionary indices.
+// Serialised by pack_placers, so the same bytes are saved & rendered from
+typedef struct packed_placers {
+	uint8_t* data;
+	size_t size;
+} PackedPlacers;
+
 typedef struct canvas_metadata {
 	int width;
 	int height;
@@ -42,10 +50,38 @@ typedef struct canvas_metadata {
 	int palette_size;
 } CanvasMetadata;
 
+typedef struct frame_rect {
+	int x;
+	int y;
+	int width;
+	int height;
+} FrameRect;
+
+// Placement of each layer within a composite frame, zero sized layers are left out
+typedef struct frame_layout {
+	int width; // Zero disables composite frames
+	int height;
+	FrameRect board;
+	FrameRect date;
+	FrameRect top_placers;
+	FrameRect canvas_control;
+} FrameLayout;
+
+#define MAX_CANVAS_OUTPUTS 16
+
+// One of the images produced from a single pass over a canvas
+typedef struct render_output {
+	char* name; // Appended to the save path, null for the sole default output
+	FrameRect region; // Zero sized for the whole canvas
+	int upscale; // Each pixel becomes an upscale * upscale block, nearest neighbour
+	int downscale; // Each downscale * downscale block becomes one pixel, box filtered
+} RenderOutput;
+
 typedef struct canvas_info {
 	int commit_id;
 	char* commit_hash;
 	time_t date;
+	int frame_index; // Position within the frame sink's stream
 } CommitInfo;
 
 // Base structs for worker jobs & results
@@ -77,7 +113,11 @@ typedef enum save_job_type:uint8_t {
 	SAVE_DATE_RENDER = 3,
 	SAVE_PLACERS_DOWNLOAD = 4,
 	SAVE_TOP_PLACERS_RENDER = 5,
-	SAVE_CANVAS_CONTROL_RENDER = 6
+	SAVE_CANVAS_CONTROL_RENDER = 6,
+	SAVE_COMPOSITE_RENDER = 7,
+	SAVE_HEATMAP_RENDER = 8,
+	SAVE_AGE_RENDER = 9,
+	SAVE_TEXT_TRACK = 10 // Appended to the text track, rather than saved as a file of its own
 } SaveJobType;
 
 typedef struct save_job {
@@ -85,6 +125,11 @@ typedef struct save_job {
 	SaveJobType type;
 	uint8_t* data;
 	size_t size;
+	uint64_t content_hash; // Downloads only, registered once saved so that duplicates can reuse this save
+	const char* variant; // Appended to the save path of renders with multiple outputs, can be null
+	// Text track cues only
+	Placer* top_placers;
+	size_t top_placers_size;
 } SaveJob;
 
 typedef struct save_result {
@@ -99,7 +144,9 @@ typedef enum render_job_type:uint8_t {
 	RENDER_CANVAS = 1,
 	RENDER_DATE = 2,
 	RENDER_TOP_PLACERS = 3,
-	RENDER_CANVAS_CONTROL = 4
+	RENDER_CANVAS_CONTROL = 4,
+	RENDER_COMPOSITE = 5,
+	RENDER_HEATMAP = 6
 } RenderJobType;
 
 typedef struct render_job_canvas {
@@ -120,10 +167,18 @@ typedef struct render_job_canvas_control {
 	RenderJobTopPlacers;
 	int width;
 	int height;
+	PackedPlacers packed_placers;
+	// Unpacked from packed_placers by the render worker, into a buffer of its own
 	size_t placers_size;
 	uint32_t* placers;
 } RenderJobCanvasControl;
 
+// All layers of a single commit's final frame
+typedef struct render_job_composite {
+	RenderJobCanvas canvas;
+	RenderJobCanvasControl canvas_control;
+} RenderJobComposite;
+
 typedef struct render_job {
 	WorkerJob;
 	RenderJobType type;
@@ -131,6 +186,9 @@ typedef struct render_job {
 		RenderJobCanvas canvas;
 		RenderJobTopPlacers top_placers;
 		RenderJobCanvasControl canvas_control;
+		RenderJobComposite composite;
+		// Palette is unused, data is null if the commit's canvas failed to download
+		RenderJobCanvas heatmap;
 	};
 } RenderJob;
 
@@ -145,12 +203,15 @@ typedef enum download_job_type:uint8_t {
 	DOWNLOAD_CANVAS = 1,
 	DOWNLOAD_PLACERS = 2,
 	DOWNLOAD_CACHED_CANVAS = 3,
-	DOWNLOAD_CACHED_PLACERS = 4
+	DOWNLOAD_CACHED_PLACERS = 4,
+	DOWNLOAD_COMPOSITE = 5,
+	DOWNLOAD_STATS = 6 // Canvas is only compared against the previous commit's, frame_index orders the pass
 } DownloadJobType;
 
 typedef struct download_job {
 	WorkerJob;
 	DownloadJobType type;
+	bool stats_baseline; // DOWNLOAD_STATS only, the canvas is only compared against as its own stats are already known
 } DownloadJob;
 
 typedef struct download_result {